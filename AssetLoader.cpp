@@ -0,0 +1,520 @@
+#include "AssetLoader.h"
+#include "MeshFile.h"
+#include "TextureFile.h"
+
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <algorithm>
+#include <chrono>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+
+AssetLoader::~AssetLoader()
+{
+	stop();
+}
+
+void AssetLoader::start(VkDevice device, VkPhysicalDevice physicalDevice, VkQueue transferQueue, uint32_t transferFamily, uint32_t graphicsFamily, vkutils::GeometryBuffers* geometry, bool block_compressed, uint32_t worker_count)
+{
+	stop();
+	this->device = device;
+	this->physicalDevice = physicalDevice;
+	this->transferQueue = transferQueue;
+	this->transferFamily = transferFamily;
+	this->graphicsFamily = graphicsFamily;
+	this->geometry = geometry;
+	this->block_compressed = block_compressed;
+
+	VkCommandPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	poolInfo.queueFamilyIndex = transferFamily;
+	poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+	if (vkCreateCommandPool(device, &poolInfo, NULL, &cmdPool) != VK_SUCCESS) {
+		throw std::runtime_error("failed to create command pool!");
+	}
+	for (UploadBatch& batch : batches) batch.cmdBuffer = vkutils::createCmdBuffer(device, cmdPool);
+	next_batch = 0;
+	timeline = vkutils::createTimelineSemaphore(device);
+	submitted = 0;
+	staging_ring.create(device, physicalDevice, STAGING_RING_SIZE);
+
+	// The render and logic threads keep the other half busy
+	if (worker_count == 0) worker_count = std::max(1u, std::thread::hardware_concurrency() / 2);
+	stop_threads = false;
+	for (uint32_t i = 0; i < worker_count; i++) workers.push_back(std::thread(&AssetLoader::worker_loop, this));
+	uploader = std::thread(&AssetLoader::upload_loop, this);
+}
+
+void AssetLoader::stop()
+{
+	if (!uploader.joinable()) return;
+	{
+		std::lock_guard<std::mutex> lk(queue_mut);
+		stop_threads = true;
+	}
+	load_cv.notify_all();
+	upload_cv.notify_all();
+	// A worker waiting for ring space fails its asset instead
+	staging_ring.abort();
+	for (std::thread& t : workers) t.join();
+	workers.clear();
+	uploader.join();
+
+	for (UploadJob& job : uploads) {
+		destroy_staging(job);
+		destroy_asset(job.asset);
+	}
+	for (LoadedAsset& asset : done) destroy_asset(asset);
+	loads.clear();
+	uploads.clear();
+	done.clear();
+	requested = 0;
+
+	staging_ring.destroy();
+	for (UploadBatch& batch : batches) batch = UploadBatch();
+	vkDestroyCommandPool(device, cmdPool, NULL);
+	cmdPool = VK_NULL_HANDLE;
+	// Whoever waited on it has been waited for: retire() only hands out values already reached
+	vkDestroySemaphore(device, timeline, NULL);
+	timeline = VK_NULL_HANDLE;
+}
+
+void AssetLoader::request_mesh(std::string key, std::string path)
+{
+	LoadJob job;
+	job.key = key;
+	job.path = path;
+	std::lock_guard<std::mutex> lk(queue_mut);
+	loads.push_back(std::move(job));
+	requested++;
+	load_cv.notify_one();
+}
+
+void AssetLoader::request_mesh(std::string key, Mesh mesh)
+{
+	LoadJob job;
+	job.key = key;
+	job.in_memory = true;
+	job.mesh = std::move(mesh);
+	std::lock_guard<std::mutex> lk(queue_mut);
+	loads.push_back(std::move(job));
+	requested++;
+	load_cv.notify_one();
+}
+
+void AssetLoader::request_texture(std::string path, uint32_t max_size)
+{
+	LoadJob job;
+	job.key = path;
+	job.path = path;
+	job.is_texture = true;
+	job.max_size = max_size;
+	std::lock_guard<std::mutex> lk(queue_mut);
+	loads.push_back(std::move(job));
+	requested++;
+	load_cv.notify_one();
+}
+
+void AssetLoader::collect(std::vector<LoadedAsset>& out)
+{
+	std::lock_guard<std::mutex> lk(queue_mut);
+	requested -= done.size();
+	for (LoadedAsset& asset : done) out.push_back(std::move(asset));
+	done.clear();
+}
+
+uint32_t AssetLoader::in_flight() const
+{
+	std::lock_guard<std::mutex> lk(queue_mut);
+	return requested - done.size();
+}
+
+void AssetLoader::worker_loop()
+{
+	std::unique_lock<std::mutex> lk(queue_mut);
+	while (true) {
+		load_cv.wait(lk, [&] { return stop_threads || !loads.empty(); });
+		if (stop_threads) return;
+		LoadJob job = std::move(loads.front());
+		loads.pop_front();
+		lk.unlock();
+
+		UploadJob upload = prepare(job);
+		lk.lock();
+		if (upload.asset.failed) done.push_back(std::move(upload.asset));
+		else {
+			uploads.push_back(std::move(upload));
+			upload_cv.notify_one();
+		}
+	}
+}
+
+void AssetLoader::upload_loop()
+{
+	std::unique_lock<std::mutex> lk(queue_mut);
+	while (true) {
+		lk.unlock();
+		retire(false);
+		lk.lock();
+		if (stop_threads) break;
+
+		UploadBatch& batch = batches[next_batch];
+		if (uploads.empty()) {
+			if (!batch.in_flight && !batches[(next_batch + 1) % UPLOAD_BATCHES].in_flight) {
+				upload_cv.wait(lk, [&] { return stop_threads || !uploads.empty(); });
+				continue;
+			}
+			// Something is copying: look at it again shortly, or as soon as there's more to send
+			upload_cv.wait_for(lk, std::chrono::milliseconds(1), [&] { return stop_threads || !uploads.empty(); });
+			continue;
+		}
+		if (batch.in_flight) {
+			// Every batch is copying, the next one is recorded once the oldest is done
+			lk.unlock();
+			wait_for(batch.value);
+			lk.lock();
+			continue;
+		}
+		// Whatever the workers finished while the last batch was recording goes out in one submit
+		batch.jobs = std::move(uploads);
+		uploads.clear();
+		lk.unlock();
+		submit(batch);
+		next_batch = (next_batch + 1) % UPLOAD_BATCHES;
+		lk.lock();
+	}
+	lk.unlock();
+	retire(true);
+}
+
+void AssetLoader::submit(UploadBatch& batch)
+{
+	vkResetCommandBuffer(batch.cmdBuffer, 0);
+	VkCommandBufferBeginInfo beginInfo{};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	if (vkBeginCommandBuffer(batch.cmdBuffer, &beginInfo) != VK_SUCCESS) {
+		throw std::runtime_error("failed to begin recording command buffer!");
+	}
+	for (const UploadJob& job : batch.jobs) record(batch.cmdBuffer, job);
+	if (vkEndCommandBuffer(batch.cmdBuffer) != VK_SUCCESS) {
+		throw std::runtime_error("failed to record command buffer!");
+	}
+
+	batch.value = submitted + 1;
+	VkTimelineSemaphoreSubmitInfo timelineInfo{};
+	timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+	timelineInfo.signalSemaphoreValueCount = 1;
+	timelineInfo.pSignalSemaphoreValues = &batch.value;
+
+	VkSubmitInfo submitInfo{};
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.pNext = &timelineInfo;
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &batch.cmdBuffer;
+	submitInfo.signalSemaphoreCount = 1;
+	submitInfo.pSignalSemaphores = &timeline;
+	if (vkQueueSubmit(transferQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS) {
+		throw std::runtime_error("failed to submit upload command buffer!");
+	}
+	submitted = batch.value;
+	batch.in_flight = true;
+}
+
+void AssetLoader::wait_for(uint64_t value)
+{
+	VkSemaphoreWaitInfo waitInfo{};
+	waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+	waitInfo.semaphoreCount = 1;
+	waitInfo.pSemaphores = &timeline;
+	waitInfo.pValues = &value;
+	vkWaitSemaphores(device, &waitInfo, UINT64_MAX);
+}
+
+void AssetLoader::retire(bool wait)
+{
+	uint64_t reached = 0;
+	vkGetSemaphoreCounterValue(device, timeline, &reached);
+	for (uint32_t i = 0; i < UPLOAD_BATCHES; i++) {
+		UploadBatch& batch = batches[(next_batch + i) % UPLOAD_BATCHES];
+		if (!batch.in_flight) continue;
+		if (wait) wait_for(batch.value);
+		// Only this thread waits, the frame never does
+		else if (reached < batch.value) return;
+		batch.in_flight = false;
+
+		// The ring space is free again as soon as the copies out of it are
+		for (UploadJob& job : batch.jobs) destroy_staging(job);
+		std::lock_guard<std::mutex> lk(queue_mut);
+		for (UploadJob& job : batch.jobs) {
+			job.asset.upload_value = batch.value;
+			done.push_back(std::move(job.asset));
+		}
+		batch.jobs.clear();
+	}
+}
+
+AssetLoader::UploadJob AssetLoader::prepare(LoadJob& job)
+{
+	UploadJob upload;
+	upload.asset.key = job.key;
+	upload.asset.is_texture = job.is_texture;
+	try {
+		if (job.is_texture) {
+			texutils::CookedTexture cooked;
+			if (block_compressed) {
+				try {
+					texutils::open_texture(job.path, cooked);
+				}
+				catch (const std::exception& e) {
+					std::cerr << "failed to cook " << job.path << " (" << e.what() << "), loading it uncompressed" << std::endl;
+					cooked.close();
+				}
+			}
+			if (cooked.is_open()) {
+				uint32_t first = 0;
+				while (first + 1 < cooked.level_count() && std::max(cooked.width(), cooked.height()) >> first > job.max_size) first++;
+				// The blocks go up as they are, all levels in one copy of the file's data
+				const uint8_t* begin = cooked.level_data(first);
+				const uint8_t* end = begin;
+				for (uint32_t l = first; l < cooked.level_count(); l++) {
+					begin = std::min(begin, cooked.level_data(l));
+					end = std::max(end, cooked.level_data(l) + cooked.level_size(l));
+				}
+				upload.staging = staging_ring.alloc(end - begin);
+				memcpy(upload.staging.data, begin, end - begin);
+				for (uint32_t l = first; l < cooked.level_count(); l++) {
+					VkBufferImageCopy region{};
+					region.bufferOffset = upload.staging.offset + (cooked.level_data(l) - begin);
+					region.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, l - first, 0, 1 };
+					region.imageExtent = { std::max(1u, cooked.width() >> l), std::max(1u, cooked.height() >> l), 1 };
+					upload.regions.push_back(region);
+				}
+				upload.format = cooked.format();
+				upload.levels = cooked.level_count() - first;
+				upload.asset.format = upload.format;
+				upload.asset.width = cooked.width();
+				upload.asset.height = cooked.height();
+				upload.asset.level_count = cooked.level_count();
+				upload.asset.first_level = first;
+				upload.asset.streamable = true;
+				upload.asset.image = vkutils::createGPUImage(
+					device,
+					physicalDevice,
+					std::max(1u, cooked.width() >> first), std::max(1u, cooked.height() >> first),
+					upload.levels,
+					upload.format,
+					VK_IMAGE_TILING_OPTIMAL,
+					VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+					VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+					VK_IMAGE_VIEW_TYPE_2D,
+					VK_IMAGE_ASPECT_COLOR_BIT
+				);
+				return upload;
+			}
+
+			int texWidth, texHeight, texChannels;
+			stbi_uc* pixels = stbi_load(job.path.c_str(), &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
+			if (!pixels) throw std::runtime_error("failed to load texture image!");
+			// The transfer queue can't blit, so the mips are built here rather than on the GPU
+			std::vector<std::vector<uint8_t>> mips = texutils::build_mip_chain(pixels, texWidth, texHeight);
+			stbi_image_free(pixels);
+			VkDeviceSize texels = 0;
+			for (const std::vector<uint8_t>& mip : mips) texels += mip.size();
+			upload.staging = staging_ring.alloc(texels);
+			VkDeviceSize offset = 0;
+			for (uint32_t l = 0; l < mips.size(); l++) {
+				VkBufferImageCopy region{};
+				region.bufferOffset = upload.staging.offset + offset;
+				region.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, l, 0, 1 };
+				region.imageExtent = { std::max(1u, (uint32_t)texWidth >> l), std::max(1u, (uint32_t)texHeight >> l), 1 };
+				upload.regions.push_back(region);
+				memcpy(upload.staging.data + offset, mips[l].data(), mips[l].size());
+				offset += mips[l].size();
+			}
+			upload.levels = mips.size();
+			upload.asset.format = VK_FORMAT_R8G8B8A8_SRGB;
+			upload.asset.width = texWidth;
+			upload.asset.height = texHeight;
+			upload.asset.level_count = upload.levels;
+			upload.asset.image = vkutils::createGPUImage(
+				device,
+				physicalDevice,
+				texWidth, texHeight,
+				upload.levels,
+				VK_FORMAT_R8G8B8A8_SRGB,
+				VK_IMAGE_TILING_OPTIMAL,
+				VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+				VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+				VK_IMAGE_VIEW_TYPE_2D,
+				VK_IMAGE_ASPECT_COLOR_BIT
+			);
+			return upload;
+		}
+
+		Mesh& mesh = upload.asset.mesh;
+		// Copied straight out of the cooked file's mapping; the parse only happens on a cache miss
+		meshutils::CookedMesh cooked;
+		bool from_memory = job.in_memory;
+		if (job.in_memory) mesh = std::move(job.mesh);
+		else if (!meshutils::open_mesh(job.path, cooked, mesh)) {
+			// Like the textures: without a cache it still loads, just parsed every time
+			std::cerr << "failed to write the cooked " << job.path << ", using it uncached" << std::endl;
+			from_memory = true;
+		}
+		if (from_memory) {
+			if (mesh._indices.empty()) throw std::runtime_error("failed to upload an empty mesh!");
+			std::vector<PackedVertex> packed;
+			pack_vertices(mesh._vertices.data(), mesh._vertices.size(), packed, mesh._decode);
+			std::vector<uint8_t> indices = pack_indices(mesh._indices.data(), mesh._indices.size(), mesh._vertices.size(), mesh._indexType);
+			mesh._indexCount = mesh._lods.empty() ? mesh._indices.size() : mesh._lods[0].indexCount;
+			upload.vertex_bytes = sizeof(PackedVertex) * packed.size();
+			upload.index_bytes = indices.size();
+			upload.staging = staging_ring.alloc(upload.vertex_bytes + upload.index_bytes);
+			memcpy(upload.staging.data, packed.data(), upload.vertex_bytes);
+			memcpy(upload.staging.data + upload.vertex_bytes, indices.data(), upload.index_bytes);
+			mesh._uvDensity = uv_density(packed.data(), mesh._decode, indices.data(), mesh._indexType, mesh._indexCount);
+			std::vector<Vertex>().swap(mesh._vertices);
+			std::vector<uint32_t>().swap(mesh._indices);
+		}
+		else {
+			if (cooked.index_count() == 0) throw std::runtime_error("failed to upload an empty mesh!");
+			mesh._decode = cooked.decode();
+			mesh._indexType = cooked.index_type();
+			mesh._lods.assign(cooked.lods(), cooked.lods() + cooked.lod_count());
+			mesh._indexCount = mesh._lods[0].indexCount;
+			if (mesh._lods.size() == 1) mesh._lods.clear();
+			upload.vertex_bytes = sizeof(PackedVertex) * cooked.vertex_count();
+			upload.index_bytes = cooked.index_size() * cooked.index_count();
+			upload.staging = staging_ring.alloc(upload.vertex_bytes + upload.index_bytes);
+			memcpy(upload.staging.data, cooked.vertices(), upload.vertex_bytes);
+			memcpy(upload.staging.data + upload.vertex_bytes, cooked.indices(), upload.index_bytes);
+			mesh._uvDensity = uv_density(cooked.vertices(), mesh._decode, cooked.indices(), mesh._indexType, mesh._indexCount);
+		}
+		mesh._vertexRange = geometry->alloc_vertices(upload.vertex_bytes);
+		mesh._indexRange = geometry->alloc_indices(upload.index_bytes);
+	}
+	catch (const std::exception& e) {
+		destroy_staging(upload);
+		destroy_asset(upload.asset);
+		upload.asset.failed = true;
+		upload.asset.error = e.what();
+	}
+	return upload;
+}
+
+void AssetLoader::record(VkCommandBuffer cmdBuffer, const UploadJob& job)
+{
+	if (!job.asset.is_texture) {
+		VkBufferCopy copyRegion{};
+		const Mesh& mesh = job.asset.mesh;
+		copyRegion.srcOffset = job.staging.offset;
+		copyRegion.dstOffset = mesh._vertexRange._offset;
+		copyRegion.size = job.vertex_bytes;
+		vkCmdCopyBuffer(cmdBuffer, job.staging.buffer, mesh._vertexRange._buffer, 1, &copyRegion);
+		copyRegion.srcOffset = job.staging.offset + job.vertex_bytes;
+		copyRegion.dstOffset = mesh._indexRange._offset;
+		copyRegion.size = job.index_bytes;
+		vkCmdCopyBuffer(cmdBuffer, job.staging.buffer, mesh._indexRange._buffer, 1, &copyRegion);
+		if (transfers_ownership()) {
+			// Released range by range, the rest of the shared buffers stays with the graphics family
+			for (const GeometryRange* range : { &mesh._vertexRange, &mesh._indexRange }) {
+				vkutils::bufferBarrier(
+					cmdBuffer,
+					range->_buffer, range->_offset, range->_size,
+					VK_ACCESS_TRANSFER_WRITE_BIT, 0,
+					VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+					transferFamily, graphicsFamily
+				);
+			}
+		}
+		return;
+	}
+
+	VkImageSubresourceRange levels = { VK_IMAGE_ASPECT_COLOR_BIT, 0, job.levels, 0, 1 };
+	vkutils::transitionImageLayout(
+		cmdBuffer,
+		job.asset.image._image,
+		job.format,
+		VK_IMAGE_LAYOUT_UNDEFINED,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+		VK_PIPELINE_STAGE_TRANSFER_BIT,
+		levels
+	);
+	vkCmdCopyBufferToImage(
+		cmdBuffer,
+		job.staging.buffer,
+		job.asset.image._image,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		job.regions.size(),
+		job.regions.data()
+	);
+	// The layout changes with the release, acquire() repeats it on the graphics side
+	bool release = transfers_ownership();
+	vkutils::transitionImageLayout(
+		cmdBuffer,
+		job.asset.image._image,
+		job.format,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+		VK_PIPELINE_STAGE_TRANSFER_BIT,
+		release ? VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT : VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+		levels,
+		release ? transferFamily : VK_QUEUE_FAMILY_IGNORED,
+		release ? graphicsFamily : VK_QUEUE_FAMILY_IGNORED
+	);
+}
+
+void AssetLoader::acquire(VkCommandBuffer cmdBuffer, const LoadedAsset& asset) const
+{
+	if (!transfers_ownership() || asset.failed) return;
+	if (!asset.is_texture) {
+		vkutils::bufferBarrier(
+			cmdBuffer,
+			asset.mesh._vertexRange._buffer, asset.mesh._vertexRange._offset, asset.mesh._vertexRange._size,
+			0, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT,
+			UPLOAD_WAIT_STAGES, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+			transferFamily, graphicsFamily
+		);
+		vkutils::bufferBarrier(
+			cmdBuffer,
+			asset.mesh._indexRange._buffer, asset.mesh._indexRange._offset, asset.mesh._indexRange._size,
+			0, VK_ACCESS_INDEX_READ_BIT,
+			UPLOAD_WAIT_STAGES, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+			transferFamily, graphicsFamily
+		);
+		return;
+	}
+	vkutils::transitionImageLayout(
+		cmdBuffer,
+		asset.image._image,
+		asset.format,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+		UPLOAD_WAIT_STAGES,
+		VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+		{ VK_IMAGE_ASPECT_COLOR_BIT, 0, asset.level_count - asset.first_level, 0, 1 },
+		transferFamily,
+		graphicsFamily
+	);
+}
+
+void AssetLoader::destroy_staging(UploadJob& job)
+{
+	staging_ring.release(job.staging);
+}
+
+void AssetLoader::destroy_asset(LoadedAsset& asset)
+{
+	if (asset.is_texture) {
+		vkutils::destroyGPUImage(device, asset.image);
+		asset.image = {};
+	}
+	else {
+		geometry->free(asset.mesh._vertexRange);
+		geometry->free(asset.mesh._indexRange);
+	}
+}
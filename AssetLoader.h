@@ -0,0 +1,139 @@
+#pragma once
+#include "vkutils.h"
+#include "StagingRing.h"
+#include "GeometryBuffers.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// A mesh or texture the loader is done with, resident on the GPU unless failed is set
+struct LoadedAsset
+{
+	std::string key; // mesh key or texture path it was requested under
+	bool is_texture = false;
+	bool failed = false;
+	std::string error;
+	Mesh mesh; // geometry ranges, decode, index type and LODs; the vertices only live on the GPU
+	GPUImage image; // cooked BC1/BC7 or R8G8B8A8_SRGB, in SHADER_READ_ONLY_OPTIMAL
+	// image holds levels [first_level, level_count) of the texture's chain, whose level 0 is
+	// width x height. Only cooked textures can be loaded again with other levels (streamable).
+	VkFormat format = VK_FORMAT_UNDEFINED;
+	uint32_t width = 0, height = 0;
+	uint32_t level_count = 0, first_level = 0;
+	bool streamable = false;
+	// The loader's upload semaphore has reached it by the time the asset is collected. A graphics
+	// submit using the asset for the first time still waits on it and runs acquire() first.
+	uint64_t upload_value = 0;
+};
+
+// Every upload is staged through one ring this big; a bigger asset gets a buffer of its own
+const VkDeviceSize STAGING_RING_SIZE = 64ull << 20;
+// Submits the upload thread can have copying at once
+const uint32_t UPLOAD_BATCHES = 2;
+// Where a graphics submit waits for uploads. Every stage, which costs nothing: the value waited
+// for has always been reached by the time an asset is collected.
+const VkPipelineStageFlags UPLOAD_WAIT_STAGES = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+
+// Loads meshes and textures without the render thread ever waiting on them. A pool of workers
+// reads, cooks and decodes each asset straight into the staging ring, then a single upload thread
+// records the copies of everything ready into one command buffer on the transfer queue, which
+// signals the next value of a timeline semaphore. It keeps recording the next batch while the last
+// one copies, and hands a batch's assets out once their value is reached, so rendering never
+// stalls on a copy. With a transfer family of its own the copies end in a release of the
+// resources to the graphics family, which acquire() completes.
+class AssetLoader
+{
+public:
+	~AssetLoader();
+	// From here on the upload thread is the only user of transferQueue. Meshes go into geometry.
+	// 0 workers: half the cores. Without block_compressed (no textureCompressionBC) textures are
+	// never cooked, only decoded.
+	void start(VkDevice device, VkPhysicalDevice physicalDevice, VkQueue transferQueue, uint32_t transferFamily, uint32_t graphicsFamily, vkutils::GeometryBuffers* geometry, bool block_compressed, uint32_t worker_count = 0);
+	// Lets the jobs in progress finish, drops the queued ones and destroys whatever wasn't collected
+	void stop();
+
+	// A mesh file goes through meshutils::open_mesh(), so a stale or missing cook happens here too
+	void request_mesh(std::string key, std::string path);
+	// A mesh built in memory (e.g. level geometry), packed on a worker
+	void request_mesh(std::string key, Mesh mesh);
+	// Goes through texutils::open_texture() like meshes do; stb_image to RGBA8 mips when the
+	// texture can't be cooked. Cooked textures only get their levels no bigger than max_size
+	// (the last level at the least).
+	void request_texture(std::string path, uint32_t max_size = UINT32_MAX);
+
+	// Any thread. Assets that became resident or failed since the last call, in completion order
+	void collect(std::vector<LoadedAsset>& done);
+	uint32_t in_flight() const;
+
+	// The timeline semaphore every upload submit signals, an asset's upload_value once it's copied
+	VkSemaphore upload_semaphore() const { return timeline; }
+	// Records the graphics family's half of the asset's ownership transfer; nothing when both
+	// queues are of one family. In a submit that waits on upload_semaphore() at UPLOAD_WAIT_STAGES.
+	void acquire(VkCommandBuffer cmdBuffer, const LoadedAsset& asset) const;
+private:
+	struct LoadJob {
+		std::string key;
+		std::string path;
+		bool is_texture = false;
+		bool in_memory = false;
+		Mesh mesh;
+		uint32_t max_size = UINT32_MAX;
+	};
+	struct UploadJob {
+		LoadedAsset asset;
+		vkutils::StagingRegion staging; // a mesh's vertices then its indices, or all the image's levels
+		VkDeviceSize vertex_bytes = 0, index_bytes = 0;
+		VkFormat format = VK_FORMAT_R8G8B8A8_SRGB;
+		uint32_t levels = 1;
+		std::vector<VkBufferImageCopy> regions; // out of staging.buffer, one per mip level
+	};
+	struct UploadBatch {
+		VkCommandBuffer cmdBuffer = VK_NULL_HANDLE;
+		uint64_t value = 0; // what its submit signals timeline to
+		std::vector<UploadJob> jobs;
+		bool in_flight = false;
+	};
+
+	VkDevice device = VK_NULL_HANDLE;
+	VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+	VkQueue transferQueue = VK_NULL_HANDLE;
+	uint32_t transferFamily = VK_QUEUE_FAMILY_IGNORED, graphicsFamily = VK_QUEUE_FAMILY_IGNORED;
+	VkSemaphore timeline = VK_NULL_HANDLE;
+	vkutils::GeometryBuffers* geometry = nullptr;
+	bool block_compressed = false;
+	vkutils::StagingRing staging_ring;
+	// Upload thread only. batches[next_batch] is the next one recorded, and the oldest in flight
+	VkCommandPool cmdPool = VK_NULL_HANDLE;
+	UploadBatch batches[UPLOAD_BATCHES];
+	uint32_t next_batch = 0;
+	uint64_t submitted = 0; // the last value signalled
+
+	std::vector<std::thread> workers;
+	std::thread uploader;
+	mutable std::mutex queue_mut;
+	std::condition_variable load_cv;
+	std::condition_variable upload_cv;
+	// Guarded by queue_mut
+	std::deque<LoadJob> loads;
+	std::vector<UploadJob> uploads;
+	std::vector<LoadedAsset> done;
+	uint32_t requested = 0; // not collected yet
+	bool stop_threads = false;
+
+	void worker_loop();
+	void upload_loop();
+	UploadJob prepare(LoadJob& job);
+	void record(VkCommandBuffer cmdBuffer, const UploadJob& job);
+	void submit(UploadBatch& batch);
+	// Hands out the batches that are done copying, oldest first; wait: all of them, however long
+	void retire(bool wait);
+	void wait_for(uint64_t value);
+	// Queue family ownership only moves between two different families
+	bool transfers_ownership() const { return transferFamily != graphicsFamily; }
+	void destroy_staging(UploadJob& job);
+	void destroy_asset(LoadedAsset& asset);
+};
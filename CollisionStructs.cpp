@@ -3,8 +3,110 @@
 #include <cmath>
 #include <algorithm>
 #include <iostream>
+#include <limits>
 #include <glm/gtc/type_ptr.hpp>
 
+// Filtered predicates: everything is evaluated in float first, together with a bound on its
+// rounding error. Only results that land inside that bound (sign can't be trusted) are
+// recomputed in double from the same float inputs. The counts are per thread, so whichever
+// thread runs collision bumps its own without any synchronisation.
+static thread_local collutils::PredicateStats pred_stats;
+static const float PRED_ERR = 8 * std::numeric_limits<float>::epsilon();
+
+collutils::PredicateStats collutils::get_predicate_stats()
+{
+	return pred_stats;
+}
+
+void collutils::reset_predicate_stats()
+{
+	pred_stats = PredicateStats();
+}
+
+// dot(a - b, c)
+static inline float filtered_dot_diff(glm::vec3 a, glm::vec3 b, glm::vec3 c)
+{
+	pred_stats.evals++;
+	float res = glm::dot(a - b, c);
+	float err = PRED_ERR * glm::dot(glm::abs(a) + glm::abs(b), glm::abs(c));
+	if (std::abs(res) > err) return res;
+	pred_stats.fallbacks++;
+	return float(glm::dot(glm::dvec3(a) - glm::dvec3(b), glm::dvec3(c)));
+}
+
+// dot(vec4(p, 1), eq)
+static inline float filtered_plane_dist(glm::vec3 p, glm::vec4 eq)
+{
+	pred_stats.evals++;
+	float res = glm::dot(glm::vec4(p, 1), eq);
+	float err = PRED_ERR * (glm::dot(glm::abs(p), glm::abs(glm::vec3(eq))) + std::abs(eq.w));
+	if (std::abs(res) > err) return res;
+	pred_stats.fallbacks++;
+	return float(glm::dot(glm::dvec3(p), glm::dvec3(glm::vec3(eq))) + double(eq.w));
+}
+
+// Contact time of c + b*t + 0.5*a*t^2 = 0. Keeps the solver's root order ((-b - r)/a first, then
+// (-b + r)/a if that one is negative) but computes both without the -b + r cancellation.
+template <typename T>
+static bool quad_contact_time(T a, T b, T c, T& t)
+{
+	T delta = b * b - 2 * a * c;
+	if (delta < 0) return false;
+	if (a == 0) {
+		if (b == 0) return false;
+		t = -c / b;
+		return true;
+	}
+	T r = std::sqrt(delta);
+	T r1, r2;
+	if (b >= 0) {
+		T q = -(b + r);
+		r1 = q / a;
+		r2 = (q != 0) ? 2 * c / q : 0;
+	}
+	else {
+		T q = r - b;
+		r1 = 2 * c / q;
+		r2 = q / a;
+	}
+	t = (r1 < 0) ? r2 : r1;
+	return true;
+}
+
+// Quadratic with a = dot(acc, n), b = dot(vel, n), c = dot(off, n) + w
+static bool filtered_contact_time(glm::vec3 acc, glm::vec3 vel, glm::vec3 off, glm::vec3 n, float w, float& t)
+{
+	pred_stats.evals++;
+	float a = glm::dot(acc, n);
+	float b = glm::dot(vel, n);
+	float c = glm::dot(off, n) + w;
+	glm::vec3 an = glm::abs(n);
+	float ea = PRED_ERR * glm::dot(glm::abs(acc), an);
+	float eb = PRED_ERR * glm::dot(glm::abs(vel), an);
+	float ec = PRED_ERR * (glm::dot(glm::abs(off), an) + std::abs(w));
+	float delta = b * b - 2 * a * c;
+	float edelta = PRED_ERR * (b * b + 2 * std::abs(a * c)) + 2 * (std::abs(b) * eb + std::abs(a) * ec + std::abs(c) * ea);
+	if (std::abs(delta) > edelta && std::abs(a) > ea) return quad_contact_time(a, b, c, t);
+	// No acceleration along n at all (ea is 0 only when every acc * n term is), e.g. gravity
+	// against a wall: linear, and only b's sign has to be trusted
+	if (ea == 0 && std::abs(b) > eb) {
+		t = -c / b;
+		return true;
+	}
+
+	pred_stats.fallbacks++;
+	glm::dvec3 nd = glm::dvec3(n);
+	double td = 0;
+	bool res = quad_contact_time(
+		glm::dot(glm::dvec3(acc), nd),
+		glm::dot(glm::dvec3(vel), nd),
+		glm::dot(glm::dvec3(off), nd) + double(w),
+		td
+	);
+	t = float(td);
+	return res;
+}
+
 
 collutils::isecLine collutils::find_isec_of_planes(glm::vec4 planeeq1, glm::vec4 planeeq2, float thickness, bool normalized)
 {
@@ -104,15 +206,25 @@ collutils::isecPoint collutils::find_isec_of_linesegments(glm::vec3 l1a, glm::ve
 void collutils::ConvexPolyPlane::init_polydata()
 {
 	sides = points.size();
+	rays.clear();
+	perps.clear();
 	for (size_t i = 0; i < points.size(); i++) rays.push_back(glm::normalize(points[(i + 1) % sides] - points[i]));
 	n = glm::cross(rays[0], rays[1]);
 	for (size_t i = 0; i < points.size(); i++) perps.push_back(glm::cross(n, rays[i]));
 	equation = glm::vec4(n, -glm::dot(n, points[0]));
 }
 
+collutils::ConvexPolyPlane::ConvexPolyPlane()
+{
+	sides = 0;
+	equation = glm::vec4(0);
+	n = glm::vec3(0);
+	height = 0;
+	friction = 0;
+}
 collutils::ConvexPolyPlane::ConvexPolyPlane(std::vector<glm::vec3> polyPoints, float thickness, float planeFriction)
 {
-	points = polyPoints;
+	points.assign(polyPoints.begin(), polyPoints.end());
 	height = thickness;
 	friction = planeFriction;
 	init_polydata();
@@ -131,7 +243,7 @@ collutils::ConvexPolyPlane::ConvexPolyPlane(glm::vec3 rectCenter, glm::vec3 u, g
 	init_polydata();
 }
 
-Mesh collutils::ConvexPolyPlane::gen_mesh() {
+Mesh collutils::ConvexPolyPlane::gen_mesh() const {
 	std::vector<Vertex> vlist = std::vector<Vertex>((sides - 2) * 3);
 	glm::vec3 uaxn = glm::normalize(rays[0]);
 	glm::vec3 vaxn = glm::cross(n, rays[0]);
@@ -161,18 +273,46 @@ void collutils::ConvexPolyPlane::apply_displacement(glm::vec3 disp)
 	equation = glm::vec4(n, -glm::dot(n, points[0]));
 }
 
-int collutils::ConvexPolyPlane::point_status(glm::vec3 p, float pdist)
+void collutils::ConvexPolyPlane::apply_rotation(glm::mat3 rot, glm::vec3 pivot)
 {
-	float ndist = glm::dot(glm::vec4(p, 1), equation);
+	for (int i = 0; i < points.size(); i++) {
+		points[i] = pivot + rot * (points[i] - pivot);
+		rays[i] = rot * rays[i];
+		perps[i] = rot * perps[i];
+	}
+	n = rot * n;
+	equation = glm::vec4(n, -glm::dot(n, points[0]));
+}
+
+// N is the side count when known at compile time (quads, triangles) so the loop fully unrolls;
+// N = 0 falls back to the runtime side count.
+template <int N>
+static inline bool in_poly_region(const collutils::ConvexPolyPlane& pp, glm::vec3 q)
+{
+	const int sides = (N > 0) ? N : pp.sides;
+	const glm::vec3* points = pp.points.data();
+	const glm::vec3* perps = pp.perps.data();
+	for (int i = 0; i < sides; i++) {
+		if (filtered_dot_diff(q, points[(i + 1 == sides) ? 0 : i + 1], perps[i]) < 0) return false;
+	}
+	return true;
+}
+
+int collutils::ConvexPolyPlane::point_status(glm::vec3 p, float pdist) const
+{
+	float ndist = filtered_plane_dist(p, equation);
 	glm::vec3 q = p - ndist * n;
-	bool in_region = false;
-	for (size_t i = 0; i < sides; i++) {
-		if (glm::dot(q - points[(i + 1) % sides], perps[i]) < 0) return 0;
+	bool in_region;
+	switch (sides) {
+	case 3: in_region = in_poly_region<3>(*this, q); break;
+	case 4: in_region = in_poly_region<4>(*this, q); break;
+	default: in_region = in_poly_region<0>(*this, q); break;
 	}
+	if (!in_region) return 0;
 	return (0 <= ndist && ndist <= height) ? 1 : 2;
 }
 
-collutils::CollPoint collutils::ConvexPolyPlane::check_point_future(glm::vec3 ploc, glm::vec3 pvel, glm::vec3 pacc, float until)
+collutils::CollPoint collutils::ConvexPolyPlane::check_point_future(glm::vec3 ploc, glm::vec3 pvel, glm::vec3 pacc, float until) const
 {
 	CollPoint out;
 	if (pacc == glm::vec3(0)) {
@@ -193,18 +333,13 @@ collutils::CollPoint collutils::ConvexPolyPlane::check_point_future(glm::vec3 pl
 		}
 	}
 	else {
-		float dqeA = glm::dot(pacc, n);
-		float qeB = glm::dot(pvel, n);
 		float qeC = glm::dot(glm::vec4(ploc, 1), equation);
-		float qdelta = qeB * qeB - 2 * dqeA * qeC;
-		if (qdelta < 0) {
+		float lpr;
+		if (!filtered_contact_time(pacc, pvel, ploc, n, equation.w, lpr)) {
 			out.will_collide = false;
 			return out;
 		}
 		else {
-			double rdelta = sqrt(qdelta);
-			float lpr = (-qeB - rdelta) / dqeA;
-			if (lpr < 0) lpr = (-qeB + rdelta) / dqeA;
 			if (lpr < 0 || lpr > until) {
 				out.will_collide = false;
 				return out;
@@ -261,6 +396,8 @@ collutils::CollMesh::CollMesh()
 
 collutils::CollMesh::CollMesh(ConvexPolyPlane cnvpp)
 {
+	vertices.reserve(cnvpp.points.size());
+	edges.reserve(cnvpp.points.size());
 	vertices.insert(vertices.end(), cnvpp.points.begin(), cnvpp.points.end());
 	planes.push_back(cnvpp);
 	for (int i = 0; i < vertices.size(); i++) {
@@ -278,6 +415,319 @@ void collutils::CollMesh::apply_displacement(glm::vec3 disp)
 	}
 }
 
+void collutils::CollMesh::apply_rotation(glm::mat3 rot, glm::vec3 pivot)
+{
+	for (int i = 0; i < vertices.size(); i++) {
+		vertices[i] = pivot + rot * (vertices[i] - pivot);
+	}
+	for (int i = 0; i < planes.size(); i++) {
+		planes[i].apply_rotation(rot, pivot);
+	}
+}
+
+float collutils::bounding_radius(const CollMesh& cm, glm::vec3 center)
+{
+	float r = 0;
+	for (int i = 0; i < cm.vertices.size(); i++) r = std::max(r, glm::length(cm.vertices[i] - center));
+	for (int i = 0; i < cm.planes.size(); i++) {
+		for (int j = 0; j < cm.planes[i].points.size(); j++) r = std::max(r, glm::length(cm.planes[i].points[j] - center));
+	}
+	return r;
+}
+
+void collutils::mesh_bounds(const CollMesh& cm, glm::vec3& bmin, glm::vec3& bmax)
+{
+	bmin = glm::vec3(std::numeric_limits<float>::max());
+	bmax = glm::vec3(-std::numeric_limits<float>::max());
+	float pad = 0;
+	for (int i = 0; i < cm.vertices.size(); i++) {
+		bmin = glm::min(bmin, cm.vertices[i]);
+		bmax = glm::max(bmax, cm.vertices[i]);
+	}
+	for (int i = 0; i < cm.planes.size(); i++) {
+		for (int j = 0; j < cm.planes[i].points.size(); j++) {
+			bmin = glm::min(bmin, cm.planes[i].points[j]);
+			bmax = glm::max(bmax, cm.planes[i].points[j]);
+		}
+		pad = std::max(pad, cm.planes[i].height);
+	}
+	bmin -= glm::vec3(pad);
+	bmax += glm::vec3(pad);
+}
+
+static void build_bvh_node(collutils::MeshBVH& bvh, const std::vector<glm::vec3>& bmins, const std::vector<glm::vec3>& bmaxs, int32_t node_idx, int32_t first, int32_t count)
+{
+	glm::vec3 nmin = glm::vec3(std::numeric_limits<float>::max());
+	glm::vec3 nmax = glm::vec3(-std::numeric_limits<float>::max());
+	glm::vec3 cmin = nmin, cmax = nmax;
+	for (int32_t i = first; i < first + count; i++) {
+		uint32_t mi = bvh.mesh_ids[i];
+		nmin = glm::min(nmin, bmins[mi]);
+		nmax = glm::max(nmax, bmaxs[mi]);
+		glm::vec3 c = 0.5f * (bmins[mi] + bmaxs[mi]);
+		cmin = glm::min(cmin, c);
+		cmax = glm::max(cmax, c);
+	}
+	bvh.nodes[node_idx].bmin = nmin;
+	bvh.nodes[node_idx].bmax = nmax;
+	if (count <= collutils::BVH_LEAF_SIZE) {
+		bvh.nodes[node_idx].first = first;
+		bvh.nodes[node_idx].count = count;
+		return;
+	}
+
+	// Median split along the widest spread of centers
+	glm::vec3 ext = cmax - cmin;
+	int axis = (ext.x >= ext.y && ext.x >= ext.z) ? 0 : ((ext.y >= ext.z) ? 1 : 2);
+	int32_t half = count / 2;
+	std::nth_element(bvh.mesh_ids.begin() + first, bvh.mesh_ids.begin() + first + half, bvh.mesh_ids.begin() + first + count,
+		[&](uint32_t a, uint32_t b) { return bmins[a][axis] + bmaxs[a][axis] < bmins[b][axis] + bmaxs[b][axis]; });
+
+	int32_t left = bvh.nodes.size();
+	bvh.nodes.push_back(collutils::BVHNode());
+	bvh.nodes.push_back(collutils::BVHNode());
+	bvh.nodes[node_idx].first = left;
+	bvh.nodes[node_idx].count = 0;
+	build_bvh_node(bvh, bmins, bmaxs, left, first, half);
+	build_bvh_node(bvh, bmins, bmaxs, left + 1, first + half, count - half);
+}
+
+void collutils::MeshBVH::build(const std::vector<CollMesh>& meshes)
+{
+	nodes.clear();
+	mesh_ids.clear();
+	parents.clear();
+	garbage = 0;
+	mesh_leaf.assign(meshes.size(), -1);
+	mesh_bmin.resize(meshes.size());
+	mesh_bmax.resize(meshes.size());
+	for (uint32_t i = 0; i < meshes.size(); i++) {
+		if (meshes[i].vertices.empty() && meshes[i].planes.empty()) continue;
+		mesh_bounds(meshes[i], mesh_bmin[i], mesh_bmax[i]);
+		mesh_ids.push_back(i);
+	}
+	if (mesh_ids.empty()) return;
+
+	nodes.reserve(2 * (mesh_ids.size() / BVH_LEAF_SIZE + 1));
+	nodes.push_back(BVHNode());
+	build_bvh_node(*this, mesh_bmin, mesh_bmax, 0, 0, mesh_ids.size());
+
+	parents.assign(nodes.size(), -1);
+	for (int32_t ni = 0; ni < nodes.size(); ni++) {
+		const BVHNode& node = nodes[ni];
+		if (node.count == 0) {
+			parents[node.first] = ni;
+			parents[node.first + 1] = ni;
+		}
+		for (int32_t i = node.first; i < node.first + node.count; i++) mesh_leaf[mesh_ids[i]] = ni;
+	}
+}
+
+static float bvh_half_area(glm::vec3 bmin, glm::vec3 bmax)
+{
+	glm::vec3 e = bmax - bmin;
+	return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+// Recomputes a node's bounds from its children or meshes, false if they didn't change
+static bool refit_bvh_node(collutils::MeshBVH& bvh, int32_t ni)
+{
+	collutils::BVHNode& node = bvh.nodes[ni];
+	glm::vec3 nmin, nmax;
+	if (node.count == 0) {
+		nmin = glm::min(bvh.nodes[node.first].bmin, bvh.nodes[node.first + 1].bmin);
+		nmax = glm::max(bvh.nodes[node.first].bmax, bvh.nodes[node.first + 1].bmax);
+	}
+	else {
+		nmin = glm::vec3(std::numeric_limits<float>::max());
+		nmax = glm::vec3(-std::numeric_limits<float>::max());
+		for (int32_t i = node.first; i < node.first + node.count; i++) {
+			nmin = glm::min(nmin, bvh.mesh_bmin[bvh.mesh_ids[i]]);
+			nmax = glm::max(nmax, bvh.mesh_bmax[bvh.mesh_ids[i]]);
+		}
+	}
+	if (nmin == node.bmin && nmax == node.bmax) return false;
+	node.bmin = nmin;
+	node.bmax = nmax;
+	return true;
+}
+
+void collutils::MeshBVH::insert(uint32_t mi, const CollMesh& mesh)
+{
+	if (mi >= mesh_leaf.size()) {
+		mesh_leaf.resize(mi + 1, -1);
+		mesh_bmin.resize(mi + 1);
+		mesh_bmax.resize(mi + 1);
+	}
+	glm::vec3 bmin, bmax;
+	mesh_bounds(mesh, bmin, bmax);
+	mesh_bmin[mi] = bmin;
+	mesh_bmax[mi] = bmax;
+
+	if (nodes.empty()) {
+		BVHNode root;
+		root.bmin = bmin;
+		root.bmax = bmax;
+		root.first = mesh_ids.size();
+		root.count = 1;
+		nodes.push_back(root);
+		parents.push_back(-1);
+		mesh_ids.push_back(mi);
+		mesh_leaf[mi] = 0;
+		return;
+	}
+
+	// Down to the leaf whose surface area grows the least, growing every node on the way
+	int32_t ni = 0;
+	int depth = 0;
+	while (true) {
+		nodes[ni].bmin = glm::min(nodes[ni].bmin, bmin);
+		nodes[ni].bmax = glm::max(nodes[ni].bmax, bmax);
+		if (nodes[ni].count > 0) break;
+		int32_t left = nodes[ni].first;
+		const BVHNode& l = nodes[left];
+		const BVHNode& r = nodes[left + 1];
+		float lcost = bvh_half_area(glm::min(l.bmin, bmin), glm::max(l.bmax, bmax)) - bvh_half_area(l.bmin, l.bmax);
+		float rcost = bvh_half_area(glm::min(r.bmin, bmin), glm::max(r.bmax, bmax)) - bvh_half_area(r.bmin, r.bmax);
+		ni = (lcost <= rcost) ? left : left + 1;
+		depth++;
+	}
+
+	BVHNode leaf = nodes[ni];
+	// Full leaves split, unless that would outgrow query()'s stack: then they just get bigger
+	if (leaf.count < BVH_LEAF_SIZE || depth + 2 >= BVH_MAX_DEPTH) {
+		if (leaf.first + leaf.count != mesh_ids.size()) {
+			std::vector<uint32_t> ids(mesh_ids.begin() + leaf.first, mesh_ids.begin() + leaf.first + leaf.count);
+			nodes[ni].first = mesh_ids.size();
+			mesh_ids.insert(mesh_ids.end(), ids.begin(), ids.end());
+			garbage += leaf.count;
+		}
+		mesh_ids.push_back(mi);
+		nodes[ni].count++;
+		mesh_leaf[mi] = ni;
+		return;
+	}
+
+	// Median split along the widest spread of centers, same as build()
+	uint32_t ids[BVH_LEAF_SIZE + 1];
+	int32_t n = leaf.count + 1;
+	std::copy(mesh_ids.begin() + leaf.first, mesh_ids.begin() + leaf.first + leaf.count, ids);
+	ids[leaf.count] = mi;
+	glm::vec3 cmin = glm::vec3(std::numeric_limits<float>::max()), cmax = -cmin;
+	for (int32_t i = 0; i < n; i++) {
+		glm::vec3 c = 0.5f * (mesh_bmin[ids[i]] + mesh_bmax[ids[i]]);
+		cmin = glm::min(cmin, c);
+		cmax = glm::max(cmax, c);
+	}
+	glm::vec3 ext = cmax - cmin;
+	int axis = (ext.x >= ext.y && ext.x >= ext.z) ? 0 : ((ext.y >= ext.z) ? 1 : 2);
+	std::sort(ids, ids + n, [&](uint32_t a, uint32_t b) { return mesh_bmin[a][axis] + mesh_bmax[a][axis] < mesh_bmin[b][axis] + mesh_bmax[b][axis]; });
+	int32_t half = n / 2;
+
+	// Left half reuses the leaf's id slots, right half goes on the end
+	int32_t left = nodes.size();
+	nodes.push_back(BVHNode());
+	nodes.push_back(BVHNode());
+	parents.push_back(ni);
+	parents.push_back(ni);
+	nodes[left].first = leaf.first;
+	nodes[left].count = half;
+	nodes[left + 1].first = mesh_ids.size();
+	nodes[left + 1].count = n - half;
+	std::copy(ids, ids + half, mesh_ids.begin() + leaf.first);
+	mesh_ids.insert(mesh_ids.end(), ids + half, ids + n);
+	garbage += leaf.count - half;
+	for (int32_t i = 0; i < n; i++) mesh_leaf[ids[i]] = (i < half) ? left : left + 1;
+	refit_bvh_node(*this, left);
+	refit_bvh_node(*this, left + 1);
+	nodes[ni].first = left;
+	nodes[ni].count = 0;
+}
+
+void collutils::MeshBVH::remove(uint32_t mi)
+{
+	if (mi >= mesh_leaf.size() || mesh_leaf[mi] < 0) return;
+	int32_t ni = mesh_leaf[mi];
+	mesh_leaf[mi] = -1;
+	BVHNode& leaf = nodes[ni];
+	int32_t last = leaf.first + leaf.count - 1;
+	for (int32_t i = leaf.first; i <= last; i++) {
+		if (mesh_ids[i] != mi) continue;
+		mesh_ids[i] = mesh_ids[last];
+		break;
+	}
+	leaf.count--;
+	garbage++;
+
+	if (leaf.count == 0) {
+		// An empty leaf would read as an inner node: the sibling takes over the parent's place
+		int32_t pi = parents[ni];
+		if (pi < 0) {
+			nodes.clear();
+			mesh_ids.clear();
+			parents.clear();
+			garbage = 0;
+			return;
+		}
+		int32_t si = (ni == nodes[pi].first) ? ni + 1 : ni - 1;
+		nodes[pi] = nodes[si];
+		if (nodes[pi].count == 0) {
+			parents[nodes[pi].first] = pi;
+			parents[nodes[pi].first + 1] = pi;
+		}
+		for (int32_t i = nodes[pi].first; i < nodes[pi].first + nodes[pi].count; i++) mesh_leaf[mesh_ids[i]] = pi;
+		garbage += 2;
+		ni = parents[pi];
+	}
+	else if (!refit_bvh_node(*this, ni)) return;
+	else ni = parents[ni];
+
+	for (; ni >= 0; ni = parents[ni]) {
+		if (!refit_bvh_node(*this, ni)) break;
+	}
+}
+
+void collutils::MeshBVH::query(glm::vec3 qmin, glm::vec3 qmax, std::vector<uint32_t>& out) const
+{
+	if (nodes.empty()) return;
+	int32_t stack[BVH_MAX_DEPTH];
+	int sp = 0;
+	stack[sp++] = 0;
+	while (sp > 0) {
+		const BVHNode& node = nodes[stack[--sp]];
+		if (node.bmin.x > qmax.x || node.bmin.y > qmax.y || node.bmin.z > qmax.z) continue;
+		if (node.bmax.x < qmin.x || node.bmax.y < qmin.y || node.bmax.z < qmin.z) continue;
+		if (node.count > 0) {
+			out.insert(out.end(), mesh_ids.begin() + node.first, mesh_ids.begin() + node.first + node.count);
+		}
+		else {
+			stack[sp++] = node.first;
+			stack[sp++] = node.first + 1;
+		}
+	}
+}
+
+// Rotation by angle (rad) about a unit axis
+static glm::mat3 axis_angle_mat(glm::vec3 axis, float angle)
+{
+	float c = std::cos(angle), s = std::sin(angle), t = 1 - c;
+	return glm::mat3(
+		glm::vec3(t * axis.x * axis.x + c, t * axis.x * axis.y + s * axis.z, t * axis.x * axis.z - s * axis.y),
+		glm::vec3(t * axis.x * axis.y - s * axis.z, t * axis.y * axis.y + c, t * axis.y * axis.z + s * axis.x),
+		glm::vec3(t * axis.x * axis.z + s * axis.y, t * axis.y * axis.z - s * axis.x, t * axis.z * axis.z + c)
+	);
+}
+
+// Spin the solid about its center for time t
+static void advance_rotation(collutils::KineSolidObj& kso, float t)
+{
+	float angspeed = glm::length(kso._angvel);
+	if (angspeed == 0 || t <= 0) return;
+	glm::mat3 rot = axis_angle_mat(kso._angvel / angspeed, angspeed * t);
+	kso._cmesh.apply_rotation(rot, kso._center);
+	kso._rot = rot * kso._rot;
+}
+
 //Outdated Fn
 collutils::CollPoint collutils::check_lines_future(glm::vec3 l1point, glm::vec3 l1dir, glm::vec3 l2point, glm::vec3 l2dir, glm::vec3 l2vel, glm::vec3 l2acc, float until)
 {
@@ -347,54 +797,66 @@ collutils::CollPoint collutils::check_lineseg_future(glm::vec3 l1a, glm::vec3 l1
 	float dqeA = glm::dot(l2acc, np);
 	float qeB = glm::dot(l2vel, np);
 	float qeC = glm::dot((l2a - l1a), np);
-	float qdelta = qeB * qeB - 2 * dqeA * qeC;
 
-	if (qdelta < 0) {
-		outdata.will_collide = false;
-		return outdata;
-	}
-	else {
-		float lpr;
-		if (dqeA == 0) {
-			if (qeB == 0) {
-				if (abs(qeC) < 0.05) {
-					lpr = 0;
-				}
-				else {
-					outdata.will_collide = false;
-					return outdata;
-				}
+	float lpr;
+	if (dqeA == 0) {
+		if (qeB == 0) {
+			if (abs(qeC) < 0.05) {
+				lpr = 0;
 			}
 			else {
-				lpr = -qeC / qeB;
+				outdata.will_collide = false;
+				return outdata;
 			}
 		}
 		else {
-			double rdelta = sqrt(qdelta);
-			lpr = (-qeB - rdelta) / dqeA;
-			if (lpr < 0) lpr = (-qeB + rdelta) / dqeA;
+			lpr = -qeC / qeB;
 		}
-		
-		if (lpr < 0 || lpr > until) {
-			outdata.will_collide = false;
-			return outdata;
-		}
-		else {
-			outdata.time = lpr;
-			glm::vec3 nlp2 = glm::cross(np, glm::normalize(l2dir));
-			glm::vec3 fl2a = l2a + l2vel * lpr + l2acc * lpr * lpr * 0.5f;
-			float lt1 = (glm::dot(fl2a - l1a, nlp2)) / glm::dot(l1dir, nlp2);
-			outdata.point = l1a + lt1 * l1dir;
-			float lt2 = glm::dot(outdata.point - fl2a, l2dir) / glm::dot(l2dir, l2dir);
-			outdata.will_collide = (0 <= lt1 && lt1 <= 1 && 0 <= lt2 && lt2 <= 1);
-			//outdata.will_collide = true;
-			outdata.point -= l2a + l2dir * lt2; //+ 0.03f * np;
-			return outdata;
+	}
+	else if (!filtered_contact_time(l2acc, l2vel, l2a - l1a, np, 0, lpr)) {
+		outdata.will_collide = false;
+		return outdata;
+	}
+	
+	if (lpr < 0 || lpr > until) {
+		outdata.will_collide = false;
+		return outdata;
+	}
+	else {
+		outdata.time = lpr;
+		glm::vec3 nlp2 = glm::cross(np, glm::normalize(l2dir));
+		glm::vec3 fl2a = l2a + l2vel * lpr + l2acc * lpr * lpr * 0.5f;
+		float lt1 = (glm::dot(fl2a - l1a, nlp2)) / glm::dot(l1dir, nlp2);
+		outdata.point = l1a + lt1 * l1dir;
+		float lt2 = glm::dot(outdata.point - fl2a, l2dir) / glm::dot(l2dir, l2dir);
+		outdata.will_collide = (0 <= lt1 && lt1 <= 1 && 0 <= lt2 && lt2 <= 1);
+		//outdata.will_collide = true;
+		outdata.point -= l2a + l2dir * lt2; //+ 0.03f * np;
+		return outdata;
+	}
+}
+
+// Edge vs edge part of check_polyplanes_future. N1/N2 work like in_poly_region's N.
+template <int N1, int N2>
+static void check_polyplane_edges(const collutils::ConvexPolyPlane& pp1, const collutils::ConvexPolyPlane& pp2, glm::vec3 pvel, glm::vec3 pacc, float until, collutils::SolidCollData& outdata)
+{
+	const int pp1s = (N1 > 0) ? N1 : pp1.sides;
+	const int pp2s = (N2 > 0) ? N2 : pp2.sides;
+	const glm::vec3* p1 = pp1.points.data();
+	const glm::vec3* p2 = pp2.points.data();
+	for (int pidx = 0; pidx < pp1s; pidx++) {
+		for (int pidy = 0; pidy < pp2s; pidy++) {
+			collutils::CollPoint tmp1 = collutils::check_lineseg_future(p1[(pidx + 1 == pp1s) ? 0 : pidx + 1], p1[pidx], p2[(pidy + 1 == pp2s) ? 0 : pidy + 1], p2[pidy], pvel, pacc, until);
+			if (tmp1.will_collide && (!outdata.will_collide || tmp1.time < outdata.time)) {
+				outdata.time = tmp1.time;
+				outdata.will_collide = true;
+				outdata.disp = (pvel * outdata.time) + (0.5f * pacc * outdata.time * outdata.time);
+			}
 		}
 	}
 }
 
-collutils::SolidCollData collutils::check_polyplanes_future(ConvexPolyPlane pp1, ConvexPolyPlane pp2, glm::vec3 pvel, glm::vec3 pacc, float until)
+collutils::SolidCollData collutils::check_polyplanes_future(const ConvexPolyPlane& pp1, const ConvexPolyPlane& pp2, glm::vec3 pvel, glm::vec3 pacc, float until)
 {
 	SolidCollData outdata;
 	outdata.time = until;
@@ -418,21 +880,40 @@ collutils::SolidCollData collutils::check_polyplanes_future(ConvexPolyPlane pp1,
 			outdata.disp = (pvel * outdata.time) + (0.5f * pacc * outdata.time * outdata.time);
 		}
 	}
-	for (int pidx = 0; pidx < pp1s; pidx++) {
-		for (int pidy = 0; pidy < pp2s; pidy++) {
-			CollPoint tmp1 = check_lineseg_future(pp1.points[(pidx + 1) % pp1s], pp1.points[pidx], pp2.points[(pidy + 1) % pp2s], pp2.points[pidy], pvel, pacc, until);
-			if (tmp1.will_collide && (!outdata.will_collide || tmp1.time < outdata.time)) {
-				outdata.time = tmp1.time;
-				outdata.will_collide = true;
-				outdata.disp = (pvel * outdata.time) + (0.5f * pacc * outdata.time * outdata.time);
-			}
-		}
-	}
+	if (pp1s == 4 && pp2s == 4) check_polyplane_edges<4, 4>(pp1, pp2, pvel, pacc, until, outdata);
+	else if (pp1s == 4 && pp2s == 3) check_polyplane_edges<4, 3>(pp1, pp2, pvel, pacc, until, outdata);
+	else if (pp1s == 3 && pp2s == 4) check_polyplane_edges<3, 4>(pp1, pp2, pvel, pacc, until, outdata);
+	else if (pp1s == 3 && pp2s == 3) check_polyplane_edges<3, 3>(pp1, pp2, pvel, pacc, until, outdata);
+	else check_polyplane_edges<0, 0>(pp1, pp2, pvel, pacc, until, outdata);
 
 	return outdata;
 }
 
-collutils::SolidCollData collutils::check_mesh_future(CollMesh cm1, CollMesh cm2, glm::vec3 mvel, glm::vec3 macc, float until)
+// Whether pl (a face of own) has all of own on one side and all of other on the opposite side.
+// Own vertices lying on the plane are skipped: the face's own corners are never exactly 0 once
+// the mesh has been moved or rotated.
+static bool is_separating_plane(const collutils::ConvexPolyPlane& pl, const collutils::CollMesh& own, const collutils::CollMesh& other)
+{
+	const float on_plane_eps = 0.0001f;
+	bool dir_sign = true;
+	bool dir_set = false;
+	for (int vxi = 0; vxi < own.vertices.size(); vxi++) {
+		float d = glm::dot(pl.equation, glm::vec4(own.vertices[vxi], 1));
+		if (std::abs(d) <= on_plane_eps) continue;
+		if (!dir_set) {
+			dir_set = true;
+			dir_sign = (d > 0);
+		}
+		else if (dir_sign != (d > 0)) return false;
+	}
+	for (int vxi = 0; vxi < other.vertices.size(); vxi++) {
+		float d = glm::dot(pl.equation, glm::vec4(other.vertices[vxi], 1));
+		if (dir_sign ^ (d <= 0)) return false;
+	}
+	return true;
+}
+
+collutils::SolidCollData collutils::check_mesh_future(const CollMesh& cm1, const CollMesh& cm2, glm::vec3 mvel, glm::vec3 macc, float until)
 {
 	SolidCollData outdata;
 	outdata.time = until;
@@ -480,28 +961,7 @@ collutils::SolidCollData collutils::check_mesh_future(CollMesh cm1, CollMesh cm2
 
 	bool found_dplane = false;
 	for (int pli = 0; pli < cm1.planes.size(); pli++) {
-		bool dir_sign = true;
-		bool dir_set = false;
-		bool this_dplane = true;
-		for (int vxi = 0; vxi < cm1.vertices.size(); vxi++) {
-			float d = glm::dot(cm1.planes[pli].equation, glm::vec4(cm1.vertices[vxi], 1));
-			if (!dir_set && d != 0) {
-				dir_set = true;
-				dir_sign = (d >= 0);
-			}
-			if (dir_sign ^ (d >= 0)) {
-				this_dplane = false;
-				break;
-			}
-		}
-		for (int vxi = 0; vxi < cm2.vertices.size(); vxi++) {
-			float d = glm::dot(cm1.planes[pli].equation, glm::vec4(cm2.vertices[vxi], 1));
-			if (dir_sign ^ (d <= 0)) {
-				this_dplane = false;
-				break;
-			}
-		}
-		if (this_dplane) {
+		if (is_separating_plane(cm1.planes[pli], cm1, cm2)) {
 			outdata.bound_dir = cm1.planes[pli].n;
 			found_dplane = true;
 			break;
@@ -509,28 +969,7 @@ collutils::SolidCollData collutils::check_mesh_future(CollMesh cm1, CollMesh cm2
 	}
 	if (!found_dplane) {
 		for (int pli = 0; pli < cm2.planes.size(); pli++) {
-			bool dir_sign = true;
-			bool dir_set = false;
-			bool this_dplane = true;
-			for (int vxi = 0; vxi < cm1.vertices.size(); vxi++) {
-				float d = glm::dot(cm2.planes[pli].equation, glm::vec4(cm1.vertices[vxi], 1));
-				if (!dir_set && d != 0) {
-					dir_set = true;
-					dir_sign = (d > 0);
-				}
-				if (dir_sign ^ (d >= 0)) {
-					this_dplane = false;
-					break;
-				}
-			}
-			for (int vxi = 0; vxi < cm2.vertices.size(); vxi++) {
-				float d = glm::dot(cm2.planes[pli].equation, glm::vec4(cm2.vertices[vxi], 1));
-				if (dir_sign ^ (d <= 0)) {
-					this_dplane = false;
-					break;
-				}
-			}
-			if (this_dplane) {
+			if (is_separating_plane(cm2.planes[pli], cm2, cm1)) {
 				outdata.bound_dir = -cm2.planes[pli].n;
 				break;
 			}
@@ -569,24 +1008,78 @@ glm::vec3 collutils::apply_bound_planes(glm::vec3 vec_to_bound, std::vector<Conv
 }
 
 glm::vec3 collutils::apply_bound_dirs(glm::vec3 vec_to_bound, std::vector<glm::vec3> bound_dirs) {
-	if (bound_dirs.size() == 0) return vec_to_bound;
+	ContactManifold manifold;
+	for (int cdi = 0; cdi < bound_dirs.size(); cdi++) manifold.add_contact(bound_dirs[cdi], 0);
+	return solve_contact_bounds(vec_to_bound, manifold);
+}
+
+void collutils::ContactManifold::add_contact(glm::vec3 n, float contactFriction)
+{
+	nx.push_back(n.x);
+	ny.push_back(n.y);
+	nz.push_back(n.z);
+	friction.push_back(contactFriction);
+}
+
+glm::vec3 collutils::solve_contact_bounds(glm::vec3 vec_to_bound, const ContactManifold& manifold, float* lambdas, int iterations)
+{
+	size_t cc = manifold.size();
+	if (cc == 0) return vec_to_bound;
 	if (glm::length(vec_to_bound) < 0.0001) return glm::vec3(0);
-	for (int cdi = 0; cdi < bound_dirs.size(); cdi++) {
-		float vcomp = glm::dot(vec_to_bound, bound_dirs[cdi]);
-		glm::vec3 vtc = (vcomp >= 0) ? vec_to_bound : project_vec_on_plane(vec_to_bound, bound_dirs[cdi]);
 
-		bool accept_graze = true;
-		for (int cdj = 0; cdj < bound_dirs.size(); cdj++) {
-			if (glm::dot(vtc, bound_dirs[cdj]) < 0) {
-				accept_graze = false;
-				break;
-			}
+	const float* nx = manifold.nx.data();
+	const float* ny = manifold.ny.data();
+	const float* nz = manifold.nz.data();
+	SmallVec<float, CONTACT_INLINE_COUNT> lam, inv_nn;
+	for (size_t i = 0; i < cc; i++) {
+		float nn = nx[i] * nx[i] + ny[i] * ny[i] + nz[i] * nz[i];
+		lam.push_back(0);
+		inv_nn.push_back((nn > 0) ? 1 / nn : 0);
+	}
+
+	// Fixed iteration count, no early out: every sweep is the same straight-line code
+	float vx = vec_to_bound.x, vy = vec_to_bound.y, vz = vec_to_bound.z;
+	for (int it = 0; it < iterations; it++) {
+		for (size_t i = 0; i < cc; i++) {
+			float vn = vx * nx[i] + vy * ny[i] + vz * nz[i];
+			float nl = std::max(0.0f, lam[i] - vn * inv_nn[i]);
+			float dl = nl - lam[i];
+			lam[i] = nl;
+			vx += dl * nx[i];
+			vy += dl * ny[i];
+			vz += dl * nz[i];
 		}
-		if (accept_graze) {
-			return vtc;
+	}
+	glm::vec3 res = glm::vec3(vx, vy, vz);
+
+	// Didn't converge (contacts box the object in): stop rather than creep into one of them
+	float tol = 0.0001f * glm::length(vec_to_bound);
+	for (size_t i = 0; i < cc; i++) {
+		if (vx * nx[i] + vy * ny[i] + vz * nz[i] < -tol) {
+			res = glm::vec3(0);
+			break;
 		}
 	}
-	return glm::vec3(0);
+	if (lambdas) std::copy(lam.begin(), lam.end(), lambdas);
+	return res;
+}
+
+collutils::ContactSolveResult collutils::solve_contact_manifold(glm::vec3 vel, glm::vec3 acc, const ContactManifold& manifold, int iterations)
+{
+	ContactSolveResult res;
+	SmallVec<float, CONTACT_INLINE_COUNT> acc_lambdas;
+	for (size_t i = 0; i < manifold.size(); i++) acc_lambdas.push_back(0);
+
+	res.vel = solve_contact_bounds(vel, manifold, nullptr, iterations);
+	res.acc = solve_contact_bounds(acc, manifold, acc_lambdas.data(), iterations);
+
+	// Friction comes from contacts that carry load and that the object isn't moving away from.
+	// Coplanar contacts share one load, so standing on a seam doesn't double the friction.
+	for (size_t i = 0; i < manifold.size(); i++) {
+		glm::vec3 n = glm::vec3(manifold.nx[i], manifold.ny[i], manifold.nz[i]);
+		if (acc_lambdas[i] > 0.0001f && glm::dot(n, vel) <= 0.0) res.friction += manifold.friction[i];
+	}
+	return res;
 }
 
 collutils::KinePointObj collutils::progress_kinematics(KinePointObj kpo, std::vector<ConvexPolyPlane>* planes, int nfPlaneIdx, float fwd_time) {
@@ -679,45 +1172,97 @@ collutils::KinePointObj collutils::progress_kinematics(KinePointObj kpo, std::ve
 	return outData;
 }
 
-collutils::KineSolidObj collutils::progress_solid_kinematics(KineSolidObj kso, std::vector<CollMesh> smeshes, int nfPlaneIdx, float fwd_time)
+// Spin constraints for one contact normal: the solid's vertices furthest along -n are where it
+// touches, and a spin may not move any of them into the contact (dot(w, r x n) >= 0)
+static void add_spin_contacts(collutils::ContactManifold& spin_manifold, const collutils::CollMesh& cm, glm::vec3 center, glm::vec3 n)
+{
+	const float support_eps = 0.01f;
+	float mind = std::numeric_limits<float>::max();
+	for (int i = 0; i < cm.vertices.size(); i++) mind = std::min(mind, glm::dot(cm.vertices[i], n));
+	for (int i = 0; i < cm.vertices.size(); i++) {
+		if (glm::dot(cm.vertices[i], n) > mind + support_eps) continue;
+		glm::vec3 j = glm::cross(cm.vertices[i] - center, n);
+		if (glm::dot(j, j) > 1e-8f) spin_manifold.add_contact(j, 0);
+	}
+}
+
+static void project_vertices(const std::vector<glm::vec3>& verts, glm::vec3 axis, float& pmin, float& pmax)
 {
+	pmin = std::numeric_limits<float>::max();
+	pmax = -std::numeric_limits<float>::max();
+	for (int i = 0; i < verts.size(); i++) {
+		float d = glm::dot(verts[i], axis);
+		pmin = std::min(pmin, d);
+		pmax = std::max(pmax, d);
+	}
+}
+
+// Separating axis test over face normals and edge pairs of two convex meshes: how deep they overlap
+// along the shallowest axis, negative when they're apart
+static float overlap_depth(const collutils::CollMesh& a, const collutils::CollMesh& b)
+{
+	float depth = std::numeric_limits<float>::max();
+	auto test_axis = [&](glm::vec3 axis) {
+		float al = glm::length(axis);
+		if (al < 1e-6f) return;
+		axis /= al;
+		float amin, amax, bmin, bmax;
+		project_vertices(a.vertices, axis, amin, amax);
+		project_vertices(b.vertices, axis, bmin, bmax);
+		depth = std::min(depth, std::min(amax - bmin, bmax - amin));
+	};
+	for (int i = 0; i < a.planes.size(); i++) test_axis(a.planes[i].n);
+	for (int i = 0; i < b.planes.size(); i++) test_axis(b.planes[i].n);
+	for (int i = 0; i < a.edges.size(); i++) {
+		glm::vec3 ea = a.vertices[a.edges[i].y] - a.vertices[a.edges[i].x];
+		for (int j = 0; j < b.edges.size(); j++) {
+			test_axis(glm::cross(ea, b.vertices[b.edges[j].y] - b.vertices[b.edges[j].x]));
+		}
+	}
+	return depth;
+}
+
+// Reused by every step of the thread's spinning solids, so they don't allocate per tick
+struct RotationScratch
+{
+	std::vector<int> near_meshes;
+	std::vector<float> pre_depths;
+	collutils::CollMesh pre_mesh;
+};
+static thread_local RotationScratch rot_scratch;
+
+// ids: which of smeshes to test (nullptr = all of them)
+static collutils::KineSolidObj progress_solid_kinematics_ids(collutils::KineSolidObj kso, const std::vector<collutils::CollMesh>& smeshes, const uint32_t* ids, size_t idcount, int nfPlaneIdx, float fwd_time)
+{
+	using namespace collutils;
 	KineSolidObj outkso = kso;
 	//out.vel += input_vel;
 
 	int coll_count = 0;
 	float remain_time = fwd_time;
 	float next_coll_time = 0;
+	float bradius = (outkso._angvel != glm::vec3(0)) ? bounding_radius(outkso._cmesh, outkso._center) : 0;
 
 	while (remain_time > 0.001) {
 		// Graze check
-		std::vector<glm::vec3> bound_dirs;
-		std::vector<ConvexPolyPlane> touching_planes;
-		std::vector<SolidCollData> graze_data = std::vector<SolidCollData>(smeshes.size());
-		int nfTpi = -1;
+		ContactManifold manifold;
+		std::vector<SolidCollData> graze_data = std::vector<SolidCollData>(idcount);
 
-		for (int cdi = 0; cdi < smeshes.size(); cdi++) {
+		for (size_t gi = 0; gi < idcount; gi++) {
+			int cdi = ids ? ids[gi] : gi;
 			//std::cout << outData.pos.x << ',' << outData.pos.y << ',' << outData.pos.z << '\n';
-			graze_data[cdi] = check_mesh_future(smeshes[cdi], outkso._cmesh, glm::vec3(0), glm::vec3(0), remain_time);
-			if (graze_data[cdi].will_collide && graze_data[cdi].time == 0) {
-				if (cdi == nfPlaneIdx) nfTpi = touching_planes.size();
-				if (graze_data[cdi].pl_id >= 0) touching_planes.push_back(smeshes[cdi].planes[graze_data[cdi].pl_id]);
-				bound_dirs.push_back(graze_data[cdi].bound_dir);
+			graze_data[gi] = check_mesh_future(smeshes[cdi], outkso._cmesh, glm::vec3(0), glm::vec3(0), remain_time);
+			if (graze_data[gi].will_collide && graze_data[gi].time == 0) {
+				float cfriction = (graze_data[gi].pl_id >= 0 && cdi != nfPlaneIdx) ? smeshes[cdi].planes[graze_data[gi].pl_id].friction : 0;
+				manifold.add_contact(graze_data[gi].bound_dir, cfriction);
 			}
 		}
 
-		// Bound velocity & acc
-		int bdl = bound_dirs.size();
-		glm::vec3 bound_vel = apply_bound_dirs(outkso._vel, bound_dirs);
-		glm::vec3 bound_acc = apply_bound_dirs(outkso._acc, bound_dirs);
-
-		// Apply friction
-		float friction_factor = 0;
-		glm::vec3 friction = glm::vec3(0.0f);
-		for (int tpi = 0; tpi < touching_planes.size(); tpi++) {
-			if ((glm::dot(touching_planes[tpi].n, outkso._acc) < 0.0 && glm::dot(touching_planes[tpi].n, outkso._vel) <= 0.0) && tpi != nfTpi) { // && glm::length(bound_vel) > 0.00f
-				friction_factor += touching_planes[tpi].friction;
-			}
-		}
+		// Bound velocity & acc, get friction
+		ContactSolveResult csr = solve_contact_manifold(outkso._vel, outkso._acc, manifold);
+		glm::vec3 bound_vel = csr.vel;
+		glm::vec3 bound_acc = csr.acc;
+		float friction_factor = csr.friction;
 
 		outkso._vel = bound_vel;
 
@@ -734,11 +1279,31 @@ collutils::KineSolidObj collutils::progress_solid_kinematics(KineSolidObj kso, s
 			}
 		}
 
-		float friction_time = remain_time;
+		// Spinning: the same PGS solve bounds the spin against every touching vertex, so only the
+		// part that would turn a contact point into its surface is removed. The step is capped so
+		// no point of the bounding sphere moves more than ROT_ADVANCE_DIST. Within a step the mesh
+		// is swept linearly and then rotated, so the linear TOI below stays valid.
+		float step_time = remain_time;
+		float angspeed = 0;
+		if (outkso._angvel != glm::vec3(0)) {
+			if (manifold.size() > 0) {
+				ContactManifold spin_manifold;
+				for (size_t ci = 0; ci < manifold.size(); ci++) {
+					add_spin_contacts(spin_manifold, outkso._cmesh, outkso._center, glm::vec3(manifold.nx[ci], manifold.ny[ci], manifold.nz[ci]));
+				}
+				outkso._angvel = solve_contact_bounds(outkso._angvel, spin_manifold);
+			}
+			angspeed = glm::length(outkso._angvel);
+			if (angspeed * bradius > 0) step_time = std::min(remain_time, ROT_ADVANCE_DIST / (angspeed * bradius));
+		}
+
+		float friction_time = step_time;
+		bool friction_stop = false;
 		if (friction_factor != 0) {
 			float temptime = -glm::length(outkso._vel) / glm::dot(glm::normalize(outkso._vel), bound_acc);
-			if (temptime >= 0) {
-				friction_time = std::min(temptime, remain_time);
+			if (temptime >= 0 && temptime < step_time) {
+				friction_time = temptime;
+				friction_stop = true;
 			}
 		}
 
@@ -746,9 +1311,10 @@ collutils::KineSolidObj collutils::progress_solid_kinematics(KineSolidObj kso, s
 		float min_time = friction_time;
 		glm::vec3 min_coll_disp = glm::vec3(0);
 		int cplane_i = -1;
-		for (int cdi = 0; cdi < smeshes.size(); cdi++) {
-			if (!(graze_data[cdi].will_collide && graze_data[cdi].time == 0)) {
-				SolidCollData coll_data = check_mesh_future(smeshes[cdi], outkso._cmesh,outkso._vel, outkso._acc, remain_time);
+		for (size_t gi = 0; gi < idcount; gi++) {
+			int cdi = ids ? ids[gi] : gi;
+			if (!(graze_data[gi].will_collide && graze_data[gi].time == 0)) {
+				SolidCollData coll_data = check_mesh_future(smeshes[cdi], outkso._cmesh,outkso._vel, outkso._acc, step_time);
 				if (coll_data.will_collide && coll_data.time < min_time) {
 					min_time = coll_data.time;
 					min_coll_disp = coll_data.disp;
@@ -762,7 +1328,7 @@ collutils::KineSolidObj collutils::progress_solid_kinematics(KineSolidObj kso, s
 			outkso._cmesh.apply_displacement(fdisp);
 			outkso._center += fdisp;
 			outkso._vel += bound_acc * friction_time;
-			if (friction_time < remain_time) {
+			if (friction_stop) {
 				outkso._vel = glm::vec3(0);
 			}
 			remain_time -= friction_time;
@@ -775,6 +1341,60 @@ collutils::KineSolidObj collutils::progress_solid_kinematics(KineSolidObj kso, s
 			outkso._vel += bound_acc * min_time;
 			remain_time -= min_time;
 		}
+
+		if (angspeed > 0) {
+			float rot_time = (cplane_i == -1) ? friction_time : min_time;
+
+			// The rotation comes after the linear step, so it can still turn the mesh into
+			// something it only just reached. Re-check against everything within the bounding
+			// sphere, back off to smaller turns, and stop spinning if even those go in deeper.
+			glm::vec3 smin = outkso._center - glm::vec3(bradius), smax = outkso._center + glm::vec3(bradius);
+			std::vector<int>& near_meshes = rot_scratch.near_meshes;
+			std::vector<float>& pre_depths = rot_scratch.pre_depths;
+			near_meshes.clear();
+			pre_depths.clear();
+			for (size_t gi = 0; gi < idcount; gi++) {
+				int cdi = ids ? ids[gi] : gi;
+				glm::vec3 mmin, mmax;
+				mesh_bounds(smeshes[cdi], mmin, mmax);
+				if (mmin.x > smax.x || mmin.y > smax.y || mmin.z > smax.z || mmax.x < smin.x || mmax.y < smin.y || mmax.z < smin.z) continue;
+				near_meshes.push_back(cdi);
+				pre_depths.push_back(std::max(0.0f, overlap_depth(smeshes[cdi], outkso._cmesh)));
+			}
+			// A backed off turn doesn't drop the rest of rot_time, it's made up in turns of the
+			// smaller size
+			CollMesh& pre_mesh = rot_scratch.pre_mesh;
+			float rot_left = rot_time;
+			float rot_step = rot_time;
+			int backoffs = 0;
+			while (rot_left > 0) {
+				rot_step = std::min(rot_step, rot_left);
+				pre_mesh = outkso._cmesh;
+				glm::mat3 pre_rot = outkso._rot;
+				advance_rotation(outkso, rot_step);
+				bool clear = true;
+				for (size_t ni = 0; ni < near_meshes.size() && clear; ni++) {
+					clear = overlap_depth(smeshes[near_meshes[ni]], outkso._cmesh) <= pre_depths[ni] + ROT_OVERLAP_TOL;
+				}
+				if (clear) {
+					rot_left -= rot_step;
+					continue;
+				}
+				outkso._cmesh = pre_mesh;
+				outkso._rot = pre_rot;
+				if (backoffs++ == ROT_BACKOFF_STEPS) {
+					outkso._angvel = glm::vec3(0);
+					break;
+				}
+				rot_step *= 0.5f;
+			}
+
+			// Touching surfaces slow the spin down the same way they slow sliding
+			if (friction_factor > 0) {
+				float nspeed = std::max(0.0f, angspeed - rot_time * friction_factor / bradius);
+				outkso._angvel *= nspeed / angspeed;
+			}
+		}
 	}
 	//std::cout << outData.pos.x << ',' << outData.pos.y << ',' << outData.pos.z << '\n';
 	//std::cout << outData.vel.x << ',' << outData.vel.y << ',' << outData.vel.z << '\n';
@@ -782,9 +1402,34 @@ collutils::KineSolidObj collutils::progress_solid_kinematics(KineSolidObj kso, s
 	return outkso;
 }
 
+collutils::KineSolidObj collutils::progress_solid_kinematics(KineSolidObj kso, const std::vector<CollMesh>& smeshes, int nfPlaneIdx, float fwd_time)
+{
+	return progress_solid_kinematics_ids(kso, smeshes, nullptr, smeshes.size(), nfPlaneIdx, fwd_time);
+}
+
+collutils::KineSolidObj collutils::progress_solid_kinematics(KineSolidObj kso, const std::vector<CollMesh>& smeshes, const MeshBVH& sbvh, int nfPlaneIdx, float fwd_time)
+{
+	// Everything the solid can reach this step: current bounds (or its bounding sphere if it spins)
+	// grown by the furthest it can travel. Contact solving only ever shrinks vel/acc.
+	glm::vec3 qmin, qmax;
+	mesh_bounds(kso._cmesh, qmin, qmax);
+	if (kso._angvel != glm::vec3(0)) {
+		float r = bounding_radius(kso._cmesh, kso._center);
+		qmin = glm::min(qmin, kso._center - glm::vec3(r));
+		qmax = glm::max(qmax, kso._center + glm::vec3(r));
+	}
+	float reach = glm::length(kso._vel) * fwd_time + 0.5f * glm::length(kso._acc) * fwd_time * fwd_time + 0.05f;
+	std::vector<uint32_t> near_ids;
+	sbvh.query(qmin - glm::vec3(reach), qmax + glm::vec3(reach), near_ids);
+	return progress_solid_kinematics_ids(kso, smeshes, near_ids.data(), near_ids.size(), nfPlaneIdx, fwd_time);
+}
+
 collutils::CollMesh collutils::gen_cube_bplanes(glm::vec3 ccenter, glm::vec3 uax, glm::vec3 vax, float ulen, float vlen, float tlen, float face_thickness, float face_friction)
 {
 	CollMesh cmesh;
+	cmesh.planes.reserve(6);
+	cmesh.vertices.reserve(8);
+	cmesh.edges.reserve(12);
 
 	glm::vec3 uaxn = glm::normalize(uax);
 	glm::vec3 vaxn = glm::normalize(vax);
@@ -815,17 +1460,20 @@ collutils::CollMesh collutils::gen_cube_bplanes(glm::vec3 ccenter, glm::vec3 uax
 	return cmesh;
 }
 
-collutils::CollMesh collutils::gen_cube_bplanes(ConvexPolyPlane pplane, float tlen)
+collutils::CollMesh collutils::gen_cube_bplanes(const ConvexPolyPlane& pplane, float tlen)
 {
+	int ppls = pplane.points.size();
 	CollMesh cmesh;
+	cmesh.planes.reserve(ppls + 2);
+	cmesh.vertices.reserve(2 * ppls);
+	cmesh.edges.reserve(3 * ppls);
 	cmesh.planes.push_back(pplane);
 	cmesh.vertices.insert(cmesh.vertices.end(),pplane.points.begin(), pplane.points.end());
-	std::vector<glm::vec3> of_points = pplane.points;
+	std::vector<glm::vec3> of_points(pplane.points.begin(), pplane.points.end());
 	for (int i = 0; i < of_points.size(); i++) {
 		of_points[i] = (pplane.points[i] - (pplane.n * tlen));
 	}
 	cmesh.vertices.insert(cmesh.vertices.end(), of_points.begin(), of_points.end());
-	int ppls = pplane.points.size();
 	for (int ppi = 0; ppi < ppls; ppi++) {
 		cmesh.planes.push_back(ConvexPolyPlane({ pplane.points[ppi], of_points[ppi], of_points[(ppi + 1) % ppls], pplane.points[(ppi + 1) % ppls] }, pplane.height, pplane.friction));
 	}
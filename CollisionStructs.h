@@ -1,7 +1,9 @@
 #pragma once
 #include <glm/vec4.hpp>
 #include <glm/mat4x4.hpp>
+#include <glm/mat3x3.hpp>
 #include <vector>
+#include <cstdint>
 #include "vkstructs.h"
 namespace collutils {
 
@@ -28,6 +30,17 @@ namespace collutils {
 		float time = 0;
 	};
 
+	// How often a collision predicate was too close to call in float and got redone in double.
+	// Counted per thread: get and reset the ones of the thread that runs collision
+	// (LogicManager::getPredicateStats hands out the logic thread's).
+	struct PredicateStats {
+		uint64_t evals = 0;
+		uint64_t fallbacks = 0;
+	};
+
+	PredicateStats get_predicate_stats();
+	void reset_predicate_stats();
+
 	struct isecPoint {
 		bool will_isec = false;
 		bool parallel = false;
@@ -47,27 +60,68 @@ namespace collutils {
 	
 	isecPoint find_isec_of_linesegments(glm::vec3 l1a, glm::vec3 l1b, glm::vec3 l2a, glm::vec3 l2b);
 
+	// Array that keeps up to N elements inline and only moves to the heap past that.
+	// Polygons are almost always quads/triangles, so their data stays inside the plane.
+	template <typename T, size_t N>
+	struct SmallVec
+	{
+		T _inline[N];
+		size_t _count = 0;
+		std::vector<T> _spill;
+
+		size_t size() const { return _count; }
+		bool empty() const { return _count == 0; }
+		T* data() { return _spill.empty() ? _inline : _spill.data(); }
+		const T* data() const { return _spill.empty() ? _inline : _spill.data(); }
+		T* begin() { return data(); }
+		T* end() { return data() + _count; }
+		const T* begin() const { return data(); }
+		const T* end() const { return data() + _count; }
+		T& operator[](size_t i) { return data()[i]; }
+		const T& operator[](size_t i) const { return data()[i]; }
+
+		void clear() { _count = 0; _spill.clear(); }
+		void push_back(const T& val) {
+			if (_count < N) _inline[_count] = val;
+			else {
+				if (_spill.empty()) _spill.assign(_inline, _inline + N);
+				_spill.push_back(val);
+			}
+			_count++;
+		}
+		template <typename It>
+		void assign(It first, It last) {
+			clear();
+			for (; first != last; first++) push_back(*first);
+		}
+	};
+
+	const size_t POLY_INLINE_SIDES = 8;
+	typedef SmallVec<glm::vec3, POLY_INLINE_SIDES> PolyVec3Array;
+
 	struct ConvexPolyPlane
 	{
-		std::vector<glm::vec3> points;
+		PolyVec3Array points;
 		int sides;
 		glm::vec4 equation;
 		glm::vec3 n;
-		std::vector<glm::vec3> rays;
-		std::vector<glm::vec3> perps;
+		PolyVec3Array rays;
+		PolyVec3Array perps;
 		float height;
 		float friction;
 
 		void init_polydata();
+		ConvexPolyPlane();
 		ConvexPolyPlane(std::vector<glm::vec3> polyPoints, float thickness = 0, float planeFriction = 0.0f);
 		ConvexPolyPlane(glm::vec3 rectCenter, glm::vec3 u, glm::vec3 v, float lenU, float lenV, float thickness = 0, float planeFriction = 0.0f);
 
-		Mesh gen_mesh();
+		Mesh gen_mesh() const;
 		void addToRenderer();
 
 		void apply_displacement(glm::vec3 disp);
-		int point_status(glm::vec3 p, float pdist = 0);
-		CollPoint check_point_future(glm::vec3 ploc, glm::vec3 pvel, glm::vec3 pacc, float until = 10);
+		void apply_rotation(glm::mat3 rot, glm::vec3 pivot);
+		int point_status(glm::vec3 p, float pdist = 0) const;
+		CollPoint check_point_future(glm::vec3 ploc, glm::vec3 pvel, glm::vec3 pacc, float until = 10) const;
 	};
 
 	struct CirclePlane
@@ -98,6 +152,46 @@ namespace collutils {
 		CollMesh();
 		CollMesh(ConvexPolyPlane cnvpp);
 		void apply_displacement(glm::vec3 disp);
+		void apply_rotation(glm::mat3 rot, glm::vec3 pivot);
+	};
+
+	float bounding_radius(const CollMesh& cm, glm::vec3 center);
+	// AABB of the mesh grown by its thickest face, i.e. everything it can touch without moving
+	void mesh_bounds(const CollMesh& cm, glm::vec3& bmin, glm::vec3& bmax);
+
+	// Static AABB tree over a set of meshes. Plain arrays, so a compiled level can store it as is.
+	struct BVHNode
+	{
+		glm::vec3 bmin;
+		int32_t first; // inner: left child (right child is first + 1), leaf: first slot in mesh_ids
+		glm::vec3 bmax;
+		int32_t count; // 0 for inner nodes
+	};
+
+	const int BVH_LEAF_SIZE = 4;
+	// Deepest tree query() can walk (its stack holds one pending sibling per level)
+	const int BVH_MAX_DEPTH = 64;
+
+	struct MeshBVH
+	{
+		std::vector<BVHNode> nodes;
+		std::vector<uint32_t> mesh_ids;
+		// Only for insert()/remove(), set up by build() and not stored in compiled levels:
+		// parent of each node, leaf of each mesh (-1 = not in the tree) and its bounds
+		std::vector<int32_t> parents;
+		std::vector<int32_t> mesh_leaf;
+		std::vector<glm::vec3> mesh_bmin, mesh_bmax;
+		// Nodes and id slots insert()/remove() left unreachable
+		size_t garbage = 0;
+
+		// Meshes with no geometry (e.g. freed slots) are left out
+		void build(const std::vector<CollMesh>& meshes);
+		void query(glm::vec3 qmin, glm::vec3 qmax, std::vector<uint32_t>& out) const;
+		// For a few meshes at a time: one root to leaf walk each, but the tree ends up looser
+		// than a fresh build(), so rebuild after big batches or once wants_rebuild()
+		void insert(uint32_t mi, const CollMesh& mesh);
+		void remove(uint32_t mi);
+		bool wants_rebuild() const { return garbage > nodes.size() + mesh_ids.size() / 2; }
 	};
 
 	struct KineSolidObj
@@ -106,26 +200,63 @@ namespace collutils {
 		glm::vec3 _center = glm::vec3(0);
 		glm::vec3 _vel = glm::vec3(0);
 		glm::vec3 _acc = glm::vec3(0);
+		glm::vec3 _angvel = glm::vec3(0); // world space, rad/s, about _center. Only ever set by the caller
+		glm::mat3 _rot = glm::mat3(1); // all the rotation applied to _cmesh so far
 	};
 
+	// Furthest any point of a spinning solid may move per conservative-advancement step.
+	// Kept under the 0.05 contact thickness so a step can't rotate through a surface.
+	const float ROT_ADVANCE_DIST = 0.02f;
+	// A rotation step may deepen an overlap by at most this much; otherwise the rest of the step's
+	// rotation is done in turns halved up to ROT_BACKOFF_STEPS times before the spin is dropped
+	const float ROT_OVERLAP_TOL = 0.0005f;
+	const int ROT_BACKOFF_STEPS = 4;
+
 	CollPoint check_lines_future(glm::vec3 l1point, glm::vec3 l1dir, glm::vec3 l2point, glm::vec3 l2dir, glm::vec3 l2vel, glm::vec3 l2acc, float until = 10);
 
 	CollPoint check_lineseg_future(glm::vec3 l1a, glm::vec3 l1b, glm::vec3 l2a, glm::vec3 l2b, glm::vec3 l2vel, glm::vec3 l2acc, float until = 10);
 
-	SolidCollData check_polyplanes_future(ConvexPolyPlane pp1, ConvexPolyPlane pp2, glm::vec3 pvel, glm::vec3 pacc, float until = 10);
+	SolidCollData check_polyplanes_future(const ConvexPolyPlane& pp1, const ConvexPolyPlane& pp2, glm::vec3 pvel, glm::vec3 pacc, float until = 10);
 
-	SolidCollData check_mesh_future(CollMesh cm1, CollMesh cm2, glm::vec3 mvel, glm::vec3 macc, float until = 0);
+	SolidCollData check_mesh_future(const CollMesh& cm1, const CollMesh& cm2, glm::vec3 mvel, glm::vec3 macc, float until = 0);
 
 	glm::vec3 project_vec_on_plane(glm::vec3 vToProj, glm::vec3 planeN);
 
 	glm::vec3 apply_bound_planes(glm::vec3 vec_to_bound, std::vector<ConvexPolyPlane> touching_planes);
 	glm::vec3 apply_bound_dirs(glm::vec3 vec_to_bound, std::vector<glm::vec3> bound_dirs);
 
+	// Contacts currently touching a solid. Kept as separate component arrays so the solver's
+	// inner loop is plain float math with no gathers.
+	const size_t CONTACT_INLINE_COUNT = 8;
+	const int CONTACT_SOLVER_ITERATIONS = 12;
+
+	struct ContactManifold
+	{
+		SmallVec<float, CONTACT_INLINE_COUNT> nx, ny, nz;
+		SmallVec<float, CONTACT_INLINE_COUNT> friction;
+
+		size_t size() const { return nx.size(); }
+		void add_contact(glm::vec3 n, float contactFriction);
+	};
+
+	struct ContactSolveResult {
+		glm::vec3 vel = glm::vec3(0);
+		glm::vec3 acc = glm::vec3(0);
+		float friction = 0;
+	};
+
+	// Projected Gauss-Seidel: closest vector to vec_to_bound that doesn't move into any contact.
+	// lambdas (optional, manifold.size() long) receives the push each contact applied.
+	glm::vec3 solve_contact_bounds(glm::vec3 vec_to_bound, const ContactManifold& manifold, float* lambdas = nullptr, int iterations = CONTACT_SOLVER_ITERATIONS);
+	ContactSolveResult solve_contact_manifold(glm::vec3 vel, glm::vec3 acc, const ContactManifold& manifold, int iterations = CONTACT_SOLVER_ITERATIONS);
+
 	KinePointObj progress_kinematics(KinePointObj kpo, std::vector<ConvexPolyPlane>* planes, int nfPlaneIdx, float fwd_time);
 
-	KineSolidObj progress_solid_kinematics(KineSolidObj kso, std::vector<CollMesh> smeshes, int nfPlaneIdx, float fwd_time);
+	KineSolidObj progress_solid_kinematics(KineSolidObj kso, const std::vector<CollMesh>& smeshes, int nfPlaneIdx, float fwd_time);
+	// Same, but only tests the meshes the bvh finds near the solid's swept bounds
+	KineSolidObj progress_solid_kinematics(KineSolidObj kso, const std::vector<CollMesh>& smeshes, const MeshBVH& sbvh, int nfPlaneIdx, float fwd_time);
 
 	CollMesh gen_cube_bplanes(glm::vec3 ccenter, glm::vec3 uax, glm::vec3 vax, float ulen, float vlen, float tlen, float face_thickness = 0.1, float face_friction = 1);
 
-	CollMesh gen_cube_bplanes(ConvexPolyPlane pplane, float tlen = 0.1);
+	CollMesh gen_cube_bplanes(const ConvexPolyPlane& pplane, float tlen = 0.1);
 }
@@ -1,76 +1,350 @@
 #define PUGIXML_HEADER_ONLY
 #include <pugixml.hpp>
-#include "vkstructs.h"
+#include "DAEParser.h"
+#include "MappedFile.h"
 
 #include <glm/vec4.hpp>
 #include <glm/mat4x4.hpp>
+#include <glm/gtc/matrix_transform.hpp>
 
 #include <vector>
+#include <string>
+#include <cstring>
+#include <algorithm>
+#include <charconv>
+#include <stdexcept>
+#include <unordered_map>
 
+namespace {
+	// A <source> as its accessor sees it: element i is data[offset + i * stride]
+	struct DaeSource
+	{
+		std::vector<float> data;
+		uint32_t count = 0;
+		uint32_t stride = 1;
+		uint32_t offset = 0;
+	};
+
+	// An input of a primitive: where in each <p> tuple its index is, and what it indexes
+	struct DaeInput
+	{
+		const DaeSource* source = nullptr;
+		uint32_t offset = 0;
+	};
+
+	struct DaeLibrary
+	{
+		std::unordered_map<std::string, pugi::xml_node> geometries;
+		std::unordered_map<std::string, pugi::xml_node> controllers;
+		std::unordered_map<std::string, pugi::xml_node> nodes;
+		// Each geometry parsed once however often the scene instances it
+		std::unordered_map<std::string, Mesh> parsed;
+	};
+}
+
+static bool is_space(char c)
+{
+	return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static size_t count_numbers(const char* text)
+{
+	size_t n = 0;
+	bool in_number = false;
+	for (; *text; text++) {
+		bool sp = is_space(*text);
+		if (!sp && !in_number) n++;
+		in_number = !sp;
+	}
+	return n;
+}
+
+// Reads up to count whitespace separated numbers of text straight into out, returns how many
 template <typename T>
-std::vector<T> tokenize_data(std::string str_data) {
-	std::string temp;
-	std::vector<T> res;
-	for (char c : str_data) {
-		if (c == ' ' && !temp.empty()) {
-			res.push_back(std::atof(temp.c_str()));
-			temp = "";
+static size_t parse_numbers(const char* text, T* out, size_t count)
+{
+	const char* end = text + strlen(text);
+	size_t n = 0;
+	while (n < count) {
+		while (text < end && is_space(*text)) text++;
+		if (text < end && *text == '+') text++;
+		std::from_chars_result r = std::from_chars(text, end, out[n]);
+		if (r.ec != std::errc()) break;
+		text = r.ptr;
+		n++;
+	}
+	return n;
+}
+
+template <typename T>
+static std::vector<T> parse_number_list(const char* text, size_t count)
+{
+	std::vector<T> out(count);
+	if (parse_numbers(text, out.data(), count) != count) {
+		throw std::runtime_error("failed to parse COLLADA number list!");
+	}
+	return out;
+}
+
+// "#id" to "id"; COLLADA urls inside the document are all fragments
+static std::string url_id(const char* url)
+{
+	return (url[0] == '#') ? std::string(url + 1) : std::string(url);
+}
+
+static glm::mat4 parse_matrix(const char* text)
+{
+	std::vector<float> v = parse_number_list<float>(text, 16);
+	// Row-major in the file, glm is column-major
+	glm::mat4 m;
+	for (int r = 0; r < 4; r++)
+		for (int c = 0; c < 4; c++) m[c][r] = v[r * 4 + c];
+	return m;
+}
+
+static DaeSource parse_source(pugi::xml_node src)
+{
+	DaeSource out;
+	pugi::xml_node arr = src.child("float_array");
+	pugi::xml_node acc = src.child("technique_common").child("accessor");
+	if (!arr) return out;
+
+	size_t count = arr.attribute("count") ? arr.attribute("count").as_uint() : count_numbers(arr.child_value());
+	out.data.resize(count);
+	out.data.resize(parse_numbers(arr.child_value(), out.data.data(), count));
+
+	out.stride = acc.attribute("stride").as_uint(1);
+	out.offset = acc.attribute("offset").as_uint(0);
+	out.count = acc ? acc.attribute("count").as_uint() : uint32_t(out.data.size() / out.stride);
+	if (out.stride == 0 || out.offset + uint64_t(out.count) * out.stride > out.data.size()) {
+		throw std::runtime_error("failed to parse COLLADA source, accessor runs past its array!");
+	}
+	return out;
+}
+
+static void fetch(const DaeInput& in, uint32_t idx, float* dst, uint32_t comps)
+{
+	if (!in.source) return;
+	if (idx >= in.source->count) throw std::runtime_error("failed to parse COLLADA primitive, index out of range!");
+	const float* src = in.source->data.data() + in.source->offset + size_t(idx) * in.source->stride;
+	for (uint32_t c = 0; c < comps && c < in.source->stride; c++) dst[c] = src[c];
+}
+
+// Appends the triangles of a <triangles> or <polylist> to out, welding as it goes
+static void add_primitive(
+	pugi::xml_node prim,
+	const std::unordered_map<std::string, DaeSource>& sources,
+	const std::unordered_map<std::string, std::vector<std::pair<std::string, std::string>>>& vertices,
+	Mesh& out,
+	VertexWelder& welder
+)
+{
+	DaeInput pos, norm, tex;
+	uint32_t stride = 0;
+	auto resolve = [&](const std::string& semantic, const std::string& src_id, uint32_t offset) {
+		auto it = sources.find(src_id);
+		if (it == sources.end()) return;
+		DaeInput in = { &it->second, offset };
+		if (semantic == "POSITION" && !pos.source) pos = in;
+		else if (semantic == "NORMAL" && !norm.source) norm = in;
+		else if (semantic == "TEXCOORD" && !tex.source) tex = in;
+	};
+	for (pugi::xml_node input : prim.children("input")) {
+		std::string semantic = input.attribute("semantic").value();
+		std::string src_id = url_id(input.attribute("source").value());
+		uint32_t offset = input.attribute("offset").as_uint();
+		stride = std::max(stride, offset + 1);
+		// TEXCOORD set 0 is the one textures are mapped with
+		if (semantic == "TEXCOORD" && input.attribute("set").as_uint(0) != 0) continue;
+		if (semantic == "VERTEX") {
+			auto it = vertices.find(src_id);
+			if (it == vertices.end()) continue;
+			for (const auto& vin : it->second) resolve(vin.first, vin.second, offset);
+		}
+		else resolve(semantic, src_id, offset);
+	}
+	if (!pos.source || stride == 0) return;
+
+	// Corners of each polygon: all 3 for <triangles>, <vcount> says for <polylist>
+	uint32_t poly_count = prim.attribute("count").as_uint();
+	std::vector<uint32_t> vcount;
+	size_t corner_count = 0;
+	if (strcmp(prim.name(), "polylist") == 0) {
+		vcount = parse_number_list<uint32_t>(prim.child("vcount").child_value(), poly_count);
+		for (uint32_t vc : vcount) corner_count += vc;
+	}
+	else corner_count = size_t(poly_count) * 3;
+	std::vector<uint32_t> p = parse_number_list<uint32_t>(prim.child("p").child_value(), corner_count * stride);
+
+	auto corner_vertex = [&](size_t corner) {
+		const uint32_t* tuple = p.data() + corner * stride;
+		Vertex v{};
+		fetch(pos, tuple[pos.offset], &v.pos.x, 3);
+		fetch(norm, tuple[norm.offset], &v.normal.x, 3);
+		fetch(tex, tuple[tex.offset], &v.texCoord.x, 2);
+		// Same flip as the OBJ loader, COLLADA's T runs up
+		v.texCoord.y = 1.0f - v.texCoord.y;
+		v.color = { 1.0f, 1.0f, 1.0f };
+		return v;
+	};
+
+	size_t tri_corners = vcount.empty() ? corner_count : 0;
+	for (uint32_t vc : vcount) tri_corners += (vc >= 3) ? size_t(vc - 2) * 3 : 0;
+	out._indices.reserve(out._indices.size() + tri_corners);
+
+	size_t first = 0;
+	for (uint32_t poly = 0; poly < poly_count; poly++) {
+		uint32_t n = vcount.empty() ? 3 : vcount[poly];
+		// Polygons as fans from their first corner
+		for (uint32_t k = 1; k + 1 < n; k++) {
+			out._indices.push_back(welder.weld(corner_vertex(first)));
+			out._indices.push_back(welder.weld(corner_vertex(first + k)));
+			out._indices.push_back(welder.weld(corner_vertex(first + k + 1)));
+		}
+		first += n;
+	}
+}
+
+static Mesh parse_geometry(pugi::xml_node geom)
+{
+	Mesh out;
+	pugi::xml_node meshnode = geom.child("mesh");
+
+	std::unordered_map<std::string, DaeSource> sources;
+	std::unordered_map<std::string, std::vector<std::pair<std::string, std::string>>> vertices;
+	for (pugi::xml_node src : meshnode.children("source")) sources[src.attribute("id").value()] = parse_source(src);
+	for (pugi::xml_node vin : meshnode.child("vertices").children("input")) {
+		vertices[meshnode.child("vertices").attribute("id").value()].push_back({ vin.attribute("semantic").value(), url_id(vin.attribute("source").value()) });
+	}
+
+	// One welder over all primitives, so vertices on the seams between them are shared.
+	// Polygon counts are a guess at the corners to come, the welder grows if it's short.
+	size_t expected = 0;
+	for (pugi::xml_node prim : meshnode.children()) expected += size_t(prim.attribute("count").as_uint()) * 3;
+	VertexWelder welder(out._vertices, expected);
+	for (pugi::xml_node prim : meshnode.children()) {
+		if (strcmp(prim.name(), "triangles") == 0 || strcmp(prim.name(), "polylist") == 0) add_primitive(prim, sources, vertices, out, welder);
+	}
+	return out;
+}
+
+// Bakes xf into the mesh; mirroring transforms get their winding flipped back
+static void transform_mesh(Mesh& mesh, const glm::mat4& xf)
+{
+	glm::vec3 c0 = glm::vec3(xf[0]), c1 = glm::vec3(xf[1]), c2 = glm::vec3(xf[2]);
+	// Cofactors of the upper 3x3: the inverse transpose, up to scale, without dividing
+	glm::vec3 n0 = glm::cross(c1, c2), n1 = glm::cross(c2, c0), n2 = glm::cross(c0, c1);
+	float det = glm::dot(c0, n0);
+	for (Vertex& v : mesh._vertices) {
+		v.pos = glm::vec3(xf * glm::vec4(v.pos, 1.0f));
+		glm::vec3 n = n0 * v.normal.x + n1 * v.normal.y + n2 * v.normal.z;
+		float len = glm::length(n);
+		if (len > 0) v.normal = n / ((det < 0) ? -len : len);
+	}
+	if (det < 0)
+		for (size_t i = 0; i + 2 < mesh._indices.size(); i += 3) std::swap(mesh._indices[i + 1], mesh._indices[i + 2]);
+}
+
+static const Mesh* find_geometry(DaeLibrary& lib, const std::string& id)
+{
+	auto parsed = lib.parsed.find(id);
+	if (parsed != lib.parsed.end()) return &parsed->second;
+	auto it = lib.geometries.find(id);
+	if (it == lib.geometries.end()) return nullptr;
+	return &(lib.parsed[id] = parse_geometry(it->second));
+}
+
+// The node's own transform elements, applied in document order
+static glm::mat4 node_transform(pugi::xml_node node)
+{
+	glm::mat4 xf = glm::mat4(1.0f);
+	for (pugi::xml_node t : node.children()) {
+		const char* name = t.name();
+		if (strcmp(name, "matrix") == 0) xf = xf * parse_matrix(t.child_value());
+		else if (strcmp(name, "translate") == 0) {
+			std::vector<float> v = parse_number_list<float>(t.child_value(), 3);
+			xf = glm::translate(xf, glm::vec3(v[0], v[1], v[2]));
+		}
+		else if (strcmp(name, "rotate") == 0) {
+			std::vector<float> v = parse_number_list<float>(t.child_value(), 4);
+			xf = glm::rotate(xf, glm::radians(v[3]), glm::vec3(v[0], v[1], v[2]));
+		}
+		else if (strcmp(name, "scale") == 0) {
+			std::vector<float> v = parse_number_list<float>(t.child_value(), 3);
+			xf = glm::scale(xf, glm::vec3(v[0], v[1], v[2]));
+		}
+	}
+	return xf;
+}
+
+static void add_instance(DaeLibrary& lib, const std::string& geom_id, const glm::mat4& xf, std::vector<Mesh>& out)
+{
+	const Mesh* geom = find_geometry(lib, geom_id);
+	if (!geom || geom->_indices.empty()) return;
+	out.push_back(*geom);
+	transform_mesh(out.back(), xf);
+}
+
+static void add_node(DaeLibrary& lib, pugi::xml_node node, const glm::mat4& parent, std::vector<Mesh>& out, int depth = 0)
+{
+	// instance_node can loop back on itself in a broken file
+	if (depth > 64) return;
+	glm::mat4 xf = parent * node_transform(node);
+	for (pugi::xml_node child : node.children()) {
+		const char* name = child.name();
+		std::string url = url_id(child.attribute("url").value());
+		if (strcmp(name, "node") == 0) add_node(lib, child, xf, out, depth + 1);
+		else if (strcmp(name, "instance_node") == 0) {
+			auto it = lib.nodes.find(url);
+			if (it != lib.nodes.end()) add_node(lib, it->second, xf, out, depth + 1);
+		}
+		else if (strcmp(name, "instance_geometry") == 0) add_instance(lib, url, xf, out);
+		else if (strcmp(name, "instance_controller") == 0) {
+			// Skinned meshes come in bind pose, there's no skinning to hand the weights to
+			auto it = lib.controllers.find(url);
+			if (it == lib.controllers.end()) continue;
+			pugi::xml_node skin = it->second.child("skin");
+			glm::mat4 bind_shape = skin.child("bind_shape_matrix") ? parse_matrix(skin.child("bind_shape_matrix").child_value()) : glm::mat4(1.0f);
+			add_instance(lib, url_id(skin.attribute("source").value()), xf * bind_shape, out);
 		}
-		else temp += c;
 	}
-	return res;
 }
 
 std::vector<Mesh> parse_dae_file(std::string dae_fname) {
+	MappedFile mf(dae_fname);
+	if (!mf.valid()) return {};
+
+	// Minimal parsing is all numbers and ids need, and skips rewriting every text node
 	pugi::xml_document doc;
-	pugi::xml_parse_result result = doc.load_file(dae_fname.c_str());
-
-	if (result) {
-		std::vector<Mesh> meshes_out;
-		for (pugi::xml_node geom : doc.child("COLLADA").child("library_geometries").children()) {
-			std::string gid = geom.attribute("id").value();
-			std::string gname = geom.attribute("id").name();
-
-			pugi::xml_node meshnode = geom.child("mesh");
-			
-			std::vector<float> plist = tokenize_data<float>(meshnode.find_child_by_attribute("id", (gid + "-positions").c_str()).value());
-			std::vector<float> nlist = tokenize_data<float>(meshnode.find_child_by_attribute("id", (gid + "-normals").c_str()).value());
-			std::vector<float> mlist = tokenize_data<float>(meshnode.find_child_by_attribute("id", (gid + "-map-0").c_str()).value());
-			std::vector<int> tlist = tokenize_data<int>(meshnode.child("triangles").child("p").value());
-
-			uint8_t vert_offset;
-			uint8_t norm_offset;
-			uint8_t tex_offset;
-			uint8_t offset_count = 0;
-
-			uint32_t tcount = unsigned int(meshnode.child("triangles").attribute("count").value());
-			for (pugi::xml_node i : meshnode.child("triangles").children("input")) {
-				if (i.attribute("semantic").value() == "VERTEX") vert_offset = uint8_t(i.attribute("offset").value());
-				if (i.attribute("semantic").value() == "NORMAL") norm_offset = uint8_t(i.attribute("offset").value());
-				if (i.attribute("semantic").value() == "TEXCOORD") tex_offset = uint8_t(i.attribute("offset").value());
-				offset_count++;
-			}
-			
-			std::vector<Vertex> v_arr;
-			for (int idx = 0; idx < tcount * 3; idx++) {
-				Vertex temp;
-				temp.pos = {
-					plist[3 * tlist[offset_count * idx + vert_offset]],
-					plist[3 * tlist[offset_count * idx + vert_offset] + 1],
-					plist[3 * tlist[offset_count * idx + vert_offset] + 2] };
-				temp.normal = {
-					nlist[3 * tlist[offset_count * idx + norm_offset]],
-					nlist[3 * tlist[offset_count * idx + norm_offset] + 1],
-					nlist[3 * tlist[offset_count * idx + norm_offset] + 2] };
-				temp.texCoord = {
-					mlist[2 * tlist[offset_count * idx + tex_offset]],
-					mlist[2 * tlist[offset_count * idx + tex_offset] + 1] };
-				v_arr.push_back(temp);
-			}
-			Mesh mtemp;
-			mtemp.add_vertices(v_arr);
-			meshes_out.push_back(mtemp);
-		}
+	pugi::xml_parse_result result = doc.load_buffer(mf.data(), mf.size(), pugi::parse_minimal);
+	if (!result) return {};
+
+	pugi::xml_node root = doc.child("COLLADA");
+	DaeLibrary lib;
+	for (pugi::xml_node geom : root.child("library_geometries").children("geometry")) lib.geometries[geom.attribute("id").value()] = geom;
+	for (pugi::xml_node ctrl : root.child("library_controllers").children("controller")) lib.controllers[ctrl.attribute("id").value()] = ctrl;
+	for (pugi::xml_node node : root.child("library_nodes").children("node")) lib.nodes[node.attribute("id").value()] = node;
+
+	std::vector<Mesh> meshes_out;
+	std::string scene_id = url_id(root.child("scene").child("instance_visual_scene").attribute("url").value());
+	pugi::xml_node scene = root.child("library_visual_scenes").find_child_by_attribute("visual_scene", "id", scene_id.c_str());
+	if (scene) {
+		for (pugi::xml_node node : scene.children("node")) add_node(lib, node, glm::mat4(1.0f), meshes_out);
 		return meshes_out;
 	}
-}
\ No newline at end of file
+
+	// No scene to place them: every geometry as authored, skinned ones in bind pose
+	for (pugi::xml_node ctrl : root.child("library_controllers").children("controller")) {
+		pugi::xml_node skin = ctrl.child("skin");
+		glm::mat4 bind_shape = skin.child("bind_shape_matrix") ? parse_matrix(skin.child("bind_shape_matrix").child_value()) : glm::mat4(1.0f);
+		add_instance(lib, url_id(skin.attribute("source").value()), bind_shape, meshes_out);
+	}
+	for (pugi::xml_node geom : root.child("library_geometries").children("geometry")) {
+		std::string gid = geom.attribute("id").value();
+		bool skinned = false;
+		for (pugi::xml_node ctrl : root.child("library_controllers").children("controller"))
+			skinned = skinned || url_id(ctrl.child("skin").attribute("source").value()) == gid;
+		if (!skinned) add_instance(lib, gid, glm::mat4(1.0f), meshes_out);
+	}
+	return meshes_out;
+}
@@ -0,0 +1,9 @@
+#pragma once
+#include "vkstructs.h"
+
+#include <string>
+#include <vector>
+
+// One Mesh per geometry instance in the file's visual scene, with node transforms (and the
+// bind shape matrix of skins) baked in. Without a scene, one per geometry as authored.
+std::vector<Mesh> parse_dae_file(std::string dae_fname);
@@ -0,0 +1,482 @@
+#include "DeviceMemory.h"
+
+#include <bit>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <iostream>
+#include <stdexcept>
+#include <algorithm>
+#include <unordered_map>
+
+namespace {
+
+	const uint32_t SL_BITS = vkutils::RangeAllocator::SL_BITS;
+	const uint32_t SL_COUNT = vkutils::RangeAllocator::SL_COUNT;
+	const uint32_t FL_COUNT = vkutils::RangeAllocator::FL_COUNT;
+	const VkDeviceSize MIN_ALIGNMENT = 16;
+	const VkDeviceSize SMALL_SIZE = VkDeviceSize(1) << (SL_BITS + 4); // below it the lists are 16 bytes apart
+	const uint32_t NONE = vkutils::RangeAllocator::NONE;
+
+	VkDeviceSize align_up(VkDeviceSize off, VkDeviceSize alignment)
+	{
+		return (off + alignment - 1) / alignment * alignment;
+	}
+}
+
+void vkutils::RangeAllocator::mapping(VkDeviceSize size, uint32_t& fl, uint32_t& sl)
+{
+	if (size < SMALL_SIZE) {
+		fl = 0;
+		sl = uint32_t(size / (SMALL_SIZE / SL_COUNT));
+		return;
+	}
+	uint32_t log = 63 - std::countl_zero(size);
+	fl = log - (SL_BITS + 4) + 1;
+	sl = uint32_t(size >> (log - SL_BITS)) - SL_COUNT;
+}
+
+void vkutils::RangeAllocator::init(VkDeviceSize size)
+{
+	nodes.clear();
+	spare.clear();
+	fl_bitmap = 0;
+	for (uint32_t fl = 0; fl < FL_COUNT; fl++) {
+		sl_bitmap[fl] = 0;
+		for (uint32_t sl = 0; sl < SL_COUNT; sl++) heads[fl][sl] = NONE;
+	}
+	used_bytes = 0;
+	allocation_count = 0;
+
+	uint32_t n = new_node();
+	nodes[n].size = size;
+	nodes[n].free = true;
+	insert_free(n);
+}
+
+uint32_t vkutils::RangeAllocator::new_node()
+{
+	if (!spare.empty()) {
+		uint32_t n = spare.back();
+		spare.pop_back();
+		nodes[n] = Node();
+		return n;
+	}
+	nodes.push_back(Node());
+	return nodes.size() - 1;
+}
+
+void vkutils::RangeAllocator::insert_free(uint32_t n)
+{
+	uint32_t fl, sl;
+	mapping(nodes[n].size, fl, sl);
+	nodes[n].prev_free = NONE;
+	nodes[n].next_free = heads[fl][sl];
+	if (heads[fl][sl] != NONE) nodes[heads[fl][sl]].prev_free = n;
+	heads[fl][sl] = n;
+	fl_bitmap |= uint64_t(1) << fl;
+	sl_bitmap[fl] |= 1u << sl;
+}
+
+void vkutils::RangeAllocator::remove_free(uint32_t n)
+{
+	uint32_t fl, sl;
+	mapping(nodes[n].size, fl, sl);
+	Node& node = nodes[n];
+	if (node.prev_free != NONE) nodes[node.prev_free].next_free = node.next_free;
+	else heads[fl][sl] = node.next_free;
+	if (node.next_free != NONE) nodes[node.next_free].prev_free = node.prev_free;
+	if (heads[fl][sl] == NONE) {
+		sl_bitmap[fl] &= ~(1u << sl);
+		if (sl_bitmap[fl] == 0) fl_bitmap &= ~(uint64_t(1) << fl);
+	}
+}
+
+// Cuts n at offset at; the second half becomes a new node, returned, and n keeps the first
+uint32_t vkutils::RangeAllocator::split(uint32_t n, VkDeviceSize at)
+{
+	uint32_t rest = new_node();
+	Node& node = nodes[n];
+	nodes[rest].offset = node.offset + at;
+	nodes[rest].size = node.size - at;
+	nodes[rest].prev_phys = n;
+	nodes[rest].next_phys = node.next_phys;
+	if (node.next_phys != NONE) nodes[node.next_phys].prev_phys = rest;
+	node.next_phys = rest;
+	node.size = at;
+	return rest;
+}
+
+bool vkutils::RangeAllocator::alloc(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& offset, uint32_t& node)
+{
+	size = align_up(std::max<VkDeviceSize>(size, 1), MIN_ALIGNMENT);
+	alignment = std::max(alignment, MIN_ALIGNMENT);
+	// Every range is 16 aligned, so that's the most padding an alignment can need
+	VkDeviceSize search = size + alignment - MIN_ALIGNMENT;
+	// Up to the next list's size, so anything in it or a bigger one fits without looking
+	if (search >= SMALL_SIZE) {
+		uint32_t log = 63 - std::countl_zero(search);
+		search += (VkDeviceSize(1) << (log - SL_BITS)) - 1;
+	}
+	uint32_t fl, sl;
+	mapping(search, fl, sl);
+	if (fl >= FL_COUNT) return false;
+
+	uint32_t sl_map = sl_bitmap[fl] & (~0u << sl);
+	if (sl_map == 0) {
+		uint64_t fl_map = (fl + 1 < 64) ? fl_bitmap & (~uint64_t(0) << (fl + 1)) : 0;
+		if (fl_map == 0) return false;
+		fl = std::countr_zero(fl_map);
+		sl_map = sl_bitmap[fl];
+	}
+	sl = std::countr_zero(sl_map);
+	uint32_t n = heads[fl][sl];
+	remove_free(n);
+
+	// The padding in front and whatever is left after go back as free ranges; both sides of a
+	// free range are always in use, so neither needs merging
+	VkDeviceSize pad = align_up(nodes[n].offset, alignment) - nodes[n].offset;
+	if (pad > 0) {
+		uint32_t front = n;
+		n = split(front, pad);
+		nodes[front].free = true;
+		insert_free(front);
+	}
+	if (nodes[n].size > size) {
+		uint32_t rest = split(n, size);
+		nodes[rest].free = true;
+		insert_free(rest);
+	}
+	nodes[n].free = false;
+	used_bytes += nodes[n].size;
+	allocation_count++;
+	offset = nodes[n].offset;
+	node = n;
+	return true;
+}
+
+void vkutils::RangeAllocator::free(uint32_t n)
+{
+	used_bytes -= nodes[n].size;
+	allocation_count--;
+	nodes[n].free = true;
+
+	uint32_t prev = nodes[n].prev_phys;
+	if (prev != NONE && nodes[prev].free) {
+		remove_free(prev);
+		nodes[prev].size += nodes[n].size;
+		nodes[prev].next_phys = nodes[n].next_phys;
+		if (nodes[n].next_phys != NONE) nodes[nodes[n].next_phys].prev_phys = prev;
+		spare.push_back(n);
+		n = prev;
+	}
+	uint32_t next = nodes[n].next_phys;
+	if (next != NONE && nodes[next].free) {
+		remove_free(next);
+		nodes[n].size += nodes[next].size;
+		nodes[n].next_phys = nodes[next].next_phys;
+		if (nodes[next].next_phys != NONE) nodes[nodes[next].next_phys].prev_phys = n;
+		spare.push_back(next);
+	}
+	insert_free(n);
+}
+
+VkDeviceSize vkutils::RangeAllocator::largest_free() const
+{
+	if (fl_bitmap == 0) return 0;
+	uint32_t fl = 63 - std::countl_zero(fl_bitmap);
+	uint32_t sl = 31 - std::countl_zero(sl_bitmap[fl]);
+	VkDeviceSize largest = 0;
+	for (uint32_t n = heads[fl][sl]; n != NONE; n = nodes[n].next_free) largest = std::max(largest, nodes[n].size);
+	return largest;
+}
+
+namespace {
+
+	struct Block
+	{
+		VkDeviceMemory memory = VK_NULL_HANDLE;
+		VkDeviceSize size = 0;
+		uint8_t* mapped = nullptr;
+		uint32_t pool = 0;
+		bool dedicated = false; // a single allocation, not sub-allocated
+		bool evacuating = false;
+		vkutils::RangeAllocator tlsf;
+	};
+
+	class Allocator
+	{
+	public:
+		Allocator(VkDevice device, VkPhysicalDevice physicalDevice);
+		~Allocator();
+		DeviceAllocation allocate(VkMemoryRequirements requirements, VkMemoryPropertyFlags properties, bool linear);
+		void free(DeviceAllocation& allocation);
+		vkutils::DeviceMemoryStats get_stats();
+		void begin_defragment(float max_occupancy);
+		bool is_evacuating(const DeviceAllocation& allocation);
+		void end_defragment();
+	private:
+		VkDevice device;
+		VkPhysicalDeviceMemoryProperties memProperties;
+		uint32_t max_memory_objects;
+		std::mutex mut;
+		// memory type * 2 + linear
+		std::vector<std::vector<std::unique_ptr<Block>>> pools;
+
+		Block* new_block(uint32_t pool, VkDeviceSize size, bool dedicated);
+		void release_block(Block* block);
+		VkDeviceSize block_size(uint32_t memoryType) const;
+	};
+
+	Allocator::Allocator(VkDevice device, VkPhysicalDevice physicalDevice) : device(device)
+	{
+		vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+		max_memory_objects = properties.limits.maxMemoryAllocationCount;
+		pools.resize(memProperties.memoryTypeCount * 2);
+	}
+
+	Allocator::~Allocator()
+	{
+		uint32_t leaked = 0;
+		for (auto& pool : pools) {
+			for (auto& block : pool) {
+				leaked += block->dedicated ? 1 : block->tlsf.allocations();
+				if (block->mapped) vkUnmapMemory(device, block->memory);
+				vkFreeMemory(device, block->memory, NULL);
+			}
+		}
+		if (leaked) std::cerr << leaked << " device memory allocations were never freed" << std::endl;
+	}
+
+	// Small heaps (e.g. host visible VRAM) get smaller blocks so a few don't take all of it
+	VkDeviceSize Allocator::block_size(uint32_t memoryType) const
+	{
+		VkDeviceSize heap = memProperties.memoryHeaps[memProperties.memoryTypes[memoryType].heapIndex].size;
+		return std::min(vkutils::DEVICE_MEMORY_BLOCK_SIZE, std::bit_floor(std::max<VkDeviceSize>(heap / 8, 1 << 20)));
+	}
+
+	Block* Allocator::new_block(uint32_t pool, VkDeviceSize size, bool dedicated)
+	{
+		uint32_t memoryType = pool / 2;
+		VkMemoryAllocateInfo allocInfo{};
+		allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+		allocInfo.allocationSize = size;
+		allocInfo.memoryTypeIndex = memoryType;
+
+		std::unique_ptr<Block> block = std::make_unique<Block>();
+		if (vkAllocateMemory(device, &allocInfo, NULL, &block->memory) != VK_SUCCESS) {
+			throw std::runtime_error("failed to allocate device memory!");
+		}
+		if (memProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+			void* temp;
+			if (vkMapMemory(device, block->memory, 0, VK_WHOLE_SIZE, 0, &temp) != VK_SUCCESS) {
+				vkFreeMemory(device, block->memory, NULL);
+				throw std::runtime_error("failed to map device memory!");
+			}
+			block->mapped = (uint8_t*)temp;
+		}
+		block->size = size;
+		block->pool = pool;
+		block->dedicated = dedicated;
+		if (!dedicated) block->tlsf.init(size);
+		pools[pool].push_back(std::move(block));
+		return pools[pool].back().get();
+	}
+
+	void Allocator::release_block(Block* block)
+	{
+		auto& pool = pools[block->pool];
+		if (block->mapped) vkUnmapMemory(device, block->memory);
+		vkFreeMemory(device, block->memory, NULL);
+		pool.erase(std::find_if(pool.begin(), pool.end(), [&](const std::unique_ptr<Block>& b) { return b.get() == block; }));
+	}
+
+	DeviceAllocation Allocator::allocate(VkMemoryRequirements requirements, VkMemoryPropertyFlags properties, bool linear)
+	{
+		uint32_t memoryType = NONE;
+		for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
+			if ((requirements.memoryTypeBits & (1 << i)) && (memProperties.memoryTypes[i].propertyFlags & properties) == properties) {
+				memoryType = i;
+				break;
+			}
+		}
+		if (memoryType == NONE) throw std::runtime_error("failed to find suitable memory type!");
+		uint32_t pool = memoryType * 2 + (linear ? 1 : 0);
+
+		std::lock_guard<std::mutex> lk(mut);
+		DeviceAllocation allocation;
+		allocation._size = requirements.size;
+		Block* found = nullptr;
+		VkDeviceSize blockSize = block_size(memoryType);
+		if (requirements.size > blockSize / 2) {
+			found = new_block(pool, requirements.size, true);
+		}
+		else {
+			for (auto& block : pools[pool]) {
+				if (block->dedicated || block->evacuating) continue;
+				if (block->tlsf.alloc(requirements.size, requirements.alignment, allocation._offset, allocation._node)) {
+					found = block.get();
+					break;
+				}
+			}
+			if (!found) {
+				found = new_block(pool, blockSize, false);
+				if (!found->tlsf.alloc(requirements.size, requirements.alignment, allocation._offset, allocation._node)) {
+					throw std::runtime_error("failed to sub-allocate device memory!");
+				}
+			}
+		}
+		allocation._memory = found->memory;
+		allocation._block = found;
+		if (found->mapped) allocation._mapped = found->mapped + allocation._offset;
+		return allocation;
+	}
+
+	void Allocator::free(DeviceAllocation& allocation)
+	{
+		std::lock_guard<std::mutex> lk(mut);
+		Block* block = (Block*)allocation._block;
+		if (block->dedicated) {
+			release_block(block);
+			return;
+		}
+		block->tlsf.free(allocation._node);
+		if (block->tlsf.allocations() > 0) return;
+		// One empty block per pool is kept around for the next allocations, unless it's being emptied
+		bool spare = !block->evacuating;
+		for (auto& other : pools[block->pool]) {
+			if (other.get() != block && !other->dedicated && other->tlsf.allocations() == 0) spare = false;
+		}
+		if (!spare) release_block(block);
+	}
+
+	vkutils::DeviceMemoryStats Allocator::get_stats()
+	{
+		std::lock_guard<std::mutex> lk(mut);
+		vkutils::DeviceMemoryStats stats;
+		stats.max_memory_objects = max_memory_objects;
+		VkDeviceSize contiguous = 0; // the largest free range of each block
+		for (auto& pool : pools) {
+			for (auto& block : pool) {
+				stats.memory_objects++;
+				stats.reserved += block->size;
+				if (block->dedicated) {
+					stats.dedicated++;
+					stats.allocations++;
+					stats.used += block->size;
+					continue;
+				}
+				stats.blocks++;
+				stats.allocations += block->tlsf.allocations();
+				stats.used += block->tlsf.used();
+				stats.free += block->size - block->tlsf.used();
+				VkDeviceSize largest = block->tlsf.largest_free();
+				stats.largest_free = std::max(stats.largest_free, largest);
+				contiguous += largest;
+			}
+		}
+		if (stats.free > 0) stats.fragmentation = 1.0f - float(contiguous) / float(stats.free);
+		return stats;
+	}
+
+	void Allocator::begin_defragment(float max_occupancy)
+	{
+		std::lock_guard<std::mutex> lk(mut);
+		for (auto& pool : pools) {
+			// Emptiest first, and only while the blocks left can take what's moved out, so moving
+			// never has to allocate a new block
+			std::vector<Block*> blocks;
+			VkDeviceSize room = 0;
+			for (auto& block : pool) {
+				if (block->dedicated) continue;
+				blocks.push_back(block.get());
+				room += block->size - block->tlsf.used();
+			}
+			std::sort(blocks.begin(), blocks.end(), [](Block* a, Block* b) { return a->tlsf.used() < b->tlsf.used(); });
+			for (Block* block : blocks) {
+				VkDeviceSize used = block->tlsf.used();
+				if (used == 0 || used >= VkDeviceSize(max_occupancy * block->size)) continue;
+				room -= block->size - used;
+				if (room < used) {
+					room += block->size - used;
+					break;
+				}
+				room -= used;
+				block->evacuating = true;
+			}
+		}
+	}
+
+	bool Allocator::is_evacuating(const DeviceAllocation& allocation)
+	{
+		std::lock_guard<std::mutex> lk(mut);
+		return allocation._block && ((Block*)allocation._block)->evacuating;
+	}
+
+	void Allocator::end_defragment()
+	{
+		std::lock_guard<std::mutex> lk(mut);
+		for (auto& pool : pools) {
+			for (auto& block : pool) block->evacuating = false;
+		}
+	}
+
+	std::mutex allocators_mut;
+	std::unordered_map<VkDevice, std::unique_ptr<Allocator>> allocators;
+
+	Allocator* find_allocator(VkDevice device)
+	{
+		std::lock_guard<std::mutex> lk(allocators_mut);
+		auto it = allocators.find(device);
+		return it == allocators.end() ? nullptr : it->second.get();
+	}
+}
+
+DeviceAllocation vkutils::allocateMemory(VkDevice device, VkPhysicalDevice physicalDevice, VkMemoryRequirements requirements, VkMemoryPropertyFlags properties, bool linear)
+{
+	Allocator* allocator;
+	{
+		std::lock_guard<std::mutex> lk(allocators_mut);
+		std::unique_ptr<Allocator>& found = allocators[device];
+		if (!found) found = std::make_unique<Allocator>(device, physicalDevice);
+		allocator = found.get();
+	}
+	return allocator->allocate(requirements, properties, linear);
+}
+
+void vkutils::freeMemory(VkDevice device, DeviceAllocation& allocation)
+{
+	if (!allocation._block) return;
+	find_allocator(device)->free(allocation);
+	allocation = DeviceAllocation();
+}
+
+void vkutils::destroyAllocator(VkDevice device)
+{
+	std::lock_guard<std::mutex> lk(allocators_mut);
+	allocators.erase(device);
+}
+
+vkutils::DeviceMemoryStats vkutils::getMemoryStats(VkDevice device)
+{
+	Allocator* allocator = find_allocator(device);
+	return allocator ? allocator->get_stats() : DeviceMemoryStats();
+}
+
+void vkutils::beginDefragment(VkDevice device, float max_occupancy)
+{
+	if (Allocator* allocator = find_allocator(device)) allocator->begin_defragment(max_occupancy);
+}
+
+bool vkutils::isEvacuating(VkDevice device, const DeviceAllocation& allocation)
+{
+	Allocator* allocator = find_allocator(device);
+	return allocator && allocator->is_evacuating(allocation);
+}
+
+void vkutils::endDefragment(VkDevice device)
+{
+	if (Allocator* allocator = find_allocator(device)) allocator->end_defragment();
+}
@@ -0,0 +1,92 @@
+#pragma once
+#include "vkstructs.h"
+
+#include <vector>
+
+namespace vkutils {
+
+	// Blocks every buffer and image is sub-allocated from, per memory type. Anything bigger than
+	// half a block gets a vkAllocateMemory of its own.
+	const VkDeviceSize DEVICE_MEMORY_BLOCK_SIZE = 64ull << 20;
+	// Blocks in use below this are emptied by defragmentation
+	const float DEFRAGMENT_MAX_OCCUPANCY = 0.5f;
+
+	// Two level segregated fit (TLSF) over the offsets [0, size) of a block or buffer: a free range
+	// big enough for any request is found with two bitmap lookups, and neighbouring free ranges
+	// merge on free. It keeps its books here rather than in the memory, which the CPU may not even
+	// see. Offsets and sizes are 16 byte aligned at the least. Not thread safe.
+	class RangeAllocator
+	{
+	public:
+		static const uint32_t SL_BITS = 4;
+		static const uint32_t SL_COUNT = 1 << SL_BITS;
+		static const uint32_t FL_COUNT = 48;
+		static const uint32_t NONE = UINT32_MAX;
+
+		void init(VkDeviceSize size);
+		// node: what to give free() back
+		bool alloc(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& offset, uint32_t& node);
+		void free(uint32_t node);
+		VkDeviceSize used() const { return used_bytes; }
+		uint32_t allocations() const { return allocation_count; }
+		VkDeviceSize largest_free() const;
+	private:
+		struct Node {
+			VkDeviceSize offset = 0, size = 0;
+			uint32_t prev_phys = NONE, next_phys = NONE;
+			uint32_t prev_free = NONE, next_free = NONE;
+			bool free = false;
+		};
+
+		std::vector<Node> nodes;
+		std::vector<uint32_t> spare; // indices of nodes merged away
+		uint64_t fl_bitmap = 0;
+		uint32_t sl_bitmap[FL_COUNT] = {};
+		uint32_t heads[FL_COUNT][SL_COUNT];
+		VkDeviceSize used_bytes = 0;
+		uint32_t allocation_count = 0;
+
+		static void mapping(VkDeviceSize size, uint32_t& fl, uint32_t& sl);
+		uint32_t new_node();
+		void insert_free(uint32_t n);
+		void remove_free(uint32_t n);
+		uint32_t split(uint32_t n, VkDeviceSize at);
+	};
+
+	struct DeviceMemoryStats
+	{
+		uint32_t blocks = 0;
+		uint32_t dedicated = 0; // allocations with a block of their own
+		uint32_t memory_objects = 0; // blocks + dedicated, against maxMemoryAllocationCount
+		uint32_t max_memory_objects = 0;
+		uint64_t allocations = 0;
+		VkDeviceSize reserved = 0; // everything allocated from Vulkan
+		VkDeviceSize used = 0;
+		VkDeviceSize free = 0;
+		VkDeviceSize largest_free = 0; // in any one block
+		float fragmentation = 0.0f; // share of the free space outside its block's largest free range
+	};
+
+	// Any thread. The allocator for a device is made on first use and goes with destroyAllocator().
+	// linear: buffers and linear images, kept in other blocks than optimal images so neighbours
+	// never need bufferImageGranularity between them.
+	DeviceAllocation allocateMemory(
+		VkDevice device,
+		VkPhysicalDevice physicalDevice,
+		VkMemoryRequirements requirements,
+		VkMemoryPropertyFlags properties,
+		bool linear
+	);
+	void freeMemory(VkDevice device, DeviceAllocation& allocation);
+	// Once everything from it has been freed, before vkDestroyDevice
+	void destroyAllocator(VkDevice device);
+	DeviceMemoryStats getMemoryStats(VkDevice device);
+
+	// Defragmentation is left to the owners of the buffers and images, who know how to move them.
+	// beginDefragment() picks the blocks used below max_occupancy and stops allocating from them;
+	// each owner then recreates whatever isEvacuating() and frees the old one, and a block is
+	// released once it's empty. endDefragment() lets allocations use what's left of them again.
+	void beginDefragment(VkDevice device, float max_occupancy = DEFRAGMENT_MAX_OCCUPANCY);
+	bool isEvacuating(VkDevice device, const DeviceAllocation& allocation);
+	void endDefragment(VkDevice device);
+}
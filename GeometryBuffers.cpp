@@ -0,0 +1,128 @@
+#include "GeometryBuffers.h"
+
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+vkutils::GeometryBuffers::~GeometryBuffers()
+{
+	destroy();
+}
+
+void vkutils::GeometryBuffers::create(VkDevice device, VkPhysicalDevice physicalDevice)
+{
+	destroy();
+	this->device = device;
+	this->physicalDevice = physicalDevice;
+	vertices.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
+	vertices.chunk_size = VERTEX_CHUNK_SIZE;
+	indices.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT;
+	indices.chunk_size = INDEX_CHUNK_SIZE;
+}
+
+void vkutils::GeometryBuffers::destroy()
+{
+	std::lock_guard<std::mutex> lk(mut);
+	for (Arena* arena : { &vertices, &indices }) {
+		for (auto& chunk : arena->chunks) vkutils::destroyBuffer(device, chunk->buffer);
+		arena->chunks.clear();
+	}
+}
+
+vkutils::GeometryBuffers::Chunk* vkutils::GeometryBuffers::new_chunk(Arena& arena, VkDeviceSize size, bool dedicated)
+{
+	std::unique_ptr<Chunk> chunk = std::make_unique<Chunk>();
+	chunk->buffer = vkutils::createBuffer(device, physicalDevice, size, arena.usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	chunk->size = size;
+	chunk->indices = &arena == &indices;
+	chunk->dedicated = dedicated;
+	if (!dedicated) chunk->ranges.init(size);
+	arena.chunks.push_back(std::move(chunk));
+	return arena.chunks.back().get();
+}
+
+GeometryRange vkutils::GeometryBuffers::alloc(Arena& arena, VkDeviceSize bytes, VkDeviceSize alignment)
+{
+	std::lock_guard<std::mutex> lk(mut);
+	GeometryRange range;
+	range._size = bytes;
+	Chunk* found = nullptr;
+	if (bytes > arena.chunk_size) {
+		found = new_chunk(arena, bytes, true);
+	}
+	else {
+		for (auto& chunk : arena.chunks) {
+			if (!chunk->dedicated && chunk->ranges.alloc(bytes, alignment, range._offset, range._node)) {
+				found = chunk.get();
+				break;
+			}
+		}
+		if (!found) {
+			found = new_chunk(arena, arena.chunk_size, false);
+			if (!found->ranges.alloc(bytes, alignment, range._offset, range._node)) {
+				throw std::runtime_error("failed to allocate geometry range!");
+			}
+		}
+	}
+	range._buffer = found->buffer._buffer;
+	range._chunk = found;
+	return range;
+}
+
+GeometryRange vkutils::GeometryBuffers::alloc_vertices(VkDeviceSize bytes)
+{
+	return alloc(vertices, bytes, sizeof(PackedVertex));
+}
+
+GeometryRange vkutils::GeometryBuffers::alloc_indices(VkDeviceSize bytes)
+{
+	return alloc(indices, bytes, sizeof(uint32_t));
+}
+
+void vkutils::GeometryBuffers::free(GeometryRange& range)
+{
+	if (!range._chunk) return;
+	std::lock_guard<std::mutex> lk(mut);
+	Chunk* chunk = (Chunk*)range._chunk;
+	Arena& arena = chunk->indices ? indices : vertices;
+	uint32_t node = range._node;
+	range = GeometryRange();
+	if (!chunk->dedicated) {
+		chunk->ranges.free(node);
+		// The first chunk stays for good, later ones go once they're empty
+		if (chunk->ranges.allocations() > 0 || chunk == arena.chunks.front().get()) return;
+	}
+	vkutils::destroyBuffer(device, chunk->buffer);
+	arena.chunks.erase(std::find_if(arena.chunks.begin(), arena.chunks.end(), [&](const std::unique_ptr<Chunk>& c) { return c.get() == chunk; }));
+}
+
+void vkutils::GeometryBuffers::upload(const GeometryRange& range, const void* data, VkCommandPool cmdPool, VkQueue queue)
+{
+	GPUBuffer stageBuffer = vkutils::createBuffer(
+		device,
+		physicalDevice,
+		range._size,
+		VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
+	);
+	memcpy(stageBuffer._allocation._mapped, data, (size_t)range._size);
+	vkutils::copyBuffer(device, cmdPool, queue, stageBuffer._buffer, range._buffer, range._size, range._offset);
+	vkutils::destroyBuffer(device, stageBuffer);
+}
+
+vkutils::GeometryStats vkutils::GeometryBuffers::get_stats() const
+{
+	std::lock_guard<std::mutex> lk(mut);
+	GeometryStats stats;
+	for (const Arena* arena : { &vertices, &indices }) {
+		bool is_indices = arena == &indices;
+		for (const auto& chunk : arena->chunks) {
+			VkDeviceSize used = chunk->dedicated ? chunk->size : chunk->ranges.used();
+			stats.ranges += chunk->dedicated ? 1 : chunk->ranges.allocations();
+			(is_indices ? stats.index_buffers : stats.vertex_buffers)++;
+			(is_indices ? stats.index_used : stats.vertex_used) += used;
+			(is_indices ? stats.index_capacity : stats.vertex_capacity) += chunk->size;
+		}
+	}
+	return stats;
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include "vkutils.h"
+
+#include <mutex>
+#include <memory>
+#include <vector>
+
+namespace vkutils {
+
+	// A new buffer this big is added when the others are full; a mesh that doesn't fit one gets its own
+	const VkDeviceSize VERTEX_CHUNK_SIZE = 64ull << 20;
+	const VkDeviceSize INDEX_CHUNK_SIZE = 32ull << 20;
+
+	struct GeometryStats
+	{
+		uint32_t vertex_buffers = 0;
+		uint32_t index_buffers = 0;
+		uint32_t ranges = 0;
+		VkDeviceSize vertex_used = 0, vertex_capacity = 0;
+		VkDeviceSize index_used = 0, index_capacity = 0;
+	};
+
+	// Vertices and indices of every mesh, in a few big device local buffers, so a pass binds them
+	// once rather than per object and a draw picks its mesh with vertexOffset and firstIndex. Any
+	// thread.
+	class GeometryBuffers
+	{
+	public:
+		~GeometryBuffers();
+		void create(VkDevice device, VkPhysicalDevice physicalDevice);
+		// Once every range has been freed
+		void destroy();
+
+		// At a whole PackedVertex, so the offset divides into a vertexOffset
+		GeometryRange alloc_vertices(VkDeviceSize bytes);
+		// At a whole index of either type
+		GeometryRange alloc_indices(VkDeviceSize bytes);
+		// Once no submit in flight draws from it
+		void free(GeometryRange& range);
+		// Init only, like createBuffer() with data: staged and copied before it returns
+		void upload(const GeometryRange& range, const void* data, VkCommandPool cmdPool, VkQueue queue);
+		GeometryStats get_stats() const;
+	private:
+		struct Chunk {
+			GPUBuffer buffer;
+			VkDeviceSize size = 0;
+			bool indices = false;
+			bool dedicated = false; // one range the size of the chunk, not sub-allocated
+			RangeAllocator ranges;
+		};
+		struct Arena {
+			std::vector<std::unique_ptr<Chunk>> chunks;
+			VkBufferUsageFlags usage = 0;
+			VkDeviceSize chunk_size = 0;
+		};
+
+		VkDevice device = VK_NULL_HANDLE;
+		VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+		mutable std::mutex mut;
+		Arena vertices, indices;
+
+		GeometryRange alloc(Arena& arena, VkDeviceSize bytes, VkDeviceSize alignment);
+		Chunk* new_chunk(Arena& arena, VkDeviceSize size, bool dedicated);
+	};
+}
@@ -0,0 +1,382 @@
+#include "LevelFile.h"
+
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <filesystem>
+
+using namespace collutils;
+
+std::string levelutils::bin_path_for(std::string text_path)
+{
+	return std::filesystem::path(text_path).replace_extension(".plvl").string();
+}
+
+uint64_t levelutils::level_entry_hash(const std::string& line)
+{
+	// FNV-1a over the tokens, with any whitespace run hashed as a single space
+	uint64_t h = 14695981039346656037ull;
+	bool in_space = false;
+	bool started = false;
+	for (char c : line) {
+		bool space = (c == ' ' || c == '\t' || c == '\r' || c == '\n');
+		if (space) {
+			in_space = started;
+			continue;
+		}
+		if (in_space) {
+			h ^= uint8_t(' ');
+			h *= 1099511628211ull;
+		}
+		in_space = false;
+		started = true;
+		h ^= uint8_t(c);
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+static bool is_level_entry(const std::string& line)
+{
+	if (line.length() < 5) return false;
+	return line.compare(0, 4, "PUVL") == 0 || line.compare(0, 4, "PNSP") == 0 ||
+		line.compare(0, 4, "CUVH") == 0 || line.compare(0, 4, "CNPH") == 0;
+}
+
+std::vector<std::string> levelutils::scan_level_entries(std::string text_path, std::vector<uint64_t>& entry_hashes)
+{
+	std::vector<std::string> entries;
+	entry_hashes.clear();
+	std::ifstream fr(text_path);
+	std::string line;
+	while (std::getline(fr, line)) {
+		if (!is_level_entry(line)) continue;
+		entry_hashes.push_back(level_entry_hash(line));
+		entries.push_back(line);
+	}
+	return entries;
+}
+
+bool levelutils::parse_level_entry(const std::string& line, CollMesh& out)
+{
+	if (!is_level_entry(line)) return false;
+
+	std::istringstream lss(line);
+
+	char itype[5];
+	float plane_thickness;
+	float plane_friction;
+
+	lss.read(itype, 4);
+	itype[4] = '\0';
+
+	lss.seekg(4);
+	lss >> plane_thickness >> plane_friction;
+	if (strcmp(itype, "PUVL") == 0) {
+		glm::vec3 u, v, rcenter;
+		float ulen, vlen;
+		lss >> rcenter.x >> rcenter.y >> rcenter.z >> u.x >> u.y >> u.z >> v.x >> v.y >> v.z >> ulen >> vlen;
+		out = CollMesh(ConvexPolyPlane(rcenter, u, v, ulen, vlen, plane_thickness, plane_friction));
+		return true;
+	}
+	// Fewer than 3 points isn't a polygon, and CompiledLevel::open would refuse the whole level over it
+	if (strcmp(itype, "PNSP") == 0) {
+		int n;
+		lss >> n;
+		if (!lss || n < 3) return false;
+		std::vector<glm::vec3> points(n);
+		for (int i = 0; i < n; i++) {
+			lss >> points[i].x >> points[i].y >> points[i].z;
+		}
+		out = CollMesh(ConvexPolyPlane(points, plane_thickness, plane_friction));
+		return true;
+	}
+	if (strcmp(itype, "CUVH") == 0) {
+		glm::vec3 u, v, rcenter;
+		float ulen, vlen, tlen;
+		lss >> rcenter.x >> rcenter.y >> rcenter.z >> u.x >> u.y >> u.z >> v.x >> v.y >> v.z >> ulen >> vlen >> tlen;
+		out = gen_cube_bplanes(rcenter, u, v, ulen, vlen, tlen, plane_thickness, plane_friction);
+		return true;
+	}
+	if (strcmp(itype, "CNPH") == 0) {
+		int n;
+		float h;
+		lss >> n;
+		if (!lss || n < 3) return false;
+		std::vector<glm::vec3> points(n);
+		for (int i = 0; i < n; i++) {
+			lss >> points[i].x >> points[i].y >> points[i].z;
+		}
+		lss >> h;
+		out = gen_cube_bplanes(ConvexPolyPlane(points, plane_thickness, plane_friction), h);
+		return true;
+	}
+	return false;
+}
+
+std::vector<CollMesh> levelutils::parse_level_text(std::string text_path, std::vector<uint64_t>* entry_hashes)
+{
+	std::vector<uint64_t> hashes;
+	std::vector<std::string> entries = scan_level_entries(text_path, hashes);
+	std::vector<CollMesh> meshes;
+	meshes.reserve(entries.size());
+	if (entry_hashes) entry_hashes->clear();
+	for (size_t i = 0; i < entries.size(); i++) {
+		CollMesh cm;
+		if (!parse_level_entry(entries[i], cm)) continue;
+		meshes.push_back(std::move(cm));
+		if (entry_hashes) entry_hashes->push_back(hashes[i]);
+	}
+	return meshes;
+}
+
+static uint64_t align_bin_offset(uint64_t off)
+{
+	return (off + 15) & ~uint64_t(15);
+}
+
+template <typename T>
+static void put_bin_section(std::vector<uint8_t>& bin, uint64_t off, const std::vector<T>& arr)
+{
+	bin.resize(off, 0);
+	const uint8_t* data = (const uint8_t*)arr.data();
+	bin.insert(bin.end(), data, data + arr.size() * sizeof(T));
+}
+
+std::vector<uint8_t> levelutils::build_level_bin(const std::vector<CollMesh>& meshes, const std::vector<uint64_t>& entry_hashes, const MeshBVH& bvh, int64_t src_stamp)
+{
+	std::vector<LevelBinMesh> bmeshes;
+	std::vector<LevelBinPlane> bplanes;
+	std::vector<glm::vec3> points, rays, perps, vertices;
+	std::vector<glm::ivec4> edges;
+	bmeshes.reserve(meshes.size());
+
+	for (size_t mi = 0; mi < meshes.size(); mi++) {
+		const CollMesh& cm = meshes[mi];
+		LevelBinMesh bm;
+		bm.first_vertex = vertices.size();
+		bm.vertex_count = cm.vertices.size();
+		bm.first_plane = bplanes.size();
+		bm.plane_count = cm.planes.size();
+		bm.first_edge = edges.size();
+		bm.edge_count = cm.edges.size();
+		mesh_bounds(cm, bm.bmin, bm.bmax);
+		bm.reserved0 = 0;
+		bm.reserved1 = 0;
+		bm.entry_hash = entry_hashes[mi];
+		vertices.insert(vertices.end(), cm.vertices.begin(), cm.vertices.end());
+		edges.insert(edges.end(), cm.edges.begin(), cm.edges.end());
+		for (const ConvexPolyPlane& pl : cm.planes) {
+			LevelBinPlane bp = {};
+			bp.equation = pl.equation;
+			bp.n = pl.n;
+			bp.height = pl.height;
+			bp.friction = pl.friction;
+			bp.first_point = points.size();
+			bp.sides = pl.points.size();
+			points.insert(points.end(), pl.points.begin(), pl.points.end());
+			rays.insert(rays.end(), pl.rays.begin(), pl.rays.end());
+			perps.insert(perps.end(), pl.perps.begin(), pl.perps.end());
+			bplanes.push_back(bp);
+		}
+		bmeshes.push_back(bm);
+	}
+
+	LevelBinHeader hdr = {};
+	memcpy(hdr.magic, "PLVL", 4);
+	hdr.version = LEVEL_BIN_VERSION;
+	hdr.src_stamp = src_stamp;
+	hdr.mesh_count = bmeshes.size();
+	hdr.plane_count = bplanes.size();
+	hdr.point_count = points.size();
+	hdr.vertex_count = vertices.size();
+	hdr.edge_count = edges.size();
+	hdr.node_count = bvh.nodes.size();
+	hdr.bvh_id_count = bvh.mesh_ids.size();
+
+	uint64_t off = align_bin_offset(sizeof(LevelBinHeader));
+	hdr.mesh_off = off; off = align_bin_offset(off + bmeshes.size() * sizeof(LevelBinMesh));
+	hdr.plane_off = off; off = align_bin_offset(off + bplanes.size() * sizeof(LevelBinPlane));
+	hdr.point_off = off; off = align_bin_offset(off + points.size() * sizeof(glm::vec3));
+	hdr.ray_off = off; off = align_bin_offset(off + rays.size() * sizeof(glm::vec3));
+	hdr.perp_off = off; off = align_bin_offset(off + perps.size() * sizeof(glm::vec3));
+	hdr.vertex_off = off; off = align_bin_offset(off + vertices.size() * sizeof(glm::vec3));
+	hdr.edge_off = off; off = align_bin_offset(off + edges.size() * sizeof(glm::ivec4));
+	hdr.node_off = off; off = align_bin_offset(off + bvh.nodes.size() * sizeof(BVHNode));
+	hdr.bvh_id_off = off; off = off + bvh.mesh_ids.size() * sizeof(uint32_t);
+	hdr.file_size = off;
+
+	std::vector<uint8_t> bin;
+	bin.reserve(hdr.file_size);
+	put_bin_section(bin, 0, std::vector<LevelBinHeader>{ hdr });
+	put_bin_section(bin, hdr.mesh_off, bmeshes);
+	put_bin_section(bin, hdr.plane_off, bplanes);
+	put_bin_section(bin, hdr.point_off, points);
+	put_bin_section(bin, hdr.ray_off, rays);
+	put_bin_section(bin, hdr.perp_off, perps);
+	put_bin_section(bin, hdr.vertex_off, vertices);
+	put_bin_section(bin, hdr.edge_off, edges);
+	put_bin_section(bin, hdr.node_off, bvh.nodes);
+	put_bin_section(bin, hdr.bvh_id_off, bvh.mesh_ids);
+	return bin;
+}
+
+bool levelutils::write_level_bin(std::string bin_path, const std::vector<uint8_t>& bin)
+{
+	// Write to a temp file and swap it in, so a reader never maps a half-written level
+	std::string tmp_path = bin_path + ".tmp";
+	{
+		std::ofstream fw(tmp_path, std::ios::binary | std::ios::trunc);
+		if (!fw.is_open()) return false;
+		fw.write((const char*)bin.data(), bin.size());
+		if (!fw.good()) return false;
+	}
+	std::error_code ec;
+	std::filesystem::rename(tmp_path, bin_path, ec);
+	return !ec;
+}
+
+template <typename T>
+static const T* bin_section(const uint8_t* data, uint64_t size, uint64_t off, uint64_t count)
+{
+	if (off % alignof(T) != 0 || off > size || count > (size - off) / sizeof(T)) return nullptr;
+	return (const T*)(data + off);
+}
+
+bool levelutils::CompiledLevel::open(std::string bin_path, int64_t src_stamp)
+{
+	close();
+	std::unique_ptr<MappedFile> mf = std::make_unique<MappedFile>(bin_path);
+	if (!mf->valid() || !attach(mf->data(), mf->size(), src_stamp)) return false;
+	_mf = std::move(mf);
+	return true;
+}
+
+bool levelutils::CompiledLevel::open_memory(std::vector<uint8_t> bin)
+{
+	close();
+	_bin = std::move(bin);
+	if (attach(_bin.data(), _bin.size(), 0)) return true;
+	close();
+	return false;
+}
+
+bool levelutils::CompiledLevel::attach(const uint8_t* data, size_t size, int64_t src_stamp)
+{
+	if (size < sizeof(LevelBinHeader)) return false;
+	const LevelBinHeader* hdr = (const LevelBinHeader*)data;
+	if (memcmp(hdr->magic, "PLVL", 4) != 0 || hdr->version != LEVEL_BIN_VERSION) return false;
+	if (src_stamp != 0 && hdr->src_stamp != src_stamp) return false;
+	if (hdr->file_size != size) return false;
+
+	_meshes = bin_section<LevelBinMesh>(data, size, hdr->mesh_off, hdr->mesh_count);
+	_planes = bin_section<LevelBinPlane>(data, size, hdr->plane_off, hdr->plane_count);
+	_points = bin_section<glm::vec3>(data, size, hdr->point_off, hdr->point_count);
+	_rays = bin_section<glm::vec3>(data, size, hdr->ray_off, hdr->point_count);
+	_perps = bin_section<glm::vec3>(data, size, hdr->perp_off, hdr->point_count);
+	_vertices = bin_section<glm::vec3>(data, size, hdr->vertex_off, hdr->vertex_count);
+	_edges = bin_section<glm::ivec4>(data, size, hdr->edge_off, hdr->edge_count);
+	_nodes = bin_section<BVHNode>(data, size, hdr->node_off, hdr->node_count);
+	_bvh_ids = bin_section<uint32_t>(data, size, hdr->bvh_id_off, hdr->bvh_id_count);
+	if (!_meshes || !_planes || !_points || !_rays || !_perps || !_vertices || !_edges || !_nodes || !_bvh_ids) return false;
+
+	for (uint32_t mi = 0; mi < hdr->mesh_count; mi++) {
+		const LevelBinMesh& bm = _meshes[mi];
+		if (uint64_t(bm.first_vertex) + bm.vertex_count > hdr->vertex_count ||
+			uint64_t(bm.first_plane) + bm.plane_count > hdr->plane_count ||
+			uint64_t(bm.first_edge) + bm.edge_count > hdr->edge_count) return false;
+		// Edges index the mesh's own vertices
+		for (uint32_t ei = bm.first_edge; ei < bm.first_edge + bm.edge_count; ei++) {
+			if (_edges[ei].x < 0 || uint32_t(_edges[ei].x) >= bm.vertex_count ||
+				_edges[ei].y < 0 || uint32_t(_edges[ei].y) >= bm.vertex_count) return false;
+		}
+	}
+	for (uint32_t pi = 0; pi < hdr->plane_count; pi++) {
+		if (_planes[pi].sides < 3) return false;
+		if (uint64_t(_planes[pi].first_point) + _planes[pi].sides > hdr->point_count) return false;
+	}
+	for (uint32_t i = 0; i < hdr->bvh_id_count; i++) {
+		if (_bvh_ids[i] >= hdr->mesh_count) return false;
+	}
+	// build() always puts children after their parent, so requiring that rules out cycles, and
+	// the depth has to fit MeshBVH::query's stack. A node with two parents would be walked twice
+	// by query() and have its depth overwritten here, so each one may only be reached once.
+	std::vector<uint8_t> node_depth(hdr->node_count, 0);
+	std::vector<uint8_t> node_seen(hdr->node_count, 0);
+	if (hdr->node_count > 0) node_seen[0] = 1;
+	for (uint32_t ni = 0; ni < hdr->node_count; ni++) {
+		const BVHNode& node = _nodes[ni];
+		if (node.count < 0 || node.first < 0) return false;
+		if (node.count > 0) {
+			if (uint64_t(node.first) + node.count > hdr->bvh_id_count) return false;
+		}
+		else {
+			if (uint32_t(node.first) <= ni || uint64_t(node.first) + 1 >= hdr->node_count) return false;
+			if (node_depth[ni] + 1 >= BVH_MAX_DEPTH) return false;
+			if (node_seen[node.first] || node_seen[node.first + 1]) return false;
+			node_seen[node.first] = node_seen[node.first + 1] = 1;
+			node_depth[node.first] = node_depth[ni] + 1;
+			node_depth[node.first + 1] = node_depth[ni] + 1;
+		}
+	}
+	_hdr = hdr;
+	return true;
+}
+
+void levelutils::CompiledLevel::close()
+{
+	_mf.reset();
+	std::vector<uint8_t>().swap(_bin);
+	_hdr = nullptr;
+}
+
+// Straight copies out of the mapping: no parsing and nothing is recomputed. Planes keep
+// their points inline, so the only allocations are the three arrays of the mesh.
+void levelutils::CompiledLevel::load_mesh(uint32_t mi, CollMesh& out) const
+{
+	const LevelBinMesh& bm = _meshes[mi];
+	out.vertices.assign(_vertices + bm.first_vertex, _vertices + bm.first_vertex + bm.vertex_count);
+	out.edges.assign(_edges + bm.first_edge, _edges + bm.first_edge + bm.edge_count);
+	out.planes.resize(bm.plane_count);
+	for (uint32_t pi = 0; pi < bm.plane_count; pi++) {
+		const LevelBinPlane& bp = _planes[bm.first_plane + pi];
+		ConvexPolyPlane& pl = out.planes[pi];
+		pl.points.assign(_points + bp.first_point, _points + bp.first_point + bp.sides);
+		pl.rays.assign(_rays + bp.first_point, _rays + bp.first_point + bp.sides);
+		pl.perps.assign(_perps + bp.first_point, _perps + bp.first_point + bp.sides);
+		pl.sides = bp.sides;
+		pl.equation = bp.equation;
+		pl.n = bp.n;
+		pl.height = bp.height;
+		pl.friction = bp.friction;
+	}
+}
+
+void levelutils::CompiledLevel::load_bvh(MeshBVH& bvh) const
+{
+	bvh.nodes.assign(_nodes, _nodes + _hdr->node_count);
+	bvh.mesh_ids.assign(_bvh_ids, _bvh_ids + _hdr->bvh_id_count);
+}
+
+std::vector<uint8_t> levelutils::compile_level(std::string text_path)
+{
+	std::vector<uint64_t> hashes;
+	std::vector<CollMesh> meshes = parse_level_text(text_path, &hashes);
+	MeshBVH bvh;
+	bvh.build(meshes);
+	return build_level_bin(meshes, hashes, bvh, file_stamp(text_path));
+}
+
+void levelutils::open_level(std::string text_path, CompiledLevel& level)
+{
+	std::string bin_path = bin_path_for(text_path);
+	int64_t stamp = file_stamp(text_path);
+	if (level.open(bin_path, stamp)) return;
+	std::vector<uint8_t> bin = compile_level(text_path);
+	if (write_level_bin(bin_path, bin) && level.open(bin_path, stamp)) return;
+	// A read-only install still runs, it just compiles the text every time
+	if (!level.open_memory(std::move(bin))) {
+		throw std::runtime_error("failed to open compiled level!");
+	}
+}
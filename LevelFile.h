@@ -0,0 +1,107 @@
+#pragma once
+#include "CollisionStructs.h"
+#include "MappedFile.h"
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+namespace levelutils {
+
+	// Bump whenever the binary layout below changes; older files just get recompiled.
+	const uint32_t LEVEL_BIN_VERSION = 3;
+
+	// Compiled level (.plvl): header, then flat arrays, each 16-byte aligned at the offset the
+	// header gives. Everything init_polydata() derives is stored, so loading does no math.
+	struct LevelBinHeader
+	{
+		char magic[4];
+		uint32_t version;
+		int64_t src_stamp; // last write time of the text file it was compiled from
+		uint32_t mesh_count, plane_count, point_count, vertex_count;
+		uint32_t edge_count, node_count, bvh_id_count, reserved;
+		uint64_t mesh_off, plane_off, point_off, ray_off, perp_off;
+		uint64_t vertex_off, edge_off, node_off, bvh_id_off;
+		uint64_t file_size;
+	};
+
+	struct LevelBinMesh
+	{
+		uint32_t first_vertex, vertex_count;
+		uint32_t first_plane, plane_count;
+		uint32_t first_edge, edge_count;
+		glm::vec3 bmin; // as collutils::mesh_bounds() gives them
+		float reserved0;
+		glm::vec3 bmax;
+		float reserved1;
+		uint64_t entry_hash; // level_entry_hash() of the text line it came from
+	};
+
+	// points/rays/perps of a plane are [first_point, first_point + sides) in their arrays
+	struct LevelBinPlane
+	{
+		glm::vec4 equation;
+		glm::vec3 n;
+		float height;
+		float friction;
+		uint32_t first_point, sides;
+		uint32_t reserved;
+	};
+
+	// An opened .plvl. Stays mapped so meshes can be pulled out of it one at a time.
+	// All ranges and BVH links are checked in open(), so neither reading meshes nor querying the
+	// BVH afterwards can go out of the file.
+	class CompiledLevel
+	{
+	public:
+		// False if the file is missing, from another version or not compiled from src_stamp.
+		// src_stamp 0 (no text source around, e.g. shipped builds) accepts any compiled file.
+		bool open(std::string bin_path, int64_t src_stamp);
+		// A build_level_bin() image that never made it to disk, kept in memory instead
+		bool open_memory(std::vector<uint8_t> bin);
+		void close();
+		bool is_open() const { return _hdr != nullptr; }
+
+		uint32_t mesh_count() const { return _hdr ? _hdr->mesh_count : 0; }
+		const LevelBinMesh& mesh_info(uint32_t mi) const { return _meshes[mi]; }
+		void load_mesh(uint32_t mi, collutils::CollMesh& out) const;
+		void load_bvh(collutils::MeshBVH& bvh) const;
+	private:
+		std::unique_ptr<MappedFile> _mf;
+		std::vector<uint8_t> _bin; // with open_memory()
+		const LevelBinHeader* _hdr = nullptr;
+		const LevelBinMesh* _meshes = nullptr;
+		const LevelBinPlane* _planes = nullptr;
+		const glm::vec3* _points = nullptr;
+		const glm::vec3* _rays = nullptr;
+		const glm::vec3* _perps = nullptr;
+		const glm::vec3* _vertices = nullptr;
+		const glm::ivec4* _edges = nullptr;
+		const collutils::BVHNode* _nodes = nullptr;
+		const uint32_t* _bvh_ids = nullptr;
+
+		// Checks the image at data and points the arrays into it
+		bool attach(const uint8_t* data, size_t size, int64_t src_stamp);
+	};
+
+	std::string bin_path_for(std::string text_path);
+
+	// Text format is the authoring source, see the comment block at the top of levels/1.txt.
+	// Every geometry line is one entry and becomes one CollMesh.
+	// Hash of an entry line, ignoring how much whitespace separates the numbers
+	uint64_t level_entry_hash(const std::string& line);
+	// Geometry lines of the file without parsing them, with their hashes
+	std::vector<std::string> scan_level_entries(std::string text_path, std::vector<uint64_t>& entry_hashes);
+	bool parse_level_entry(const std::string& line, collutils::CollMesh& out);
+	std::vector<collutils::CollMesh> parse_level_text(std::string text_path, std::vector<uint64_t>* entry_hashes = nullptr);
+
+	// The .plvl image of meshes, byte for byte what write_level_bin() puts on disk
+	std::vector<uint8_t> build_level_bin(const std::vector<collutils::CollMesh>& meshes, const std::vector<uint64_t>& entry_hashes, const collutils::MeshBVH& bvh, int64_t src_stamp);
+	bool write_level_bin(std::string bin_path, const std::vector<uint8_t>& bin);
+
+	std::vector<uint8_t> compile_level(std::string text_path);
+	// Opens the compiled level next to text_path, (re)compiling it first when it's out of date.
+	// When the compiled file can't be written the level is used from memory.
+	void open_level(std::string text_path, CompiledLevel& level);
+}
@@ -0,0 +1,521 @@
+#include "LevelStreamer.h"
+
+#include <cmath>
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+using namespace collutils;
+
+int64_t levelutils::chunk_key(glm::ivec2 coord)
+{
+	return (int64_t(coord.x) << 32) | uint32_t(coord.y);
+}
+
+glm::ivec2 levelutils::chunk_coord_of(glm::vec3 p)
+{
+	return glm::ivec2(int(std::floor(p.x / CHUNK_SIZE)), int(std::floor(p.z / CHUNK_SIZE)));
+}
+
+static int chunk_distance(glm::ivec2 a, glm::ivec2 b)
+{
+	return std::max(std::abs(a.x - b.x), std::abs(a.y - b.y));
+}
+
+static int64_t chunk_key_of(const levelutils::LevelBinMesh& bm)
+{
+	glm::vec3 ext = bm.bmax - bm.bmin;
+	if (ext.x > levelutils::CHUNK_SIZE || ext.z > levelutils::CHUNK_SIZE) return levelutils::PERSISTENT_CHUNK_KEY;
+	return levelutils::chunk_key(levelutils::chunk_coord_of(0.5f * (bm.bmin + bm.bmax)));
+}
+
+static size_t collmesh_bytes(const CollMesh& cm)
+{
+	size_t b = sizeof(CollMesh);
+	b += cm.vertices.capacity() * sizeof(glm::vec3);
+	b += cm.edges.capacity() * sizeof(glm::ivec4);
+	b += cm.planes.capacity() * sizeof(ConvexPolyPlane);
+	for (const ConvexPolyPlane& pl : cm.planes) {
+		b += (pl.points._spill.capacity() + pl.rays._spill.capacity() + pl.perps._spill.capacity()) * sizeof(glm::vec3);
+	}
+	return b;
+}
+
+static size_t mesh_bytes(const Mesh& m)
+{
+	return sizeof(Mesh) + m._vertices.capacity() * sizeof(Vertex) + m._indices.capacity() * sizeof(uint32_t);
+}
+
+levelutils::LevelStreamer::~LevelStreamer()
+{
+	close();
+}
+
+void levelutils::LevelStreamer::open(std::string text_path)
+{
+	close();
+	this->text_path = text_path;
+	open_level(text_path, level);
+	watched_stamp = file_stamp(text_path);
+	last_watch = std::chrono::steady_clock::now();
+	chunk_meshes = index_chunks();
+	live_ids.reserve(level.mesh_count());
+	for (uint32_t mi = 0; mi < level.mesh_count(); mi++) live_ids.insert({ level.mesh_info(mi).entry_hash, mi });
+
+	stop_loader = false;
+	loader = std::thread(&LevelStreamer::loader_loop, this);
+	if (chunk_meshes.count(PERSISTENT_CHUNK_KEY)) request(PERSISTENT_CHUNK_KEY, glm::ivec2(0));
+}
+
+void levelutils::LevelStreamer::close()
+{
+	if (loader.joinable()) {
+		{
+			std::lock_guard<std::mutex> lk(queue_mut);
+			stop_loader = true;
+		}
+		queue_cv.notify_all();
+		loader.join();
+	}
+	queue.clear();
+	done.clear();
+	in_flight = 0;
+	pending.clear();
+	resident.clear();
+	chunk_meshes.clear();
+	generation = 0;
+	applied_generation = 0;
+	reload_done = false;
+	reload_changed.clear();
+	partial_keys.clear();
+	reload_queued = false;
+	stats = StreamingStats();
+	total_load_ms = 0;
+	added_meshes.clear();
+	added_info.clear();
+	live_ids.clear();
+	level.close();
+}
+
+void levelutils::LevelStreamer::set_hot_reload(bool enable)
+{
+	hot_reload = enable;
+}
+
+levelutils::LevelStreamer::ChunkIndex levelutils::LevelStreamer::index_chunks() const
+{
+	ChunkIndex index;
+	for (uint32_t mi = 0; mi < level.mesh_count(); mi++) {
+		const LevelBinMesh& bm = level.mesh_info(mi);
+		int64_t key = chunk_key_of(bm);
+		index[key].ids.push_back(mi);
+		index[key].entries.push_back(bm.entry_hash);
+	}
+	return index;
+}
+
+const levelutils::LevelBinMesh& levelutils::LevelStreamer::entry_info(uint32_t id) const
+{
+	if (id < level.mesh_count()) return level.mesh_info(id);
+	return added_info[id - level.mesh_count()];
+}
+
+void levelutils::LevelStreamer::load_entry(uint32_t id, CollMesh& out) const
+{
+	if (id < level.mesh_count()) level.load_mesh(id, out);
+	else out = added_meshes[id - level.mesh_count()];
+}
+
+void levelutils::LevelStreamer::request(int64_t key, glm::ivec2 coord)
+{
+	pending.insert(key);
+	{
+		std::lock_guard<std::mutex> lk(queue_mut);
+		ChunkRequest req;
+		req.key = key;
+		req.coord = coord;
+		req.requested = std::chrono::steady_clock::now();
+		queue.push_back(std::move(req));
+	}
+	queue_cv.notify_one();
+}
+
+void levelutils::LevelStreamer::accept_chunk(LevelChunk& chunk, std::vector<LevelChunk>& loaded)
+{
+	if (chunk.partial) {
+		partial_keys.erase(chunk.key);
+		// Its chunk got evicted in the meantime, the new entries come with the next full load
+		auto rit = resident.find(chunk.key);
+		if (rit == resident.end()) return;
+		rit->second.entries.insert(rit->second.entries.end(), chunk.entries.begin(), chunk.entries.end());
+		rit->second.entry_bytes.insert(rit->second.entry_bytes.end(), chunk.entry_bytes.begin(), chunk.entry_bytes.end());
+	}
+	else {
+		pending.erase(chunk.key);
+		stats.loads++;
+		stats.last_load_ms = chunk.load_ms;
+		stats.max_load_ms = std::max(stats.max_load_ms, chunk.load_ms);
+		total_load_ms += chunk.load_ms;
+		stats.avg_load_ms = float(total_load_ms / stats.loads);
+		ResidentChunk& rc = resident[chunk.key];
+		rc.coord = chunk.coord;
+		rc.entries = chunk.entries;
+		rc.entry_bytes = chunk.entry_bytes;
+	}
+	loaded.push_back(std::move(chunk));
+}
+
+void levelutils::LevelStreamer::apply_reload(const std::unordered_set<int64_t>& changed, std::vector<RemovedEntry>& removed)
+{
+	// Diff the resident chunks the reload touched against the level by entry hash, plus the
+	// ones whose partial load is now a generation behind and will be dropped. Entries that are
+	// in both stay as they are, so the cost here scales with the edit, not the level.
+	std::unordered_set<int64_t> keys = changed;
+	keys.insert(partial_keys.begin(), partial_keys.end());
+	partial_keys.clear();
+	std::vector<ChunkRequest> partials;
+	uint32_t added = 0, dropped = 0;
+	{
+		std::lock_guard<std::mutex> lk(queue_mut);
+		for (int64_t key : keys) {
+			auto rit = resident.find(key);
+			if (rit == resident.end()) continue;
+			ResidentChunk& rc = rit->second;
+			std::unordered_map<uint64_t, int> have;
+			for (uint64_t e : rc.entries) have[e]++;
+
+			ChunkRequest req;
+			req.key = key;
+			req.coord = rc.coord;
+			req.requested = std::chrono::steady_clock::now();
+			req.generation = generation;
+			auto cit = chunk_meshes.find(key);
+			if (cit != chunk_meshes.end()) {
+				for (size_t i = 0; i < cit->second.ids.size(); i++) {
+					auto hit = have.find(cit->second.entries[i]);
+					if (hit != have.end() && hit->second > 0) hit->second--;
+					else req.only_ids.push_back(cit->second.ids[i]);
+				}
+			}
+
+			// Whatever is left in have is gone from the file
+			size_t kept = 0;
+			for (size_t i = 0; i < rc.entries.size(); i++) {
+				int& left = have[rc.entries[i]];
+				if (left > 0) {
+					left--;
+					removed.push_back({ key, rc.entries[i] });
+					dropped++;
+					continue;
+				}
+				rc.entries[kept] = rc.entries[i];
+				rc.entry_bytes[kept] = rc.entry_bytes[i];
+				kept++;
+			}
+			rc.entries.resize(kept);
+			rc.entry_bytes.resize(kept);
+
+			added += req.only_ids.size();
+			if (!req.only_ids.empty()) {
+				partial_keys.insert(key);
+				partials.push_back(std::move(req));
+			}
+		}
+		for (ChunkRequest& req : partials) queue.push_back(std::move(req));
+		stats.last_reload_ms = reload_ms;
+	}
+	if (!partials.empty()) queue_cv.notify_one();
+
+	stats.reloads++;
+	stats.last_reload_added = added;
+	stats.last_reload_removed = dropped;
+}
+
+void levelutils::LevelStreamer::update(glm::vec3 center, std::vector<LevelChunk>& loaded, std::vector<int64_t>& evicted, std::vector<RemovedEntry>& removed)
+{
+	glm::ivec2 cc = chunk_coord_of(center);
+	auto too_far = [&](int64_t key, glm::ivec2 coord) {
+		return key != PERSISTENT_CHUNK_KEY && chunk_distance(coord, cc) > CHUNK_EVICT_RADIUS;
+	};
+
+	if (hot_reload && !reload_queued) {
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (std::chrono::duration<float, std::milli>(now - last_watch).count() >= HOT_RELOAD_POLL_MS) {
+			last_watch = now;
+			int64_t stamp = file_stamp(text_path);
+			if (stamp != 0 && stamp != watched_stamp) {
+				watched_stamp = stamp;
+				reload_queued = true;
+				{
+					std::lock_guard<std::mutex> lk(queue_mut);
+					ChunkRequest req;
+					req.reload = true;
+					req.requested = now;
+					queue.push_back(std::move(req));
+				}
+				queue_cv.notify_one();
+			}
+		}
+	}
+
+	std::vector<LevelChunk> ready;
+	bool reloaded = false;
+	std::unordered_set<int64_t> changed;
+	{
+		std::lock_guard<std::mutex> lk(queue_mut);
+		ready.swap(done);
+		reloaded = reload_done;
+		reload_done = false;
+		changed.swap(reload_changed);
+		// Not started yet and already out of range: just forget them
+		for (auto it = queue.begin(); it != queue.end();) {
+			if (!it->reload && it->only_ids.empty() && too_far(it->key, it->coord)) {
+				pending.erase(it->key);
+				it = queue.erase(it);
+			}
+			else it++;
+		}
+	}
+
+	// Chunks loaded before the reload go in first so the diff sees them
+	for (LevelChunk& chunk : ready) {
+		if (chunk.generation != applied_generation) continue;
+		if (too_far(chunk.key, chunk.coord)) {
+			if (!chunk.partial) pending.erase(chunk.key);
+			continue;
+		}
+		accept_chunk(chunk, loaded);
+	}
+	if (reloaded) {
+		applied_generation++;
+		reload_queued = false;
+		apply_reload(changed, removed);
+		for (LevelChunk& chunk : ready) {
+			if (chunk.generation != applied_generation) continue;
+			if (too_far(chunk.key, chunk.coord)) {
+				if (!chunk.partial) pending.erase(chunk.key);
+				continue;
+			}
+			accept_chunk(chunk, loaded);
+		}
+	}
+
+	for (auto it = resident.begin(); it != resident.end();) {
+		if (too_far(it->first, it->second.coord)) {
+			evicted.push_back(it->first);
+			stats.evictions++;
+			it = resident.erase(it);
+		}
+		else it++;
+	}
+
+	{
+		std::vector<std::pair<int64_t, glm::ivec2>> wanted;
+		{
+			std::lock_guard<std::mutex> lk(queue_mut);
+			auto want = [&](int64_t key, glm::ivec2 coord) {
+				if (!chunk_meshes.count(key) || resident.count(key) || pending.count(key)) return;
+				wanted.push_back({ key, coord });
+			};
+			// A reload can give a level its first persistent mesh
+			want(PERSISTENT_CHUNK_KEY, glm::ivec2(0));
+			for (int dx = -CHUNK_LOAD_RADIUS; dx <= CHUNK_LOAD_RADIUS; dx++) {
+				for (int dz = -CHUNK_LOAD_RADIUS; dz <= CHUNK_LOAD_RADIUS; dz++) {
+					glm::ivec2 coord = cc + glm::ivec2(dx, dz);
+					want(chunk_key(coord), coord);
+				}
+			}
+		}
+		for (auto& w : wanted) request(w.first, w.second);
+	}
+
+	stats.resident_chunks = resident.size();
+	stats.pending_chunks = pending.size();
+	stats.resident_bytes = 0;
+	for (auto& it : resident) {
+		for (size_t b : it.second.entry_bytes) stats.resident_bytes += b;
+	}
+}
+
+void levelutils::LevelStreamer::wait_idle()
+{
+	std::unique_lock<std::mutex> lk(queue_mut);
+	idle_cv.wait(lk, [&] { return queue.empty() && in_flight == 0; });
+}
+
+bool levelutils::LevelStreamer::is_resident(glm::vec3 p) const
+{
+	int64_t key = chunk_key(chunk_coord_of(p));
+	std::lock_guard<std::mutex> lk(queue_mut);
+	if (chunk_meshes.count(PERSISTENT_CHUNK_KEY) && !resident.count(PERSISTENT_CHUNK_KEY)) return false;
+	return !chunk_meshes.count(key) || resident.count(key);
+}
+
+levelutils::StreamingStats levelutils::LevelStreamer::get_stats() const
+{
+	return stats;
+}
+
+void levelutils::LevelStreamer::loader_loop()
+{
+	std::unique_lock<std::mutex> lk(queue_mut);
+	while (true) {
+		queue_cv.wait(lk, [&] { return stop_loader || !queue.empty(); });
+		if (stop_loader) return;
+		ChunkRequest req = std::move(queue.front());
+		queue.pop_front();
+		in_flight++;
+		lk.unlock();
+
+		if (req.reload) {
+			reload_level();
+			lk.lock();
+		}
+		else {
+			LevelChunk chunk = load_chunk(req);
+			lk.lock();
+			done.push_back(std::move(chunk));
+		}
+		in_flight--;
+		if (queue.empty() && in_flight == 0) idle_cv.notify_all();
+	}
+}
+
+levelutils::LevelChunk levelutils::LevelStreamer::load_chunk(const ChunkRequest& req)
+{
+	// Only this thread swaps chunk_meshes and the mapped level, so they can be read unlocked here
+	LevelChunk chunk;
+	chunk.key = req.key;
+	chunk.coord = req.coord;
+	chunk.generation = generation;
+	chunk.partial = !req.only_ids.empty();
+
+	std::vector<uint32_t> ids;
+	if (chunk.partial) {
+		// Diffed against a level that has been reloaded again since: it keeps the old generation
+		// so update() drops it, and that reload's diff asks for these entries again
+		if (req.generation != generation) {
+			chunk.generation = req.generation;
+			return chunk;
+		}
+		ids = req.only_ids;
+	}
+	else {
+		// A reload can empty a chunk out between the request and now
+		auto it = chunk_meshes.find(req.key);
+		if (it != chunk_meshes.end()) ids = it->second.ids;
+	}
+
+	chunk.meshes.resize(ids.size());
+	for (size_t i = 0; i < ids.size(); i++) {
+		load_entry(ids[i], chunk.meshes[i]);
+		chunk.entries.push_back(entry_info(ids[i]).entry_hash);
+		size_t b = collmesh_bytes(chunk.meshes[i]);
+		for (const ConvexPolyPlane& pl : chunk.meshes[i].planes) {
+			chunk.render_meshes.push_back(pl.gen_mesh());
+			b += mesh_bytes(chunk.render_meshes.back());
+		}
+		chunk.entry_bytes.push_back(b);
+		chunk.bytes += b;
+	}
+	chunk.load_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - req.requested).count();
+	return chunk;
+}
+
+void levelutils::LevelStreamer::reload_level()
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	// Entries are matched by hash against the live ones, so only new lines get parsed and
+	// nothing that stayed is loaded, indexed or written again. The .plvl on disk is left as it
+	// is: it's older than the text now, so the next open_level() recompiles it.
+	std::vector<uint32_t> gone;
+	std::vector<CollMesh> new_meshes;
+	std::vector<LevelBinMesh> new_info;
+	try {
+		if (file_stamp(text_path) == 0) throw std::runtime_error("level file is gone");
+		std::vector<uint64_t> hashes;
+		std::vector<std::string> lines = scan_level_entries(text_path, hashes);
+
+		// hash -> how many lines have it, and one of them
+		std::unordered_map<uint64_t, std::pair<uint32_t, size_t>> wanted;
+		for (size_t i = 0; i < lines.size(); i++) {
+			std::pair<uint32_t, size_t>& w = wanted[hashes[i]];
+			if (w.first++ == 0) w.second = i;
+		}
+		for (auto it = live_ids.begin(); it != live_ids.end();) {
+			auto range = live_ids.equal_range(it->first);
+			auto wit = wanted.find(it->first);
+			uint32_t keep = (wit != wanted.end()) ? wit->second.first : 0;
+			uint32_t have = 0;
+			for (it = range.first; it != range.second; it++, have++) {
+				if (have >= keep) gone.push_back(it->second);
+			}
+			if (wit != wanted.end()) wit->second.first = keep - std::min(keep, have);
+		}
+		for (auto& w : wanted) {
+			if (w.second.first == 0) continue;
+			CollMesh cm;
+			if (!parse_level_entry(lines[w.second.second], cm)) continue;
+			LevelBinMesh info = {};
+			mesh_bounds(cm, info.bmin, info.bmax);
+			info.entry_hash = w.first;
+			for (uint32_t k = 0; k < w.second.first; k++) {
+				new_meshes.push_back(cm);
+				new_info.push_back(info);
+			}
+		}
+	}
+	catch (const std::exception& e) {
+		// Keep the level as it was, the next save gets another go
+		std::cerr << "failed to hot reload " << text_path << " (" << e.what() << ")" << std::endl;
+		gone.clear();
+		new_meshes.clear();
+		new_info.clear();
+	}
+
+	std::vector<std::pair<int64_t, uint32_t>> drops, adds;
+	for (uint32_t id : gone) {
+		const LevelBinMesh& info = entry_info(id);
+		drops.push_back({ chunk_key_of(info), id });
+		auto range = live_ids.equal_range(info.entry_hash);
+		for (auto it = range.first; it != range.second; it++) {
+			if (it->second != id) continue;
+			live_ids.erase(it);
+			break;
+		}
+		if (id >= level.mesh_count()) added_meshes[id - level.mesh_count()] = CollMesh();
+	}
+	for (size_t i = 0; i < new_meshes.size(); i++) {
+		uint32_t id = level.mesh_count() + added_meshes.size();
+		added_meshes.push_back(std::move(new_meshes[i]));
+		added_info.push_back(new_info[i]);
+		live_ids.insert({ new_info[i].entry_hash, id });
+		adds.push_back({ chunk_key_of(new_info[i]), id });
+	}
+
+	float ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+	std::lock_guard<std::mutex> lk(queue_mut);
+	for (auto& d : drops) {
+		ChunkMeshes& cm = chunk_meshes[d.first];
+		for (size_t i = 0; i < cm.ids.size(); i++) {
+			if (cm.ids[i] != d.second) continue;
+			cm.ids[i] = cm.ids.back();
+			cm.entries[i] = cm.entries.back();
+			cm.ids.pop_back();
+			cm.entries.pop_back();
+			break;
+		}
+		if (cm.ids.empty()) chunk_meshes.erase(d.first);
+		reload_changed.insert(d.first);
+	}
+	for (auto& a : adds) {
+		ChunkMeshes& cm = chunk_meshes[a.first];
+		cm.ids.push_back(a.second);
+		cm.entries.push_back(entry_info(a.second).entry_hash);
+		reload_changed.insert(a.first);
+	}
+	generation++;
+	reload_done = true;
+	reload_ms = ms;
+}
@@ -0,0 +1,152 @@
+#pragma once
+#include "LevelFile.h"
+
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace levelutils {
+
+	// Levels are cut into square XZ chunks by mesh center
+	const float CHUNK_SIZE = 16.0f;
+	// Chunks (in chunk steps, square) kept loaded around the player
+	const int CHUNK_LOAD_RADIUS = 1;
+	// Resident chunks are only dropped past this, so walking along a chunk border doesn't thrash
+	const int CHUNK_EVICT_RADIUS = 2;
+	// Meshes that don't fit a chunk (e.g. one big floor) go here and stay loaded
+	const int64_t PERSISTENT_CHUNK_KEY = INT64_MIN;
+	// How often hot reload looks at the level file
+	const float HOT_RELOAD_POLL_MS = 500.0f;
+
+	int64_t chunk_key(glm::ivec2 coord);
+	glm::ivec2 chunk_coord_of(glm::vec3 p);
+
+	struct LevelChunk
+	{
+		int64_t key = 0;
+		glm::ivec2 coord = glm::ivec2(0);
+		// Only entries a hot reload added to an already resident chunk; goes on top of it
+		bool partial = false;
+		uint32_t generation = 0;
+		std::vector<collutils::CollMesh> meshes;
+		std::vector<uint64_t> entries; // entry hash of each mesh
+		std::vector<Mesh> render_meshes; // one per plane, in mesh order
+		std::vector<size_t> entry_bytes; // collision + render memory of each mesh
+		size_t bytes = 0;
+		float load_ms = 0;
+	};
+
+	// Entry a hot reload took out of a resident chunk
+	struct RemovedEntry
+	{
+		int64_t chunk;
+		uint64_t entry;
+	};
+
+	struct StreamingStats
+	{
+		uint32_t resident_chunks = 0;
+		uint32_t pending_chunks = 0;
+		size_t resident_bytes = 0;
+		uint64_t loads = 0;
+		uint64_t evictions = 0;
+		float last_load_ms = 0; // request to ready, includes time spent queued
+		float avg_load_ms = 0;
+		float max_load_ms = 0;
+		uint64_t reloads = 0;
+		float last_reload_ms = 0; // recompile on the loader thread
+		uint32_t last_reload_added = 0;
+		uint32_t last_reload_removed = 0;
+	};
+
+	class LevelStreamer
+	{
+	public:
+		~LevelStreamer();
+		// Compiles text_path if needed, indexes its chunks and starts the loader thread
+		void open(std::string text_path);
+		void close();
+		// Watch the text file and apply edits to the resident chunks as they're saved. Off by
+		// default; the edits live in memory and the .plvl is recompiled by the next open().
+		void set_hot_reload(bool enable);
+
+		// Logic thread only. Hands over chunks that finished loading (whole or partial), requests
+		// the ones around center, and returns resident chunks that are now too far away as well as
+		// entries a hot reload removed from resident chunks.
+		void update(glm::vec3 center, std::vector<LevelChunk>& loaded, std::vector<int64_t>& evicted, std::vector<RemovedEntry>& removed);
+		// Blocks until every requested chunk has finished loading (they still go out via update)
+		void wait_idle();
+		bool is_resident(glm::vec3 p) const;
+		StreamingStats get_stats() const;
+	private:
+		struct ChunkRequest {
+			int64_t key = 0;
+			glm::ivec2 coord = glm::ivec2(0);
+			std::chrono::steady_clock::time_point requested;
+			bool reload = false; // recompile the level instead of loading a chunk
+			uint32_t generation = 0; // for partial loads: which level only_ids belong to
+			std::vector<uint32_t> only_ids;
+		};
+		struct ResidentChunk {
+			glm::ivec2 coord = glm::ivec2(0);
+			std::vector<uint64_t> entries;
+			std::vector<size_t> entry_bytes;
+		};
+		struct ChunkMeshes {
+			std::vector<uint32_t> ids; // into the compiled level
+			std::vector<uint64_t> entries;
+		};
+		typedef std::unordered_map<int64_t, ChunkMeshes> ChunkIndex;
+
+		std::string text_path;
+		// Loader thread only, except in open()/close()
+		CompiledLevel level;
+		// Hot reload edits on top of the compiled level: ids past level.mesh_count() index these.
+		// Ids are never reused, a removed entry just leaves an empty mesh behind.
+		std::vector<collutils::CollMesh> added_meshes;
+		std::vector<LevelBinMesh> added_info;
+		std::unordered_multimap<uint64_t, uint32_t> live_ids; // entry hash -> id, for every live entry
+
+		std::thread loader;
+		mutable std::mutex queue_mut;
+		std::condition_variable queue_cv;
+		std::condition_variable idle_cv;
+		// Guarded by queue_mut: a reload swaps these on the loader thread
+		std::deque<ChunkRequest> queue;
+		std::vector<LevelChunk> done;
+		ChunkIndex chunk_meshes;
+		uint32_t generation = 0;
+		bool reload_done = false;
+		std::unordered_set<int64_t> reload_changed; // chunks the last reload added to or removed from
+		float reload_ms = 0;
+		int in_flight = 0;
+		bool stop_loader = false;
+
+		// Owned by the logic thread
+		std::unordered_set<int64_t> pending;
+		std::unordered_map<int64_t, ResidentChunk> resident;
+		uint32_t applied_generation = 0;
+		// Resident chunks with a partial load queued for applied_generation
+		std::unordered_set<int64_t> partial_keys;
+		bool hot_reload = false;
+		bool reload_queued = false;
+		int64_t watched_stamp = 0;
+		std::chrono::steady_clock::time_point last_watch;
+		StreamingStats stats;
+		double total_load_ms = 0;
+
+		void request(int64_t key, glm::ivec2 coord);
+		void accept_chunk(LevelChunk& chunk, std::vector<LevelChunk>& loaded);
+		void apply_reload(const std::unordered_set<int64_t>& changed, std::vector<RemovedEntry>& removed);
+		void loader_loop();
+		ChunkIndex index_chunks() const;
+		const LevelBinMesh& entry_info(uint32_t id) const;
+		void load_entry(uint32_t id, collutils::CollMesh& out) const;
+		LevelChunk load_chunk(const ChunkRequest& req);
+		void reload_level();
+	};
+}
@@ -5,84 +5,21 @@
 #include <thread>
 #include <fstream>
 #include <iostream>
-#include <sstream>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
 using namespace collutils;
 
-LogicManager::LogicManager(PrismInputs* ipmgr, PrismAudioManager* audman, int logicpolltime_ms)
+LogicManager::LogicManager(PrismInputs* ipmgr, PrismAudioManager* audman, int logicpolltime_ms, bool levelhotreload, size_t stressspawncount)
 {
 	inputmgr = ipmgr;
     audiomgr = audman;
     if (logicpolltime_ms != 0) logicPollTime = logicpolltime_ms;
+    levelHotReload = levelhotreload;
+    stressSpawnCount = stressspawncount;
     init();
 }
 
-void LogicManager::parseCollDataFile(std::string cfname)
-{
-    std::ifstream fr(cfname);
-    std::string line;
-    while (std::getline(fr, line)) {
-        if (line.length() < 5) continue;
-
-        std::istringstream lss(line);
-
-        char itype[5];
-        float plane_thickness;
-        float plane_friction;
-
-        lss.read(itype, 4);
-        itype[4] = '\0';
-
-        if (itype[0] != '#') {
-            try {
-                lss.seekg(4);
-                lss >> plane_thickness >> plane_friction;
-                if (strcmp(itype, "PUVL") == 0) {
-                    glm::vec3 u, v, rcenter;
-                    float ulen, vlen;
-                    lss >> rcenter.x >> rcenter.y >> rcenter.z >> u.x >> u.y >> u.z >> v.x >> v.y >> v.z >> ulen >> vlen;
-                    static_bounds.push_back(CollMesh(ConvexPolyPlane(rcenter, u, v, ulen, vlen, plane_thickness, plane_friction)));
-                    continue;
-                }
-                if (strcmp(itype, "PNSP") == 0) {
-                    int n;
-                    lss >> n;
-                    std::vector<glm::vec3> points(n);
-                    for (int i = 0; i < n; i++) {
-                        lss >> points[i].x >> points[i].y >> points[i].z;
-                    }
-                    static_bounds.push_back(CollMesh(ConvexPolyPlane(points, plane_thickness, plane_friction)));
-                    continue;
-                }
-                if (strcmp(itype, "CUVH") == 0) {
-                    glm::vec3 u, v, rcenter;
-                    float ulen, vlen, tlen;
-                    lss >> rcenter.x >> rcenter.y >> rcenter.z >> u.x >> u.y >> u.z >> v.x >> v.y >> v.z >> ulen >> vlen >> tlen;
-                    static_bounds.push_back(gen_cube_bplanes(rcenter, u, v, ulen, vlen, tlen, plane_thickness, plane_friction));
-                    continue;
-                }
-                if (strcmp(itype, "CNPH") == 0) {
-                    int n;
-                    float h;
-                    lss >> n;
-                    std::vector<glm::vec3> points(n);
-                    for (int i = 0; i < n; i++) {
-                        lss >> points[i].x >> points[i].y >> points[i].z;
-                    }
-                    lss >> h;
-                    static_bounds.push_back(gen_cube_bplanes(ConvexPolyPlane(points, plane_thickness, plane_friction), h));
-                    continue;
-                }
-            }
-            catch (int eno) {
-                continue;
-            }
-        }
-    }
-}
-
 void LogicManager::init()
 {
     sunlightDir = currentCamEye;
@@ -129,6 +66,19 @@ void LogicManager::init()
     lObjects["room"] = room;
     newObjQueue.push_back("room");
 
+    // Small prisms in a square grid above the room, all sharing one mesh and texture
+    size_t stressSide = (size_t)ceil(sqrt((double)stressSpawnCount));
+    for (size_t si = 0; si < stressSpawnCount; si++) {
+        ObjectLogicData prism;
+        prism.id = "stress" + std::to_string(si);
+        prism.modelFilePath = "models/obamaprisme.obj";
+        prism.texFilePath = "textures/obama_prime.jpg";
+        prism.objLRS.location = glm::vec3((si % stressSide) - stressSide * 0.5f, 12.0f, (si / stressSide) - stressSide * 0.5f) * 0.25f;
+        prism.objLRS.scale = glm::vec3{ 0.02f };
+        lObjects[prism.id] = prism;
+        newObjQueue.push_back(prism.id);
+    }
+
     /*
     lObjects["floor"] = floor;
     newObjQueue.push_back("floor");
@@ -195,15 +145,6 @@ void LogicManager::init()
     plights[0] = glm::vec4(1.5, 1.5, 1.5, 1.0);
     plights[1] = glm::vec4(1.5, 1.5, 1.5, 1.0);
 
-    parseCollDataFile("levels/1.txt");
-
-    for (int sbi = 0; sbi < static_bounds.size(); sbi++) {
-        for (int ppi = 0; ppi < static_bounds[sbi].planes.size(); ppi++) {
-            new_bp_meshes.push_back(static_bounds[sbi].planes[ppi].gen_mesh());
-        }
-        
-    }
-    
     //add player
     player._cmesh = gen_cube_bplanes(glm::vec3(1, 1, 1), glm::vec3(1, 0, 0), glm::vec3(0, 1, 0), 0.2, 0.25, 0.2, 0.1, 10);
     //player._cmesh = CollMesh();
@@ -213,6 +154,14 @@ void LogicManager::init()
     player._acc = glm::vec3(0, -10, 0);
     in_air = true;
 
+    // Only the chunks around the player are loaded, the rest streams in as it moves
+    level_streamer.open("levels/1.txt");
+    // Edits to the level file show up in game as soon as it is saved (for level editing only)
+    level_streamer.set_hot_reload(levelHotReload);
+    streamLevel();
+    level_streamer.wait_idle();
+    streamLevel();
+
     audiomgr->add_aud_buffer("jump", "sounds/jump1.wav");
     audiomgr->add_aud_buffer("fall", "sounds/fall1.wav");
     audiomgr->add_aud_source("player");
@@ -220,6 +169,99 @@ void LogicManager::init()
     audiomgr->update_listener(player._center, player._vel, currentCamDir, currentCamUp);
 }
 
+void LogicManager::streamLevel()
+{
+    std::vector<levelutils::LevelChunk> loaded;
+    std::vector<int64_t> evicted;
+    std::vector<levelutils::RemovedEntry> removed;
+    level_streamer.update(player._center, loaded, evicted, removed);
+    if (loaded.empty() && evicted.empty() && removed.empty()) return;
+
+    // Slots emptied and filled here. The BVH is edited in place for them, unless the batch is
+    // big next to what's loaded (e.g. the first chunks) and a fresh build gives a better tree.
+    std::vector<uint32_t> freed, filled;
+    auto free_slot = [&](uint32_t sbi) {
+        removed_bp_ids.insert(removed_bp_ids.end(), static_bound_render_ids[sbi].begin(), static_bound_render_ids[sbi].end());
+        static_bounds[sbi] = CollMesh();
+        static_bound_render_ids[sbi].clear();
+        free_bound_slots.push_back(sbi);
+        freed.push_back(sbi);
+    };
+    for (int64_t key : evicted) {
+        auto it = chunk_bound_slots.find(key);
+        if (it == chunk_bound_slots.end()) continue;
+        for (uint32_t sbi : it->second) free_slot(sbi);
+        chunk_bound_slots.erase(it);
+    }
+    // Each removed entry takes out one mesh with the same chunk and hash
+    for (const levelutils::RemovedEntry& re : removed) {
+        auto it = chunk_bound_slots.find(re.chunk);
+        if (it == chunk_bound_slots.end()) continue;
+        std::vector<uint32_t>& slots = it->second;
+        for (size_t i = 0; i < slots.size(); i++) {
+            if (static_bound_entries[slots[i]] != re.entry) continue;
+            free_slot(slots[i]);
+            slots[i] = slots.back();
+            slots.pop_back();
+            break;
+        }
+    }
+
+    // Partial chunks from a hot reload go on top of what's there, same as whole ones
+    for (levelutils::LevelChunk& chunk : loaded) {
+        size_t rmi = 0;
+        for (size_t mi = 0; mi < chunk.meshes.size(); mi++) {
+            std::string prefix = "sbound-" + std::to_string(static_bound_counter++) + "-";
+            std::vector<std::string> rids;
+            for (size_t pi = 0; pi < chunk.meshes[mi].planes.size(); pi++, rmi++) {
+                rids.push_back(prefix + std::to_string(pi));
+                new_bp_meshes.push_back({ rids.back(), std::move(chunk.render_meshes[rmi]) });
+            }
+            uint32_t sbi = static_bounds.size();
+            if (!free_bound_slots.empty()) {
+                sbi = free_bound_slots.back();
+                free_bound_slots.pop_back();
+            }
+            else {
+                static_bounds.emplace_back();
+                static_bound_chunks.push_back(0);
+                static_bound_entries.push_back(0);
+                static_bound_render_ids.emplace_back();
+            }
+            static_bounds[sbi] = std::move(chunk.meshes[mi]);
+            static_bound_chunks[sbi] = chunk.key;
+            static_bound_entries[sbi] = chunk.entries[mi];
+            static_bound_render_ids[sbi] = std::move(rids);
+            chunk_bound_slots[chunk.key].push_back(sbi);
+            filled.push_back(sbi);
+        }
+    }
+
+    size_t live = static_bounds.size() - free_bound_slots.size();
+    if (freed.size() + filled.size() > live / 4 || static_bvh.wants_rebuild()) {
+        static_bvh.build(static_bounds);
+        return;
+    }
+    for (uint32_t sbi : freed) static_bvh.remove(sbi);
+    for (uint32_t sbi : filled) static_bvh.insert(sbi, static_bounds[sbi]);
+}
+
+levelutils::StreamingStats LogicManager::getStreamingStats()
+{
+    rpush_mut.lock();
+    levelutils::StreamingStats stats = level_streamer.get_stats();
+    rpush_mut.unlock();
+    return stats;
+}
+
+collutils::PredicateStats LogicManager::getPredicateStats()
+{
+    rpush_mut.lock();
+    collutils::PredicateStats stats = predicate_stats;
+    rpush_mut.unlock();
+    return stats;
+}
+
 void LogicManager::run()
 {
 	std::chrono::system_clock::time_point start = std::chrono::system_clock::now();
@@ -248,15 +290,18 @@ void LogicManager::pushToRenderer(PrismRenderer* renderer)
     }
     for (int sbi = 0; sbi < new_bp_meshes.size(); sbi++) {
         renderer->addRenderObj(
-            "sbound-" + std::to_string(sbi),
-            new_bp_meshes[sbi],
+            new_bp_meshes[sbi].first,
+            new_bp_meshes[sbi].second,
             "textures/basic_tile.jpg",
             "linear",
             glm::mat4(1)
             );
     }
+    renderer->removeRenderObjs(removed_bp_ids);
+    for (const std::string& rid : removed_bp_ids) lObjects.erase(rid);
     newObjQueue.clear();
     new_bp_meshes.clear();
+    removed_bp_ids.clear();
 
     //currentCamDir = glm::vec3(0.0, 0.0, -1.0);
 
@@ -271,8 +316,9 @@ void LogicManager::pushToRenderer(PrismRenderer* renderer)
         currentCamEye + currentCamDir,
         currentCamUp
     );
+    renderer->cameraFovY = glm::radians(90.0f);
     glm::mat4 proj = glm::perspective(
-        glm::radians(90.0f),
+        renderer->cameraFovY,
         renderer->swapChainExtent.width / (float)renderer->swapChainExtent.height,
         0.01f,
         20.0f);
@@ -282,7 +328,7 @@ void LogicManager::pushToRenderer(PrismRenderer* renderer)
 
     size_t robjCount = renderer->renderObjects.size();
     for (size_t it = 0; it < robjCount; it++) {
-        std::string objid = renderer->renderObjects[it].id;
+        const std::string& objid = renderer->renderObjects[it].id;
         renderer->renderObjects[it].uboData.model = lObjects[objid].objLRS.getTMatrix();
     }
     rpush_mut.unlock();
@@ -305,10 +351,16 @@ void LogicManager::computeLogic(std::chrono::system_clock::time_point curr_time,
         plights[1] = glm::vec4(currentCamEye, 1.0);
     }
 
+    streamLevel();
+
     bool ground_touch = false;
     int ground_plane = -1;
     glm::vec3 ground_normal = glm::vec3(0);
-    for (int pli = 0; pli < static_bounds.size(); pli++){
+    glm::vec3 pbmin, pbmax;
+    mesh_bounds(player._cmesh, pbmin, pbmax);
+    std::vector<uint32_t> near_bounds;
+    static_bvh.query(pbmin - glm::vec3(0.05f), pbmax + glm::vec3(0.05f), near_bounds);
+    for (uint32_t pli : near_bounds) {
         SolidCollData tmp_scd = check_mesh_future(static_bounds[pli], player._cmesh, glm::vec3(0), glm::vec3(0), 0);
         if (tmp_scd.will_collide && glm::dot(tmp_scd.bound_dir, glm::vec3(0, 1, 0)) > 0.1) {
             ground_touch = true;
@@ -359,7 +411,10 @@ void LogicManager::computeLogic(std::chrono::system_clock::time_point curr_time,
     }
     //if (inputmgr->wasKeyPressed(GLFW_KEY_LEFT_CONTROL)) playVel = playVel - crely * (CAM_SPEED * logicDeltaT);
     
-    player = progress_solid_kinematics(player, static_bounds, (glm::length(inp_vel) > 0) ? ground_plane : -1, logicDeltaT);
+    // Hold the player in place until the ground under it has streamed in
+    if (level_streamer.is_resident(player._center)) {
+        player = progress_solid_kinematics(player, static_bounds, static_bvh, (glm::length(inp_vel) > 0) ? ground_plane : -1, logicDeltaT);
+    }
     //player = progress_solid_kinematics(player, static_bounds, (glm::length(inp_vel) > 0) ? ground_plane : -1, 0.05);
 
     currentCamEye = player._center;
@@ -379,6 +434,7 @@ void LogicManager::computeLogic(std::chrono::system_clock::time_point curr_time,
     lObjects["obama"].updateAnim("rotateprism", int(logicDeltaT * 1000));
 
     inputmgr->clearMOffset();
+    predicate_stats = get_predicate_stats();
     rpush_mut.unlock();
 }
 
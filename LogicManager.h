@@ -4,6 +4,8 @@
 #include "PrismAudioManager.h"
 #include "ObjectLogicData.h"
 #include "CollisionStructs.h"
+#include "LevelFile.h"
+#include "LevelStreamer.h"
 
 #include <regex>
 
@@ -11,15 +13,20 @@
 class LogicManager
 {
 public:
-	LogicManager(PrismInputs* ipmgr, PrismAudioManager* audman, int logicpolltime_ms=1);
+	// stressspawncount: that many extra objects in a grid, to see how the renderer copes with them
+	LogicManager(PrismInputs* ipmgr, PrismAudioManager* audman, int logicpolltime_ms=1, bool levelhotreload=false, size_t stressspawncount=0);
 	void run();
 	void stop();
-	void parseCollDataFile(std::string cfname);
 	void pushToRenderer(PrismRenderer* renderer);
+	levelutils::StreamingStats getStreamingStats();
+	// Since startup, from the logic thread that runs the player's collision
+	collutils::PredicateStats getPredicateStats();
 private:
 	PrismInputs* inputmgr;
 	PrismAudioManager* audiomgr;
 	int logicPollTime = 1;
+	bool levelHotReload = false;
+	size_t stressSpawnCount = 0;
 	bool shouldStop = false;
 	float langle = 0;
 
@@ -33,18 +40,31 @@ private:
 
 	glm::vec3 sunlightDir = (glm::vec3(0.0f, 0.2f, 0.0f));
 
+	// Slots keep their index so the BVH can be edited in place, freed ones hold an empty mesh
 	std::vector<collutils::CollMesh> static_bounds;
+	collutils::MeshBVH static_bvh;
+	// Per static_bounds slot: its chunk key, level entry hash and the render objects of its planes
+	std::vector<int64_t> static_bound_chunks;
+	std::vector<uint64_t> static_bound_entries;
+	std::vector<std::vector<std::string>> static_bound_render_ids;
+	std::vector<uint32_t> free_bound_slots;
+	std::unordered_map<int64_t, std::vector<uint32_t>> chunk_bound_slots;
+	uint64_t static_bound_counter = 0;
+	levelutils::LevelStreamer level_streamer;
 
 	collutils::KinePointObj player_point;
 	collutils::KineSolidObj player;
 	bool in_air = false;
+	collutils::PredicateStats predicate_stats; // copied out of the logic thread's counters every tick
 
 	std::unordered_map<std::string, ObjectLogicData> lObjects;
 	std::vector<glm::vec4> plights;
 	std::vector<std::string> newObjQueue;
-	std::vector<Mesh> new_bp_meshes;
+	std::vector<std::pair<std::string, Mesh>> new_bp_meshes;
+	std::vector<std::string> removed_bp_ids;
 	
 	void init();
+	void streamLevel();
 	void computeLogic(std::chrono::system_clock::time_point curr_time, std::chrono::milliseconds gap);
 	std::chrono::system_clock::time_point lastLogicComputeTime;
 	bool started = false;
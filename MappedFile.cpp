@@ -0,0 +1,74 @@
+#include "MappedFile.h"
+
+#include <filesystem>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(std::string path)
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return;
+	LARGE_INTEGER fsize;
+	if (!GetFileSizeEx(file, &fsize) || fsize.QuadPart == 0) {
+		CloseHandle(file);
+		return;
+	}
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping == NULL) {
+		CloseHandle(file);
+		return;
+	}
+	_data = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (_data == nullptr) {
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return;
+	}
+	_size = fsize.QuadPart;
+	_file = file;
+	_mapping = mapping;
+#else
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) return;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return;
+	}
+	void* ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED) return;
+	_data = (const uint8_t*)ptr;
+	_size = st.st_size;
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+	if (_data == nullptr) return;
+#ifdef _WIN32
+	UnmapViewOfFile(_data);
+	CloseHandle(_mapping);
+	CloseHandle(_file);
+#else
+	munmap((void*)_data, _size);
+#endif
+}
+
+int64_t file_stamp(std::string path)
+{
+	std::error_code ec;
+	auto ftime = std::filesystem::last_write_time(path, ec);
+	if (ec) return 0;
+	return ftime.time_since_epoch().count();
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+// Read-only memory map of a whole file
+class MappedFile
+{
+public:
+	MappedFile(std::string path);
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	const uint8_t* data() const { return _data; }
+	size_t size() const { return _size; }
+	bool valid() const { return _data != nullptr; }
+private:
+	const uint8_t* _data = nullptr;
+	size_t _size = 0;
+#ifdef _WIN32
+	void* _file = nullptr;
+	void* _mapping = nullptr;
+#endif
+};
+
+// Last write time of path, 0 if it doesn't exist
+int64_t file_stamp(std::string path);
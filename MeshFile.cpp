@@ -0,0 +1,191 @@
+#include "MeshFile.h"
+#include "DAEParser.h"
+#include "MeshOptimize.h"
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <filesystem>
+#include <algorithm>
+
+static const uint64_t FNV_OFFSET = 14695981039346656037ull;
+static const uint64_t FNV_PRIME = 1099511628211ull;
+
+static uint64_t fnv1a(const uint8_t* data, size_t size, uint64_t h = FNV_OFFSET)
+{
+	for (size_t i = 0; i < size; i++) {
+		h ^= data[i];
+		h *= FNV_PRIME;
+	}
+	return h;
+}
+
+static uint64_t path_hash(std::string src_path)
+{
+	std::string norm = std::filesystem::path(src_path).lexically_normal().generic_string();
+	return fnv1a((const uint8_t*)norm.data(), norm.size());
+}
+
+std::string meshutils::cache_path_for(std::string src_path)
+{
+	// Keeps the source extension, so floor.obj and floor.dae don't share a cache
+	return src_path + ".pmsh";
+}
+
+uint64_t meshutils::content_hash(std::string path)
+{
+	MappedFile mf(path);
+	if (!mf.valid()) return 0;
+	return fnv1a(mf.data(), mf.size());
+}
+
+bool meshutils::load_mesh_source(std::string src_path, Mesh& out)
+{
+	std::string ext = std::filesystem::path(src_path).extension().string();
+	std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return std::tolower(c); });
+	if (ext == ".obj") return out.load_from_obj(src_path.c_str());
+	if (ext == ".dae") {
+		std::vector<Mesh> parts = parse_dae_file(src_path);
+		if (parts.empty()) return false;
+		for (Mesh& part : parts) {
+			uint32_t base = out._vertices.size();
+			out._vertices.insert(out._vertices.end(), part._vertices.begin(), part._vertices.end());
+			for (uint32_t idx : part._indices) out._indices.push_back(base + idx);
+		}
+		return true;
+	}
+	return false;
+}
+
+static uint64_t align_bin_offset(uint64_t off)
+{
+	return (off + 15) & ~uint64_t(15);
+}
+
+template <typename T>
+static void write_bin_section(std::ofstream& fw, uint64_t off, const std::vector<T>& arr)
+{
+	static const char zeros[16] = {};
+	fw.write(zeros, off - uint64_t(fw.tellp()));
+	if (!arr.empty()) fw.write((const char*)arr.data(), arr.size() * sizeof(T));
+}
+
+bool meshutils::write_mesh_bin(std::string cache_path, std::string src_path, const Mesh& mesh, int64_t src_stamp, uint64_t src_hash)
+{
+	MeshBinHeader hdr = {};
+	memcpy(hdr.magic, "PMSH", 4);
+	hdr.version = MESH_BIN_VERSION;
+	hdr.src_stamp = src_stamp;
+	hdr.src_hash = src_hash;
+	hdr.path_hash = path_hash(src_path);
+	std::vector<PackedVertex> packed;
+	pack_vertices(mesh._vertices.data(), mesh._vertices.size(), packed, hdr.decode);
+	VkIndexType index_type;
+	std::vector<uint8_t> indices = pack_indices(mesh._indices.data(), mesh._indices.size(), mesh._vertices.size(), index_type);
+	hdr.vertex_count = mesh._vertices.size();
+	hdr.index_count = mesh._indices.size();
+	hdr.vertex_size = sizeof(PackedVertex);
+	hdr.index_size = (index_type == VK_INDEX_TYPE_UINT16) ? 2 : 4;
+	if (mesh._lods.empty()) {
+		hdr.lod_count = 1;
+		hdr.lods[0].indexCount = mesh._indices.size();
+	}
+	else {
+		hdr.lod_count = std::min<size_t>(mesh._lods.size(), MAX_MESH_LODS);
+		std::copy(mesh._lods.begin(), mesh._lods.begin() + hdr.lod_count, hdr.lods);
+	}
+	hdr.bmin = mesh._vertices.empty() ? glm::vec3(0) : mesh._vertices[0].pos;
+	hdr.bmax = hdr.bmin;
+	for (const Vertex& v : mesh._vertices) {
+		hdr.bmin = glm::min(hdr.bmin, v.pos);
+		hdr.bmax = glm::max(hdr.bmax, v.pos);
+	}
+
+	uint64_t off = align_bin_offset(sizeof(MeshBinHeader));
+	hdr.vertex_off = off; off = align_bin_offset(off + packed.size() * sizeof(PackedVertex));
+	hdr.index_off = off; off = off + indices.size();
+	hdr.file_size = off;
+
+	// Same temp file and swap as compiled levels, a reader never maps a half-written mesh
+	std::string tmp_path = cache_path + ".tmp";
+	{
+		std::ofstream fw(tmp_path, std::ios::binary | std::ios::trunc);
+		if (!fw.is_open()) return false;
+		fw.write((const char*)&hdr, sizeof(hdr));
+		write_bin_section(fw, hdr.vertex_off, packed);
+		write_bin_section(fw, hdr.index_off, indices);
+		if (!fw.good()) return false;
+	}
+	std::error_code ec;
+	std::filesystem::rename(tmp_path, cache_path, ec);
+	return !ec;
+}
+
+bool meshutils::CookedMesh::open(std::string cache_path, std::string src_path)
+{
+	close();
+	std::unique_ptr<MappedFile> mf = std::make_unique<MappedFile>(cache_path);
+	if (!mf->valid() || mf->size() < sizeof(MeshBinHeader)) return false;
+
+	const MeshBinHeader* hdr = (const MeshBinHeader*)mf->data();
+	if (memcmp(hdr->magic, "PMSH", 4) != 0 || hdr->version != MESH_BIN_VERSION || hdr->vertex_size != sizeof(PackedVertex)) return false;
+	if (hdr->index_size != 2 && hdr->index_size != 4) return false;
+	if (hdr->path_hash != path_hash(src_path) || hdr->file_size != mf->size()) return false;
+	if (hdr->vertex_off % alignof(PackedVertex) != 0 || hdr->vertex_off > mf->size() ||
+		hdr->vertex_count > (mf->size() - hdr->vertex_off) / sizeof(PackedVertex)) return false;
+	if (hdr->index_off % hdr->index_size != 0 || hdr->index_off > mf->size() ||
+		hdr->index_count > (mf->size() - hdr->index_off) / hdr->index_size) return false;
+	if (hdr->lod_count == 0 || hdr->lod_count > MAX_MESH_LODS) return false;
+	for (uint32_t i = 0; i < hdr->lod_count; i++) {
+		const MeshLod& lod = hdr->lods[i];
+		if (lod.indexCount % 3 != 0 || lod.firstIndex > hdr->index_count || lod.indexCount > hdr->index_count - lod.firstIndex) return false;
+	}
+
+	// A touched but unchanged source (checkout, copy) only costs a hash, not a reparse
+	int64_t stamp = file_stamp(src_path);
+	if (stamp != 0 && stamp != hdr->src_stamp && content_hash(src_path) != hdr->src_hash) return false;
+
+	const uint8_t* indices = mf->data() + hdr->index_off;
+	for (uint32_t i = 0; i < hdr->index_count; i++) {
+		uint32_t idx = (hdr->index_size == 2) ? ((const uint16_t*)indices)[i] : ((const uint32_t*)indices)[i];
+		if (idx >= hdr->vertex_count) return false;
+	}
+	_vertices = (const PackedVertex*)(mf->data() + hdr->vertex_off);
+	_indices = indices;
+	_hdr = hdr;
+	_mf = std::move(mf);
+	return true;
+}
+
+void meshutils::CookedMesh::close()
+{
+	_mf.reset();
+	_hdr = nullptr;
+	_vertices = nullptr;
+	_indices = nullptr;
+}
+
+bool meshutils::cook_mesh(std::string src_path, std::string cache_path, Mesh& mesh, bool optimize)
+{
+	if (!load_mesh_source(src_path, mesh)) {
+		throw std::runtime_error("failed to load mesh source!");
+	}
+	if (optimize) {
+		optimize_mesh(mesh);
+		build_lods(mesh);
+	}
+	return write_mesh_bin(cache_path, src_path, mesh, file_stamp(src_path), content_hash(src_path));
+}
+
+bool meshutils::open_mesh(std::string src_path, CookedMesh& mesh, Mesh& uncached)
+{
+	std::string cache_path = cache_path_for(src_path);
+	if (mesh.open(cache_path, src_path)) return true;
+	if (cook_mesh(src_path, cache_path, uncached) && mesh.open(cache_path, src_path)) {
+		uncached = Mesh();
+		return true;
+	}
+	if (uncached._lods.size() > MAX_MESH_LODS) uncached._lods.resize(MAX_MESH_LODS);
+	if (uncached._lods.size() == 1) uncached._lods.clear();
+	return false;
+}
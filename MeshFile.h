@@ -0,0 +1,84 @@
+#pragma once
+#include "vkstructs.h"
+#include "MappedFile.h"
+
+#include <string>
+#include <memory>
+#include <cstdint>
+
+namespace meshutils {
+
+	// Bump whenever the layout below or what cooking does to a mesh changes
+	const uint32_t MESH_BIN_VERSION = 5;
+
+	// Cooked mesh (.pmsh, next to its source): header, then the PackedVertex and index arrays
+	// exactly as the renderer uploads them, each 16-byte aligned at the offset the header gives.
+	struct MeshBinHeader
+	{
+		char magic[4];
+		uint32_t version;
+		int64_t src_stamp; // last write time of the source file
+		uint64_t src_hash; // content_hash() of the source file
+		uint64_t path_hash; // of the source path, so a cache copied next to another file is rejected
+		uint32_t vertex_count, index_count;
+		uint32_t vertex_size; // sizeof(PackedVertex) when cooked
+		uint32_t index_size; // 2 or 4, see pack_indices()
+		VertexDecode decode;
+		glm::vec3 bmin;
+		float reserved0;
+		glm::vec3 bmax;
+		float reserved1;
+		uint64_t vertex_off, index_off;
+		uint64_t file_size;
+		uint32_t lod_count; // at least 1, the full mesh
+		uint32_t reserved2;
+		MeshLod lods[MAX_MESH_LODS]; // ranges of the index array, finest first
+	};
+
+	// An opened .pmsh, read in place from a memory map of the file
+	class CookedMesh
+	{
+	public:
+		// False if the file is missing, from another version or cooked from something else.
+		// The source counts as unchanged when its stamp matches or, failing that, its contents do.
+		// Without a source around (shipped builds) any valid cooked file is accepted.
+		bool open(std::string cache_path, std::string src_path);
+		void close();
+		bool is_open() const { return _mf != nullptr; }
+
+		uint32_t vertex_count() const { return _hdr ? _hdr->vertex_count : 0; }
+		uint32_t index_count() const { return _hdr ? _hdr->index_count : 0; }
+		const PackedVertex* vertices() const { return _vertices; }
+		const void* indices() const { return _indices; }
+		VkIndexType index_type() const { return (_hdr && _hdr->index_size == 2) ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32; }
+		uint32_t index_size() const { return _hdr ? _hdr->index_size : 0; }
+		VertexDecode decode() const { return _hdr ? _hdr->decode : VertexDecode(); }
+		glm::vec3 bmin() const { return _hdr ? _hdr->bmin : glm::vec3(0); }
+		glm::vec3 bmax() const { return _hdr ? _hdr->bmax : glm::vec3(0); }
+		uint32_t lod_count() const { return _hdr ? _hdr->lod_count : 0; }
+		const MeshLod* lods() const { return _hdr ? _hdr->lods : nullptr; }
+	private:
+		std::unique_ptr<MappedFile> _mf;
+		const MeshBinHeader* _hdr = nullptr;
+		const PackedVertex* _vertices = nullptr;
+		const uint8_t* _indices = nullptr;
+	};
+
+	std::string cache_path_for(std::string src_path);
+	// FNV-1a of the whole file, 0 if it can't be read
+	uint64_t content_hash(std::string path);
+
+	// .obj, or .dae with every mesh parse_dae_file() gives merged into one
+	bool load_mesh_source(std::string src_path, Mesh& out);
+	bool write_mesh_bin(std::string cache_path, std::string src_path, const Mesh& mesh, int64_t src_stamp, uint64_t src_hash);
+
+	// Parses src_path into out and writes its cooked mesh, reordered for the vertex cache and
+	// overdraw and with its LOD chain (see MeshOptimize.h) unless optimize is off. Prints ACMR/ATVR
+	// before and after, and the triangles and error of each LOD. False if the file couldn't be
+	// written, out is still cooked.
+	bool cook_mesh(std::string src_path, std::string cache_path, Mesh& out, bool optimize = true);
+	// Opens the cooked mesh next to src_path, cooking it first when it's missing or out of date.
+	// False when the cook couldn't be written (e.g. a read-only install): uncached then holds it,
+	// with the LODs the file would have had, to be used from memory.
+	bool open_mesh(std::string src_path, CookedMesh& mesh, Mesh& uncached);
+}
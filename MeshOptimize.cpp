@@ -0,0 +1,475 @@
+#include "MeshOptimize.h"
+
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <cfloat>
+
+meshutils::VertexCacheStats meshutils::analyze_vertex_cache(const std::vector<uint32_t>& indices, size_t vertex_count, uint32_t cache_size)
+{
+	VertexCacheStats stats;
+	if (indices.size() < 3 || vertex_count == 0) return stats;
+
+	// FIFO: a vertex is in the cache until cache_size other vertices went in after it
+	std::vector<int64_t> inserted(vertex_count, INT64_MIN / 2);
+	int64_t inserts = 0;
+	for (uint32_t v : indices) {
+		if (inserts - inserted[v] < cache_size) continue;
+		inserted[v] = inserts++;
+	}
+	stats.acmr = float(inserts) / float(indices.size() / 3);
+	stats.atvr = float(inserts) / float(vertex_count);
+	return stats;
+}
+
+std::vector<uint32_t> meshutils::optimize_vertex_cache(std::vector<uint32_t>& indices, size_t vertex_count, uint32_t cache_size)
+{
+	std::vector<uint32_t> clusters;
+	size_t tri_count = indices.size() / 3;
+	if (tri_count == 0) return clusters;
+
+	// Triangles around each vertex, flattened
+	std::vector<uint32_t> live(vertex_count, 0);
+	for (size_t i = 0; i < tri_count * 3; i++) live[indices[i]]++;
+	std::vector<uint32_t> adj_off(vertex_count + 1, 0);
+	for (size_t v = 0; v < vertex_count; v++) adj_off[v + 1] = adj_off[v] + live[v];
+	std::vector<uint32_t> adj(tri_count * 3);
+	{
+		std::vector<uint32_t> fill(adj_off.begin(), adj_off.end() - 1);
+		for (size_t i = 0; i < tri_count * 3; i++) adj[fill[indices[i]]++] = i / 3;
+	}
+
+	std::vector<uint32_t> cache_time(vertex_count, 0);
+	std::vector<uint8_t> emitted(tri_count, 0);
+	std::vector<uint32_t> dead_end;
+	std::vector<uint32_t> candidates;
+	std::vector<uint32_t> out;
+	out.reserve(tri_count * 3);
+	uint32_t time = cache_size + 1;
+	size_t cursor = 0;
+
+	int64_t fan = -1;
+	while (cursor < vertex_count && live[cursor] == 0) cursor++;
+	if (cursor < vertex_count) fan = cursor;
+	clusters.push_back(0);
+
+	while (fan >= 0) {
+		candidates.clear();
+		for (uint32_t k = adj_off[fan]; k < adj_off[fan + 1]; k++) {
+			uint32_t t = adj[k];
+			if (emitted[t]) continue;
+			for (int j = 0; j < 3; j++) {
+				uint32_t v = indices[3 * t + j];
+				out.push_back(v);
+				dead_end.push_back(v);
+				candidates.push_back(v);
+				live[v]--;
+				if (time - cache_time[v] > cache_size) cache_time[v] = time++;
+			}
+			emitted[t] = 1;
+		}
+
+		// Prefer the candidate that has been in the cache longest but will still be there
+		// once its remaining triangles are emitted
+		int64_t next = -1;
+		int64_t best = -1;
+		for (uint32_t v : candidates) {
+			if (live[v] == 0) continue;
+			int64_t p = 0;
+			if (time - cache_time[v] + 2 * live[v] <= cache_size) p = time - cache_time[v];
+			if (p > best) {
+				best = p;
+				next = v;
+			}
+		}
+		if (next < 0) {
+			while (!dead_end.empty()) {
+				uint32_t d = dead_end.back();
+				dead_end.pop_back();
+				if (live[d] > 0) {
+					next = d;
+					break;
+				}
+			}
+			while (next < 0 && cursor < vertex_count) {
+				if (live[cursor] > 0) next = cursor;
+				else cursor++;
+			}
+			// Restarting from a vertex that's no longer cached: start a new cluster
+			if (next >= 0 && time - cache_time[next] > cache_size) clusters.push_back(out.size() / 3);
+		}
+		fan = next;
+	}
+
+	// Degenerate input can leave triangles no vertex walk reaches (none in practice); keep them
+	for (size_t t = 0; t < tri_count; t++) {
+		if (emitted[t]) continue;
+		out.insert(out.end(), indices.begin() + 3 * t, indices.begin() + 3 * t + 3);
+	}
+	indices.swap(out);
+	return clusters;
+}
+
+void meshutils::optimize_overdraw(std::vector<uint32_t>& indices, const std::vector<Vertex>& vertices, const std::vector<uint32_t>& clusters)
+{
+	size_t tri_count = indices.size() / 3;
+	if (clusters.size() < 2) return;
+
+	glm::vec3 mesh_center = glm::vec3(0);
+	for (size_t i = 0; i < tri_count * 3; i++) mesh_center += vertices[indices[i]].pos;
+	mesh_center /= float(tri_count * 3);
+
+	// How far a cluster faces out from the center: area weighted centroid and normal
+	std::vector<float> outward(clusters.size());
+	for (size_t ci = 0; ci < clusters.size(); ci++) {
+		size_t end = (ci + 1 < clusters.size()) ? clusters[ci + 1] : tri_count;
+		glm::vec3 centroid = glm::vec3(0), normal = glm::vec3(0);
+		float area = 0;
+		for (size_t t = clusters[ci]; t < end; t++) {
+			glm::vec3 a = vertices[indices[3 * t]].pos;
+			glm::vec3 b = vertices[indices[3 * t + 1]].pos;
+			glm::vec3 c = vertices[indices[3 * t + 2]].pos;
+			glm::vec3 n = glm::cross(b - a, c - a);
+			float ta = glm::length(n);
+			centroid += ta * (a + b + c) / 3.0f;
+			normal += n;
+			area += ta;
+		}
+		float nlen = glm::length(normal);
+		if (area <= 0 || nlen <= 0) continue;
+		outward[ci] = glm::dot(centroid / area - mesh_center, normal / nlen);
+	}
+
+	std::vector<uint32_t> order(clusters.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return outward[a] > outward[b]; });
+
+	std::vector<uint32_t> out;
+	out.reserve(indices.size());
+	for (uint32_t ci : order) {
+		size_t end = (ci + 1 < clusters.size()) ? clusters[ci + 1] : tri_count;
+		out.insert(out.end(), indices.begin() + 3 * clusters[ci], indices.begin() + 3 * end);
+	}
+	out.insert(out.end(), indices.begin() + tri_count * 3, indices.end());
+	indices.swap(out);
+}
+
+void meshutils::optimize_vertex_fetch(std::vector<uint32_t>& indices, std::vector<Vertex>& vertices)
+{
+	std::vector<uint32_t> remap(vertices.size(), UINT32_MAX);
+	std::vector<Vertex> out;
+	out.reserve(vertices.size());
+	for (uint32_t& idx : indices) {
+		if (remap[idx] == UINT32_MAX) {
+			remap[idx] = out.size();
+			out.push_back(vertices[idx]);
+		}
+		idx = remap[idx];
+	}
+	// Vertices no triangle uses are dropped
+	vertices.swap(out);
+}
+
+void meshutils::optimize_mesh(Mesh& mesh)
+{
+	std::vector<uint32_t> clusters = optimize_vertex_cache(mesh._indices, mesh._vertices.size());
+	optimize_overdraw(mesh._indices, mesh._vertices, clusters);
+	optimize_vertex_fetch(mesh._indices, mesh._vertices);
+}
+
+namespace {
+	// Sum of squared distances to a set of planes: symmetric 4x4, upper triangle, weighted by
+	// the area it was gathered over so error() is a mean and reads as a squared distance
+	struct Quadric
+	{
+		double a[10] = {};
+		double w = 0;
+
+		void add_plane(glm::vec3 n, float d, double weight)
+		{
+			double p[4] = { n.x, n.y, n.z, d };
+			int k = 0;
+			for (int i = 0; i < 4; i++)
+				for (int j = i; j < 4; j++) a[k++] += weight * p[i] * p[j];
+			w += weight;
+		}
+		void add(const Quadric& o)
+		{
+			for (int k = 0; k < 10; k++) a[k] += o.a[k];
+			w += o.w;
+		}
+		double error(glm::vec3 v) const
+		{
+			if (w <= 0) return 0;
+			double p[4] = { v.x, v.y, v.z, 1.0 };
+			double e = 0;
+			int k = 0;
+			for (int i = 0; i < 4; i++)
+				for (int j = i; j < 4; j++) e += (i == j ? 1.0 : 2.0) * a[k++] * p[i] * p[j];
+			return std::max(e, 0.0) / w;
+		}
+	};
+
+	enum VertexKind : uint8_t { KIND_MANIFOLD, KIND_BORDER, KIND_LOCKED };
+
+	// Moves the position of from onto that of to, see wedge_moves in simplify_mesh()
+	struct Collapse
+	{
+		uint32_t from, to;
+		double cost;
+	};
+}
+
+// Positions where more normals or UVs meet than this are left alone
+static const uint32_t MAX_WEDGES = 8;
+
+std::vector<uint32_t> meshutils::simplify_mesh(const std::vector<uint32_t>& indices, const std::vector<Vertex>& vertices,
+	size_t target_index_count, float max_error, float& error)
+{
+	error = 0;
+	std::vector<uint32_t> result(indices.begin(), indices.begin() + indices.size() / 3 * 3);
+	size_t vertex_count = vertices.size();
+	if (result.size() <= target_index_count || vertex_count == 0) return result;
+
+	// Vertices split only by normal or UV (wedges) share a position: pos_id names the
+	// position, twin rings through every wedge at it
+	std::vector<uint32_t> pos_id(vertex_count), twin(vertex_count), wedges(vertex_count, 1);
+	{
+		std::vector<uint32_t> by_pos(vertex_count);
+		std::iota(by_pos.begin(), by_pos.end(), 0);
+		std::sort(by_pos.begin(), by_pos.end(), [&](uint32_t a, uint32_t b) {
+			const glm::vec3& pa = vertices[a].pos;
+			const glm::vec3& pb = vertices[b].pos;
+			if (pa.x != pb.x) return pa.x < pb.x;
+			if (pa.y != pb.y) return pa.y < pb.y;
+			return pa.z < pb.z;
+		});
+		for (size_t i = 0; i < vertex_count;) {
+			size_t j = i + 1;
+			while (j < vertex_count && vertices[by_pos[j]].pos == vertices[by_pos[i]].pos) j++;
+			for (size_t k = i; k < j; k++) {
+				pos_id[by_pos[k]] = by_pos[i];
+				twin[by_pos[k]] = by_pos[(k + 1 < j) ? k + 1 : i];
+				wedges[by_pos[k]] = j - i;
+			}
+			i = j;
+		}
+	}
+
+	// Triangles around each vertex, flattened; rebuilt every pass, edge queries walk it
+	std::vector<uint32_t> adj_off(vertex_count + 1), adj;
+	auto build_adjacency = [&]() {
+		std::fill(adj_off.begin(), adj_off.end(), 0);
+		for (uint32_t idx : result) adj_off[idx + 1]++;
+		for (size_t v = 0; v < vertex_count; v++) adj_off[v + 1] += adj_off[v];
+		adj.resize(result.size());
+		std::vector<uint32_t> fill(adj_off.begin(), adj_off.end() - 1);
+		for (size_t i = 0; i < result.size(); i++) adj[fill[result[i]]++] = i / 3;
+	};
+	// Whether a triangle has the directed edge a->b
+	auto has_edge = [&](uint32_t a, uint32_t b) {
+		for (uint32_t k = adj_off[a]; k < adj_off[a + 1]; k++) {
+			const uint32_t* t = &result[3 * adj[k]];
+			int corner = (t[0] == a) ? 0 : (t[1] == a) ? 1 : 2;
+			if (t[(corner + 1) % 3] == b) return true;
+		}
+		return false;
+	};
+	// The same between any wedges at the positions of a and b
+	auto has_pos_edge = [&](uint32_t a, uint32_t b) {
+		uint32_t w = a;
+		do {
+			for (uint32_t k = adj_off[w]; k < adj_off[w + 1]; k++) {
+				const uint32_t* t = &result[3 * adj[k]];
+				int corner = (t[0] == w) ? 0 : (t[1] == w) ? 1 : 2;
+				if (pos_id[t[(corner + 1) % 3]] == pos_id[b]) return true;
+			}
+			w = twin[w];
+		} while (w != a);
+		return false;
+	};
+	build_adjacency();
+
+	// Plane of every triangle on its corners. Edges with nothing on the other side in the index
+	// buffer (open borders and seams) also get a plane standing up from the triangle through
+	// them, so outlines and seams keep their shape.
+	std::vector<Quadric> quadrics(vertex_count);
+	std::vector<uint8_t> border_edges(vertex_count, 0); // by pos_id
+	for (size_t i = 0; i < result.size(); i += 3) {
+		glm::vec3 p[3] = { vertices[result[i]].pos, vertices[result[i + 1]].pos, vertices[result[i + 2]].pos };
+		glm::vec3 n = glm::cross(p[1] - p[0], p[2] - p[0]);
+		float area = glm::length(n);
+		if (area <= 0) continue;
+		n /= area;
+		for (int e = 0; e < 3; e++) quadrics[result[i + e]].add_plane(n, -glm::dot(n, p[0]), area);
+		for (int e = 0; e < 3; e++) {
+			uint32_t a = result[i + e], b = result[i + (e + 1) % 3];
+			if (has_edge(b, a)) continue;
+			glm::vec3 ev = p[(e + 1) % 3] - p[e];
+			glm::vec3 bn = glm::cross(ev, n);
+			float blen = glm::length(bn);
+			if (blen <= 0) continue;
+			bn /= blen;
+			float weight = glm::dot(ev, ev) * 10.0f;
+			quadrics[a].add_plane(bn, -glm::dot(bn, p[e]), weight);
+			quadrics[b].add_plane(bn, -glm::dot(bn, p[e]), weight);
+			if (has_pos_edge(b, a)) continue;
+			border_edges[pos_id[a]] = std::min(border_edges[pos_id[a]] + 1, 255);
+			border_edges[pos_id[b]] = std::min(border_edges[pos_id[b]] + 1, 255);
+		}
+	}
+	// Corners where borders meet stay put, open borders only slide along themselves
+	std::vector<uint8_t> kind(vertex_count, KIND_MANIFOLD);
+	for (size_t v = 0; v < vertex_count; v++) {
+		uint8_t borders = border_edges[pos_id[v]];
+		if (borders > 2 || wedges[v] > MAX_WEDGES) kind[v] = KIND_LOCKED;
+		else if (borders > 0) kind[v] = KIND_BORDER;
+	}
+
+	// Every wedge at from's position has to land on the one wedge at to's position it shares
+	// an edge with, or its triangles would take attributes from the wrong side of a seam
+	std::vector<std::pair<uint32_t, uint32_t>> moves;
+	auto wedge_moves = [&](uint32_t from, uint32_t to) {
+		moves.clear();
+		uint32_t u = from;
+		do {
+			uint32_t target = UINT32_MAX;
+			uint32_t v = to;
+			do {
+				if (has_edge(u, v) || has_edge(v, u)) {
+					if (target != UINT32_MAX) return false;
+					target = v;
+				}
+				v = twin[v];
+			} while (v != to);
+			if (target == UINT32_MAX) return false;
+			moves.push_back({ u, target });
+			u = twin[u];
+		} while (u != from);
+		return true;
+	};
+
+	double max_cost = double(max_error) * double(max_error);
+	double worst = 0;
+	std::vector<uint32_t> remap(vertex_count);
+	std::vector<uint8_t> touched(vertex_count);
+	std::vector<Collapse> collapses;
+
+	// Counts the triangles around from that the collapse removes; false if one would turn over
+	auto check_move = [&](uint32_t from, uint32_t to, size_t& removed) {
+		glm::vec3 pu = vertices[from].pos, pv = vertices[to].pos;
+		for (uint32_t k = adj_off[from]; k < adj_off[from + 1]; k++) {
+			const uint32_t* t = &result[3 * adj[k]];
+			if (t[0] == to || t[1] == to || t[2] == to) {
+				removed++;
+				continue;
+			}
+			int corner = (t[0] == from) ? 0 : (t[1] == from) ? 1 : 2;
+			glm::vec3 p1 = vertices[t[(corner + 1) % 3]].pos, p2 = vertices[t[(corner + 2) % 3]].pos;
+			if (glm::dot(glm::cross(p1 - pu, p2 - pu), glm::cross(p1 - pv, p2 - pv)) <= 0) return false;
+		}
+		return true;
+	};
+
+	// Greedy passes: cheapest collapses first, each vertex moved or moved onto at most once a pass
+	while (result.size() > target_index_count) {
+		size_t tri_count = result.size() / 3;
+
+		collapses.clear();
+		for (size_t i = 0; i < result.size(); i += 3) {
+			for (int e = 0; e < 3; e++) {
+				uint32_t a = result[i + e], b = result[i + (e + 1) % 3];
+				// Interior edges come up once from each side
+				if (a > b && has_edge(b, a)) continue;
+				bool border = !has_pos_edge(b, a);
+				uint32_t ends[2][2] = { { a, b }, { b, a } };
+				for (auto& uv : ends) {
+					uint32_t u = uv[0], v = uv[1];
+					if (kind[u] == KIND_LOCKED || (kind[u] == KIND_BORDER && !border)) continue;
+					if (!wedge_moves(u, v)) continue;
+					Quadric q;
+					for (auto& m : moves) {
+						q.add(quadrics[m.first]);
+						q.add(quadrics[m.second]);
+					}
+					collapses.push_back({ u, v, q.error(vertices[v].pos) });
+				}
+			}
+		}
+		if (collapses.empty()) break;
+		std::sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b) { return a.cost < b.cost; });
+		// A collapse removes about two triangles; past what reaching the target takes, don't
+		// go much costlier this pass, the next one re-sorts with what has changed
+		size_t goal = std::min((tri_count - target_index_count / 3) / 2, collapses.size() - 1);
+		double pass_cost = std::min(max_cost, collapses[goal].cost * 1.5);
+
+		std::iota(remap.begin(), remap.end(), 0);
+		std::fill(touched.begin(), touched.end(), 0);
+		size_t tris_left = tri_count;
+		size_t done = 0;
+		for (const Collapse& c : collapses) {
+			if (c.cost > pass_cost || tris_left * 3 <= target_index_count) break;
+			wedge_moves(c.from, c.to);
+			size_t removed = 0;
+			bool ok = true;
+			for (auto& m : moves) ok = ok && !touched[m.first] && !touched[m.second] && check_move(m.first, m.second, removed);
+			if (!ok) continue;
+
+			for (auto& m : moves) {
+				remap[m.first] = m.second;
+				quadrics[m.second].add(quadrics[m.first]);
+				for (uint32_t k = adj_off[m.first]; k < adj_off[m.first + 1]; k++)
+					for (int j = 0; j < 3; j++) touched[result[3 * adj[k] + j]] = 1;
+				touched[m.second] = 1;
+			}
+			tris_left -= std::min(removed, tris_left);
+			worst = std::max(worst, c.cost);
+			done++;
+		}
+		if (done == 0) break;
+
+		size_t out = 0;
+		for (size_t i = 0; i < result.size(); i += 3) {
+			uint32_t a = remap[result[i]], b = remap[result[i + 1]], c = remap[result[i + 2]];
+			if (a == b || b == c || a == c) continue;
+			result[out++] = a;
+			result[out++] = b;
+			result[out++] = c;
+		}
+		result.resize(out);
+		build_adjacency();
+	}
+	error = float(std::sqrt(worst));
+	return result;
+}
+
+void meshutils::build_lods(Mesh& mesh)
+{
+	mesh._lods.clear();
+	size_t full_count = mesh._indices.size();
+	if (full_count / 3 < 2 * LOD_MIN_TRIANGLES) return;
+
+	std::vector<uint32_t> full(mesh._indices);
+	mesh._lods.push_back({ 0, uint32_t(full_count), 0 });
+	size_t target = full_count;
+	for (uint32_t level = 1; level < MAX_MESH_LODS; level++) {
+		target = target / 6 * 3;
+		if (target / 3 < LOD_MIN_TRIANGLES) break;
+
+		// From the full mesh each time, so the error is measured against what LOD 0 shows
+		float error = 0;
+		std::vector<uint32_t> lod = simplify_mesh(full, mesh._vertices, target, FLT_MAX, error);
+		const MeshLod prev = mesh._lods.back();
+		// Seams and borders are locked, a mesh that's mostly seams can stall well above target
+		if (lod.size() > size_t(prev.indexCount) * 8 / 10) break;
+		optimize_vertex_cache(lod, mesh._vertices.size());
+
+		MeshLod next;
+		next.firstIndex = mesh._indices.size();
+		next.indexCount = lod.size();
+		next.error = std::max(error, prev.error);
+		mesh._lods.push_back(next);
+		mesh._indices.insert(mesh._indices.end(), lod.begin(), lod.end());
+	}
+	if (mesh._lods.size() == 1) mesh._lods.clear();
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include "vkstructs.h"
+
+#include <vector>
+#include <cstdint>
+
+namespace meshutils {
+
+	// Post-transform cache the optimizer targets and stats are measured against (FIFO)
+	const uint32_t VERTEX_CACHE_SIZE = 16;
+
+	struct VertexCacheStats
+	{
+		float acmr = 0; // vertex shader runs per triangle: 0.5 is ideal, 3 is no reuse at all
+		float atvr = 0; // vertex shader runs per vertex: 1 is ideal
+	};
+
+	VertexCacheStats analyze_vertex_cache(const std::vector<uint32_t>& indices, size_t vertex_count, uint32_t cache_size = VERTEX_CACHE_SIZE);
+
+	// Tipsify (Sander et al. 2007): reorders triangles for vertex cache reuse. Returns where
+	// the cache had to be restarted from a dead end, as first-triangle offsets of each cluster.
+	std::vector<uint32_t> optimize_vertex_cache(std::vector<uint32_t>& indices, size_t vertex_count, uint32_t cache_size = VERTEX_CACHE_SIZE);
+	// Sorts the clusters so the ones facing away from the mesh center draw first, which
+	// fills depth with outer surfaces before what they hide. Triangles keep their order inside a cluster.
+	void optimize_overdraw(std::vector<uint32_t>& indices, const std::vector<Vertex>& vertices, const std::vector<uint32_t>& clusters);
+	// Renumbers vertices in the order the indices first touch them
+	void optimize_vertex_fetch(std::vector<uint32_t>& indices, std::vector<Vertex>& vertices);
+
+	// All of the above, in order
+	void optimize_mesh(Mesh& mesh);
+
+	// Levels below this many triangles aren't generated, they'd save next to nothing
+	const uint32_t LOD_MIN_TRIANGLES = 64;
+
+	// Quadric error edge collapse (Garland & Heckbert 1997) onto existing vertices, so the result
+	// indexes the same vertex array. Vertices on UV/normal seams stay put, open borders only
+	// collapse along themselves. Stops at target_index_count, or when nothing is left to collapse
+	// under max_error; error gets how far the result may be off the input surface.
+	std::vector<uint32_t> simplify_mesh(const std::vector<uint32_t>& indices, const std::vector<Vertex>& vertices,
+		size_t target_index_count, float max_error, float& error);
+	// Appends up to MAX_MESH_LODS - 1 levels, each about half the triangles of the one before,
+	// after the full detail indices and fills mesh._lods. Run after optimize_mesh().
+	void build_lods(Mesh& mesh);
+}
@@ -1,14 +1,14 @@
 #include "PrismRenderer.h"
+#include "MeshFile.h"
 
 #include <set>
+#include <cmath>
+#include <algorithm>
 #include <iostream>
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
-#define STB_IMAGE_IMPLEMENTATION
-#include <stb_image.h>
-
 void PrismRenderer::getVkInstance()
 {
 	//Struct with app info
@@ -18,7 +18,7 @@ void PrismRenderer::getVkInstance()
 	appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
 	appInfo.pEngineName = "Prism Engine";
 	appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-	appInfo.apiVersion = VK_API_VERSION_1_0;
+	appInfo.apiVersion = VK_API_VERSION_1_2;
 
 	instance = vkutils::createVKInstance(
 		appInfo,
@@ -57,10 +57,30 @@ void PrismRenderer::getVkLogicalDevice()
 	//Struct to create logical device
 	VkPhysicalDeviceFeatures deviceFeatures{};
 	deviceFeatures.samplerAnisotropy = VK_TRUE;
+	// LOD draws are indirect, with the object index as firstInstance
+	deviceFeatures.drawIndirectFirstInstance = VK_TRUE;
+	// Cooked textures are BC1/BC7, without it the loader decodes them to RGBA8 instead
+	VkPhysicalDeviceFeatures supportedFeatures;
+	vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+	deviceFeatures.textureCompressionBC = supportedFeatures.textureCompressionBC;
+	bcTextures = supportedFeatures.textureCompressionBC;
+
+	// Uploads signal a timeline semaphore the frames wait on
+	VkPhysicalDeviceVulkan12Features supportedFeatures12{};
+	supportedFeatures12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+	VkPhysicalDeviceFeatures2 supportedFeatures2{};
+	supportedFeatures2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+	supportedFeatures2.pNext = &supportedFeatures12;
+	vkGetPhysicalDeviceFeatures2(physicalDevice, &supportedFeatures2);
+	if (!supportedFeatures12.timelineSemaphore) throw std::runtime_error("failed to find timeline semaphore support!");
+	VkPhysicalDeviceVulkan12Features deviceFeatures12{};
+	deviceFeatures12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+	deviceFeatures12.timelineSemaphore = VK_TRUE;
 
 	VkPhysicalDeviceVulkan11Features deviceFeatures11{};
 	deviceFeatures11.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES;
 	deviceFeatures11.shaderDrawParameters = VK_TRUE;
+	deviceFeatures11.pNext = &deviceFeatures12;
 
 	VkDeviceCreateInfo createInfo{};
 	createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
@@ -156,19 +176,26 @@ void PrismRenderer::createSwapChain(SwapChainSupportDetails swapChainSupport)
 }
 
 void PrismRenderer::createDescriptorPool() {
+	// Each frame has its scene, light and camera uniforms, its object buffer and its point light
+	// shadow maps; textures have texturePools. Growing the object buffers replaces every frame's
+	// object set, at most once a frame, and the old ones wait out the frames in flight. Made again
+	// when the swap chain's image count changes
+	uint32_t frames = MAX_FRAMES_IN_FLIGHT;
+	uint32_t objectSets = frames * (1 + MAX_FRAMES_IN_FLIGHT);
 	std::vector<VkDescriptorPoolSize> poolSizes =
 	{
-		{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 200 },
-		{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 200 },
-		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 200 },
-		{ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 200 }
+		{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, frames * 3 },
+		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, objectSets },
+		{ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, frames * MAX_POINT_LIGHTS }
 	};
 
 	VkDescriptorPoolCreateInfo poolInfo{};
 	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	// Replaced object sets are given back
+	poolInfo.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
 	poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
 	poolInfo.pPoolSizes = poolSizes.data();
-	poolInfo.maxSets = 40;
+	poolInfo.maxSets = frames * 4 + objectSets;
 
 	if (vkCreateDescriptorPool(device, &poolInfo, NULL, &descriptorPool) != VK_SUCCESS) {
 		throw std::runtime_error("failed to create descriptor pool!");
@@ -202,9 +229,11 @@ void PrismRenderer::makeBasicCmdPools()
 		}
 	}
 
+	// Not tied to the frames, it outlives swap chain recreation
+	if (uploadCmdPool != VK_NULL_HANDLE) return;
 	VkCommandPoolCreateInfo poolInfo{};
 	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-	poolInfo.queueFamilyIndex = queueFamilyIndices.transferFamily.value();
+	poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
 	poolInfo.flags = 0; // Optional
 	if (vkCreateCommandPool(device, &poolInfo, NULL, &uploadCmdPool) != VK_SUCCESS) {
 		throw std::runtime_error("failed to create command pool!");
@@ -248,7 +277,7 @@ void PrismRenderer::makePLightMaps()
 			vkutils::transitionImageLayout(
 				device,
 				uploadCmdPool,
-				transferQueue,
+				graphicsQueue,
 				gimg._image,
 				VK_FORMAT_R32_SFLOAT,
 				VK_IMAGE_LAYOUT_UNDEFINED,
@@ -265,7 +294,7 @@ void PrismRenderer::makePLightMaps()
 			dSetLayouts["frag_plight_sampler"],
 			frameDatas[i].shadow_cube_maps,
 			VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-			texSamplers["linear"]
+			texSamplers["shadow"]
 		);
 		frameDatas[i].shadowMapTemp = vkutils::createGPUImage(
 			device,
@@ -281,7 +310,7 @@ void PrismRenderer::makePLightMaps()
 		vkutils::transitionImageLayout(
 			device,
 			uploadCmdPool,
-			transferQueue,
+			graphicsQueue,
 			frameDatas[i].shadowMapTemp._image,
 			VK_FORMAT_R32_SFLOAT,
 			VK_IMAGE_LAYOUT_UNDEFINED,
@@ -304,7 +333,7 @@ void PrismRenderer::makePLightMaps()
 		vkutils::transitionImageLayout(
 			device,
 			uploadCmdPool,
-			transferQueue,
+			graphicsQueue,
 			frameDatas[i].shadowDepthImage._image,
 			depthFormat,
 			VK_IMAGE_LAYOUT_UNDEFINED,
@@ -458,17 +487,53 @@ void PrismRenderer::makeBasicDSets()
 			dSetLayouts["vert_uniform"],
 			VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER
 		);
-		frameDatas[i].setBuffers["object"] = vkutils::createSetBuffer(
-			device,
-			physicalDevice,
-			sizeof(GPUObjectData) * MAX_OBJECTS,
-			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-			descriptorPool,
-			dSetLayouts["vert_storage"],
-			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER
-		);
+		makeObjectBuffers(frameDatas[i]);
+		frameDatas[i].sceneData = (GPUSceneData*)frameDatas[i].setBuffers["scene"]._gBuffer._allocation._mapped;
+		frameDatas[i].cameraData = (GPUCameraData*)frameDatas[i].setBuffers["camera"]._gBuffer._allocation._mapped;
+		frameDatas[i].lightData = (GPULight*)frameDatas[i].setBuffers["light"]._gBuffer._allocation._mapped;
+	}
+}
+
+void PrismRenderer::makeObjectBuffers(GPUFrameData& frame)
+{
+	frame.setBuffers["object"] = vkutils::createSetBuffer(
+		device,
+		physicalDevice,
+		sizeof(GPUObjectData) * objectCapacity,
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		descriptorPool,
+		dSetLayouts["vert_storage"],
+		VK_DESCRIPTOR_TYPE_STORAGE_BUFFER
+	);
+	frame.lodDraws = vkutils::createBuffer(
+		device,
+		physicalDevice,
+		sizeof(VkDrawIndexedIndirectCommand) * objectCapacity * (1 + MAX_POINT_LIGHTS),
+		VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
+	);
+	// Recycled memory: until updateLodDraws fills them in, the commands draw nothing
+	memset(frame.lodDraws._allocation._mapped, 0, sizeof(VkDrawIndexedIndirectCommand) * objectCapacity * (1 + MAX_POINT_LIGHTS));
+	frame.objectData = (GPUObjectData*)frame.setBuffers["object"]._gBuffer._allocation._mapped;
+	frame.objectsWritten.clear();
+	frame.lodViews.clear();
+}
+
+bool PrismRenderer::growObjectBuffers(size_t objectCount)
+{
+	if (objectCount <= objectCapacity) return false;
+	// Doubling keeps the copies of everything into the new buffers rare however many objects come
+	while (objectCapacity < objectCount) objectCapacity *= 2;
+	// New buffers and sets rather than updating the old sets, which frames in flight may still read
+	DeletionQueue& retired = deletionQueues[currentFrame];
+	for (GPUFrameData& frame : frameDatas) {
+		retired.dSets.push_back({ descriptorPool, frame.setBuffers["object"]._dSet });
+		retired.buffers.push_back(frame.setBuffers["object"]._gBuffer);
+		retired.buffers.push_back(frame.lodDraws);
+		makeObjectBuffers(frame);
 	}
+	return true;
 }
 
 void PrismRenderer::addSimplePipeline(std::string name, VkRenderPass rPass, std::unordered_map<VkShaderStageFlagBits, std::string> stage_shader_map, std::vector<std::string> reqDSetLayouts, VkOffset2D scissorOffset, VkExtent2D scissorExtent, float VPWidth, float VPHeight, bool invert_VP_Y, std::vector<VkPushConstantRange> pushConstantRanges)
@@ -487,8 +552,8 @@ void PrismRenderer::addSimplePipeline(std::string name, VkRenderPass rPass, std:
 		shaderStageInfos.push_back(shaderStageInfo);
 	}
 
-	auto bindingDescription = Vertex::getBindingDescription();
-	auto attributeDescriptions = Vertex::getAttributeDescriptions();
+	auto bindingDescription = PackedVertex::getBindingDescription();
+	auto attributeDescriptions = PackedVertex::getAttributeDescriptions();
 
 	VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
 	vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
@@ -658,6 +723,28 @@ void PrismRenderer::createShadowFrameBuffers()
 	}
 }
 
+// What a pass last bound: meshes share the geometry buffers, so most draws need no bind at all.
+// Passes draw the 16 bit indexed meshes first, so the index type changes once.
+struct BoundGeometry {
+	VkBuffer vertices = VK_NULL_HANDLE;
+	VkBuffer indices = VK_NULL_HANDLE;
+	VkIndexType indexType = VK_INDEX_TYPE_MAX_ENUM;
+};
+
+static void bindGeometry(VkCommandBuffer cmdBuffer, const Mesh* mesh, BoundGeometry& bound)
+{
+	if (mesh->_vertexRange._buffer != bound.vertices) {
+		VkDeviceSize offset = 0;
+		vkCmdBindVertexBuffers(cmdBuffer, 0, 1, &mesh->_vertexRange._buffer, &offset);
+		bound.vertices = mesh->_vertexRange._buffer;
+	}
+	if (mesh->_indexRange._buffer != bound.indices || mesh->_indexType != bound.indexType) {
+		vkCmdBindIndexBuffer(cmdBuffer, mesh->_indexRange._buffer, 0, mesh->_indexType);
+		bound.indices = mesh->_indexRange._buffer;
+		bound.indexType = mesh->_indexType;
+	}
+}
+
 void PrismRenderer::addPLightCmds(VkCommandBuffer cmdBuffer, int frameNo)
 {
 	std::vector<VkClearValue> clearValues = std::vector<VkClearValue>(2);
@@ -703,16 +790,15 @@ void PrismRenderer::addPLightCmds(VkCommandBuffer cmdBuffer, int frameNo)
 				{ frameDatas[frameNo].setBuffers["light"]._dSet, frameDatas[frameNo].setBuffers["object"]._dSet },
 				{ { {VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(GPULightPC)}, &tlpc } }
 			);
-			size_t robjCount = renderObjects.size();
-			for (size_t ro_idx = 0; ro_idx < robjCount; ro_idx++) {
-				RenderObject robj = renderObjects[ro_idx];
-
-				VkBuffer vertexBuffers[] = { robj.mesh->_vertexBuffer._buffer };
-				VkDeviceSize offsets[] = { 0 };
-				vkCmdBindVertexBuffers(cmdBuffer, 0, 1, vertexBuffers, offsets);
-				vkCmdBindIndexBuffer(cmdBuffer, robj.mesh->_indexBuffer._buffer, 0, VK_INDEX_TYPE_UINT32);
-				
-				robj.drawMesh(cmdBuffer, ro_idx);
+			size_t robjCount = std::min(renderObjects.size(), objectCapacity);
+			BoundGeometry bound;
+			for (VkIndexType indexType : { VK_INDEX_TYPE_UINT16, VK_INDEX_TYPE_UINT32 }) {
+				for (size_t ro_idx = 0; ro_idx < robjCount; ro_idx++) {
+					RenderObject& robj = renderObjects[ro_idx];
+					if (robj.mesh->_indexType != indexType) continue;
+					bindGeometry(cmdBuffer, robj.mesh, bound);
+					robj.drawMeshIndirect(cmdBuffer, frameDatas[frameNo].lodDraws._buffer, lodDrawOffset(1 + lidx, ro_idx));
+				}
 			}
 			vkCmdEndRenderPass(cmdBuffer);
 
@@ -800,31 +886,31 @@ void PrismRenderer::addFinalMeshCmds(VkCommandBuffer cmdBuffer, int frameNo)
 
 	vkutils::beginRenderPass(finalRenderPass, frameDatas[frameNo].swapChainFrameBuffer, swapChainExtent, cmdBuffer, clearValues);
 
-	size_t robjCount = renderObjects.size();
+	size_t robjCount = std::min(renderObjects.size(), objectCapacity);
 
 	GPUPipeline final_pipeline = pipelines["final_mesh"];
 	final_pipeline.bindPipeline(cmdBuffer);
 
-	for (size_t ro_idx = 0; ro_idx < robjCount; ro_idx++) {
-		RenderObject robj = renderObjects[ro_idx];
-
-		VkBuffer vertexBuffers[] = { robj.mesh->_vertexBuffer._buffer };
-		VkDeviceSize offsets[] = { 0 };
-		vkCmdBindVertexBuffers(cmdBuffer, 0, 1, vertexBuffers, offsets);
-		vkCmdBindIndexBuffer(cmdBuffer, robj.mesh->_indexBuffer._buffer, 0, VK_INDEX_TYPE_UINT32);
-		final_pipeline.bindPipelineDSets(
-			cmdBuffer,
-			{
-				frameDatas[frameNo].setBuffers["camera"]._dSet,
-				frameDatas[frameNo].setBuffers["object"]._dSet,
-				frameDatas[frameNo].setBuffers["scene"]._dSet,
-				robj.texture->_dSet,
-				frameDatas[frameNo].setBuffers["light"]._dSet,
-				frameDatas[frameNo].shadow_cube_dset
-			},
-			{}
-		);
-		robj.drawMesh(cmdBuffer, ro_idx);
+	BoundGeometry bound;
+	for (VkIndexType indexType : { VK_INDEX_TYPE_UINT16, VK_INDEX_TYPE_UINT32 }) {
+		for (size_t ro_idx = 0; ro_idx < robjCount; ro_idx++) {
+			RenderObject& robj = renderObjects[ro_idx];
+			if (robj.mesh->_indexType != indexType) continue;
+			bindGeometry(cmdBuffer, robj.mesh, bound);
+			final_pipeline.bindPipelineDSets(
+				cmdBuffer,
+				{
+					frameDatas[frameNo].setBuffers["camera"]._dSet,
+					frameDatas[frameNo].setBuffers["object"]._dSet,
+					frameDatas[frameNo].setBuffers["scene"]._dSet,
+					robj.texture->_dSet,
+					frameDatas[frameNo].setBuffers["light"]._dSet,
+					frameDatas[frameNo].shadow_cube_dset
+				},
+				{}
+			);
+			robj.drawMeshIndirect(cmdBuffer, frameDatas[frameNo].lodDraws._buffer, lodDrawOffset(0, ro_idx));
+		}
 	}
 	vkCmdEndRenderPass(cmdBuffer);
 }
@@ -832,6 +918,7 @@ void PrismRenderer::addFinalMeshCmds(VkCommandBuffer cmdBuffer, int frameNo)
 void PrismRenderer::createFinalCmdBuffers() {
 	for (size_t i = 0; i < frameDatas.size(); i++) {
 		frameDatas[i].commandBuffer = vkutils::createCmdBuffer(device, frameDatas[i].commandPool);
+		frameDatas[i].acquireCmdBuffer = vkutils::createCmdBuffer(device, frameDatas[i].commandPool);
 
 		VkCommandBufferBeginInfo beginInfo{};
 		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
@@ -846,6 +933,8 @@ void PrismRenderer::createFinalCmdBuffers() {
 
 void PrismRenderer::refreshFinalCmdBuffers() {
 	for (size_t i = 0; i < frameDatas.size(); i++) {
+		// Objects may have changed slots or meshes, so every LOD draw is picked again
+		frameDatas[i].lodViews.clear();
 		if (vkResetCommandBuffer(frameDatas[i].commandBuffer, 0) != VK_SUCCESS) throw std::runtime_error("failed to reset command buffers!");
 
 		VkCommandBufferBeginInfo beginInfo{};
@@ -879,35 +968,44 @@ void PrismRenderer::createSyncObjects() {
 	}
 }
 
-void PrismRenderer::createBasicSamplers()
+void PrismRenderer::addSampler(std::string name, VkFilter filter, VkSamplerMipmapMode mipmapMode, VkSamplerAddressMode addressMode, bool anisotropy, float maxLod)
 {
-	//Create Basic Texture Sampler
 	VkSamplerCreateInfo samplerInfo{};
 	samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
-	samplerInfo.magFilter = VK_FILTER_LINEAR;
-	samplerInfo.minFilter = VK_FILTER_LINEAR;
-	samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-	samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-	samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-	samplerInfo.anisotropyEnable = VK_TRUE;
+	samplerInfo.magFilter = filter;
+	samplerInfo.minFilter = filter;
+	samplerInfo.addressModeU = addressMode;
+	samplerInfo.addressModeV = addressMode;
+	samplerInfo.addressModeW = addressMode;
+	samplerInfo.anisotropyEnable = anisotropy ? VK_TRUE : VK_FALSE;
 	//get max supported anisotropy
 	VkPhysicalDeviceProperties properties{};
 	vkGetPhysicalDeviceProperties(physicalDevice, &properties);
-	samplerInfo.maxAnisotropy = properties.limits.maxSamplerAnisotropy;
+	samplerInfo.maxAnisotropy = anisotropy ? properties.limits.maxSamplerAnisotropy : 1.0f;
 	samplerInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
 	samplerInfo.unnormalizedCoordinates = VK_FALSE;
 	samplerInfo.compareEnable = VK_FALSE;
 	samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
 	//mipmap settings
-	samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+	samplerInfo.mipmapMode = mipmapMode;
 	samplerInfo.mipLodBias = 0.0f;
 	samplerInfo.minLod = 0.0f;
-	samplerInfo.maxLod = 0.0f;
+	samplerInfo.maxLod = maxLod;
 
-	VkSampler basicTexSampler;
-	if (vkCreateSampler(device, &samplerInfo, nullptr, &basicTexSampler) != VK_SUCCESS) throw std::runtime_error("failed to create texture sampler!");
+	VkSampler sampler;
+	if (vkCreateSampler(device, &samplerInfo, nullptr, &sampler) != VK_SUCCESS) throw std::runtime_error("failed to create texture sampler!");
 
-	texSamplers["linear"] = basicTexSampler;
+	texSamplers[name] = sampler;
+}
+
+void PrismRenderer::createBasicSamplers()
+{
+	// Textures: trilinear and anisotropic over the whole mip chain
+	addSampler("linear", VK_FILTER_LINEAR, VK_SAMPLER_MIPMAP_MODE_LINEAR, VK_SAMPLER_ADDRESS_MODE_REPEAT, true, VK_LOD_CLAMP_NONE);
+	// Blocky look up close, still picks a mip when minified so it doesn't shimmer
+	addSampler("nearest", VK_FILTER_NEAREST, VK_SAMPLER_MIPMAP_MODE_NEAREST, VK_SAMPLER_ADDRESS_MODE_REPEAT, false, VK_LOD_CLAMP_NONE);
+	// Shadow cube maps have a single level, the shader does its own soft sampling
+	addSampler("shadow", VK_FILTER_LINEAR, VK_SAMPLER_MIPMAP_MODE_NEAREST, VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE, false, 0.0f);
 }
 
 void PrismRenderer::initVulkan()
@@ -931,6 +1029,10 @@ void PrismRenderer::initVulkan()
 	createShadowFrameBuffers();
 	createFinalCmdBuffers();
 	createSyncObjects();
+	deletionQueues.resize(MAX_FRAMES_IN_FLIGHT);
+	geometryBuffers.create(device, physicalDevice);
+	makePlaceholderAssets();
+	assetLoader.start(device, physicalDevice, transferQueue, queueFamilyIndices.transferFamily.value(), queueFamilyIndices.graphicsFamily.value(), &geometryBuffers, bcTextures);
 }
 
 void PrismRenderer::recreateSwapChain()
@@ -958,19 +1060,28 @@ void PrismRenderer::recreateSwapChain()
 		createFinalCmdBuffers();
 	}
 	else{
+		// Another number of frames in flight: everything sized by it is made again. The device is
+		// idle, so what the old frames retired can go now
+		for (DeletionQueue& queue : deletionQueues) flushDeletions(queue);
+		deletionQueues.resize(MAX_FRAMES_IN_FLIGHT);
+		vkDestroyDescriptorPool(device, descriptorPool, NULL);
+		createDescriptorPool();
 		makeBasicCmdPools();
 		createDepthImage();
+		makePLightMaps();
 		makeBasicDSets();
 		makeFinalPipeline();
 		makeShadowPipeline();
 		createFinalFrameBuffers();
 		createShadowFrameBuffers();
 		createFinalCmdBuffers();
-		imagesInFlight.resize(frameDatas.size(), VK_NULL_HANDLE);
+		imagesInFlight.assign(frameDatas.size(), VK_NULL_HANDLE);
+		createSyncObjects();
+		currentFrame = 0;
 	}
 }
 
-void PrismRenderer::updateUBOs(uint32_t curr_img)
+void PrismRenderer::updateUBOs(uint32_t frameNo)
 {
 	std::chrono::steady_clock::time_point currentFrameTime;
 
@@ -992,39 +1103,100 @@ void PrismRenderer::updateUBOs(uint32_t curr_img)
 
 	uboUpdateCallback(framedeltat, this);
 
-	void* tscenedata;
-	vkMapMemory(device, frameDatas[curr_img].setBuffers["scene"]._gBuffer._bufferMemory, 0, sizeof(currentScene), 0, &tscenedata);
-	memcpy(tscenedata, &currentScene, sizeof(GPUSceneData));
-	vkUnmapMemory(device, frameDatas[curr_img].setBuffers["scene"]._gBuffer._bufferMemory);
-
-	void* camdata;
-	vkMapMemory(device, frameDatas[curr_img].setBuffers["camera"]._gBuffer._bufferMemory, 0, sizeof(currentCamera), 0, &camdata);
-	memcpy(camdata, &currentCamera, sizeof(GPUCameraData));
-	vkUnmapMemory(device, frameDatas[curr_img].setBuffers["camera"]._gBuffer._bufferMemory);
+	// Straight into the mapped buffers: no maps, lookups or copies in between
+	GPUFrameData& frame = frameDatas[frameNo];
+	*frame.sceneData = currentScene;
+	*frame.cameraData = currentCamera;
 
 	for (int pli = 0; pli < pointLights.size(); pli++) pointLights[pli].viewproj = glm::translate(glm::mat4(1.0f), -glm::vec3(pointLights[pli].pos));
+	memcpy(frame.lightData, pointLights.data(), sizeof(GPULight) * std::min<size_t>(pointLights.size(), MAX_POINT_LIGHTS));
 
-	void* scubedata;
-	vkMapMemory(device, frameDatas[curr_img].setBuffers["light"]._gBuffer._bufferMemory, 0, sizeof(GPULight)*pointLights.size(), 0, &scubedata);
-	memcpy(scubedata, pointLights.data(), sizeof(GPULight)*pointLights.size());
-	vkUnmapMemory(device, frameDatas[curr_img].setBuffers["light"]._gBuffer._bufferMemory);
-
-	size_t objCount = renderObjects.size();
-	std::vector<GPUObjectData> objubo;
+	// Only what changed since this frame's buffer was last written: most objects stand still
+	size_t objCount = std::min(renderObjects.size(), objectCapacity);
+	movedObjects.clear();
 	for (size_t i = 0; i < objCount; i++) {
-		objubo.push_back(renderObjects[i].uboData);
+		const GPUObjectData& obj = renderObjects[i].uboData;
+		if (i < frame.objectsWritten.size() && memcmp(&frame.objectsWritten[i], &obj, sizeof(GPUObjectData)) == 0) continue;
+		frame.objectData[i] = obj;
+		if (i < frame.objectsWritten.size()) frame.objectsWritten[i] = obj;
+		else frame.objectsWritten.push_back(obj);
+		movedObjects.push_back(i);
 	}
 
-	if (objCount > 0) {
-		void* objdata;
-		vkMapMemory(device, frameDatas[curr_img].setBuffers["object"]._gBuffer._bufferMemory, 0, sizeof(objubo) * objCount, 0, &objdata);
-		memcpy(objdata, objubo.data(), sizeof(GPUObjectData) * objCount);
-		vkUnmapMemory(device, frameDatas[curr_img].setBuffers["object"]._gBuffer._bufferMemory);
+	updateLodDraws(frameNo);
+}
+
+VkDeviceSize PrismRenderer::lodDrawOffset(size_t pass, size_t ro_idx)
+{
+	return sizeof(VkDrawIndexedIndirectCommand) * (pass * objectCapacity + ro_idx);
+}
+
+// Screen pixels per object space unit at the point of the object closest to eye
+static float pixelsPerUnit(const RenderObject& robj, glm::vec3 eye, float fovY, float viewHeight)
+{
+	// Bounding sphere of the quantization box, in world space
+	const Mesh* mesh = robj.mesh;
+	const glm::mat4& model = robj.uboData.model;
+	glm::vec3 half = glm::vec3(mesh->_decode.posScale) * 0.5f;
+	glm::vec3 center = glm::vec3(model * glm::vec4(glm::vec3(mesh->_decode.posOffset) + half, 1.0f));
+	float scale = std::max({ glm::length(glm::vec3(model[0])), glm::length(glm::vec3(model[1])), glm::length(glm::vec3(model[2])) });
+	float dist = std::max(glm::length(center - eye) - glm::length(half) * scale, 0.01f);
+	return scale * viewHeight * 0.5f / (std::tan(fovY * 0.5f) * dist);
+}
+
+// Coarsest level whose error, projected from eye at the object's nearest point, stays within
+// maxPixels on a view of fovY spanning viewHeight pixels
+static const MeshLod* selectLod(const RenderObject& robj, glm::vec3 eye, float fovY, float viewHeight, float maxPixels)
+{
+	const Mesh* mesh = robj.mesh;
+	if (mesh->_lods.empty()) return nullptr;
+
+	float pixels = pixelsPerUnit(robj, eye, fovY, viewHeight);
+	const MeshLod* lod = &mesh->_lods[0];
+	for (const MeshLod& l : mesh->_lods)
+		if (l.error * pixels <= maxPixels) lod = &l;
+	return lod;
+}
+
+void PrismRenderer::updateLodDraws(uint32_t frameNo)
+{
+	GPUFrameData& frame = frameDatas[frameNo];
+	size_t objCount = std::min(renderObjects.size(), objectCapacity);
+	if (objCount == 0) return;
+
+	VkDrawIndexedIndirectCommand* draws = (VkDrawIndexedIndirectCommand*)frame.lodDraws._allocation._mapped;
+	bool allValid = frame.lodViews.size() == 1 + MAX_POINT_LIGHTS;
+	frame.lodViews.resize(1 + MAX_POINT_LIGHTS);
+	for (size_t pass = 0; pass <= MAX_POINT_LIGHTS; pass++) {
+		bool shadow = pass > 0;
+		LodView view{};
+		// Shadow maps of lights that aren't there are never sampled
+		view.skip = shadow && pass - 1 >= pointLights.size();
+		if (!view.skip && !shadow) view = { glm::vec3(currentCamera.camPos), cameraFovY, (float)swapChainExtent.height, lodPixelError, false };
+		if (!view.skip && shadow) view = { glm::vec3(pointLights[pass - 1].pos), glm::radians(90.0f), (float)plight_smap_extent.height, lodPixelError * shadowLodBias, false };
+
+		// A pass seen from where it was last time only needs the objects that moved
+		bool viewSame = allValid && frame.lodViews[pass] == view;
+		frame.lodViews[pass] = view;
+		size_t count = viewSame ? movedObjects.size() : objCount;
+		for (size_t k = 0; k < count; k++) {
+			size_t i = viewSame ? movedObjects[k] : k;
+			const RenderObject& robj = renderObjects[i];
+			const MeshLod* lod = view.skip ? nullptr : selectLod(robj, view.eye, view.fovY, view.viewHeight, view.maxPixels);
+
+			VkDrawIndexedIndirectCommand& cmd = draws[pass * objectCapacity + i];
+			cmd.indexCount = lod ? lod->indexCount : robj.mesh->_indexCount;
+			cmd.instanceCount = view.skip ? 0 : 1;
+			cmd.firstIndex = robj.mesh->firstIndex() + (lod ? lod->firstIndex : 0);
+			cmd.vertexOffset = robj.mesh->vertexOffset();
+			cmd.firstInstance = i;
+		}
 	}
 }
 
 void PrismRenderer::drawFrame() {
 	vkWaitForFences(device, 1, &frameDatas[currentFrame].renderFence, VK_TRUE, UINT64_MAX);
+	flushDeletions(deletionQueues[currentFrame]);
 
 	uint32_t imageIndex;
 	VkResult result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX, frameDatas[currentFrame].presentSemaphore, VK_NULL_HANDLE, &imageIndex);
@@ -1046,22 +1218,37 @@ void PrismRenderer::drawFrame() {
 	// Mark the image as now being in use by this frame
 	imagesInFlight[imageIndex] = frameDatas[currentFrame].renderFence;
 
+	updatePendingSpawns();
+	updateTextureStreaming();
+	evictUnusedAssets();
 	spawn_mut.unlock();
 
-	updateUBOs(imageIndex);
+	// The frame slot whose fence was just waited for: its command buffer is the one submitted and
+	// reads this slot's buffers, whichever swap chain image it was given
+	updateUBOs(currentFrame);
 	//inputmgr.clearMOffset();
 
 	spawn_mut.lock();
 	VkSubmitInfo submitInfo{};
 	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 
-	VkSemaphore waitSemaphores[] = { frameDatas[currentFrame].presentSemaphore };
-	VkPipelineStageFlags waitStages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
-	submitInfo.waitSemaphoreCount = 1;
+	// The upload semaphore only when this frame took in new assets; its binary neighbours ignore their values
+	VkSemaphore waitSemaphores[] = { frameDatas[currentFrame].presentSemaphore, assetLoader.upload_semaphore() };
+	VkPipelineStageFlags waitStages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, UPLOAD_WAIT_STAGES };
+	uint64_t waitValues[] = { 0, uploadWait };
+	submitInfo.waitSemaphoreCount = uploadWait > 0 ? 2 : 1;
 	submitInfo.pWaitSemaphores = waitSemaphores;
 	submitInfo.pWaitDstStageMask = waitStages;
-	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = &frameDatas[currentFrame].commandBuffer;
+	VkTimelineSemaphoreSubmitInfo timelineInfo{};
+	timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+	timelineInfo.waitSemaphoreValueCount = submitInfo.waitSemaphoreCount;
+	timelineInfo.pWaitSemaphoreValues = waitValues;
+	submitInfo.pNext = &timelineInfo;
+
+	VkCommandBuffer cmdBuffers[] = { frameDatas[currentFrame].acquireCmdBuffer, frameDatas[currentFrame].commandBuffer };
+	if (acquiring && vkEndCommandBuffer(cmdBuffers[0]) != VK_SUCCESS) throw std::runtime_error("failed to record command buffer!");
+	submitInfo.commandBufferCount = acquiring ? 2 : 1;
+	submitInfo.pCommandBuffers = acquiring ? cmdBuffers : &cmdBuffers[1];
 
 	VkSemaphore signalSemaphores[] = { frameDatas[currentFrame].renderSemaphore };
 	submitInfo.signalSemaphoreCount = 1;
@@ -1072,6 +1259,8 @@ void PrismRenderer::drawFrame() {
 	if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, frameDatas[currentFrame].renderFence) != VK_SUCCESS) {
 		throw std::runtime_error("failed to submit draw command buffer!");
 	}
+	uploadWait = 0;
+	acquiring = false;
 
 	VkPresentInfoKHR presentInfo{};
 	presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -1095,6 +1284,7 @@ void PrismRenderer::drawFrame() {
 	}
 
 	currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+	frameNumber++;
 }
 
 void PrismRenderer::mainLoop()
@@ -1113,42 +1303,41 @@ void PrismRenderer::run()
 	cleanup();
 }
 
-Mesh* PrismRenderer::addMesh(std::string meshFilePath)
+void PrismRenderer::makePlaceholderAssets()
 {
-	Mesh tmesh;
-	tmesh.load_from_obj(meshFilePath.c_str());
-	tmesh._vertexBuffer = vkutils::createBuffer(
-		device, physicalDevice,
-		sizeof(Vertex) * tmesh._vertices.size(), tmesh._vertices.data(),
-		VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-		uploadCmdPool,
-		transferQueue
-	);
-	tmesh._indexBuffer = vkutils::createBuffer(
-		device, physicalDevice,
-		sizeof(uint32_t) * tmesh._indices.size(), tmesh._indices.data(),
-		VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-		uploadCmdPool,
-		transferQueue
-	);
-	meshes[meshFilePath] = tmesh;
-	return &meshes[meshFilePath];
-}
-
-GPUTexture2d* PrismRenderer::loadTexture(std::string texturePath, std::string texSamplerType) {
-	int texWidth, texHeight, texChannels;
-	stbi_uc* pixels = stbi_load(texturePath.c_str(), &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
-	VkDeviceSize imageSize = texWidth * texHeight * 4;
-
-	if (!pixels) throw std::runtime_error("failed to load texture image!");
-
-	GPUTexture2d tex;
-	tex._gImage = vkutils::createGPUImage(
+	// Unit cube, a separate face per side so it still lights like one
+	std::vector<Vertex> verts;
+	std::vector<uint32_t> indices;
+	glm::vec3 normals[6] = { {1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1} };
+	glm::vec2 uvs[4] = { {0, 0}, {1, 0}, {1, 1}, {0, 1} };
+	for (glm::vec3 n : normals) {
+		glm::vec3 u = (std::abs(n.y) > 0.5f) ? glm::vec3(1, 0, 0) : glm::vec3(0, 1, 0);
+		glm::vec3 v = glm::cross(n, u);
+		uint32_t base = verts.size();
+		for (int c = 0; c < 4; c++) {
+			Vertex vert{};
+			vert.pos = 0.5f * (n + (uvs[c].x * 2 - 1) * u + (uvs[c].y * 2 - 1) * v);
+			vert.normal = n;
+			vert.color = glm::vec3(1);
+			vert.texCoord = uvs[c];
+			verts.push_back(vert);
+		}
+		for (uint32_t idx : { 0, 1, 2, 0, 2, 3 }) indices.push_back(base + idx);
+	}
+	std::vector<PackedVertex> packed;
+	pack_vertices(verts.data(), verts.size(), packed, placeholderMesh._decode);
+	std::vector<uint8_t> packedIndices = pack_indices(indices.data(), indices.size(), verts.size(), placeholderMesh._indexType);
+	placeholderMesh._indexCount = indices.size();
+	placeholderMesh._vertexRange = geometryBuffers.alloc_vertices(sizeof(PackedVertex) * packed.size());
+	placeholderMesh._indexRange = geometryBuffers.alloc_indices(packedIndices.size());
+	geometryBuffers.upload(placeholderMesh._vertexRange, packed.data(), uploadCmdPool, graphicsQueue);
+	geometryBuffers.upload(placeholderMesh._indexRange, packedIndices.data(), uploadCmdPool, graphicsQueue);
+
+	uint8_t grey[4] = { 128, 128, 128, 255 };
+	placeholderTexture._gImage = vkutils::createGPUImage(
 		device,
 		physicalDevice,
-		texWidth, texHeight,
+		1, 1,
 		VK_FORMAT_R8G8B8A8_SRGB,
 		VK_IMAGE_TILING_OPTIMAL,
 		VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
@@ -1159,8 +1348,8 @@ GPUTexture2d* PrismRenderer::loadTexture(std::string texturePath, std::string te
 	vkutils::transitionImageLayout(
 		device,
 		uploadCmdPool,
-		transferQueue,
-		tex._gImage._image,
+		graphicsQueue,
+		placeholderTexture._gImage._image,
 		VK_FORMAT_R8G8B8A8_SRGB,
 		VK_IMAGE_LAYOUT_UNDEFINED,
 		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
@@ -1171,129 +1360,470 @@ GPUTexture2d* PrismRenderer::loadTexture(std::string texturePath, std::string te
 		device,
 		physicalDevice,
 		uploadCmdPool,
-		transferQueue,
-		imageSize,
-		pixels,
-		tex._gImage,
+		graphicsQueue,
+		sizeof(grey),
+		grey,
+		placeholderTexture._gImage,
 		{ 0, 0, 0 },
-		{ (uint32_t)texWidth, (uint32_t)texHeight, 1 }
+		{ 1, 1, 1 }
 	);
-	stbi_image_free(pixels);
 	vkutils::transitionImageLayout(
 		device,
 		uploadCmdPool,
-		transferQueue,
-		tex._gImage._image,
+		graphicsQueue,
+		placeholderTexture._gImage._image,
 		VK_FORMAT_R8G8B8A8_SRGB,
 		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
 		VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
 		VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
 		VK_PIPELINE_STAGE_ALL_COMMANDS_BIT
 	);
-	tex._dSet = vkutils::createImageDSet(
-		device,
-		descriptorPool,
-		dSetLayouts["frag_sampler"],
-		{ tex._gImage },
-		VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-		texSamplers["linear"]
-	);
-	textures[texturePath] = tex;
-	return &textures[texturePath];
+	makeTextureDSet(placeholderTexture, "linear");
 }
 
-void PrismRenderer::addRenderObj(
+std::shared_future<bool> PrismRenderer::queueSpawn(PendingSpawn spawn)
+{
+	if (!texSamplers.count(spawn.samplerType)) throw std::runtime_error("failed to find texture sampler!");
+	std::shared_future<bool> resident = spawn.resident.get_future().share();
+	spawn_queue_mut.lock();
+	// A respawn under the same id brings new mesh data, it mustn't pick up the cached old mesh
+	if (spawn.meshInMemory) spawn.meshKey += "#" + std::to_string(memoryMeshCount++);
+	spawnQueue.push_back(std::move(spawn));
+	spawn_queue_mut.unlock();
+	return resident;
+}
+
+std::shared_future<bool> PrismRenderer::addRenderObj(
 	std::string id,
 	std::string meshFilePath,
 	std::string texFilePath,
 	std::string texSamplerType,
 	glm::mat4 initTransform,
 	bool include_in_final_render,
-	bool include_in_shadow_map
+	bool include_in_shadow_map,
+	bool use_placeholder
 ) {
-	spawn_mut.lock();
-	RenderObject robj;
-	robj.id = id;
-	robj.renderable = include_in_final_render;
-	robj.shadowcasting = include_in_shadow_map;
-	robj.uboData.model = initTransform;
-
-	auto meshit = meshes.find(meshFilePath);
-	if (meshit == meshes.end()) robj.mesh = addMesh(meshFilePath);
-	else robj.mesh = &(*meshit).second;
-
-	GPUTexture2d* texdata;
-	auto texit = textures.find(texFilePath);
-	if (texit == textures.end()) texdata = loadTexture(texFilePath, texSamplerType);
-	else texdata = &(*texit).second;
-	robj.texture = texdata;
-	renderObjects.push_back(robj);
-
-	refreshFinalCmdBuffers();
-	spawn_mut.unlock();
+	PendingSpawn spawn;
+	spawn.robj.id = id;
+	spawn.robj.renderable = include_in_final_render;
+	spawn.robj.shadowcasting = include_in_shadow_map;
+	spawn.robj.uboData.model = initTransform;
+	spawn.meshKey = meshFilePath;
+	spawn.texKey = texFilePath;
+	spawn.samplerType = texSamplerType;
+	spawn.placeholder = use_placeholder;
+	return queueSpawn(std::move(spawn));
 }
 
-void PrismRenderer::addRenderObj(
+std::shared_future<bool> PrismRenderer::addRenderObj(
 	std::string id,
 	Mesh meshData,
 	std::string texFilePath,
 	std::string texSamplerType,
 	glm::mat4 initTransform,
 	bool include_in_final_render,
-	bool include_in_shadow_map
+	bool include_in_shadow_map,
+	bool use_placeholder
 ) {
-	spawn_mut.lock();
-	RenderObject robj;
-	robj.id = id;
-	robj.renderable = include_in_final_render;
-	robj.shadowcasting = include_in_shadow_map;
-	robj.uboData.model = initTransform;
-
-	auto meshit = meshes.find(id);
-	if (meshit == meshes.end()) {
-		meshData._vertexBuffer = vkutils::createBuffer(
-			device, physicalDevice,
-			sizeof(Vertex) * meshData._vertices.size(), meshData._vertices.data(),
-			VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-			uploadCmdPool,
-			transferQueue
-		);
-		meshData._indexBuffer = vkutils::createBuffer(
-			device, physicalDevice,
-			sizeof(uint32_t) * meshData._indices.size(), meshData._indices.data(),
-			VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-			uploadCmdPool,
-			transferQueue
-		);
-		meshes[id] = meshData;
-		meshit = meshes.find(id);
+	PendingSpawn spawn;
+	spawn.robj.id = id;
+	spawn.robj.renderable = include_in_final_render;
+	spawn.robj.shadowcasting = include_in_shadow_map;
+	spawn.robj.uboData.model = initTransform;
+	spawn.meshKey = id;
+	spawn.meshInMemory = true;
+	spawn.meshData = std::move(meshData);
+	spawn.texKey = texFilePath;
+	spawn.samplerType = texSamplerType;
+	spawn.placeholder = use_placeholder;
+	return queueSpawn(std::move(spawn));
+}
+
+bool PrismRenderer::addLoadedAsset(LoadedAsset& asset)
+{
+	// Unused until a spawn takes it, e.g. when the spawns that asked for it were removed meanwhile
+	assetsReleased = true;
+	if (!asset.is_texture) {
+		Mesh& mesh = meshes[asset.key] = std::move(asset.mesh);
+		mesh._lastUsed = frameNumber;
+		return false;
+	}
+	textureStreamer.set_resident(asset.key, asset.format, asset.width, asset.height, asset.level_count, asset.first_level, asset.streamable);
+	auto texit = textures.find(asset.key);
+	if (texit == textures.end()) {
+		GPUTexture2d tex;
+		tex._gImage = asset.image;
+		makeTextureDSet(tex, "linear");
+		tex._source = asset.key;
+		tex._lastUsed = frameNumber;
+		textures[asset.key] = tex;
+		return false;
 	}
-	robj.mesh = &(*meshit).second;
 
-	GPUTexture2d* texdata;
-	auto texit = textures.find(texFilePath);
-	if (texit == textures.end()) texdata = loadTexture(texFilePath, texSamplerType);
-	else texdata = &(*texit).second;
-	robj.texture = texdata;
+	// Other levels of a resident texture: objects keep their GPUTexture2d, it just gets the new image
+	DeletionQueue& retired = deletionQueues[currentFrame];
+	retired.images.push_back(texit->second._gImage);
+	retireTextureDSet(texit->second);
+	texit->second._gImage = asset.image;
+	makeTextureDSet(texit->second, "linear");
+	for (auto& it : samplerTextures) {
+		if (it.second._source != asset.key) continue;
+		retireTextureDSet(it.second);
+		it.second._gImage = asset.image;
+		makeTextureDSet(it.second, it.first.substr(it.first.rfind('|') + 1));
+	}
+	return true;
+}
 
-	renderObjects.push_back(robj);
+void PrismRenderer::retainAssets(const RenderObject& robj)
+{
+	if (robj.mesh != &placeholderMesh) robj.mesh->_refs++;
+	auto texit = textures.find(robj.texture->_source);
+	if (texit != textures.end()) texit->second._refs++;
+}
 
-	refreshFinalCmdBuffers();
-	spawn_mut.unlock();
+void PrismRenderer::releaseAssets(const RenderObject& robj)
+{
+	if (robj.mesh != &placeholderMesh && --robj.mesh->_refs == 0) {
+		robj.mesh->_lastUsed = frameNumber;
+		assetsReleased = true;
+	}
+	auto texit = textures.find(robj.texture->_source);
+	if (texit != textures.end() && --texit->second._refs == 0) {
+		texit->second._lastUsed = frameNumber;
+		assetsReleased = true;
+	}
 }
 
-void PrismRenderer::removeRenderObj(std::string id)
+void PrismRenderer::evictUnusedAssets()
 {
-	spawn_mut.lock();
-	for (auto it = renderObjects.begin(); it != renderObjects.end(); it++) {
-		if (it->id == id) {
-			renderObjects.erase(it);
-			refreshFinalCmdBuffers();
+	if (!assetsReleased) return;
+	assetsReleased = false;
+
+	// Spawns still waiting keep whatever of theirs already arrived, and a texture with a stream
+	// load on its way is left to it
+	std::unordered_set<std::string> wanted = loadingTextures;
+	for (const PendingSpawn& spawn : pendingSpawns) {
+		wanted.insert(spawn.meshKey);
+		wanted.insert(spawn.texKey);
+	}
+	struct UnusedAsset {
+		std::string key;
+		bool is_texture;
+		uint64_t lastUsed;
+		VkDeviceSize bytes;
+	};
+	std::vector<UnusedAsset> unused;
+	std::vector<std::string> unusedMemoryMeshes;
+	VkDeviceSize unusedBytes = 0;
+	for (auto& it : meshes) {
+		if (it.second._refs > 0 || wanted.count(it.first)) continue;
+		// Every queueSpawn gives an in-memory mesh a new key, so nothing will ask for this one again
+		if (it.first.find('#') != std::string::npos) {
+			unusedMemoryMeshes.push_back(it.first);
+			continue;
+		}
+		VkDeviceSize bytes = it.second._vertexRange._size + it.second._indexRange._size;
+		unused.push_back({ it.first, false, it.second._lastUsed, bytes });
+		unusedBytes += bytes;
+	}
+	for (auto& it : textures) {
+		if (it.second._refs > 0 || wanted.count(it.first)) continue;
+		VkDeviceSize bytes = it.second._gImage._allocation._size;
+		unused.push_back({ it.first, true, it.second._lastUsed, bytes });
+		unusedBytes += bytes;
+	}
+	for (const std::string& key : unusedMemoryMeshes) evictMesh(key);
+	if (unusedBytes <= assetCacheBudget) return;
+
+	std::sort(unused.begin(), unused.end(), [](const UnusedAsset& a, const UnusedAsset& b) { return a.lastUsed < b.lastUsed; });
+	for (const UnusedAsset& asset : unused) {
+		if (unusedBytes <= assetCacheBudget) break;
+		unusedBytes -= asset.bytes;
+		if (asset.is_texture) evictTexture(asset.key);
+		else evictMesh(asset.key);
+	}
+}
+
+void PrismRenderer::evictMesh(std::string key)
+{
+	auto meshit = meshes.find(key);
+	deletionQueues[currentFrame].ranges.push_back(meshit->second._vertexRange);
+	deletionQueues[currentFrame].ranges.push_back(meshit->second._indexRange);
+	meshes.erase(meshit);
+}
+
+void PrismRenderer::evictTexture(std::string path)
+{
+	auto texit = textures.find(path);
+	DeletionQueue& retired = deletionQueues[currentFrame];
+	retired.images.push_back(texit->second._gImage);
+	retireTextureDSet(texit->second);
+	for (auto it = samplerTextures.begin(); it != samplerTextures.end();) {
+		if (it->second._source != path) {
+			it++;
+			continue;
+		}
+		retireTextureDSet(it->second);
+		it = samplerTextures.erase(it);
+	}
+	textures.erase(texit);
+	textureStreamer.remove(path);
+}
+
+void PrismRenderer::flushDeletions(DeletionQueue& queue)
+{
+	for (auto& dSet : queue.dSets) vkFreeDescriptorSets(device, dSet.first, 1, &dSet.second);
+	for (GPUImage& image : queue.images) vkutils::destroyGPUImage(device, image);
+	for (GeometryRange& range : queue.ranges) geometryBuffers.free(range);
+	for (GPUBuffer& buffer : queue.buffers) vkutils::destroyBuffer(device, buffer);
+	queue.dSets.clear();
+	queue.images.clear();
+	queue.ranges.clear();
+	queue.buffers.clear();
+}
+
+void PrismRenderer::acquireAsset(const LoadedAsset& asset)
+{
+	uploadWait = std::max(uploadWait, asset.upload_value);
+	// One family: the semaphore wait alone makes the copies visible
+	if (queueFamilyIndices.transferFamily == queueFamilyIndices.graphicsFamily) return;
+	VkCommandBuffer cmdBuffer = frameDatas[currentFrame].acquireCmdBuffer;
+	if (!acquiring) {
+		// The frame's fence has been waited on, so its last acquires are done with
+		vkResetCommandBuffer(cmdBuffer, 0);
+		VkCommandBufferBeginInfo beginInfo{};
+		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+		beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+		if (vkBeginCommandBuffer(cmdBuffer, &beginInfo) != VK_SUCCESS) throw std::runtime_error("failed to begin recording command buffer!");
+		acquiring = true;
+	}
+	assetLoader.acquire(cmdBuffer, asset);
+}
+
+void PrismRenderer::makeTextureDSet(GPUTexture2d& tex, std::string samplerType)
+{
+	VkDescriptorSetAllocateInfo dSetAllocInfo{};
+	dSetAllocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	dSetAllocInfo.descriptorSetCount = 1;
+	dSetAllocInfo.pSetLayouts = &dSetLayouts["frag_sampler"];
+	// Newest first, it's the likeliest to have room; older ones get room back as sets are retired
+	tex._dPool = VK_NULL_HANDLE;
+	for (auto it = texturePools.rbegin(); it != texturePools.rend(); it++) {
+		dSetAllocInfo.descriptorPool = *it;
+		if (vkAllocateDescriptorSets(device, &dSetAllocInfo, &tex._dSet) == VK_SUCCESS) {
+			tex._dPool = *it;
 			break;
 		}
 	}
+	if (tex._dPool == VK_NULL_HANDLE) {
+		VkDescriptorPoolSize poolSize{ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, TEXTURE_POOL_SETS };
+		VkDescriptorPoolCreateInfo poolInfo{};
+		poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+		poolInfo.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
+		poolInfo.poolSizeCount = 1;
+		poolInfo.pPoolSizes = &poolSize;
+		poolInfo.maxSets = TEXTURE_POOL_SETS;
+		VkDescriptorPool pool;
+		if (vkCreateDescriptorPool(device, &poolInfo, NULL, &pool) != VK_SUCCESS) {
+			throw std::runtime_error("failed to create descriptor pool!");
+		}
+		texturePools.push_back(pool);
+		dSetAllocInfo.descriptorPool = pool;
+		if (vkAllocateDescriptorSets(device, &dSetAllocInfo, &tex._dSet) != VK_SUCCESS) {
+			throw std::runtime_error("failed to allocate descriptor set!");
+		}
+		tex._dPool = pool;
+	}
+	vkutils::writeImageDSet(
+		device,
+		tex._dSet,
+		{ tex._gImage },
+		VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+		texSamplers[samplerType]
+	);
+}
+
+void PrismRenderer::retireTextureDSet(GPUTexture2d& tex)
+{
+	deletionQueues[currentFrame].dSets.push_back({ tex._dPool, tex._dSet });
+}
+
+GPUTexture2d* PrismRenderer::getTexture(std::string path, std::string samplerType)
+{
+	auto texit = textures.find(path);
+	if (texit == textures.end()) return nullptr;
+	if (samplerType == "linear") return &texit->second;
+	// Same image, its own descriptor set
+	std::string key = path + "|" + samplerType;
+	auto it = samplerTextures.find(key);
+	if (it == samplerTextures.end()) {
+		GPUTexture2d tex;
+		tex._gImage = texit->second._gImage;
+		makeTextureDSet(tex, samplerType);
+		tex._source = path;
+		it = samplerTextures.emplace(key, tex).first;
+	}
+	return &it->second;
+}
+
+void PrismRenderer::updateTextureStreaming()
+{
+	textureStreamer.set_budget(textureBudget);
+	textureStreamer.begin_frame();
+	glm::vec3 eye = glm::vec3(currentCamera.camPos);
+	for (const RenderObject& robj : renderObjects) {
+		if (!robj.renderable || robj.texture->_source.empty() || robj.mesh->_uvDensity <= 0) continue;
+		float pixels = pixelsPerUnit(robj, eye, cameraFovY, swapChainExtent.height);
+		textureStreamer.want(robj.texture->_source, robj.mesh->_uvDensity / pixels);
+	}
+	std::vector<texutils::StreamRequest> requests;
+	textureStreamer.update(requests);
+	for (texutils::StreamRequest& req : requests) {
+		assetLoader.request_texture(req.path, req.max_size);
+		loadingTextures.insert(req.path);
+	}
+}
+
+void PrismRenderer::updatePendingSpawns()
+{
+	std::vector<PendingSpawn> incoming;
+	spawn_queue_mut.lock();
+	incoming.swap(spawnQueue);
+	spawn_queue_mut.unlock();
+
+	bool changed = false;
+	for (PendingSpawn& spawn : incoming) {
+		// Each asset is only requested once, however many spawns wait on it
+		if (!meshes.count(spawn.meshKey) && !loadingMeshes.count(spawn.meshKey)) {
+			if (spawn.meshInMemory) assetLoader.request_mesh(spawn.meshKey, std::move(spawn.meshData));
+			else assetLoader.request_mesh(spawn.meshKey, spawn.meshKey);
+			loadingMeshes.insert(spawn.meshKey);
+		}
+		if (!textures.count(spawn.texKey) && !loadingTextures.count(spawn.texKey)) {
+			// Just the coarse levels, streaming brings in the rest once the object is drawn
+			assetLoader.request_texture(spawn.texKey, texutils::STREAM_MIN_SIZE);
+			loadingTextures.insert(spawn.texKey);
+		}
+		if (spawn.placeholder) {
+			RenderObject robj = spawn.robj;
+			robj.mesh = &placeholderMesh;
+			robj.texture = &placeholderTexture;
+			robj.uboData.decode = placeholderMesh._decode;
+			renderObjects.push_back(robj);
+			changed = true;
+		}
+		pendingSpawns.push_back(std::move(spawn));
+	}
+
+	std::vector<LoadedAsset> loaded;
+	assetLoader.collect(loaded);
+	std::unordered_set<std::string> failedMeshes, failedTextures;
+	for (LoadedAsset& asset : loaded) {
+		if (asset.is_texture) loadingTextures.erase(asset.key);
+		else loadingMeshes.erase(asset.key);
+		if (!asset.failed) {
+			acquireAsset(asset);
+			changed |= addLoadedAsset(asset);
+		}
+		else {
+			std::cerr << "failed to load " << asset.key << ": " << asset.error << std::endl;
+			// A failed stream load leaves the levels already resident in use
+			if (asset.is_texture && textures.count(asset.key)) textureStreamer.request_failed(asset.key);
+			else if (asset.is_texture) failedTextures.insert(asset.key);
+			else failedMeshes.insert(asset.key);
+		}
+	}
+
+	for (PendingSpawn& spawn : pendingSpawns) {
+		auto meshit = meshes.find(spawn.meshKey);
+		Mesh* mesh = (meshit != meshes.end()) ? &meshit->second : nullptr;
+		GPUTexture2d* tex = getTexture(spawn.texKey, spawn.samplerType);
+		bool failed = failedMeshes.count(spawn.meshKey) || failedTextures.count(spawn.texKey);
+
+		auto shown = renderObjects.end();
+		if (spawn.placeholder) {
+			for (shown = renderObjects.begin(); shown != renderObjects.end(); shown++)
+				if (shown->id == spawn.robj.id) break;
+		}
+		if (failed) {
+			if (shown != renderObjects.end()) {
+				releaseAssets(*shown);
+				renderObjects.erase(shown);
+			}
+			// The half that did arrive may be left unused
+			assetsReleased = true;
+			changed |= spawn.placeholder;
+			spawn.resident.set_value(false);
+			spawn.done = true;
+			continue;
+		}
+
+		// Whichever half already arrived replaces its placeholder
+		if (shown != renderObjects.end()) {
+			Mesh* showMesh = mesh ? mesh : &placeholderMesh;
+			GPUTexture2d* showTex = tex ? tex : &placeholderTexture;
+			if (shown->mesh != showMesh || shown->texture != showTex) changed = true;
+			releaseAssets(*shown);
+			shown->mesh = showMesh;
+			shown->texture = showTex;
+			shown->uboData.decode = showMesh->_decode;
+			retainAssets(*shown);
+		}
+		if (!mesh || !tex) continue;
+		if (shown == renderObjects.end()) {
+			spawn.robj.mesh = mesh;
+			spawn.robj.texture = tex;
+			spawn.robj.uboData.decode = mesh->_decode;
+			retainAssets(spawn.robj);
+			renderObjects.push_back(spawn.robj);
+			changed = true;
+		}
+		spawn.resident.set_value(true);
+		spawn.done = true;
+	}
+	// In one pass, erasing each as it's done is quadratic with many spawns arriving at once
+	pendingSpawns.erase(std::remove_if(pendingSpawns.begin(), pendingSpawns.end(), [](const PendingSpawn& spawn) { return spawn.done; }), pendingSpawns.end());
+
+	changed |= growObjectBuffers(renderObjects.size());
+	if (changed) refreshFinalCmdBuffers();
+}
+
+void PrismRenderer::removeRenderObj(std::string id)
+{
+	removeRenderObjs({ id });
+}
+
+void PrismRenderer::removeRenderObjs(const std::vector<std::string>& ids)
+{
+	if (ids.empty()) return;
+	std::unordered_set<std::string> removing(ids.begin(), ids.end());
+	spawn_mut.lock();
+	// One compacting pass per list and one re-record, however many ids
+	size_t objCount = renderObjects.size();
+	renderObjects.erase(std::remove_if(renderObjects.begin(), renderObjects.end(), [&](const RenderObject& robj) {
+		if (!removing.count(robj.id)) return false;
+		releaseAssets(robj);
+		return true;
+	}), renderObjects.end());
+	bool changed = renderObjects.size() != objCount;
+	// A spawn still waiting on its assets is dropped; the assets stay cached once they arrive
+	for (PendingSpawn& spawn : pendingSpawns) {
+		if (!removing.count(spawn.robj.id)) continue;
+		spawn.resident.set_value(false);
+		spawn.done = true;
+		assetsReleased = true;
+	}
+	pendingSpawns.erase(std::remove_if(pendingSpawns.begin(), pendingSpawns.end(), [](const PendingSpawn& spawn) { return spawn.done; }), pendingSpawns.end());
+	spawn_queue_mut.lock();
+	for (PendingSpawn& spawn : spawnQueue) {
+		if (!removing.count(spawn.robj.id)) continue;
+		spawn.resident.set_value(false);
+		spawn.done = true;
+	}
+	spawnQueue.erase(std::remove_if(spawnQueue.begin(), spawnQueue.end(), [](const PendingSpawn& spawn) { return spawn.done; }), spawnQueue.end());
+	spawn_queue_mut.unlock();
+	if (changed) refreshFinalCmdBuffers();
 	spawn_mut.unlock();
 }
 
@@ -1317,11 +1847,13 @@ void PrismRenderer::cleanupSwapChain(bool destroy_only_swapchain)
 			vkDestroyFramebuffer(device, fdata.swapChainFrameBuffer, NULL);
 			vkDestroyFramebuffer(device, fdata.shadowFrameBuffer, NULL);
 			vkFreeCommandBuffers(device, fdata.commandPool, 1, &fdata.commandBuffer);
+			vkFreeCommandBuffers(device, fdata.commandPool, 1, &fdata.acquireCmdBuffer);
 			vkDestroySemaphore(device, fdata.renderSemaphore, NULL);
 			vkDestroySemaphore(device, fdata.presentSemaphore, NULL);
 			vkDestroyFence(device, fdata.renderFence, NULL);
 			vkDestroyCommandPool(device, fdata.commandPool, NULL);
-			//for (auto t : fdata.setBuffers) vkutils::destroySetBuffer(device, descriptorPool, t.second);
+			vkutils::destroyBuffer(device, fdata.lodDraws);
+			for (auto t : fdata.setBuffers) vkutils::destroySetBuffer(device, descriptorPool, t.second);
 			fdata.setBuffers.clear();
 		}
 	vkDestroySwapchainKHR(device, swapChain, NULL);
@@ -1329,24 +1861,40 @@ void PrismRenderer::cleanupSwapChain(bool destroy_only_swapchain)
 
 void PrismRenderer::cleanup()
 {
+	assetLoader.stop();
+	for (PendingSpawn& spawn : pendingSpawns) spawn.resident.set_value(false);
+	for (PendingSpawn& spawn : spawnQueue) spawn.resident.set_value(false);
+	pendingSpawns.clear();
+	spawnQueue.clear();
 	cleanupSwapChain(false);
+	// Everything was waited for on the way out of mainLoop
+	for (DeletionQueue& queue : deletionQueues) flushDeletions(queue);
 
 	vkDestroyDescriptorPool(device, descriptorPool, NULL);
+	// Takes the resident textures' sets with them
+	for (VkDescriptorPool pool : texturePools) vkDestroyDescriptorPool(device, pool, NULL);
+	texturePools.clear();
 	for (auto it : texSamplers) vkDestroySampler(device, it.second, NULL);
 	texSamplers.clear();
 	for (auto it : textures) vkutils::destroyGPUImage(device, it.second._gImage);
 	textures.clear();
+	samplerTextures.clear();
 	for (auto it : pipelines) {
 		vkDestroyPipeline(device, it.second._pipeline, NULL);
 		vkDestroyPipelineLayout(device, it.second._pipelineLayout, NULL);
 	}
 	pipelines.clear();
 	for (auto it : meshes) {
-		vkutils::destroyBuffer(device, it.second._vertexBuffer);
-		vkutils::destroyBuffer(device, it.second._indexBuffer);
+		geometryBuffers.free(it.second._vertexRange);
+		geometryBuffers.free(it.second._indexRange);
 	}
 	meshes.clear();
+	geometryBuffers.free(placeholderMesh._vertexRange);
+	geometryBuffers.free(placeholderMesh._indexRange);
+	geometryBuffers.destroy();
+	vkutils::destroyGPUImage(device, placeholderTexture._gImage);
 	vkDestroyCommandPool(device, uploadCmdPool, NULL);
+	vkutils::destroyAllocator(device);
 	vkDestroyDevice(device, NULL);
 	if (enableValidationLayers) vkutils::DestroyDebugUtilsMessengerEXT(instance, debugMessenger, NULL);
 	vkDestroySurfaceKHR(instance, surface, NULL);
@@ -1,9 +1,13 @@
 #pragma once
 
 #include "vkutils.h"
+#include "AssetLoader.h"
+#include "TextureStreamer.h"
 
 #include <mutex>
 #include <vector>
+#include <future>
+#include <unordered_set>
 
 class PrismRenderer
 {
@@ -13,6 +17,18 @@ public:
 	VkExtent2D plight_smap_extent = { 1024, 1024 };
 	VkExtent2D dlight_smap_extent = { 1024, 1024 };
 
+	// Vertical fov of the projection in currentCamera, LOD selection needs it
+	float cameraFovY = glm::radians(90.0f);
+	// How many pixels of simplification error a mesh LOD may show, and how much more of it
+	// the point light shadow maps put up with
+	float lodPixelError = 1.0f;
+	float shadowLodBias = 4.0f;
+	// VRAM textures may take up; past it the streamer drops whichever cooked levels free the most
+	uint64_t textureBudget = texutils::DEFAULT_TEXTURE_BUDGET;
+	// VRAM meshes and textures no object uses any more may stay cached in, for objects spawned
+	// with them again; past it the least recently used are freed
+	uint64_t assetCacheBudget = 128ull << 20;
+
 	GPUSceneData currentScene;
 	GPUCameraData currentCamera;
 	std::vector<RenderObject> renderObjects;
@@ -26,25 +42,38 @@ public:
 	PrismRenderer(GLFWwindow* glfwWindow, void(*nextFrameCallback)(float framedeltat, PrismRenderer* renderer));
 	void (*uboUpdateCallback) (float framedeltat, PrismRenderer* renderer);
 	void run();
-	void addRenderObj(
+	// Never waits on a load: the object shows up in renderObjects once its mesh and texture are
+	// resident, and the future says whether it made it there. With use_placeholder it's drawn
+	// right away, as a unit cube and/or with a flat grey texture until the real ones arrive.
+	// texSamplerType is one of createBasicSamplers()' samplers, usually "linear" or "nearest".
+	std::shared_future<bool> addRenderObj(
 		std::string id,
 		std::string meshFilePath,
 		std::string texFilePath,
 		std::string texSamplerType,
 		glm::mat4 initTransform,
 		bool include_in_final_render = true,
-		bool include_in_shadow_map = true
+		bool include_in_shadow_map = true,
+		bool use_placeholder = false
 	);
-	void addRenderObj(
+	// meshData is never shared with another spawn, not even an earlier one with the same id
+	std::shared_future<bool> addRenderObj(
 		std::string id,
 		Mesh meshData,
 		std::string texFilePath,
 		std::string texSamplerType,
 		glm::mat4 initTransform,
 		bool include_in_final_render = true,
-		bool include_in_shadow_map = true
+		bool include_in_shadow_map = true,
+		bool use_placeholder = false
 	);
 	void removeRenderObj(std::string id);
+	// Many at once, with the command buffers recorded again just once
+	void removeRenderObjs(const std::vector<std::string>& ids);
+	// Render thread only, e.g. from uboUpdateCallback
+	texutils::TextureStreamingStats getTextureStreamingStats() const { return textureStreamer.get_stats(); }
+	vkutils::DeviceMemoryStats getMemoryStats() const { return vkutils::getMemoryStats(device); }
+	vkutils::GeometryStats getGeometryStats() const { return geometryBuffers.get_stats(); }
 private:
 #ifdef NDEBUG
 	const bool enableValidationLayers = false;
@@ -61,6 +90,7 @@ private:
 	VkDevice device;
 	QueueFamilyIndices queueFamilyIndices;
 	VkQueue graphicsQueue, presentQueue, transferQueue;
+	bool bcTextures = false;
 	VkSurfaceKHR surface;
 
 	unsigned int MAX_FRAMES_IN_FLIGHT = 3;
@@ -68,15 +98,21 @@ private:
 	VkSwapchainKHR swapChain;
 	VkFormat swapChainImageFormat;
 
-	const unsigned int MAX_OBJECTS = 1000;
+	// Objects the object buffers and LOD draw buffers have room for, doubled whenever there are more
+	size_t objectCapacity = 1024;
 	const unsigned int MAX_POINT_LIGHTS = 4;
 	const unsigned int MAX_DIRECTIONAL_LIGHTS = 10;
 
 	VkDescriptorPool descriptorPool;
+	// Texture sets come and go with streaming, so they get pools of their own, another one
+	// whenever all of them are full
+	std::vector<VkDescriptorPool> texturePools;
+	const uint32_t TEXTURE_POOL_SETS = 256;
 	std::unordered_map<std::string, VkDescriptorSetLayout> dSetLayouts;
 	std::unordered_map<std::string, GPUPipeline> pipelines;
 	std::unordered_map<std::string, Mesh> meshes;
-	std::unordered_map<std::string, GPUTexture2d> textures;
+	std::unordered_map<std::string, GPUTexture2d> textures; // with the "linear" sampler
+	std::unordered_map<std::string, GPUTexture2d> samplerTextures; // the same images with other samplers, by path|sampler
 	std::unordered_map<std::string, VkSampler> texSamplers;
 
 	std::vector<GPUBuffer> uniformBuffers;
@@ -90,9 +126,46 @@ private:
 	VkFormat depthFormat;
 	GPUImage depthImage;
 
-	VkCommandPool uploadCmdPool;
+	// Init time uploads, on the graphics queue so nothing they touch changes queue family
+	VkCommandPool uploadCmdPool = VK_NULL_HANDLE;
 	std::vector<VkFence> imagesInFlight;
 
+	struct PendingSpawn {
+		RenderObject robj;
+		std::string meshKey, texKey, samplerType;
+		bool meshInMemory = false;
+		Mesh meshData; // handed to the loader if meshKey isn't resident or loading yet
+		bool placeholder = false; // robj is already in renderObjects, drawn with the placeholders
+		std::promise<bool> resident;
+		bool done = false; // resident is set, it leaves pendingSpawns
+	};
+	vkutils::GeometryBuffers geometryBuffers; // every mesh's vertices and indices
+	AssetLoader assetLoader;
+	std::mutex spawn_queue_mut;
+	std::vector<PendingSpawn> spawnQueue; // guarded by spawn_queue_mut, taken in by drawFrame
+	uint64_t memoryMeshCount = 0; // guarded by spawn_queue_mut, numbers in-memory meshes' keys
+	// Under spawn_mut
+	std::vector<PendingSpawn> pendingSpawns;
+	std::unordered_set<std::string> loadingMeshes, loadingTextures;
+	Mesh placeholderMesh;
+	GPUTexture2d placeholderTexture;
+	texutils::TextureStreamer textureStreamer;
+	// What was replaced or evicted while recording a frame, destroyed once that frame slot's fence
+	// has signalled again: by then no frame submitted before it can be using them
+	struct DeletionQueue {
+		std::vector<GPUImage> images;
+		std::vector<std::pair<VkDescriptorPool, VkDescriptorSet>> dSets;
+		std::vector<GeometryRange> ranges;
+		std::vector<GPUBuffer> buffers;
+	};
+	std::vector<DeletionQueue> deletionQueues; // per frame in flight
+	uint64_t frameNumber = 0;
+	bool assetsReleased = false; // some mesh or texture's refs dropped to 0 since the last eviction
+	// What the next submit waits on the loader's upload semaphore for, 0: nothing new in it.
+	// acquiring: the frame's acquireCmdBuffer has ownership acquires recorded and goes first.
+	uint64_t uploadWait = 0;
+	bool acquiring = false;
+
 	void getVkInstance();
 	void createSurface();
 	void getVkLogicalDevice();
@@ -106,6 +179,11 @@ private:
 	void addDsetLayout(std::string name, uint32_t binding, VkDescriptorType dType, uint32_t dCount, VkShaderStageFlags stageFlag);
 	void makeBasicDSetLayouts();
 	void makeBasicDSets();
+	// frame's "object" set buffer and lodDraws, for objectCapacity objects
+	void makeObjectBuffers(GPUFrameData& frame);
+	// Makes every frame's object buffers bigger once objectCount is past objectCapacity; the
+	// command buffers need recording again when it did
+	bool growObjectBuffers(size_t objectCount);
 	void addSimplePipeline(
 		std::string name,
 		VkRenderPass rPass,
@@ -129,13 +207,41 @@ private:
 
 	void initVulkan();
 	void recreateSwapChain();
-	void updateUBOs(uint32_t curr_img);
+	void updateUBOs(uint32_t frameNo);
+	// Picks each object's LOD for the final pass and every point light's shadow passes, again
+	// only for the passes whose view changed and the objects in movedObjects
+	void updateLodDraws(uint32_t frameNo);
+	std::vector<size_t> movedObjects; // by updateUBOs, the objects whose data it wrote
+	VkDeviceSize lodDrawOffset(size_t pass, size_t ro_idx);
 	void drawFrame();
 	void mainLoop();
 
+	void addSampler(std::string name, VkFilter filter, VkSamplerMipmapMode mipmapMode, VkSamplerAddressMode addressMode, bool anisotropy, float maxLod);
 	void createBasicSamplers();
-	Mesh* addMesh(std::string meshFilePath);
-	GPUTexture2d* loadTexture(std::string texturePath, std::string texSamplerType);
+	void makePlaceholderAssets();
+	std::shared_future<bool> queueSpawn(PendingSpawn spawn);
+	// Starts loads for new spawns and moves the ones whose assets are resident into renderObjects
+	void updatePendingSpawns();
+	// Makes the next submit wait for the asset's upload and take it over from the transfer family
+	void acquireAsset(const LoadedAsset& asset);
+	// True when it replaced the levels of a resident texture, which the command buffers still use
+	bool addLoadedAsset(LoadedAsset& asset);
+	// A render object holds a ref on its mesh and texture unless they're the placeholders
+	void retainAssets(const RenderObject& robj);
+	void releaseAssets(const RenderObject& robj);
+	// Frees unreferenced in-memory meshes, and the least recently used unreferenced meshes and
+	// textures past assetCacheBudget
+	void evictUnusedAssets();
+	void evictMesh(std::string key);
+	void evictTexture(std::string path);
+	void flushDeletions(DeletionQueue& queue);
+	// Gives tex a set for its image from a texture pool with room, making a new pool if none has
+	void makeTextureDSet(GPUTexture2d& tex, std::string samplerType);
+	void retireTextureDSet(GPUTexture2d& tex);
+	// The resident texture at path with the given sampler, nullptr while it isn't resident
+	GPUTexture2d* getTexture(std::string path, std::string samplerType);
+	// Tells the streamer what the drawn objects need and requests the levels it asks for
+	void updateTextureStreaming();
 
 	void cleanupSwapChain(bool destroy_only_swapchain);
 	void cleanup();
@@ -0,0 +1,161 @@
+#include "StagingRing.h"
+
+#include <stdexcept>
+#include <algorithm>
+
+static VkDeviceSize align_up(VkDeviceSize off, VkDeviceSize alignment)
+{
+	return (off + alignment - 1) / alignment * alignment;
+}
+
+vkutils::StagingRing::~StagingRing()
+{
+	destroy();
+}
+
+void vkutils::StagingRing::create(VkDevice device, VkPhysicalDevice physicalDevice, VkDeviceSize capacity)
+{
+	destroy();
+	this->device = device;
+	this->physicalDevice = physicalDevice;
+	this->capacity = capacity;
+
+	// Every region can be the source of a buffer to image copy, whatever the format
+	VkPhysicalDeviceProperties properties{};
+	vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+	alignment = std::max<VkDeviceSize>(16, properties.limits.optimalBufferCopyOffsetAlignment);
+
+	ring = vkutils::createBuffer(
+		device,
+		physicalDevice,
+		capacity,
+		VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
+	);
+	// Host visible memory comes mapped
+	mapped = ring._allocation._mapped;
+
+	std::lock_guard<std::mutex> lk(mut);
+	live.clear();
+	head = tail = 0;
+	aborted = false;
+	stats = StagingStats();
+	stats.capacity = capacity;
+}
+
+void vkutils::StagingRing::destroy()
+{
+	if (ring._buffer == VK_NULL_HANDLE) return;
+	vkutils::destroyBuffer(device, ring);
+	ring = {};
+	mapped = nullptr;
+	capacity = 0;
+}
+
+bool vkutils::StagingRing::fits(VkDeviceSize size, VkDeviceSize& begin) const
+{
+	if (live.empty()) {
+		begin = 0;
+		return size <= capacity;
+	}
+	VkDeviceSize at = align_up(head, alignment);
+	if (head > tail) {
+		// Used: [tail, head). After head, else wrap around to the start
+		if (at + size <= capacity) {
+			begin = at;
+			return true;
+		}
+		begin = 0;
+		return size <= tail;
+	}
+	// Wrapped, used: [tail, capacity) and [0, head); head == tail is full
+	begin = at;
+	return head != tail && at + size <= tail;
+}
+
+vkutils::StagingRegion vkutils::StagingRing::alloc(VkDeviceSize size)
+{
+	size = std::max<VkDeviceSize>(size, 1);
+	StagingRegion region;
+	region.size = size;
+	if (size > capacity) {
+		// Rare enough that a buffer of its own beats holding everything else up for it
+		region.dedicated = vkutils::createBuffer(
+			device,
+			physicalDevice,
+			size,
+			VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
+		);
+		region.buffer = region.dedicated._buffer;
+		region.data = region.dedicated._allocation._mapped;
+		std::lock_guard<std::mutex> lk(mut);
+		region.id = next_id++;
+		stats.allocations++;
+		stats.dedicated++;
+		stats.bytes += size;
+		return region;
+	}
+
+	std::unique_lock<std::mutex> lk(mut);
+	VkDeviceSize begin = 0;
+	if (!aborted && !fits(size, begin)) {
+		stats.waits++;
+		space_cv.wait(lk, [&] { return aborted || fits(size, begin); });
+	}
+	if (aborted) throw std::runtime_error("failed to stage upload, the loader is stopping!");
+
+	region.id = next_id++;
+	region.buffer = ring._buffer;
+	region.offset = begin;
+	region.data = mapped + begin;
+	live.push_back({ region.id, begin });
+	if (live.size() == 1) tail = begin;
+	head = begin + size;
+	stats.allocations++;
+	stats.bytes += size;
+	return region;
+}
+
+void vkutils::StagingRing::release(StagingRegion& region)
+{
+	if (region.id == 0) return;
+	if (region.dedicated._buffer != VK_NULL_HANDLE) {
+		vkutils::destroyBuffer(device, region.dedicated);
+		region = StagingRegion();
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lk(mut);
+		for (Allocation& a : live) {
+			if (a.id == region.id) {
+				a.released = true;
+				break;
+			}
+		}
+		while (!live.empty() && live.front().released) live.pop_front();
+		if (live.empty()) head = tail = 0;
+		else tail = live.front().begin;
+	}
+	space_cv.notify_all();
+	region = StagingRegion();
+}
+
+void vkutils::StagingRing::abort()
+{
+	{
+		std::lock_guard<std::mutex> lk(mut);
+		aborted = true;
+	}
+	space_cv.notify_all();
+}
+
+vkutils::StagingStats vkutils::StagingRing::get_stats() const
+{
+	std::lock_guard<std::mutex> lk(mut);
+	StagingStats s = stats;
+	if (live.empty()) s.in_use = 0;
+	else if (head > tail) s.in_use = head - tail;
+	else s.in_use = capacity - tail + head;
+	return s;
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include "vkutils.h"
+
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+namespace vkutils {
+
+	// Part of the ring, or a buffer of its own when it's bigger than the whole ring
+	struct StagingRegion
+	{
+		VkBuffer buffer = VK_NULL_HANDLE;
+		VkDeviceSize offset = 0; // into buffer
+		VkDeviceSize size = 0;
+		uint8_t* data = nullptr; // mapped, write only
+		uint64_t id = 0; // 0: nothing allocated
+		GPUBuffer dedicated;
+	};
+
+	struct StagingStats
+	{
+		VkDeviceSize capacity = 0;
+		VkDeviceSize in_use = 0; // from the oldest unreleased region to the newest, wasted wrap space included
+		uint64_t allocations = 0;
+		uint64_t dedicated = 0; // didn't fit the ring
+		uint64_t waits = 0; // allocations that had to wait for space
+		VkDeviceSize bytes = 0;
+	};
+
+	// One persistently mapped host visible buffer every upload stages through, so staging costs a
+	// memcpy rather than a buffer, an allocation and a map. Regions go out in ring order and come
+	// back with release() once the submit reading them has signalled its fence; one released early
+	// is only reused after the ones allocated before it. Any thread.
+	class StagingRing
+	{
+	public:
+		~StagingRing();
+		void create(VkDevice device, VkPhysicalDevice physicalDevice, VkDeviceSize capacity);
+		void destroy();
+
+		// Aligned for buffer to image copies. Blocks while the ring is full, so a caller must not hold
+		// another unreleased region while asking for one; throws once abort() has been called.
+		StagingRegion alloc(VkDeviceSize size);
+		void release(StagingRegion& region);
+		// Fails the allocations waiting for space and any after, for shutting down
+		void abort();
+		StagingStats get_stats() const;
+	private:
+		struct Allocation {
+			uint64_t id;
+			VkDeviceSize begin;
+			bool released = false;
+		};
+
+		VkDevice device = VK_NULL_HANDLE;
+		VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+		GPUBuffer ring;
+		uint8_t* mapped = nullptr;
+		VkDeviceSize capacity = 0;
+		VkDeviceSize alignment = 16;
+
+		mutable std::mutex mut;
+		std::condition_variable space_cv;
+		// Guarded by mut. head: where the next region goes, tail: start of the oldest live one
+		std::deque<Allocation> live;
+		VkDeviceSize head = 0, tail = 0;
+		uint64_t next_id = 1;
+		bool aborted = false;
+		StagingStats stats;
+
+		bool fits(VkDeviceSize size, VkDeviceSize& begin) const;
+	};
+}
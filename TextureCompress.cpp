@@ -0,0 +1,348 @@
+#include "TextureCompress.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cfloat>
+#include <cstring>
+
+uint32_t texutils::block_bytes(BlockFormat format)
+{
+	return (format == BlockFormat::BC1) ? 8 : 16;
+}
+
+static float srgb_to_linear(float c)
+{
+	return (c <= 0.04045f) ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+}
+
+static uint8_t linear_to_srgb(float c)
+{
+	c = std::clamp(c, 0.0f, 1.0f);
+	float s = (c <= 0.0031308f) ? c * 12.92f : 1.055f * std::pow(c, 1.0f / 2.4f) - 0.055f;
+	return uint8_t(s * 255.0f + 0.5f);
+}
+
+std::vector<std::vector<uint8_t>> texutils::build_mip_chain(const uint8_t* rgba, uint32_t width, uint32_t height)
+{
+	float to_linear[256];
+	for (int i = 0; i < 256; i++) to_linear[i] = srgb_to_linear(i / 255.0f);
+
+	std::vector<std::vector<uint8_t>> levels;
+	levels.emplace_back(rgba, rgba + size_t(width) * height * 4);
+	while (width > 1 || height > 1) {
+		uint32_t w = std::max(1u, width / 2), h = std::max(1u, height / 2);
+		const std::vector<uint8_t>& src = levels.back();
+		std::vector<uint8_t> dst(size_t(w) * h * 4);
+		// 2x2 box, an odd last row/column is folded into the texel before it
+		for (uint32_t y = 0; y < h; y++) {
+			uint32_t y0 = std::min(y * 2, height - 1), y1 = std::min(y * 2 + 1, height - 1);
+			for (uint32_t x = 0; x < w; x++) {
+				uint32_t x0 = std::min(x * 2, width - 1), x1 = std::min(x * 2 + 1, width - 1);
+				const uint8_t* p[4] = {
+					&src[(size_t(y0) * width + x0) * 4], &src[(size_t(y0) * width + x1) * 4],
+					&src[(size_t(y1) * width + x0) * 4], &src[(size_t(y1) * width + x1) * 4]
+				};
+				uint8_t* out = &dst[(size_t(y) * w + x) * 4];
+				for (int c = 0; c < 3; c++) {
+					out[c] = linear_to_srgb(0.25f * (to_linear[p[0][c]] + to_linear[p[1][c]] + to_linear[p[2][c]] + to_linear[p[3][c]]));
+				}
+				out[3] = uint8_t((p[0][3] + p[1][3] + p[2][3] + p[3][3] + 2) / 4);
+			}
+		}
+		levels.push_back(std::move(dst));
+		width = w;
+		height = h;
+	}
+	return levels;
+}
+
+// Mean and principal axis (power iteration on the covariance) of the block's first n channels
+static void principal_axis(const float (*px)[4], int n, float* mean, float* axis)
+{
+	float cov[4][4] = {};
+	for (int c = 0; c < n; c++) {
+		mean[c] = 0;
+		for (int i = 0; i < 16; i++) mean[c] += px[i][c];
+		mean[c] /= 16.0f;
+	}
+	for (int i = 0; i < 16; i++)
+		for (int a = 0; a < n; a++)
+			for (int b = 0; b < n; b++) cov[a][b] += (px[i][a] - mean[a]) * (px[i][b] - mean[b]);
+
+	// Start along the largest spread, so a block that varies in one channel converges at once
+	int widest = 0;
+	for (int c = 1; c < n; c++) if (cov[c][c] > cov[widest][widest]) widest = c;
+	for (int c = 0; c < n; c++) axis[c] = (c == widest) ? 1.0f : 0.25f;
+	for (int it = 0; it < 8; it++) {
+		float next[4] = {};
+		for (int a = 0; a < n; a++)
+			for (int b = 0; b < n; b++) next[a] += cov[a][b] * axis[b];
+		float len = 0;
+		for (int c = 0; c < n; c++) len += next[c] * next[c];
+		if (len < 1e-12f) break;
+		len = std::sqrt(len);
+		for (int c = 0; c < n; c++) axis[c] = next[c] / len;
+	}
+}
+
+// Least squares endpoints for fixed per-texel weights (0 = lo, 1 = hi); false if they're degenerate
+static bool fit_endpoints(const float (*px)[4], int n, const float* weight, float* lo, float* hi)
+{
+	float aa = 0, ab = 0, bb = 0;
+	float ax[4] = {}, bx[4] = {};
+	for (int i = 0; i < 16; i++) {
+		float b = weight[i], a = 1.0f - b;
+		aa += a * a;
+		ab += a * b;
+		bb += b * b;
+		for (int c = 0; c < n; c++) {
+			ax[c] += a * px[i][c];
+			bx[c] += b * px[i][c];
+		}
+	}
+	float det = aa * bb - ab * ab;
+	if (std::abs(det) < 1e-6f) return false;
+	for (int c = 0; c < n; c++) {
+		lo[c] = std::clamp((bb * ax[c] - ab * bx[c]) / det, 0.0f, 255.0f);
+		hi[c] = std::clamp((aa * bx[c] - ab * ax[c]) / det, 0.0f, 255.0f);
+	}
+	return true;
+}
+
+static uint16_t pack_565(const float* c)
+{
+	int r = int(c[0] * 31.0f / 255.0f + 0.5f), g = int(c[1] * 63.0f / 255.0f + 0.5f), b = int(c[2] * 31.0f / 255.0f + 0.5f);
+	return uint16_t((r << 11) | (g << 5) | b);
+}
+
+static void unpack_565(uint16_t v, float* c)
+{
+	int r = (v >> 11) & 31, g = (v >> 5) & 63, b = v & 31;
+	c[0] = float((r << 3) | (r >> 2));
+	c[1] = float((g << 2) | (g >> 4));
+	c[2] = float((b << 3) | (b >> 2));
+}
+
+// Indices for two 565 endpoints in four color mode (c0 > c1), returns the squared error
+static float bc1_indices(const float (*px)[4], uint16_t c0, uint16_t c1, uint8_t* idx)
+{
+	float pal[4][3];
+	unpack_565(c0, pal[0]);
+	unpack_565(c1, pal[1]);
+	for (int c = 0; c < 3; c++) {
+		pal[2][c] = (2 * pal[0][c] + pal[1][c]) / 3.0f;
+		pal[3][c] = (pal[0][c] + 2 * pal[1][c]) / 3.0f;
+	}
+	float total = 0;
+	for (int i = 0; i < 16; i++) {
+		float best = FLT_MAX;
+		for (int p = 0; p < 4; p++) {
+			float d = 0;
+			for (int c = 0; c < 3; c++) d += (px[i][c] - pal[p][c]) * (px[i][c] - pal[p][c]);
+			if (d < best) {
+				best = d;
+				idx[i] = p;
+			}
+		}
+		total += best;
+	}
+	return total;
+}
+
+void texutils::encode_bc1_block(const uint8_t* rgba, uint8_t* out)
+{
+	float px[16][4];
+	for (int i = 0; i < 16; i++)
+		for (int c = 0; c < 4; c++) px[i][c] = rgba[i * 4 + c];
+
+	float mean[4], axis[4];
+	principal_axis(px, 3, mean, axis);
+	float tmin = FLT_MAX, tmax = -FLT_MAX;
+	for (int i = 0; i < 16; i++) {
+		float t = 0;
+		for (int c = 0; c < 3; c++) t += (px[i][c] - mean[c]) * axis[c];
+		tmin = std::min(tmin, t);
+		tmax = std::max(tmax, t);
+	}
+	float hi[4], lo[4];
+	for (int c = 0; c < 3; c++) {
+		hi[c] = std::clamp(mean[c] + axis[c] * tmax, 0.0f, 255.0f);
+		lo[c] = std::clamp(mean[c] + axis[c] * tmin, 0.0f, 255.0f);
+	}
+
+	uint16_t best0 = 0, best1 = 0;
+	uint8_t best_idx[16] = {};
+	float best_err = FLT_MAX;
+	for (int it = 0; it < 3; it++) {
+		uint16_t c0 = pack_565(hi), c1 = pack_565(lo);
+		if (c0 < c1) std::swap(c0, c1);
+		uint8_t idx[16] = {};
+		// Equal endpoints mean three color mode, where index 0 still is c0
+		float err = (c0 == c1) ? bc1_indices(px, c0, c0, idx) : bc1_indices(px, c0, c1, idx);
+		if (c0 == c1) std::fill(idx, idx + 16, 0);
+		if (err < best_err) {
+			best_err = err;
+			best0 = c0;
+			best1 = c1;
+			std::copy(idx, idx + 16, best_idx);
+		}
+		if (c0 == c1) break;
+
+		const float to_weight[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+		float weight[16];
+		for (int i = 0; i < 16; i++) weight[i] = to_weight[idx[i]];
+		if (!fit_endpoints(px, 3, weight, lo, hi)) break;
+	}
+
+	uint32_t bits = 0;
+	for (int i = 0; i < 16; i++) bits |= uint32_t(best_idx[i]) << (i * 2);
+	out[0] = best0 & 0xff;
+	out[1] = best0 >> 8;
+	out[2] = best1 & 0xff;
+	out[3] = best1 >> 8;
+	memcpy(out + 4, &bits, 4);
+}
+
+static const int BC7_WEIGHTS4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+// Mode 6 endpoint: 7 bits per channel plus a p-bit shared by the channels, 8 bits once expanded
+static void quantize_bc7(const float* c, int pbit, uint8_t* q)
+{
+	for (int ch = 0; ch < 4; ch++) q[ch] = uint8_t(std::clamp(int(std::floor((c[ch] - pbit) / 2.0f + 0.5f)), 0, 127));
+}
+
+static float bc7_indices(const float (*px)[4], const uint8_t* q0, const uint8_t* q1, int p0, int p1, uint8_t* idx)
+{
+	int e0[4], e1[4];
+	for (int c = 0; c < 4; c++) {
+		e0[c] = (q0[c] << 1) | p0;
+		e1[c] = (q1[c] << 1) | p1;
+	}
+	float pal[16][4];
+	for (int w = 0; w < 16; w++)
+		for (int c = 0; c < 4; c++) pal[w][c] = float(((64 - BC7_WEIGHTS4[w]) * e0[c] + BC7_WEIGHTS4[w] * e1[c] + 32) >> 6);
+
+	float d[4], dd = 0;
+	for (int c = 0; c < 4; c++) {
+		d[c] = float(e1[c] - e0[c]);
+		dd += d[c] * d[c];
+	}
+	float total = 0;
+	for (int i = 0; i < 16; i++) {
+		// Projection gets within one step of the nearest palette entry, the neighbours settle it
+		int guess = 0;
+		if (dd > 0) {
+			float t = 0;
+			for (int c = 0; c < 4; c++) t += (px[i][c] - e0[c]) * d[c];
+			guess = std::clamp(int(t / dd * 15.0f + 0.5f), 0, 15);
+		}
+		float best = FLT_MAX;
+		for (int w = std::max(0, guess - 1); w <= std::min(15, guess + 1); w++) {
+			float e = 0;
+			for (int c = 0; c < 4; c++) e += (px[i][c] - pal[w][c]) * (px[i][c] - pal[w][c]);
+			if (e < best) {
+				best = e;
+				idx[i] = w;
+			}
+		}
+		total += best;
+	}
+	return total;
+}
+
+void texutils::encode_bc7_block(const uint8_t* rgba, uint8_t* out)
+{
+	float px[16][4];
+	for (int i = 0; i < 16; i++)
+		for (int c = 0; c < 4; c++) px[i][c] = rgba[i * 4 + c];
+
+	float mean[4], axis[4];
+	principal_axis(px, 4, mean, axis);
+	float tmin = FLT_MAX, tmax = -FLT_MAX;
+	for (int i = 0; i < 16; i++) {
+		float t = 0;
+		for (int c = 0; c < 4; c++) t += (px[i][c] - mean[c]) * axis[c];
+		tmin = std::min(tmin, t);
+		tmax = std::max(tmax, t);
+	}
+	float lo[4], hi[4];
+	for (int c = 0; c < 4; c++) {
+		lo[c] = std::clamp(mean[c] + axis[c] * tmin, 0.0f, 255.0f);
+		hi[c] = std::clamp(mean[c] + axis[c] * tmax, 0.0f, 255.0f);
+	}
+
+	uint8_t best_q0[4] = {}, best_q1[4] = {}, best_idx[16] = {};
+	int best_p0 = 0, best_p1 = 0;
+	float best_err = FLT_MAX;
+	for (int it = 0; it < 3; it++) {
+		uint8_t it_idx[16] = {};
+		float it_err = FLT_MAX;
+		for (int p = 0; p < 4; p++) {
+			int p0 = p & 1, p1 = p >> 1;
+			uint8_t q0[4], q1[4], idx[16];
+			quantize_bc7(lo, p0, q0);
+			quantize_bc7(hi, p1, q1);
+			float err = bc7_indices(px, q0, q1, p0, p1, idx);
+			if (err < it_err) {
+				it_err = err;
+				std::copy(idx, idx + 16, it_idx);
+			}
+			if (err < best_err) {
+				best_err = err;
+				best_p0 = p0;
+				best_p1 = p1;
+				std::copy(q0, q0 + 4, best_q0);
+				std::copy(q1, q1 + 4, best_q1);
+				std::copy(idx, idx + 16, best_idx);
+			}
+		}
+		if (best_err == 0) break;
+		float weight[16];
+		for (int i = 0; i < 16; i++) weight[i] = BC7_WEIGHTS4[it_idx[i]] / 64.0f;
+		if (!fit_endpoints(px, 4, weight, lo, hi)) break;
+	}
+
+	// The first index is stored without its top bit, so it has to be in the lower half
+	if (best_idx[0] & 8) {
+		std::swap(best_q0, best_q1);
+		std::swap(best_p0, best_p1);
+		for (int i = 0; i < 16; i++) best_idx[i] = 15 - best_idx[i];
+	}
+
+	uint64_t lo_bits = 1ull << 6; // mode 6
+	int pos = 7;
+	for (int c = 0; c < 4; c++) {
+		lo_bits |= uint64_t(best_q0[c]) << pos;
+		lo_bits |= uint64_t(best_q1[c]) << (pos + 7);
+		pos += 14;
+	}
+	lo_bits |= uint64_t(best_p0) << 63;
+	uint64_t hi_bits = uint64_t(best_p1);
+	hi_bits |= uint64_t(best_idx[0]) << 1;
+	for (int i = 1; i < 16; i++) hi_bits |= uint64_t(best_idx[i]) << (4 + (i - 1) * 4);
+	memcpy(out, &lo_bits, 8);
+	memcpy(out + 8, &hi_bits, 8);
+}
+
+std::vector<uint8_t> texutils::encode_image(const uint8_t* rgba, uint32_t width, uint32_t height, BlockFormat format)
+{
+	uint32_t bw = (width + 3) / 4, bh = (height + 3) / 4;
+	uint32_t bytes = block_bytes(format);
+	std::vector<uint8_t> out(size_t(bw) * bh * bytes);
+	uint8_t block[64];
+	for (uint32_t by = 0; by < bh; by++) {
+		for (uint32_t bx = 0; bx < bw; bx++) {
+			for (uint32_t y = 0; y < 4; y++) {
+				uint32_t sy = std::min(by * 4 + y, height - 1);
+				for (uint32_t x = 0; x < 4; x++) {
+					uint32_t sx = std::min(bx * 4 + x, width - 1);
+					memcpy(&block[(y * 4 + x) * 4], &rgba[(size_t(sy) * width + sx) * 4], 4);
+				}
+			}
+			uint8_t* dst = &out[(size_t(by) * bw + bx) * bytes];
+			if (format == BlockFormat::BC1) encode_bc1_block(block, dst);
+			else encode_bc7_block(block, dst);
+		}
+	}
+	return out;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+namespace texutils {
+
+	// BC1 (opaque, 8 bytes per 4x4 block) or BC7 mode 6 (RGBA, 16 bytes per block)
+	enum class BlockFormat { BC1, BC7 };
+
+	uint32_t block_bytes(BlockFormat format);
+	// Full chain down to 1x1, level 0 included. RGBA8 sRGB in and out, averaged in linear space.
+	std::vector<std::vector<uint8_t>> build_mip_chain(const uint8_t* rgba, uint32_t width, uint32_t height);
+
+	// rgba holds the 4x4 block's texels row by row
+	void encode_bc1_block(const uint8_t* rgba, uint8_t* out);
+	void encode_bc7_block(const uint8_t* rgba, uint8_t* out);
+	// Whole image, edge texels repeated to fill partial blocks
+	std::vector<uint8_t> encode_image(const uint8_t* rgba, uint32_t width, uint32_t height, BlockFormat format);
+}
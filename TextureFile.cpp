@@ -0,0 +1,236 @@
+#include "TextureFile.h"
+#include "MeshFile.h"
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <filesystem>
+#include <algorithm>
+
+#include <stb_image.h>
+
+static const uint8_t KTX2_IDENTIFIER[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+static const char* SOURCE_KEY = "PrismSource";
+
+static uint64_t path_hash(std::string src_path)
+{
+	// FNV-1a, as for cooked meshes
+	std::string norm = std::filesystem::path(src_path).lexically_normal().generic_string();
+	uint64_t h = 14695981039346656037ull;
+	for (unsigned char c : norm) {
+		h ^= c;
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+static uint64_t align_to(uint64_t off, uint64_t alignment)
+{
+	return (off + alignment - 1) / alignment * alignment;
+}
+
+std::string texutils::cache_path_for(std::string src_path)
+{
+	return src_path + ".ktx2";
+}
+
+VkFormat texutils::vk_format(BlockFormat format)
+{
+	return (format == BlockFormat::BC1) ? VK_FORMAT_BC1_RGB_SRGB_BLOCK : VK_FORMAT_BC7_SRGB_BLOCK;
+}
+
+uint64_t texutils::level_bytes(VkFormat format, uint32_t width, uint32_t height, uint32_t level)
+{
+	uint64_t w = std::max(1u, width >> level), h = std::max(1u, height >> level);
+	if (format == VK_FORMAT_BC1_RGB_SRGB_BLOCK) return ((w + 3) / 4) * ((h + 3) / 4) * 8;
+	if (format == VK_FORMAT_BC7_SRGB_BLOCK) return ((w + 3) / 4) * ((h + 3) / 4) * 16;
+	return w * h * 4;
+}
+
+// Basic data format descriptor (Khronos DFD 1.3) of a 4x4 block format with one color sample
+static std::vector<uint32_t> block_dfd(texutils::BlockFormat format)
+{
+	bool bc1 = format == texutils::BlockFormat::BC1;
+	uint32_t color_model = bc1 ? 128 : 135; // KHR_DF_MODEL_BC1A, KHR_DF_MODEL_BC7
+	uint32_t block = texutils::block_bytes(format);
+	std::vector<uint32_t> dfd;
+	dfd.push_back(4 + 24 + 16); // dfdTotalSize
+	dfd.push_back(0); // vendor 0 (Khronos), descriptor type 0 (basic)
+	dfd.push_back(2 | ((24 + 16) << 16)); // version 1.3, block size
+	dfd.push_back(color_model | (1 << 8) | (2 << 16)); // BT.709 primaries, sRGB transfer, straight alpha
+	dfd.push_back(3 | (3 << 8)); // 4x4x1x1 texels per block
+	dfd.push_back(block); // bytes in plane 0
+	dfd.push_back(0);
+	// The one sample covers the whole block
+	dfd.push_back(0 | ((block * 8 - 1) << 16));
+	dfd.push_back(0);
+	dfd.push_back(0);
+	dfd.push_back(UINT32_MAX);
+	return dfd;
+}
+
+static void add_kv_entry(std::vector<uint8_t>& kvd, const char* key, const void* value, uint32_t value_size)
+{
+	uint32_t len = strlen(key) + 1 + value_size;
+	size_t at = kvd.size();
+	kvd.resize(at + 4 + align_to(len, 4));
+	memcpy(&kvd[at], &len, 4);
+	memcpy(&kvd[at + 4], key, strlen(key) + 1);
+	memcpy(&kvd[at + 4 + strlen(key) + 1], value, value_size);
+}
+
+bool texutils::write_texture_bin(std::string cache_path, std::string src_path, const std::vector<std::vector<uint8_t>>& levels,
+	uint32_t width, uint32_t height, BlockFormat format, int64_t src_stamp, uint64_t src_hash)
+{
+	Ktx2Header hdr = {};
+	memcpy(hdr.identifier, KTX2_IDENTIFIER, 12);
+	hdr.vkFormat = vk_format(format);
+	hdr.typeSize = 1;
+	hdr.pixelWidth = width;
+	hdr.pixelHeight = height;
+	hdr.faceCount = 1;
+	hdr.levelCount = levels.size();
+
+	std::vector<uint32_t> dfd = block_dfd(format);
+	// Keys go in byte order
+	std::vector<uint8_t> kvd;
+	const char writer[] = "PrismEngine";
+	add_kv_entry(kvd, "KTXwriter", writer, sizeof(writer));
+	TexSourceInfo info = {};
+	info.version = TEX_BIN_VERSION;
+	info.src_stamp = src_stamp;
+	info.src_hash = src_hash;
+	info.path_hash = path_hash(src_path);
+	add_kv_entry(kvd, SOURCE_KEY, &info, sizeof(info));
+
+	uint64_t off = sizeof(Ktx2Header) + levels.size() * sizeof(Ktx2Level);
+	hdr.dfdByteOffset = off;
+	hdr.dfdByteLength = dfd.size() * 4;
+	off += hdr.dfdByteLength;
+	hdr.kvdByteOffset = off;
+	hdr.kvdByteLength = kvd.size();
+	off += kvd.size();
+
+	// Level data goes coarsest first, each on a block boundary
+	std::vector<Ktx2Level> index(levels.size());
+	for (size_t l = levels.size(); l-- > 0;) {
+		off = align_to(off, block_bytes(format));
+		index[l].byteOffset = off;
+		index[l].byteLength = levels[l].size();
+		index[l].uncompressedByteLength = levels[l].size();
+		off += levels[l].size();
+	}
+
+	// Same temp file and swap as cooked meshes
+	std::string tmp_path = cache_path + ".tmp";
+	{
+		std::ofstream fw(tmp_path, std::ios::binary | std::ios::trunc);
+		if (!fw.is_open()) return false;
+		fw.write((const char*)&hdr, sizeof(hdr));
+		fw.write((const char*)index.data(), index.size() * sizeof(Ktx2Level));
+		fw.write((const char*)dfd.data(), dfd.size() * 4);
+		fw.write((const char*)kvd.data(), kvd.size());
+		static const char zeros[16] = {};
+		for (size_t l = levels.size(); l-- > 0;) {
+			fw.write(zeros, index[l].byteOffset - uint64_t(fw.tellp()));
+			fw.write((const char*)levels[l].data(), levels[l].size());
+		}
+		if (!fw.good()) return false;
+	}
+	std::error_code ec;
+	std::filesystem::rename(tmp_path, cache_path, ec);
+	return !ec;
+}
+
+bool texutils::CookedTexture::open(std::string cache_path, std::string src_path)
+{
+	close();
+	std::unique_ptr<MappedFile> mf = std::make_unique<MappedFile>(cache_path);
+	if (!mf->valid() || mf->size() < sizeof(Ktx2Header)) return false;
+
+	const Ktx2Header* hdr = (const Ktx2Header*)mf->data();
+	if (memcmp(hdr->identifier, KTX2_IDENTIFIER, 12) != 0) return false;
+	uint32_t block;
+	if (hdr->vkFormat == VK_FORMAT_BC1_RGB_SRGB_BLOCK) block = 8;
+	else if (hdr->vkFormat == VK_FORMAT_BC7_SRGB_BLOCK) block = 16;
+	else return false;
+	VkFormat format = (VkFormat)hdr->vkFormat;
+	if (hdr->typeSize != 1 || hdr->pixelDepth != 0 || hdr->layerCount != 0 || hdr->faceCount != 1 || hdr->supercompressionScheme != 0) return false;
+	if (hdr->pixelWidth == 0 || hdr->pixelHeight == 0 || hdr->levelCount == 0) return false;
+	uint32_t max_levels = 1;
+	while ((std::max(hdr->pixelWidth, hdr->pixelHeight) >> max_levels) > 0) max_levels++;
+	if (hdr->levelCount > max_levels) return false;
+	if (sizeof(Ktx2Header) + uint64_t(hdr->levelCount) * sizeof(Ktx2Level) > mf->size()) return false;
+
+	const Ktx2Level* levels = (const Ktx2Level*)(mf->data() + sizeof(Ktx2Header));
+	for (uint32_t l = 0; l < hdr->levelCount; l++) {
+		if (levels[l].byteLength != level_bytes(format, hdr->pixelWidth, hdr->pixelHeight, l)) return false;
+		if (levels[l].byteOffset % block != 0 || levels[l].byteOffset > mf->size() || levels[l].byteLength > mf->size() - levels[l].byteOffset) return false;
+	}
+
+	// Find which source this was cooked from
+	if (hdr->kvdByteOffset > mf->size() || hdr->kvdByteLength > mf->size() - hdr->kvdByteOffset) return false;
+	const uint8_t* kv = mf->data() + hdr->kvdByteOffset;
+	const uint8_t* kv_end = kv + hdr->kvdByteLength;
+	TexSourceInfo info = {};
+	bool found = false;
+	while (kv_end - kv >= 4 && !found) {
+		uint32_t len;
+		memcpy(&len, kv, 4);
+		if (len > uint64_t(kv_end - kv) - 4) return false;
+		size_t key_len = strlen(SOURCE_KEY) + 1;
+		if (len == key_len + sizeof(TexSourceInfo) && memcmp(kv + 4, SOURCE_KEY, key_len) == 0) {
+			memcpy(&info, kv + 4 + key_len, sizeof(info));
+			found = true;
+		}
+		kv += 4 + align_to(len, 4);
+	}
+	if (!found || info.version != TEX_BIN_VERSION || info.path_hash != path_hash(src_path)) return false;
+
+	int64_t stamp = file_stamp(src_path);
+	if (stamp != 0 && stamp != info.src_stamp && meshutils::content_hash(src_path) != info.src_hash) return false;
+
+	_hdr = hdr;
+	_levels = levels;
+	_mf = std::move(mf);
+	return true;
+}
+
+void texutils::CookedTexture::close()
+{
+	_mf.reset();
+	_hdr = nullptr;
+	_levels = nullptr;
+}
+
+void texutils::cook_texture(std::string src_path, std::string cache_path)
+{
+	int texWidth, texHeight, texChannels;
+	stbi_uc* pixels = stbi_load(src_path.c_str(), &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
+	if (!pixels) throw std::runtime_error("failed to load texture image!");
+	std::vector<std::vector<uint8_t>> mips = build_mip_chain(pixels, texWidth, texHeight);
+	stbi_image_free(pixels);
+
+	bool opaque = true;
+	for (size_t i = 3; i < mips[0].size() && opaque; i += 4) opaque = mips[0][i] == 255;
+	BlockFormat format = opaque ? BlockFormat::BC1 : BlockFormat::BC7;
+
+	std::vector<std::vector<uint8_t>> levels;
+	for (size_t l = 0; l < mips.size(); l++) {
+		uint32_t w = std::max(1, texWidth >> l), h = std::max(1, texHeight >> l);
+		levels.push_back(encode_image(mips[l].data(), w, h, format));
+	}
+	if (!write_texture_bin(cache_path, src_path, levels, texWidth, texHeight, format, file_stamp(src_path), meshutils::content_hash(src_path))) {
+		throw std::runtime_error("failed to write cooked texture!");
+	}
+}
+
+void texutils::open_texture(std::string src_path, CookedTexture& tex)
+{
+	std::string cache_path = cache_path_for(src_path);
+	if (tex.open(cache_path, src_path)) return;
+	cook_texture(src_path, cache_path);
+	if (!tex.open(cache_path, src_path)) {
+		throw std::runtime_error("failed to open cooked texture!");
+	}
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include "vkstructs.h"
+#include "MappedFile.h"
+#include "TextureCompress.h"
+
+#include <string>
+#include <memory>
+#include <cstdint>
+
+namespace texutils {
+
+	// Bump whenever what cooking does to a texture changes
+	const uint32_t TEX_BIN_VERSION = 1;
+
+	// Cooked texture (.ktx2, next to its source): a KTX2 file with the block compressed mip chain,
+	// readable by KTX tools. Which source it was cooked from goes in a "PrismSource" key/value entry.
+	struct Ktx2Header
+	{
+		uint8_t identifier[12];
+		uint32_t vkFormat;
+		uint32_t typeSize;
+		uint32_t pixelWidth, pixelHeight, pixelDepth;
+		uint32_t layerCount, faceCount, levelCount;
+		uint32_t supercompressionScheme;
+		uint32_t dfdByteOffset, dfdByteLength;
+		uint32_t kvdByteOffset, kvdByteLength;
+		uint64_t sgdByteOffset, sgdByteLength;
+	};
+
+	// Follows the header, one per level, finest first
+	struct Ktx2Level
+	{
+		uint64_t byteOffset, byteLength, uncompressedByteLength;
+	};
+
+	struct TexSourceInfo
+	{
+		uint32_t version;
+		uint32_t reserved;
+		int64_t src_stamp;
+		uint64_t src_hash;
+		uint64_t path_hash;
+	};
+
+	// An opened .ktx2, read in place from a memory map of the file
+	class CookedTexture
+	{
+	public:
+		// Same rules as meshutils::CookedMesh::open()
+		bool open(std::string cache_path, std::string src_path);
+		void close();
+		bool is_open() const { return _mf != nullptr; }
+
+		uint32_t width() const { return _hdr ? _hdr->pixelWidth : 0; }
+		uint32_t height() const { return _hdr ? _hdr->pixelHeight : 0; }
+		uint32_t level_count() const { return _hdr ? _hdr->levelCount : 0; }
+		VkFormat format() const { return _hdr ? (VkFormat)_hdr->vkFormat : VK_FORMAT_UNDEFINED; }
+		const uint8_t* level_data(uint32_t level) const { return _mf->data() + _levels[level].byteOffset; }
+		uint64_t level_size(uint32_t level) const { return _levels[level].byteLength; }
+	private:
+		std::unique_ptr<MappedFile> _mf;
+		const Ktx2Header* _hdr = nullptr;
+		const Ktx2Level* _levels = nullptr;
+	};
+
+	std::string cache_path_for(std::string src_path);
+	VkFormat vk_format(BlockFormat format);
+	// One level of a BC1/BC7 or R8G8B8A8 image with the given level 0 size
+	uint64_t level_bytes(VkFormat format, uint32_t width, uint32_t height, uint32_t level);
+
+	bool write_texture_bin(std::string cache_path, std::string src_path, const std::vector<std::vector<uint8_t>>& levels,
+		uint32_t width, uint32_t height, BlockFormat format, int64_t src_stamp, uint64_t src_hash);
+
+	// Decodes src_path, builds its mip chain and writes it block compressed: BC1 when every texel
+	// is opaque, BC7 otherwise. Prints the format, size and time it took.
+	void cook_texture(std::string src_path, std::string cache_path);
+	// Opens the cooked texture next to src_path, cooking it first when it's missing or out of date
+	void open_texture(std::string src_path, CookedTexture& tex);
+}
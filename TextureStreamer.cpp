@@ -0,0 +1,149 @@
+#include "TextureStreamer.h"
+
+#include <cmath>
+#include <algorithm>
+
+uint64_t texutils::TextureStreamer::bytes_from(const StreamedTexture& tex, uint32_t first_level) const
+{
+	uint64_t b = 0;
+	for (uint32_t l = first_level; l < tex.level_count; l++) b += level_bytes(tex.format, tex.width, tex.height, l);
+	return b;
+}
+
+uint32_t texutils::TextureStreamer::min_first(const StreamedTexture& tex) const
+{
+	uint32_t first = 0;
+	while (first + 1 < tex.level_count && std::max(tex.width, tex.height) >> first > STREAM_MIN_SIZE) first++;
+	return first;
+}
+
+void texutils::TextureStreamer::set_resident(std::string path, VkFormat format, uint32_t width, uint32_t height, uint32_t level_count, uint32_t first_level, bool streamable)
+{
+	StreamedTexture& tex = textures[path];
+	if (tex.pending) pending--;
+	tex.format = format;
+	tex.width = width;
+	tex.height = height;
+	tex.level_count = std::max(level_count, 1u);
+	tex.resident_first = first_level;
+	tex.target_first = first_level;
+	tex.streamable = streamable;
+	tex.pending = false;
+}
+
+void texutils::TextureStreamer::request_failed(std::string path)
+{
+	auto it = textures.find(path);
+	if (it == textures.end()) return;
+	if (it->second.pending) pending--;
+	it->second.pending = false;
+	it->second.streamable = false;
+}
+
+void texutils::TextureStreamer::remove(std::string path)
+{
+	auto it = textures.find(path);
+	if (it == textures.end()) return;
+	if (it->second.pending) pending--;
+	textures.erase(it);
+}
+
+void texutils::TextureStreamer::begin_frame()
+{
+	for (auto& it : textures) it.second.wanted_first = it.second.level_count;
+}
+
+void texutils::TextureStreamer::want(const std::string& path, float uv_per_pixel)
+{
+	auto it = textures.find(path);
+	if (it == textures.end()) return;
+	StreamedTexture& tex = it->second;
+	// Trilinear filtering reads floor(lod) and the level after it
+	float lod = std::log2(std::max(uv_per_pixel * std::max(tex.width, tex.height), 1e-6f));
+	uint32_t first = (lod <= 0.0f) ? 0 : std::min(uint32_t(lod), tex.level_count - 1);
+	tex.wanted_first = std::min(tex.wanted_first, first);
+}
+
+void texutils::TextureStreamer::update(std::vector<StreamRequest>& requests)
+{
+	uint64_t resident = 0, wanted = 0, fixed = 0;
+	for (auto& it : textures) {
+		StreamedTexture& tex = it.second;
+		resident += bytes_from(tex, tex.resident_first);
+		if (!tex.streamable) {
+			fixed += bytes_from(tex, tex.resident_first);
+			continue;
+		}
+		tex.target_first = std::min(tex.wanted_first, min_first(tex));
+		wanted += bytes_from(tex, tex.target_first);
+	}
+
+	// Over budget: keep dropping the finest level that frees the most, so big textures on screen
+	// lose a level before small ones lose theirs
+	uint64_t total = fixed + wanted;
+	while (total > budget) {
+		StreamedTexture* best = nullptr;
+		uint64_t best_bytes = 0;
+		for (auto& it : textures) {
+			StreamedTexture& tex = it.second;
+			if (!tex.streamable || tex.target_first >= min_first(tex)) continue;
+			uint64_t b = level_bytes(tex.format, tex.width, tex.height, tex.target_first);
+			if (b > best_bytes) {
+				best = &tex;
+				best_bytes = b;
+			}
+		}
+		if (!best) break;
+		best->target_first++;
+		total -= best_bytes;
+	}
+
+	// More detail is loaded as soon as it's wanted, less only past the slack unless the budget
+	// needs the memory back. Those evictions go first, then the textures furthest from their target.
+	struct Candidate {
+		std::string path;
+		StreamedTexture* tex;
+		bool reclaim; // an eviction the budget asks for
+		uint32_t levels; // how far it is from its target
+	};
+	bool over = resident > budget;
+	std::vector<Candidate> candidates;
+	for (auto& it : textures) {
+		StreamedTexture& tex = it.second;
+		if (!tex.streamable || tex.pending) continue;
+		bool cut = tex.target_first > std::min(tex.wanted_first, min_first(tex));
+		if (tex.target_first < tex.resident_first) {
+			candidates.push_back({ it.first, &tex, false, tex.resident_first - tex.target_first });
+		}
+		else if (tex.target_first > tex.resident_first + STREAM_EVICT_SLACK || ((over || cut) && tex.target_first > tex.resident_first)) {
+			candidates.push_back({ it.first, &tex, over || cut, tex.target_first - tex.resident_first });
+		}
+	}
+	std::sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) {
+		if (a.reclaim != b.reclaim) return a.reclaim;
+		return a.levels > b.levels;
+	});
+	for (Candidate& c : candidates) {
+		if (pending >= STREAM_MAX_PENDING) break;
+		if (c.tex->target_first < c.tex->resident_first) stats.upgrades++;
+		else stats.downgrades++;
+		c.tex->pending = true;
+		pending++;
+		requests.push_back({ c.path, c.tex->target_first, std::max(c.tex->width, c.tex->height) >> c.tex->target_first });
+	}
+
+	stats.resident_bytes = resident;
+	stats.wanted_bytes = fixed + wanted;
+	stats.target_bytes = total;
+}
+
+texutils::TextureStreamingStats texutils::TextureStreamer::get_stats() const
+{
+	TextureStreamingStats s = stats;
+	s.textures = textures.size();
+	s.streamed = 0;
+	for (const auto& it : textures) s.streamed += it.second.streamable;
+	s.pending = pending;
+	s.budget = budget;
+	return s;
+}
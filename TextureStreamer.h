@@ -0,0 +1,81 @@
+#pragma once
+#include "TextureFile.h"
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+namespace texutils {
+
+	// Streamed textures never go below the levels up to this size, and spawn with just those
+	const uint32_t STREAM_MIN_SIZE = 128;
+	// Detail is only dropped once it's this many levels finer than needed, so an object moving
+	// back and forth across a threshold doesn't reload its texture each time
+	const uint32_t STREAM_EVICT_SLACK = 1;
+	// Texture loads in flight at once, the rest wait for a later update
+	const uint32_t STREAM_MAX_PENDING = 4;
+	const uint64_t DEFAULT_TEXTURE_BUDGET = 256ull << 20;
+
+	struct TextureStreamingStats
+	{
+		uint32_t textures = 0;
+		uint32_t streamed = 0; // cooked ones, the rest are always fully resident
+		uint32_t pending = 0;
+		uint64_t budget = 0;
+		uint64_t resident_bytes = 0;
+		uint64_t wanted_bytes = 0; // what the objects drawn last update asked for
+		uint64_t target_bytes = 0; // wanted_bytes cut down to the budget
+		uint64_t upgrades = 0;
+		uint64_t downgrades = 0;
+	};
+
+	// Load path again with levels [first_level, level_count)
+	struct StreamRequest
+	{
+		std::string path;
+		uint32_t first_level;
+		uint32_t max_size; // the same for AssetLoader::request_texture()
+	};
+
+	// Decides which mip levels of each texture should be resident, within a VRAM budget. It owns
+	// no GPU objects: the renderer tells it what is resident and what is drawn, and loads the
+	// levels it asks for. Render thread only.
+	class TextureStreamer
+	{
+	public:
+		void set_budget(uint64_t bytes) { budget = bytes; }
+		// path now has levels [first_level, level_count) of its chain resident; a pending request for
+		// it is done. Textures that can't be streamed count against the budget as they are.
+		void set_resident(std::string path, VkFormat format, uint32_t width, uint32_t height, uint32_t level_count, uint32_t first_level, bool streamable);
+		// The last request for path failed, it's left as it is from now on
+		void request_failed(std::string path);
+		// path is no longer resident
+		void remove(std::string path);
+
+		// Once per frame: want() each drawn object's texture, then update()
+		void begin_frame();
+		// uv_per_pixel: how much of the UV range one screen pixel of an object covers
+		void want(const std::string& path, float uv_per_pixel);
+		void update(std::vector<StreamRequest>& requests);
+		TextureStreamingStats get_stats() const;
+	private:
+		struct StreamedTexture {
+			VkFormat format = VK_FORMAT_UNDEFINED;
+			uint32_t width = 0, height = 0;
+			uint32_t level_count = 1;
+			uint32_t resident_first = 0;
+			uint32_t target_first = 0;
+			uint32_t wanted_first = 0; // level_count when nothing drew it this frame
+			bool streamable = false;
+			bool pending = false;
+		};
+
+		std::unordered_map<std::string, StreamedTexture> textures;
+		uint64_t budget = DEFAULT_TEXTURE_BUDGET;
+		uint32_t pending = 0;
+		TextureStreamingStats stats;
+
+		uint64_t bytes_from(const StreamedTexture& tex, uint32_t first_level) const;
+		uint32_t min_first(const StreamedTexture& tex) const;
+	};
+}
@@ -5,6 +5,9 @@
 #include <algorithm>
 #include <thread>
 #include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
 
 #include <GLFW/glfw3.h>
 #define GLFW_EXPOSE_NATIVE_WIN32
@@ -44,7 +47,19 @@ void nextFrameCallBack(float framedeltat, PrismRenderer* renderer) {
     if (appComps.logicmgr != NULL) appComps.logicmgr->pushToRenderer(renderer);
 }
 
-int main() {
+int main(int argc, char** argv) {
+    // --hot-reload: apply edits to the level file while the game runs
+    // --stress-spawn [count]: spawn count extra objects (200000 by default) to stress the renderer
+    bool levelHotReload = false;
+    size_t stressSpawnCount = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--hot-reload") == 0) levelHotReload = true;
+        if (strcmp(argv[i], "--stress-spawn") == 0) {
+            stressSpawnCount = 200000;
+            if (i + 1 < argc && isdigit((unsigned char)argv[i + 1][0])) stressSpawnCount = strtoull(argv[++i], NULL, 10);
+        }
+    }
+
     // Resolution suggestion
     int WIDTH = 1280;
     int HEIGHT = 720;
@@ -63,7 +78,7 @@ int main() {
     PrismAudioManager audman = PrismAudioManager();
     appComps.audman = &audman;
     std::cout << "audio manager init complete" << std::endl;
-    LogicManager logicmgr = LogicManager(&inputmgr, &audman, 1);
+    LogicManager logicmgr = LogicManager(&inputmgr, &audman, 1, levelHotReload, stressSpawnCount);
     appComps.logicmgr = &logicmgr;
     std::cout << "logic manager init complete" << std::endl;
 
@@ -9,25 +9,39 @@ layout(set = 0, binding = 0) uniform GPUCameraData {
 
 struct ObjectData{
 	mat4 model;
+	vec4 posOffset;
+	vec4 posScale;
+	vec4 uvOffsetScale;
 };
 
 layout(std140,set = 1, binding = 0) readonly buffer ObjectBuffer{ ObjectData objects[];} objectBuffer;
 
-layout(location = 0) in vec3 inPosition;
-layout(location = 1) in vec3 inNormal;
-layout(location = 2) in vec3 inColor;
-layout(location = 3) in vec2 inTexCoord;
+// PackedVertex: unorm16 position and texcoord within the mesh bounds, octahedral normal
+layout(location = 0) in vec4 inPackedPosition;
+layout(location = 1) in vec2 inPackedNormal;
+layout(location = 2) in vec2 inPackedTexCoord;
 
 layout(location = 0) out vec3 fragPosition;
 layout(location = 1) out vec3 fragColor;
 layout(location = 2) out vec2 fragTexCoord;
 layout(location = 3) out vec3 fragNormal;
 
+vec3 octDecode(vec2 e) {
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if (n.z < 0.0) n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    return normalize(n);
+}
+
 void main() {
+    ObjectData obj = objectBuffer.objects[gl_BaseInstance];
+    vec3 inPosition = obj.posOffset.xyz + inPackedPosition.xyz * obj.posScale.xyz;
+    vec3 inNormal = octDecode(inPackedNormal);
+    vec2 inTexCoord = obj.uvOffsetScale.xy + inPackedTexCoord * obj.uvOffsetScale.zw;
+
     mat4 transformMatrix = camData.viewproj * objectBuffer.objects[gl_BaseInstance].model;
     gl_Position =  transformMatrix * vec4(inPosition, 1.0);
     fragPosition = (objectBuffer.objects[gl_BaseInstance].model * vec4(inPosition, 1.0)).xyz;
-    fragColor = inColor;
+    fragColor = vec3(1.0);
     fragTexCoord = inTexCoord;
     fragNormal = normalize(vec3(objectBuffer.objects[gl_BaseInstance].model * vec4(inNormal, 0.0)));
 }
\ No newline at end of file
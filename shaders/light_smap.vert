@@ -17,23 +17,26 @@ layout(push_constant) uniform lpconst {
 
 struct ObjectData{
 	mat4 model;
+	vec4 posOffset;
+	vec4 posScale;
+	vec4 uvOffsetScale;
 };
 
 layout(std140,set = 1, binding = 0) readonly buffer ObjectBuffer{
 	ObjectData objects[];
 } objectBuffer;
 
-layout(location = 0) in vec3 inPosition;
-layout(location = 1) in vec3 inNormal;
-layout(location = 2) in vec3 inColor;
-layout(location = 3) in vec2 inTexCoord;
+// PackedVertex, only the position is needed here
+layout(location = 0) in vec4 inPackedPosition;
 
 layout(location = 0) out vec4 fragPos;
 layout(location = 1) out vec4 lightPos;
 
 void main() {
     lightPos = lightBuffer.lights[lightPC.idx.x].pos;
-    fragPos = objectBuffer.objects[gl_BaseInstance].model * vec4(inPosition, 1.0f);
+    ObjectData obj = objectBuffer.objects[gl_BaseInstance];
+    vec3 inPosition = obj.posOffset.xyz + inPackedPosition.xyz * obj.posScale.xyz;
+    fragPos = obj.model * vec4(inPosition, 1.0f);
     vec4 cpos = lightPC.viewproj * lightBuffer.lights[lightPC.idx.x].viewproj * fragPos;
     gl_Position = cpos;
 }
\ No newline at end of file
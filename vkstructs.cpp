@@ -9,17 +9,193 @@
 #include <glm/mat4x4.hpp>
 
 #include <iostream>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+static uint64_t hash_float_bits(uint64_t h, float f)
+{
+	// -0.0 == 0.0, so they have to land on the same hash
+	uint32_t bits;
+	if (f == 0.0f) f = 0.0f;
+	memcpy(&bits, &f, sizeof(bits));
+	h ^= bits;
+	h *= 0x100000001b3ull;
+	return h ^ (h >> 29);
+}
+
+size_t Vertex::hash() const
+{
+	uint64_t h = 0xcbf29ce484222325ull;
+	h = hash_float_bits(h, pos.x); h = hash_float_bits(h, pos.y); h = hash_float_bits(h, pos.z);
+	h = hash_float_bits(h, normal.x); h = hash_float_bits(h, normal.y); h = hash_float_bits(h, normal.z);
+	h = hash_float_bits(h, color.x); h = hash_float_bits(h, color.y); h = hash_float_bits(h, color.z);
+	h = hash_float_bits(h, texCoord.x); h = hash_float_bits(h, texCoord.y);
+	// Final avalanche so the low bits used for the slot index depend on everything
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	return size_t(h);
+}
+
+VertexWelder::VertexWelder(std::vector<Vertex>& out_vertices, size_t expected_count) : _vertices(out_vertices)
+{
+	// At most half full even if nothing welds
+	size_t slot_count = 16;
+	while (slot_count < expected_count * 2) slot_count *= 2;
+	rehash(slot_count);
+	_vertices.reserve(_vertices.size() + expected_count);
+}
+
+void VertexWelder::rehash(size_t slot_count)
+{
+	std::vector<uint32_t> old;
+	old.swap(_slots);
+	_slots.assign(slot_count, 0);
+	_mask = slot_count - 1;
+	for (uint32_t s : old) {
+		if (s == 0) continue;
+		size_t i = _vertices[s - 1].hash() & _mask;
+		while (_slots[i] != 0) i = (i + 1) & _mask;
+		_slots[i] = s;
+	}
+}
+
+uint32_t VertexWelder::weld(const Vertex& v)
+{
+	size_t i = v.hash() & _mask;
+	while (_slots[i] != 0) {
+		if (_vertices[_slots[i] - 1] == v) return _slots[i] - 1;
+		i = (i + 1) & _mask;
+	}
+	uint32_t idx = static_cast<uint32_t>(_vertices.size());
+	_vertices.push_back(v);
+	_slots[i] = idx + 1;
+	if (++_used * 2 > _slots.size()) rehash(_slots.size() * 2);
+	return idx;
+}
+
+static uint16_t quantize_unorm16(float v, float offset, float scale)
+{
+	if (scale <= 0) return 0;
+	float t = std::min(std::max((v - offset) / scale, 0.0f), 1.0f);
+	return uint16_t(t * 65535.0f + 0.5f);
+}
+
+static int16_t quantize_snorm16(float v)
+{
+	float t = std::min(std::max(v, -1.0f), 1.0f);
+	return int16_t(std::round(t * 32767.0f));
+}
+
+static glm::vec2 oct_encode(glm::vec3 n)
+{
+	float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+	if (l1 <= 0) return glm::vec2(0);
+	glm::vec2 p = glm::vec2(n.x, n.y) / l1;
+	if (n.z < 0) {
+		glm::vec2 sgn = glm::vec2(p.x >= 0 ? 1.0f : -1.0f, p.y >= 0 ? 1.0f : -1.0f);
+		p = (glm::vec2(1.0f) - glm::vec2(std::abs(p.y), std::abs(p.x))) * sgn;
+	}
+	return p;
+}
+
+static glm::vec3 oct_decode(glm::vec2 e)
+{
+	glm::vec3 n = glm::vec3(e.x, e.y, 1.0f - std::abs(e.x) - std::abs(e.y));
+	if (n.z < 0) {
+		glm::vec2 sgn = glm::vec2(n.x >= 0 ? 1.0f : -1.0f, n.y >= 0 ? 1.0f : -1.0f);
+		glm::vec2 xy = (glm::vec2(1.0f) - glm::vec2(std::abs(n.y), std::abs(n.x))) * sgn;
+		n.x = xy.x;
+		n.y = xy.y;
+	}
+	return glm::normalize(n);
+}
+
+void pack_vertices(const Vertex* verts, size_t count, std::vector<PackedVertex>& out, VertexDecode& decode)
+{
+	decode = VertexDecode();
+	out.resize(count);
+	if (count == 0) return;
+
+	glm::vec3 pmin = verts[0].pos, pmax = verts[0].pos;
+	glm::vec2 tmin = verts[0].texCoord, tmax = verts[0].texCoord;
+	for (size_t i = 1; i < count; i++) {
+		pmin = glm::min(pmin, verts[i].pos);
+		pmax = glm::max(pmax, verts[i].pos);
+		tmin = glm::min(tmin, verts[i].texCoord);
+		tmax = glm::max(tmax, verts[i].texCoord);
+	}
+	decode.posOffset = glm::vec4(pmin, 0);
+	decode.posScale = glm::vec4(pmax - pmin, 0);
+	decode.uvOffsetScale = glm::vec4(tmin.x, tmin.y, tmax.x - tmin.x, tmax.y - tmin.y);
+
+	for (size_t i = 0; i < count; i++) {
+		const Vertex& v = verts[i];
+		PackedVertex& pv = out[i];
+		for (int c = 0; c < 3; c++) pv.pos[c] = quantize_unorm16(v.pos[c], decode.posOffset[c], decode.posScale[c]);
+		pv.pos[3] = 0;
+		glm::vec2 oct = oct_encode(v.normal);
+		pv.normal[0] = quantize_snorm16(oct.x);
+		pv.normal[1] = quantize_snorm16(oct.y);
+		pv.texCoord[0] = quantize_unorm16(v.texCoord.x, tmin.x, tmax.x - tmin.x);
+		pv.texCoord[1] = quantize_unorm16(v.texCoord.y, tmin.y, tmax.y - tmin.y);
+	}
+}
+
+Vertex unpack_vertex(const PackedVertex& pv, const VertexDecode& decode)
+{
+	Vertex v{};
+	glm::vec3 q = glm::vec3(pv.pos[0], pv.pos[1], pv.pos[2]) / 65535.0f;
+	v.pos = glm::vec3(decode.posOffset) + q * glm::vec3(decode.posScale);
+	glm::vec2 e = glm::max(glm::vec2(pv.normal[0], pv.normal[1]) / 32767.0f, glm::vec2(-1.0f));
+	v.normal = oct_decode(e);
+	glm::vec2 t = glm::vec2(pv.texCoord[0], pv.texCoord[1]) / 65535.0f;
+	v.texCoord = glm::vec2(decode.uvOffsetScale.x, decode.uvOffsetScale.y) + t * glm::vec2(decode.uvOffsetScale.z, decode.uvOffsetScale.w);
+	v.color = glm::vec3(1.0f);
+	return v;
+}
+
+std::vector<uint8_t> pack_indices(const uint32_t* indices, size_t count, size_t vertex_count, VkIndexType& type)
+{
+	std::vector<uint8_t> out;
+	if (vertex_count <= 65536) {
+		type = VK_INDEX_TYPE_UINT16;
+		out.resize(count * sizeof(uint16_t));
+		uint16_t* dst = (uint16_t*)out.data();
+		for (size_t i = 0; i < count; i++) dst[i] = uint16_t(indices[i]);
+	}
+	else {
+		type = VK_INDEX_TYPE_UINT32;
+		out.resize(count * sizeof(uint32_t));
+		memcpy(out.data(), indices, count * sizeof(uint32_t));
+	}
+	return out;
+}
+
+float uv_density(const PackedVertex* verts, const VertexDecode& decode, const void* indices, VkIndexType type, size_t index_count)
+{
+	double uv_area = 0, pos_area = 0;
+	for (size_t i = 0; i + 2 < index_count; i += 3) {
+		Vertex v[3];
+		for (int c = 0; c < 3; c++) {
+			uint32_t idx = (type == VK_INDEX_TYPE_UINT16) ? ((const uint16_t*)indices)[i + c] : ((const uint32_t*)indices)[i + c];
+			v[c] = unpack_vertex(verts[idx], decode);
+		}
+		glm::vec2 t1 = v[1].texCoord - v[0].texCoord, t2 = v[2].texCoord - v[0].texCoord;
+		uv_area += std::abs(t1.x * t2.y - t1.y * t2.x);
+		pos_area += glm::length(glm::cross(v[1].pos - v[0].pos, v[2].pos - v[0].pos));
+	}
+	if (pos_area <= 0) return 0.0f;
+	return float(std::sqrt(uv_area / pos_area));
+}
 
 void Mesh::add_vertices(std::vector<Vertex> verts)
 {
-	std::unordered_map<Vertex, uint32_t> uniqueVertices{};
+	VertexWelder welder(_vertices, verts.size());
+	_indices.reserve(_indices.size() + verts.size());
 	for (int i = 0; i < verts.size(); i++) {
-		Vertex v = verts[i];
-		if (uniqueVertices.count(v) == 0) {
-			uniqueVertices[v] = static_cast<uint32_t>(_vertices.size());
-			_vertices.push_back(v);
-		}
-		_indices.push_back(uniqueVertices[v]);
+		_indices.push_back(welder.weld(verts[i]));
 	}
 }
 
@@ -35,7 +211,10 @@ bool Mesh::load_from_obj(const char* filename)
 		return false;
 	}
 
-	std::unordered_map<Vertex, uint32_t> uniqueVertices{};
+	size_t index_count = 0;
+	for (const auto& shape : shapes) index_count += shape.mesh.indices.size();
+	VertexWelder welder(_vertices, index_count);
+	_indices.reserve(_indices.size() + index_count);
 
 	for (const auto& shape : shapes) {
 		for (const auto& index : shape.mesh.indices) {
@@ -60,12 +239,7 @@ bool Mesh::load_from_obj(const char* filename)
 
 			vertex.color = { 1.0f, 1.0f, 1.0f };
 
-			if (uniqueVertices.count(vertex) == 0) {
-				uniqueVertices[vertex] = static_cast<uint32_t>(_vertices.size());
-				_vertices.push_back(vertex);
-			}
-
-			_indices.push_back(uniqueVertices[vertex]);
+			_indices.push_back(welder.weld(vertex));
 		}
 
 	}
@@ -85,5 +259,10 @@ void GPUPipeline::bindPipelineDSets(VkCommandBuffer cmdBuffer, std::vector<VkDes
 
 void RenderObject::drawMesh(VkCommandBuffer cmdBuffer, int obj_idx)
 {
-	vkCmdDrawIndexed(cmdBuffer, static_cast<uint32_t>(mesh->_indices.size()), 1, 0, 0, obj_idx);
+	vkCmdDrawIndexed(cmdBuffer, mesh->_indexCount, 1, mesh->firstIndex(), mesh->vertexOffset(), obj_idx);
+}
+
+void RenderObject::drawMeshIndirect(VkCommandBuffer cmdBuffer, VkBuffer drawBuffer, VkDeviceSize offset)
+{
+	vkCmdDrawIndexedIndirect(cmdBuffer, drawBuffer, offset, 1, sizeof(VkDrawIndexedIndirectCommand));
 }
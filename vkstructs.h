@@ -81,20 +81,92 @@ struct Vertex {
 	}
 
 	bool operator==(const Vertex& other) const {
-		return pos == other.pos && color == other.color && texCoord == other.texCoord;
+		return pos == other.pos && normal == other.normal && color == other.color && texCoord == other.texCoord;
 	}
+
+	// Over every attribute, consistent with operator== (0.0 and -0.0 hash the same)
+	size_t hash() const;
 };
 
 namespace std {
 	template<> struct hash<Vertex> {
 		size_t operator()(Vertex const& vertex) const {
-			return ((hash<glm::vec3>()(vertex.pos) ^
-				(hash<glm::vec3>()(vertex.normal) << 1)) >> 1) ^
-				(hash<glm::vec2>()(vertex.texCoord) << 1);
+			return vertex.hash();
 		}
 	};
 }
 
+// What the vertex shaders need to turn a PackedVertex back into positions and texcoords
+struct VertexDecode {
+	glm::vec4 posOffset = glm::vec4(0);
+	glm::vec4 posScale = glm::vec4(1);
+	glm::vec4 uvOffsetScale = glm::vec4(0, 0, 1, 1); // xy offset, zw scale
+};
+
+// GPU side vertex, 16 bytes instead of Vertex's 44. Positions and texcoords are unorm16 within
+// the mesh's bounds (see VertexDecode), normals are octahedral snorm16. Colour isn't stored:
+// nothing reads it, the vertex shader passes white on.
+struct PackedVertex {
+	uint16_t pos[4]; // w unused, keeps the normal 4-byte aligned
+	int16_t normal[2];
+	uint16_t texCoord[2];
+
+	static VkVertexInputBindingDescription getBindingDescription() {
+		VkVertexInputBindingDescription bindingDescription{};
+		bindingDescription.binding = 0;
+		bindingDescription.stride = sizeof(PackedVertex);
+		bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+
+		return bindingDescription;
+	}
+
+	static std::array<VkVertexInputAttributeDescription, 3> getAttributeDescriptions() {
+		std::array<VkVertexInputAttributeDescription, 3> attributeDescriptions{};
+		attributeDescriptions[0].binding = 0;
+		attributeDescriptions[0].location = 0;
+		attributeDescriptions[0].format = VK_FORMAT_R16G16B16A16_UNORM;
+		attributeDescriptions[0].offset = offsetof(PackedVertex, pos);
+
+		attributeDescriptions[1].binding = 0;
+		attributeDescriptions[1].location = 1;
+		attributeDescriptions[1].format = VK_FORMAT_R16G16_SNORM;
+		attributeDescriptions[1].offset = offsetof(PackedVertex, normal);
+
+		attributeDescriptions[2].binding = 0;
+		attributeDescriptions[2].location = 2;
+		attributeDescriptions[2].format = VK_FORMAT_R16G16_UNORM;
+		attributeDescriptions[2].offset = offsetof(PackedVertex, texCoord);
+
+		return attributeDescriptions;
+	}
+};
+
+void pack_vertices(const Vertex* verts, size_t count, std::vector<PackedVertex>& out, VertexDecode& decode);
+// Same math as the vertex shaders, colour comes back white
+Vertex unpack_vertex(const PackedVertex& pv, const VertexDecode& decode);
+// 16-bit indices when every vertex fits, 32-bit otherwise; returns the raw index buffer
+std::vector<uint8_t> pack_indices(const uint32_t* indices, size_t count, size_t vertex_count, VkIndexType& type);
+// Texture coordinate units per object space unit, area weighted over the triangles; 0 when the
+// mesh has no UVs. Texture streaming goes from this to how many texels an object shows.
+float uv_density(const PackedVertex* verts, const VertexDecode& decode, const void* indices, VkIndexType type, size_t index_count);
+
+// Vertex dedup for building index buffers: open addressing over indices into the
+// output vertex array, so welding does no allocation past the first sizing.
+class VertexWelder {
+public:
+	// expected_count: vertices that will be passed to weld(), e.g. the index count
+	VertexWelder(std::vector<Vertex>& out_vertices, size_t expected_count);
+	// Index of v in out_vertices, appending it if no equal vertex was welded before
+	uint32_t weld(const Vertex& v);
+private:
+	std::vector<Vertex>& _vertices;
+	std::vector<uint32_t> _slots; // vertex index + 1, 0 is empty
+	size_t _mask = 0;
+	size_t _used = 0;
+
+	void rehash(size_t slot_count);
+};
+
 struct GPUPushConstant {
 	VkPushConstantRange PCRange;
 	void* PCData;
@@ -114,9 +186,19 @@ struct RunnableGPUPipeline {
 	std::vector<GPUPushConstant> pushConstants;
 };
 
+// A range of one of the allocator's blocks, see DeviceMemory.h
+struct DeviceAllocation {
+	VkDeviceMemory _memory = VK_NULL_HANDLE; // shared with the other allocations in the block
+	VkDeviceSize _offset = 0;
+	VkDeviceSize _size = 0;
+	uint8_t* _mapped = nullptr; // host visible memory stays mapped, this is already at _offset
+	void* _block = nullptr;
+	uint32_t _node = 0;
+};
+
 struct GPUBuffer {
-	VkBuffer _buffer;
-	VkDeviceMemory _bufferMemory;
+	VkBuffer _buffer = VK_NULL_HANDLE;
+	DeviceAllocation _allocation;
 };
 
 struct GPUSetBuffer {
@@ -124,28 +206,67 @@ struct GPUSetBuffer {
 	VkDescriptorSet _dSet;
 };
 
+const uint32_t MAX_MESH_LODS = 4;
+
+// A level of detail: a range of the mesh's index buffer over the vertices all levels share
+struct MeshLod {
+	uint32_t firstIndex = 0;
+	uint32_t indexCount = 0;
+	float error = 0; // how far (object space, roughly) the level may be off the full mesh
+	uint32_t reserved = 0;
+};
+
+// Part of one of the vertex or index buffers all meshes share, see GeometryBuffers.h
+struct GeometryRange {
+	VkBuffer _buffer = VK_NULL_HANDLE;
+	VkDeviceSize _offset = 0;
+	VkDeviceSize _size = 0;
+	void* _chunk = nullptr;
+	uint32_t _node = 0;
+};
+
 struct Mesh {
 	std::vector<Vertex> _vertices;
 	std::vector<uint32_t> _indices;
 
-	GPUBuffer _vertexBuffer;
-	GPUBuffer _indexBuffer;
+	// Set on upload: the ranges hold PackedVertex and _indexType indices. Draws add vertexOffset()
+	// and firstIndex() to reach them.
+	GeometryRange _vertexRange;
+	GeometryRange _indexRange;
+	VertexDecode _decode;
+	VkIndexType _indexType = VK_INDEX_TYPE_UINT32;
+	uint32_t _indexCount = 0; // of the full detail level
+	// Coarser levels follow the full one in _indices, see meshutils::build_lods(). Empty: one level
+	std::vector<MeshLod> _lods;
+	float _uvDensity = 0; // see uv_density()
 	VkSampler _textureSampler;
+	// Render objects drawing it, and the frame that number last dropped to 0. Unused meshes stay
+	// cached until the renderer's cache budget runs out, least recently used go first.
+	uint32_t _refs = 0;
+	uint64_t _lastUsed = 0;
+
+	int32_t vertexOffset() const { return int32_t(_vertexRange._offset / sizeof(PackedVertex)); }
+	uint32_t firstIndex() const { return uint32_t(_indexRange._offset / (_indexType == VK_INDEX_TYPE_UINT16 ? 2 : 4)); }
 
 	void add_vertices(std::vector<Vertex> verts);
 	bool load_from_obj(const char* filename);
 };
 
 struct GPUImage {
-	VkImage _image;
-	VkDeviceMemory _imageMemory;
-	VkImageViewCreateInfo _imageViewInfo;
-	VkImageView _imageView;
+	VkImage _image = VK_NULL_HANDLE;
+	DeviceAllocation _allocation; // none for swap chain images
+	VkImageViewCreateInfo _imageViewInfo{};
+	VkImageView _imageView = VK_NULL_HANDLE;
 };
 
 struct GPUTexture2d {
 	GPUImage _gImage;
 	VkDescriptorSet _dSet;
+	VkDescriptorPool _dPool = VK_NULL_HANDLE; // the texture pool _dSet came from
+	std::string _source; // texture file it was loaded from, empty for built in ones
+	// Like Mesh's, counted on the "linear" one for every sampler's
+	uint32_t _refs = 0;
+	uint64_t _lastUsed = 0;
 };
 
 struct GPUCameraData {
@@ -156,6 +277,7 @@ struct GPUCameraData {
 
 struct GPUObjectData {
 	glm::mat4 model = glm::mat4{ 1.0f };
+	VertexDecode decode; // of the object's mesh
 };
 
 struct GPUSceneData {
@@ -189,10 +311,31 @@ public:
 	bool shadowcasting = true;
 
 	void drawMesh(VkCommandBuffer cmdBuffer, int obj_idx = 0);
+	// Draws the VkDrawIndexedIndirectCommand at offset in drawBuffer, which picks the LOD
+	void drawMeshIndirect(VkCommandBuffer cmdBuffer, VkBuffer drawBuffer, VkDeviceSize offset);
+};
+
+// What a pass's LODs were picked for: where it's seen from and how fine it needs to be
+struct LodView {
+	glm::vec3 eye;
+	float fovY, viewHeight, maxPixels;
+	bool skip; // the pass isn't drawn, its commands draw nothing
+	bool operator==(const LodView&) const = default;
 };
 
 struct GPUFrameData {
 	std::unordered_map<std::string, GPUSetBuffer> setBuffers;
+	// VkDrawIndexedIndirectCommand per object for the final pass, then for each point light's shadow passes
+	GPUBuffer lodDraws;
+	// setBuffers' memory, mapped for as long as they exist
+	GPUSceneData* sceneData = nullptr;
+	GPUCameraData* cameraData = nullptr;
+	GPULight* lightData = nullptr; // MAX_POINT_LIGHTS
+	GPUObjectData* objectData = nullptr; // the renderer's objectCapacity
+	// What objectData holds so far, so only objects that changed are written again
+	std::vector<GPUObjectData> objectsWritten;
+	// Per pass, what lodDraws' commands were picked for. Empty: none are valid
+	std::vector<LodView> lodViews;
 
 	GPUImage shadowMapTemp;
 	GPUImage shadowDepthImage;
@@ -200,6 +343,8 @@ struct GPUFrameData {
 
 	VkCommandPool commandPool;
 	VkCommandBuffer commandBuffer;
+	// Re-recorded by the frames that take in new uploads, submitted ahead of commandBuffer
+	VkCommandBuffer acquireCmdBuffer;
 	std::vector<GPUImage> shadow_cube_maps;
 	VkDescriptorSet shadow_cube_dset;
 	std::vector<GPUImage> shadow_dir_maps;
@@ -262,7 +262,8 @@ bool isDeviceSuitable(
 	}
 
 	return (allow_integrated || supportedProperties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU) &&
-		supportedFeatures.geometryShader && indices.isComplete() && extensionsSupported && swapChainAdequate && supportedFeatures.samplerAnisotropy;
+		supportedFeatures.geometryShader && indices.isComplete() && extensionsSupported && swapChainAdequate && supportedFeatures.samplerAnisotropy &&
+		supportedFeatures.drawIndirectFirstInstance;
 }
 
 VkPhysicalDevice vkutils::pickPhysicalDevice(
@@ -333,17 +334,13 @@ VkExtent2D vkutils::chooseSwapExtent(GLFWwindow* window, const VkSurfaceCapabili
 	}
 }
 
-uint32_t findMemoryType(VkPhysicalDevice physicalDevice, uint32_t typeFilter, VkMemoryPropertyFlags properties) {
-	VkPhysicalDeviceMemoryProperties memProperties;
-	vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
-
-	for (uint32_t i = 0; i < memProperties.memoryTypeCount; i++) {
-		if ((typeFilter & (1 << i)) && (memProperties.memoryTypes[i].propertyFlags & properties) == properties) {
-			return i;
-		}
-	}
+DeviceAllocation bindImageMemory(VkDevice device, VkPhysicalDevice physicalDevice, VkImage image, VkImageTiling tiling, VkMemoryPropertyFlags memFlag) {
+	VkMemoryRequirements memRequirements;
+	vkGetImageMemoryRequirements(device, image, &memRequirements);
 
-	throw std::runtime_error("failed to find suitable memory type!");
+	DeviceAllocation allocation = vkutils::allocateMemory(device, physicalDevice, memRequirements, memFlag, tiling == VK_IMAGE_TILING_LINEAR);
+	vkBindImageMemory(device, image, allocation._memory, allocation._offset);
+	return allocation;
 }
 
 GPUImage vkutils::createGPUImage(VkDevice device, VkImage image, VkImageViewCreateInfo imageViewInfo)
@@ -396,21 +393,44 @@ GPUImage vkutils::createGPUImage(VkDevice device, VkPhysicalDevice physicalDevic
 	VkImage tImg;
 	if (vkCreateImage(device, &imageInfo, NULL, &tImg) != VK_SUCCESS) throw std::runtime_error("failed to create image!");
 
-	VkMemoryRequirements memRequirements;
-	vkGetImageMemoryRequirements(device, tImg, &memRequirements);
+	DeviceAllocation tImgMem = bindImageMemory(device, physicalDevice, tImg, tiling, memFlag);
+
+	GPUImage res = createGPUImage(device, tImg, viewType, format, aspectFlag);
+	res._allocation = tImgMem;
+	return res;
+}
+
+GPUImage vkutils::createGPUImage(VkDevice device, VkPhysicalDevice physicalDevice, uint32_t width, uint32_t height, uint32_t mipLevels, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usageFlag, VkMemoryPropertyFlags memFlag, VkImageViewType viewType, VkImageAspectFlags aspectFlag)
+{
+	VkImageCreateInfo imageInfo{};
+	imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+	imageInfo.imageType = VK_IMAGE_TYPE_2D;
+	imageInfo.extent.width = width;
+	imageInfo.extent.height = height;
+	imageInfo.extent.depth = 1;
+	imageInfo.mipLevels = mipLevels;
+	imageInfo.arrayLayers = 1;
+	imageInfo.format = format;
+	imageInfo.tiling = tiling;
+	imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	imageInfo.usage = usageFlag;
+	imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+	imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
-	VkMemoryAllocateInfo allocInfo{};
-	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocInfo.allocationSize = memRequirements.size;
-	allocInfo.memoryTypeIndex = findMemoryType(physicalDevice, memRequirements.memoryTypeBits, memFlag);
+	VkImage tImg;
+	if (vkCreateImage(device, &imageInfo, NULL, &tImg) != VK_SUCCESS) throw std::runtime_error("failed to create image!");
 
-	VkDeviceMemory tImgMem;
-	if (vkAllocateMemory(device, &allocInfo, NULL, &tImgMem) != VK_SUCCESS) throw std::runtime_error("failed to allocate image memory!");
+	DeviceAllocation tImgMem = bindImageMemory(device, physicalDevice, tImg, tiling, memFlag);
 
-	vkBindImageMemory(device, tImg, tImgMem, 0);
+	VkImageViewCreateInfo viewInfo{};
+	viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+	viewInfo.image = tImg;
+	viewInfo.viewType = viewType;
+	viewInfo.format = format;
+	viewInfo.subresourceRange = { aspectFlag, 0, mipLevels, 0, 1 };
 
-	GPUImage res = createGPUImage(device, tImg, viewType, format, aspectFlag);
-	res._imageMemory = tImgMem;
+	GPUImage res = createGPUImage(device, tImg, viewInfo);
+	res._allocation = tImgMem;
 	return res;
 }
 
@@ -435,21 +455,10 @@ GPUImage vkutils::createGPUImage(VkDevice device, VkPhysicalDevice physicalDevic
 	VkImage tImg;
 	if (vkCreateImage(device, &imageInfo, NULL, &tImg) != VK_SUCCESS) throw std::runtime_error("failed to create image!");
 
-	VkMemoryRequirements memRequirements;
-	vkGetImageMemoryRequirements(device, tImg, &memRequirements);
-
-	VkMemoryAllocateInfo allocInfo{};
-	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocInfo.allocationSize = memRequirements.size;
-	allocInfo.memoryTypeIndex = findMemoryType(physicalDevice, memRequirements.memoryTypeBits, memFlag);
-
-	VkDeviceMemory tImgMem;
-	if (vkAllocateMemory(device, &allocInfo, NULL, &tImgMem) != VK_SUCCESS) throw std::runtime_error("failed to allocate image memory!");
-
-	vkBindImageMemory(device, tImg, tImgMem, 0);
+	DeviceAllocation tImgMem = bindImageMemory(device, physicalDevice, tImg, tiling, memFlag);
 
 	GPUImage res = createGPUImage(device, tImg, viewType, format, aspectFlag);
-	res._imageMemory = tImgMem;
+	res._allocation = tImgMem;
 	return res;
 }
 
@@ -475,23 +484,11 @@ GPUImage vkutils::createGPUImage(VkDevice device, VkPhysicalDevice physicalDevic
 		throw std::runtime_error("failed to create image!");
 	}
 
-	VkMemoryRequirements memRequirements;
-	vkGetImageMemoryRequirements(device, tImg, &memRequirements);
-
-	VkMemoryAllocateInfo allocInfo{};
-	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocInfo.allocationSize = memRequirements.size;
-	allocInfo.memoryTypeIndex = findMemoryType(physicalDevice, memRequirements.memoryTypeBits, memFlag);
-
-	VkDeviceMemory tImgMem;
-	if (vkAllocateMemory(device, &allocInfo, NULL, &tImgMem) != VK_SUCCESS) {
-		throw std::runtime_error("failed to allocate image memory!");
-	}
-
-	vkBindImageMemory(device, tImg, tImgMem, 0);
+	DeviceAllocation tImgMem = bindImageMemory(device, physicalDevice, tImg, tiling, memFlag);
 
 	GPUImage res = createGPUImage(device, tImg, imageViewInfo);
-	res._imageMemory = tImgMem;
+	res._allocation = tImgMem;
+	return res;
 }
 
 GPUImage vkutils::createGPUImage(VkDevice device, VkPhysicalDevice physicalDevice, uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, uint32_t layerCount, VkImageCreateFlags imageFlag, VkImageUsageFlags usageFlag, VkMemoryPropertyFlags memFlag, VkImageViewCreateInfo imageViewInfo)
@@ -517,30 +514,18 @@ GPUImage vkutils::createGPUImage(VkDevice device, VkPhysicalDevice physicalDevic
 		throw std::runtime_error("failed to create image!");
 	}
 
-	VkMemoryRequirements memRequirements;
-	vkGetImageMemoryRequirements(device, tImg, &memRequirements);
-
-	VkMemoryAllocateInfo allocInfo{};
-	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocInfo.allocationSize = memRequirements.size;
-	allocInfo.memoryTypeIndex = findMemoryType(physicalDevice, memRequirements.memoryTypeBits, memFlag);
-
-	VkDeviceMemory tImgMem;
-	if (vkAllocateMemory(device, &allocInfo, NULL, &tImgMem) != VK_SUCCESS) {
-		throw std::runtime_error("failed to allocate image memory!");
-	}
-
-	vkBindImageMemory(device, tImg, tImgMem, 0);
+	DeviceAllocation tImgMem = bindImageMemory(device, physicalDevice, tImg, tiling, memFlag);
 
 	GPUImage res = createGPUImage(device, tImg, imageViewInfo);
-	res._imageMemory = tImgMem;
+	res._allocation = tImgMem;
+	return res;
 }
 
 void vkutils::destroyGPUImage(VkDevice device, GPUImage image, bool memory_already_freed)
 {
 	vkDestroyImageView(device, image._imageView, NULL);
 	vkDestroyImage(device, image._image, NULL);
-	if (!memory_already_freed) vkFreeMemory(device, image._imageMemory, NULL);
+	if (!memory_already_freed) vkutils::freeMemory(device, image._allocation);
 }
 
 VkCommandBuffer vkutils::createCmdBuffer(VkDevice device, VkCommandPool cmdPool) {
@@ -580,8 +565,16 @@ void endSingleTimeCommands(VkDevice device, VkCommandPool cmdPool, VkCommandBuff
 	submitInfo.commandBufferCount = 1;
 	submitInfo.pCommandBuffers = &commandBuffer;
 
-	vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE);
-	vkQueueWaitIdle(queue);
+	// Its own fence rather than the whole queue idling, which would wait on everyone else's work too
+	VkFenceCreateInfo fenceInfo{};
+	fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+	VkFence fence;
+	if (vkCreateFence(device, &fenceInfo, NULL, &fence) != VK_SUCCESS) {
+		throw std::runtime_error("failed to create fence!");
+	}
+	vkQueueSubmit(queue, 1, &submitInfo, fence);
+	vkWaitForFences(device, 1, &fence, VK_TRUE, UINT64_MAX);
+	vkDestroyFence(device, fence, NULL);
 
 	vkFreeCommandBuffers(device, cmdPool, 1, &commandBuffer);
 }
@@ -593,7 +586,7 @@ void vkutils::transitionImageLayout(VkCommandBuffer cmdBuffer, VkImage image, Vk
 	barrier.oldLayout = oldLayout;
 	barrier.newLayout = newLayout;
 	barrier.srcQueueFamilyIndex = srcQFI;
-	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = dstQFI;
 	barrier.image = image;
 
 	barrier.subresourceRange = subresourceRange;
@@ -681,11 +674,51 @@ void vkutils::transitionImageLayout(VkDevice device, VkCommandPool cmdPool, VkQu
 {
 	VkCommandBuffer commandBuffer = beginSingleTimeCommands(device, cmdPool);
 
-	transitionImageLayout(commandBuffer, image, format, oldLayout, newLayout, srcStageMask, dstStageMask, subresourceRange);
+	transitionImageLayout(commandBuffer, image, format, oldLayout, newLayout, srcStageMask, dstStageMask, subresourceRange, srcQFI, dstQFI);
 
 	endSingleTimeCommands(device, cmdPool, commandBuffer, queue);
 }
 
+void vkutils::bufferBarrier(VkCommandBuffer cmdBuffer, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize size, VkAccessFlags srcAccessMask, VkAccessFlags dstAccessMask, VkPipelineStageFlags srcStageMask, VkPipelineStageFlags dstStageMask, uint32_t srcQFI, uint32_t dstQFI)
+{
+	VkBufferMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	barrier.srcAccessMask = srcAccessMask;
+	barrier.dstAccessMask = dstAccessMask;
+	barrier.srcQueueFamilyIndex = srcQFI;
+	barrier.dstQueueFamilyIndex = dstQFI;
+	barrier.buffer = buffer;
+	barrier.offset = offset;
+	barrier.size = size;
+
+	vkCmdPipelineBarrier(
+		cmdBuffer,
+		srcStageMask, dstStageMask,
+		0,
+		0, nullptr,
+		1, &barrier,
+		0, nullptr
+	);
+}
+
+VkSemaphore vkutils::createTimelineSemaphore(VkDevice device, uint64_t initialValue)
+{
+	VkSemaphoreTypeCreateInfo typeInfo{};
+	typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+	typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+	typeInfo.initialValue = initialValue;
+
+	VkSemaphoreCreateInfo semaphoreInfo{};
+	semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+	semaphoreInfo.pNext = &typeInfo;
+
+	VkSemaphore semaphore;
+	if (vkCreateSemaphore(device, &semaphoreInfo, NULL, &semaphore) != VK_SUCCESS) {
+		throw std::runtime_error("failed to create timeline semaphore!");
+	}
+	return semaphore;
+}
+
 VkFramebuffer vkutils::createFrameBuffer(VkDevice device, VkRenderPass renderPass, std::vector<GPUImage> attachments, uint32_t width, uint32_t height, uint32_t layers)
 {
 	std::vector<VkImageView> attachment_iviews;
@@ -796,26 +829,18 @@ GPUBuffer vkutils::createBuffer(
 	VkMemoryRequirements memRequirements;
 	vkGetBufferMemoryRequirements(device, gBuff._buffer, &memRequirements);
 
-	VkMemoryAllocateInfo allocInfo{};
-	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocInfo.allocationSize = memRequirements.size;
-	allocInfo.memoryTypeIndex = findMemoryType(physicalDevice, memRequirements.memoryTypeBits, properties);
-
-	if (vkAllocateMemory(device, &allocInfo, NULL, &gBuff._bufferMemory) != VK_SUCCESS) {
-		throw std::runtime_error("failed to allocate buffer memory!");
-	}
-
-	vkBindBufferMemory(device, gBuff._buffer, gBuff._bufferMemory, 0);
+	gBuff._allocation = allocateMemory(device, physicalDevice, memRequirements, properties, true);
+	vkBindBufferMemory(device, gBuff._buffer, gBuff._allocation._memory, gBuff._allocation._offset);
 
 	return gBuff;
 }
 
-void vkutils::copyBuffer(VkDevice device, VkCommandPool cmdPool, VkQueue queue, VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
+void vkutils::copyBuffer(VkDevice device, VkCommandPool cmdPool, VkQueue queue, VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size, VkDeviceSize dstOffset) {
 	VkCommandBuffer commandBuffer = beginSingleTimeCommands(device, cmdPool);
 
 	VkBufferCopy copyRegion{};
 	copyRegion.srcOffset = 0; // Optional
-	copyRegion.dstOffset = 0; // Optional
+	copyRegion.dstOffset = dstOffset;
 	copyRegion.size = size;
 	vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
 
@@ -877,6 +902,12 @@ VkDescriptorSet vkutils::createImageDSet(VkDevice device, VkDescriptorPool dPool
 		throw std::runtime_error("failed to allocate descriptor set!");
 	}
 
+	writeImageDSet(device, dSet, images, imageLayout, sampler);
+	return dSet;
+}
+
+void vkutils::writeImageDSet(VkDevice device, VkDescriptorSet dSet, std::vector<GPUImage> images, VkImageLayout imageLayout, VkSampler sampler)
+{
 	std::vector<VkDescriptorImageInfo> imageInfos;
 	for (int i = 0; i < images.size(); i++) {
 		VkDescriptorImageInfo imageInfo{};
@@ -896,7 +927,6 @@ VkDescriptorSet vkutils::createImageDSet(VkDevice device, VkDescriptorPool dPool
 	dSetWrite.pImageInfo = imageInfos.data();
 
 	vkUpdateDescriptorSets(device, 1, &dSetWrite, 0, NULL);
-	return dSet;
 }
 
 GPUBuffer vkutils::createBuffer(
@@ -917,10 +947,7 @@ GPUBuffer vkutils::createBuffer(
 		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
 	);
 
-	void* temp;
-	vkMapMemory(device, stageBuffer._bufferMemory, 0, buffSize, 0, &temp);
-	memcpy(temp, data, (size_t)buffSize);
-	vkUnmapMemory(device, stageBuffer._bufferMemory);
+	memcpy(stageBuffer._allocation._mapped, data, (size_t)buffSize);
 
 	GPUBuffer resBuffer;
 	resBuffer = createBuffer(
@@ -946,10 +973,7 @@ void vkutils::writeToBuffer(VkDevice device, VkPhysicalDevice physicalDevice, GP
 		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
 	);
 
-	void* temp;
-	vkMapMemory(device, stageBuffer._bufferMemory, 0, buffSize, 0, &temp);
-	memcpy(temp, data, (size_t)buffSize);
-	vkUnmapMemory(device, stageBuffer._bufferMemory);
+	memcpy(stageBuffer._allocation._mapped, data, (size_t)buffSize);
 
 	copyBuffer(device, cmdPool, queue, stageBuffer._buffer, buffer._buffer, buffSize);
 	destroyBuffer(device, stageBuffer);
@@ -958,7 +982,7 @@ void vkutils::writeToBuffer(VkDevice device, VkPhysicalDevice physicalDevice, GP
 void vkutils::destroyBuffer(VkDevice device, GPUBuffer buffer)
 {
 	vkDestroyBuffer(device, buffer._buffer, NULL);
-	vkFreeMemory(device, buffer._bufferMemory, NULL);
+	freeMemory(device, buffer._allocation);
 }
 
 void vkutils::copyDataToImage(VkDevice device, VkPhysicalDevice physicalDevice, VkCommandPool cmdPool, VkQueue queue, VkDeviceSize dataSize, void* data, GPUImage image, VkOffset3D imgOffset, VkExtent3D imgExtent)
@@ -971,10 +995,7 @@ void vkutils::copyDataToImage(VkDevice device, VkPhysicalDevice physicalDevice,
 		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
 	);
 
-	void* temp;
-	vkMapMemory(device, stageBuffer._bufferMemory, 0, dataSize, 0, &temp);
-	memcpy(temp, data, (size_t)dataSize);
-	vkUnmapMemory(device, stageBuffer._bufferMemory);
+	memcpy(stageBuffer._allocation._mapped, data, (size_t)dataSize);
 
 	VkCommandBuffer cmdBuffer = beginSingleTimeCommands(device, cmdPool);
 	VkBufferImageCopy region{};
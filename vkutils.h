@@ -1,6 +1,7 @@
 #pragma once
 
 #include "vkstructs.h"
+#include "DeviceMemory.h"
 
 #include <vector>
 #include <array>
@@ -67,6 +68,19 @@ namespace vkutils {
 		VkImageViewType viewType,
 		VkImageAspectFlags aspectFlag
 	);
+	// Image and view with mipLevels levels
+	GPUImage createGPUImage(
+		VkDevice device,
+		VkPhysicalDevice physicalDevice,
+		uint32_t width, uint32_t height,
+		uint32_t mipLevels,
+		VkFormat format,
+		VkImageTiling tiling,
+		VkImageUsageFlags usageFlag,
+		VkMemoryPropertyFlags memFlag,
+		VkImageViewType viewType,
+		VkImageAspectFlags aspectFlag
+	);
 	GPUImage createGPUImage(
 		VkDevice device,
 		VkPhysicalDevice physicalDevice,
@@ -122,6 +136,23 @@ namespace vkutils {
 		uint32_t dstQFI = VK_QUEUE_FAMILY_IGNORED
 	);
 
+	// With srcQFI != dstQFI, one half of a queue family ownership transfer of [offset, offset + size)
+	void bufferBarrier(
+		VkCommandBuffer cmdBuffer,
+		VkBuffer buffer,
+		VkDeviceSize offset,
+		VkDeviceSize size,
+		VkAccessFlags srcAccessMask,
+		VkAccessFlags dstAccessMask,
+		VkPipelineStageFlags srcStageMask,
+		VkPipelineStageFlags dstStageMask,
+		uint32_t srcQFI = VK_QUEUE_FAMILY_IGNORED,
+		uint32_t dstQFI = VK_QUEUE_FAMILY_IGNORED
+	);
+
+	// Signalled and waited on with a value, which only ever goes up
+	VkSemaphore createTimelineSemaphore(VkDevice device, uint64_t initialValue = 0);
+
 	VkFramebuffer createFrameBuffer(
 		VkDevice device,
 		VkRenderPass renderPass,
@@ -164,7 +195,8 @@ namespace vkutils {
 		VkCommandPool cmdPool,
 		VkQueue queue,
 		VkBuffer srcBuffer, VkBuffer dstBuffer,
-		VkDeviceSize size
+		VkDeviceSize size,
+		VkDeviceSize dstOffset = 0
 	);
 	GPUBuffer createBuffer(
 		VkDevice device,
@@ -217,6 +249,14 @@ namespace vkutils {
 		VkImageLayout imageLayout,
 		VkSampler sampler
 	);
+	// Points an already allocated set's combined image samplers at images
+	void writeImageDSet(
+		VkDevice device,
+		VkDescriptorSet dSet,
+		std::vector<GPUImage> images,
+		VkImageLayout imageLayout,
+		VkSampler sampler
+	);
 
 	GPUSetBuffer createSetBuffer(
 		VkDevice device,